@@ -0,0 +1,581 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Benchmark
+ *
+ * Description:
+ *   This software is used to measure the performance of crelay.
+ *   There are 3 workloads:
+ *    1. get/set loops against each detected relay card
+ *    2. the same loops against simulated cards only (-m), which needs
+ *       the library built with DRV_SIM=y and runs without hardware
+ *    3. HTTP load against a running crelay daemon (-H)
+ *   For every operation the latency (50th and 99th percentile) and the
+ *   number of operations per second are reported.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Build instructions:
+ *   make bench
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2016-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "relay_drv.h"
+#include "dev_worker.h"
+#ifdef DRV_SIM
+#include "relay_drv_sim.h"
+#endif
+
+#define VERSION "0.11"
+
+#define DEFAULT_NUM_OPS     1000
+#define DEFAULT_NUM_CLIENTS 8
+#define DEFAULT_HTTP_PORT   "8000"
+#define DEFAULT_HTTP_URL    "/gpio"
+#define MAX_NUM_CLIENTS     256
+#define MAX_RESPONSE_LEN    16384
+
+typedef enum
+{
+   OP_GET,
+   OP_GET_ALL,
+   OP_CACHED,
+   OP_SET,
+   OP_SET_MASK,
+   OP_WORKER_SET
+} bench_op_t;
+
+static const char* op_name[] = {"get", "get_all", "cached", "set", "set_mask", "worker_set"};
+
+/* HTTP load client */
+typedef struct
+{
+   struct addrinfo* addr;
+   const char* host;
+   const char* url;
+   uint64_t*   samples;   /* latency of each request in ns */
+   int         num;
+   int         errors;
+} http_client_t;
+
+
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+
+static int cmp_u64(const void* a, const void* b)
+{
+   uint64_t x = *(const uint64_t*)a;
+   uint64_t y = *(const uint64_t*)b;
+
+   return (x > y) - (x < y);
+}
+
+
+/**********************************************************
+ * Function report()
+ *
+ * Description: Print the latency percentiles and the rate
+ *              of a measurement
+ *
+ * Parameters: name (in)       - name of the operation
+ *             samples (in)    - latency of each operation
+ *             num (in)        - number of operations
+ *             errors (in)     - number of failed operations
+ *             elapsed (in)    - total time in ns
+ *
+ * Return:  none
+ *********************************************************/
+static void report(const char* name, uint64_t* samples, int num, int errors, uint64_t elapsed)
+{
+   if (num == 0)
+   {
+      printf("  %-12s no samples\n", name);
+      return;
+   }
+
+   qsort(samples, num, sizeof(uint64_t), cmp_u64);
+   printf("  %-12s p50 %10.3f us   p99 %10.3f us   %10.0f ops/s", name,
+          samples[num/2] / 1000.0, samples[(num*99)/100] / 1000.0,
+          num / (elapsed / 1e9));
+   if (errors > 0)
+      printf("   (%d errors)", errors);
+   printf("\n");
+}
+
+
+/**********************************************************
+ * Function bench_op()
+ *
+ * Description: Run one operation in a tight loop on an open
+ *              relay card
+ *
+ * Parameters: dev (in)     - relay device
+ *             op (in)      - operation
+ *             num (in)     - number of operations
+ *             samples (in) - buffer for num latencies
+ *
+ * Return:  none
+ *********************************************************/
+static void bench_op(relay_dev_t* dev, bench_op_t op, int num, uint64_t* samples)
+{
+   relay_mask_t all = RELAY_MASK_ALL(dev->num_relays);
+   relay_mask_t states;
+   relay_state_t rstate;
+   worker_cmd_t cmd;
+   uint64_t start, t;
+   int i, err, errors=0;
+
+   memset(&cmd, 0, sizeof(cmd));
+   cmd.type = WORKER_SET_MASK;
+   cmd.relay_mask = all;
+
+   start = now_ns();
+   for (i=0; i<num; i++)
+   {
+      t = now_ns();
+      switch (op)
+      {
+         case OP_GET:
+            err = crelay_dev_get_relay(dev, FIRST_RELAY, &rstate);
+            break;
+         case OP_GET_ALL:
+            err = crelay_dev_get_all_relays(dev, &states);
+            break;
+         case OP_CACHED:
+            err = crelay_dev_get_cached_relays(dev, &states);
+            break;
+         case OP_SET:
+            err = crelay_dev_set_relay(dev, FIRST_RELAY, (i & 1) ? ON : OFF);
+            break;
+         case OP_SET_MASK:
+            err = crelay_dev_set_relay_mask(dev, all, (i & 1) ? all : 0);
+            break;
+         case OP_WORKER_SET:
+            cmd.relay_states = (i & 1) ? all : 0;
+            err = crelay_worker_exec(dev->serial, &cmd);
+            break;
+         default:
+            err = -1;
+      }
+      samples[i] = now_ns() - t;
+      if (err != 0) errors++;
+   }
+   report(op_name[op], samples, num, errors, now_ns() - start);
+}
+
+
+/**********************************************************
+ * Function bench_card()
+ *
+ * Description: Run all operations on a relay card. The
+ *              relay states are restored at the end.
+ *
+ * Parameters: serial (in) - serial number (NULL = any card)
+ *             num (in)    - number of operations per test
+ *             mock (in)   - only simulated cards
+ *
+ * Return:  0 - success
+ *         -1 - fail, card not found or skipped
+ *********************************************************/
+static int bench_card(char* serial, int num, int mock)
+{
+   char cname[MAX_RELAY_CARD_NAME_LEN];
+   relay_mask_t saved;
+   relay_dev_t* dev;
+   relay_dev_t info;
+   worker_cmd_t cmd;
+   uint64_t* samples;
+   bench_op_t op;
+
+   if ((dev = crelay_open(serial)) == NULL)
+      return -1;
+   crelay_get_relay_card_name(dev->relay_type, cname);
+   if (mock && strcmp(cname, SIM_NAME))
+   {
+      crelay_close(dev);
+      return -1;
+   }
+   if ((samples = malloc(num * sizeof(uint64_t))) == NULL)
+   {
+      crelay_close(dev);
+      return -1;
+   }
+
+   printf("%s (serial %s, %d relays)\n", cname, dev->serial, dev->num_relays);
+   if (crelay_dev_get_all_relays(dev, &saved) != 0)
+      saved = 0;
+   for (op=OP_GET; op<=OP_SET_MASK; op++)
+   {
+      bench_op(dev, op, num, samples);
+   }
+   crelay_dev_set_relay_mask(dev, RELAY_MASK_ALL(dev->num_relays), saved);
+
+   /* Same writes through the worker, which includes the queue
+    * and the thread switch. The worker opens the card itself
+    * and only serial and num_relays of the copy are used. */
+   info = *dev;
+   crelay_close(dev);
+   if (crelay_worker_get(info.serial) == 0)
+   {
+      bench_op(&info, OP_WORKER_SET, num, samples);
+      memset(&cmd, 0, sizeof(cmd));
+      cmd.type = WORKER_SET_MASK;
+      cmd.relay_mask = RELAY_MASK_ALL(info.num_relays);
+      cmd.relay_states = saved;
+      crelay_worker_exec(info.serial, &cmd);
+   }
+
+   free(samples);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function http_connect()
+ *
+ * Description: Open a TCP connection to the daemon
+ *
+ * Parameters: addr (in) - server address
+ *
+ * Return:  socket, -1 on failure
+ *********************************************************/
+static int http_connect(struct addrinfo* addr)
+{
+   int sock, one=1;
+
+   if ((sock = socket(addr->ai_family, SOCK_STREAM, 0)) < 0)
+      return -1;
+   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   if (connect(sock, addr->ai_addr, addr->ai_addrlen) != 0)
+   {
+      close(sock);
+      return -1;
+   }
+   return sock;
+}
+
+
+/**********************************************************
+ * Function http_request()
+ *
+ * Description: Send a GET request on a keep-alive
+ *              connection and read the complete response
+ *
+ * Parameters: sock (in) - connected socket
+ *             req (in)  - request
+ *             len (in)  - length of the request
+ *
+ * Return:  HTTP status code
+ *          -1 - fail, connection closed or invalid response
+ *********************************************************/
+static int http_request(int sock, const char* req, int len)
+{
+   char buf[MAX_RESPONSE_LEN+1];
+   char *body, *p;
+   int  n, total=0, status, clen=-1;
+
+   if (send(sock, req, len, MSG_NOSIGNAL) != len)
+      return -1;
+
+   /* Read the header */
+   while (1)
+   {
+      if ((n = recv(sock, buf+total, MAX_RESPONSE_LEN-total, 0)) <= 0)
+         return -1;
+      total += n;
+      buf[total] = 0;
+      if ((body = strstr(buf, "\r\n\r\n")) != NULL)
+         break;
+      if (total == MAX_RESPONSE_LEN)
+         return -1;
+   }
+   body += 4;
+   if (sscanf(buf, "HTTP/%*s %d", &status) != 1)
+      return -1;
+   if ((p = strcasestr(buf, "\r\nContent-Length:")) != NULL && p < body)
+      clen = atoi(p+17);
+
+   /* Read the rest of the body, the response stays on its own
+    * since the requests are not pipelined */
+   if (clen < 0)
+      return (status == 304) ? status : -1;
+   n = clen - (total - (body - buf));
+   while (n > 0)
+   {
+      int r = recv(sock, buf, (n < MAX_RESPONSE_LEN) ? n : MAX_RESPONSE_LEN, 0);
+      if (r <= 0)
+         return -1;
+      n -= r;
+   }
+   return status;
+}
+
+
+static void* http_client_thread(void* arg)
+{
+   http_client_t* c = arg;
+   char req[512];
+   uint64_t t;
+   int len, i, status, sock=-1;
+
+   len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", c->url, c->host);
+   for (i=0; i<c->num; i++)
+   {
+      t = now_ns();
+      if (sock < 0 && (sock = http_connect(c->addr)) < 0)
+      {
+         c->samples[i] = now_ns() - t;
+         c->errors++;
+         continue;
+      }
+      status = http_request(sock, req, len);
+      c->samples[i] = now_ns() - t;
+      if (status < 0)
+      {
+         /* Connection closed by the server, open a new one */
+         close(sock);
+         sock = -1;
+      }
+      if (status < 200 || status >= 400)
+         c->errors++;
+   }
+   if (sock >= 0) close(sock);
+   return NULL;
+}
+
+
+/**********************************************************
+ * Function bench_http()
+ *
+ * Description: Send requests to the daemon from several
+ *              concurrent clients
+ *
+ * Parameters: server (in)  - host[:port]
+ *             url (in)     - requested URL
+ *             clients (in) - number of concurrent clients
+ *             num (in)     - total number of requests
+ *
+ * Return:  0 - success
+ *         -1 - fail
+ *********************************************************/
+static int bench_http(char* server, const char* url, int clients, int num)
+{
+   pthread_t thread[MAX_NUM_CLIENTS];
+   http_client_t c[MAX_NUM_CLIENTS];
+   struct addrinfo hints, *addr;
+   uint64_t* samples;
+   uint64_t start;
+   const char* port = DEFAULT_HTTP_PORT;
+   char* p;
+   int i, n=0, errors=0;
+
+   if ((p = strrchr(server, ':')) != NULL)
+   {
+      *p = 0;
+      port = p+1;
+   }
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo(server, port, &hints, &addr) != 0)
+   {
+      fprintf(stderr, "Unknown host %s\n", server);
+      return -1;
+   }
+   if ((samples = malloc(num * sizeof(uint64_t))) == NULL)
+   {
+      freeaddrinfo(addr);
+      return -1;
+   }
+
+   printf("HTTP GET %s:%s%s, %d clients\n", server, port, url, clients);
+   start = now_ns();
+   for (i=0; i<clients; i++)
+   {
+      c[i].addr = addr;
+      c[i].host = server;
+      c[i].url = url;
+      c[i].samples = samples + n;
+      c[i].num = num/clients + (i < num%clients);
+      c[i].errors = 0;
+      n += c[i].num;
+      if (pthread_create(&thread[i], NULL, http_client_thread, &c[i]) != 0)
+      {
+         clients = i;
+         n -= c[i].num;
+         break;
+      }
+   }
+   for (i=0; i<clients; i++)
+   {
+      pthread_join(thread[i], NULL);
+      errors += c[i].errors;
+   }
+   report("request", samples, n, errors, now_ns() - start);
+
+   free(samples);
+   freeaddrinfo(addr);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function print_usage()
+ *
+ * Description: Print the program usage
+ *
+ * Parameters: none
+ *
+ * Return:  none
+ *********************************************************/
+static void print_usage(void)
+{
+   printf("crelay-bench, version %s\n\n", VERSION);
+   printf("This utility measures the latency and throughput of crelay.\n\n");
+   printf("Syntax:\n");
+   printf("    crelay-bench [-n <ops>] [-s <serial number>] [-m]\n");
+   printf("    crelay-bench -H <host>[:<port>] [-c <clients>] [-n <requests>] [-u <url>]\n\n");
+   printf("       -n number of operations per test (default %d)\n", DEFAULT_NUM_OPS);
+   printf("       -s only test the card with this serial number\n");
+   printf("       -m only test simulated cards (library built with DRV_SIM=y)\n");
+#ifdef DRV_SIM
+   printf("       -C number of simulated cards (default 1)\n");
+   printf("       -R number of relays per simulated card (default %d)\n", SIM_NUM_RELAYS);
+   printf("       -l latency of simulated card operations in us (default 0)\n");
+   printf("       -j max random jitter added to the latency in us (default 0)\n");
+   printf("       -e percentage of failing simulated operations (default 0)\n");
+#endif
+   printf("       -H HTTP load against a crelay daemon (default port %s)\n", DEFAULT_HTTP_PORT);
+   printf("       -c number of concurrent HTTP clients (default %d)\n", DEFAULT_NUM_CLIENTS);
+   printf("       -u requested URL (default %s)\n\n", DEFAULT_HTTP_URL);
+   printf("       The relays of the tested cards are switched, their states\n");
+   printf("       are restored at the end of the test.\n\n");
+}
+
+
+/**********************************************************
+ * Function main()
+ *********************************************************/
+int main(int argc, char *argv[])
+{
+   static relay_info_t relay_info[MAX_LISTED_CARDS];
+   int num_cards, i;
+   char* serial=NULL;
+   char* server=NULL;
+   const char* url=DEFAULT_HTTP_URL;
+   int num=DEFAULT_NUM_OPS;
+   int clients=DEFAULT_NUM_CLIENTS;
+   int mock=0;
+   int found=0;
+   int opt;
+#ifdef DRV_SIM
+   int sim_cards=1, sim_relays=SIM_NUM_RELAYS, sim_latency=0, sim_jitter=0;
+   double sim_errors=0;
+#endif
+
+   while ((opt = getopt(argc, argv, "n:s:mH:c:u:C:R:l:j:e:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'n': num = atoi(optarg); break;
+         case 's': serial = optarg; break;
+         case 'm': mock = 1; break;
+         case 'H': server = optarg; break;
+         case 'c': clients = atoi(optarg); break;
+         case 'u': url = optarg; break;
+#ifdef DRV_SIM
+         case 'C': sim_cards = atoi(optarg); break;
+         case 'R': sim_relays = atoi(optarg); break;
+         case 'l': sim_latency = atoi(optarg); break;
+         case 'j': sim_jitter = atoi(optarg); break;
+         case 'e': sim_errors = atof(optarg); break;
+#endif
+         default:
+            print_usage();
+            exit(EXIT_FAILURE);
+      }
+   }
+   if (num < 1 || clients < 1 || clients > MAX_NUM_CLIENTS)
+   {
+      print_usage();
+      exit(EXIT_FAILURE);
+   }
+
+#ifdef DRV_SIM
+   if (sim_cards > 0xFFFF || sim_relays > 0xFF || sim_latency < 0 || sim_jitter < 0 ||
+       sim_set_params(sim_cards, sim_relays, sim_latency, sim_jitter, sim_errors) != 0)
+   {
+      print_usage();
+      exit(EXIT_FAILURE);
+   }
+#endif
+
+   if (server != NULL)
+   {
+      exit(bench_http(server, url, clients, num) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+   }
+
+   if (serial != NULL)
+   {
+      found = (bench_card(serial, num, mock) == 0);
+   }
+   else if ((num_cards = crelay_detect_all_relay_cards(relay_info, MAX_LISTED_CARDS)) > 0)
+   {
+      for (i=0; i<num_cards && i<MAX_LISTED_CARDS; i++)
+      {
+         if (bench_card(relay_info[i].serial, num, mock) == 0)
+            found++;
+      }
+   }
+   else
+   {
+      found = (bench_card(NULL, num, mock) == 0);
+   }
+
+   if (!found)
+   {
+      printf("No compatible device detected.\n");
+      exit(EXIT_FAILURE);
+   }
+   exit(EXIT_SUCCESS);
+}
@@ -45,12 +45,301 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 
 #include "relay_drv.h"
 
 #define VERSION "0.11"
+#define DEFAULT_PULSE_DURATION 1000 /* ms */
+
+/* Relay commands, set together until the next step (a wait, a
+ * read or the end of a script line) */
+typedef struct
+{
+   relay_dev_t* dev;
+   relay_mask_t mask;
+   relay_mask_t states;
+   uint32_t pulse_ms[MAX_NUM_RELAYS+1];   /* pulses starting with the write */
+   uint64_t pulse_end[MAX_NUM_RELAYS+1];  /* 0 = no pulse */
+   uint64_t deadline;                     /* time of the next step */
+} cli_seq_t;
+
+
+static uint64_t now_ms(void)
+{
+   struct timespec ts;
+   
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+static void sleep_until(uint64_t t)
+{
+   struct timespec ts;
+   uint64_t now = now_ms();
+   
+   if (t <= now) return;
+   ts.tv_sec = (t-now) / 1000;
+   ts.tv_nsec = ((t-now) % 1000) * 1000000;
+   nanosleep(&ts, NULL);
+}
+
+
+/**********************************************************
+ * Function cli_flush()
+ * 
+ * Description:
+ *           Writes the relays collected so far with a single
+ *           transfer and starts their pulses
+ * 
+ * Parameters:
+ *           seq (in/out) - command sequence
+ * 
+ * Returns:   0 - success
+ *           <0 - fail
+ *********************************************************/
+static int cli_flush(cli_seq_t* seq)
+{
+   uint64_t now;
+   int err=0;
+   int i;
+   
+   if (seq->mask == 0)
+      return 0;
+   err = crelay_dev_set_relay_mask(seq->dev, seq->mask, seq->states);
+   now = now_ms();
+   for (i=FIRST_RELAY; i<=MAX_NUM_RELAYS; i++)
+   {
+      if (!(seq->mask & RELAY_BIT(i))) continue;
+      /* Explicit switching ends a pulse */
+      seq->pulse_end[i] = (err == 0 && seq->pulse_ms[i]) ? now + seq->pulse_ms[i] : 0;
+      seq->pulse_ms[i] = 0;
+   }
+   seq->mask = seq->states = 0;
+   return err;
+}
+
+
+/**********************************************************
+ * Function cli_sleep()
+ * 
+ * Description:
+ *           Waits until the given time and ends the pulses
+ *           which expire meanwhile. Pulses ending at the
+ *           same time are written at once.
+ * 
+ * Parameters:
+ *           seq (in/out) - command sequence
+ *           t (in)       - time to wait for, in ms
+ *                          (0 = until all pulses ended)
+ * 
+ * Returns:   0 - success
+ *           <0 - fail
+ *********************************************************/
+static int cli_sleep(cli_seq_t* seq, uint64_t t)
+{
+   relay_mask_t mask;
+   uint64_t next;
+   uint64_t now;
+   int err=0;
+   int i;
+   
+   while (1)
+   {
+      next = 0;
+      for (i=FIRST_RELAY; i<=MAX_NUM_RELAYS; i++)
+      {
+         if (seq->pulse_end[i] && (next == 0 || seq->pulse_end[i] < next))
+            next = seq->pulse_end[i];
+      }
+      if (next == 0 || (t != 0 && next > t))
+         break;
+      
+      sleep_until(next);
+      now = now_ms();
+      mask = 0;
+      for (i=FIRST_RELAY; i<=MAX_NUM_RELAYS; i++)
+      {
+         if (seq->pulse_end[i] && seq->pulse_end[i] <= now)
+         {
+            mask |= RELAY_BIT(i);
+            seq->pulse_end[i] = 0;
+         }
+      }
+      if (crelay_dev_set_relay_mask(seq->dev, mask, 0) != 0)
+         err = -2;
+   }
+   sleep_until(t);
+   return err;
+}
+
+
+/**********************************************************
+ * Function cli_abort()
+ * 
+ * Description:
+ *           Ends the outstanding pulses right away after an
+ *           error, so no relay is left on. Best effort, since
+ *           the card may be the cause of the error.
+ * 
+ * Parameters:
+ *           seq (in/out) - command sequence
+ * 
+ * Returns:   none
+ *********************************************************/
+static void cli_abort(cli_seq_t* seq)
+{
+   relay_mask_t mask=0;
+   int i;
+   
+   for (i=FIRST_RELAY; i<=MAX_NUM_RELAYS; i++)
+   {
+      if (seq->pulse_end[i])
+      {
+         mask |= RELAY_BIT(i);
+         seq->pulse_end[i] = 0;
+      }
+   }
+   if (mask)
+      crelay_dev_set_relay_mask(seq->dev, mask, 0);
+}
+
+
+/**********************************************************
+ * Function cli_step()
+ * 
+ * Description:
+ *           Processes one relay command, the relay number
+ *           may be followed by the state as separate word
+ * 
+ *           <relay>=on|off|pulse[:<ms>]  set a relay
+ *           <relay> [on|off]             set or read a relay
+ *           wait=<ms>                    wait before the next step
+ * 
+ * Parameters:
+ *           seq (in/out) - command sequence
+ *           word (in)    - command
+ *           next (in)    - next word or NULL
+ * 
+ * Returns:  number of words used
+ *           -1 - fail, invalid command
+ *           <-1 - fail, relay command failed
+ *********************************************************/
+static int cli_step(cli_seq_t* seq, char* word, char* next)
+{
+   relay_state_t rstate;
+   char* value;
+   char* end;
+   long relay;
+   long ms;
+   int used=1;
+   
+   if (!strncmp(word, "wait=", 5))
+   {
+      ms = strtol(word+5, &end, 10);
+      if (end == word+5 || (*end && strcmp(end, "ms")) || ms < 0) return -1;
+      if (cli_flush(seq) != 0) return -2;
+      /* Steps keep their timing, whatever the commands take */
+      seq->deadline += ms;
+      return (cli_sleep(seq, seq->deadline) != 0) ? -2 : used;
+   }
+   
+   relay = strtol(word, &end, 10);
+   if (end == word || relay < FIRST_RELAY || relay > MAX_NUM_RELAYS) return -1;
+   if (*end == '=')
+   {
+      value = end+1;
+   }
+   else if (*end == 0 && next != NULL &&
+            (!strcasecmp(next, "on") || !strcasecmp(next, "off")))
+   {
+      value = next;
+      used++;
+   }
+   else if (*end == 0)
+   {
+      /* Read, after the relays set before */
+      if (cli_flush(seq) != 0 || crelay_dev_get_relay(seq->dev, relay, &rstate) != 0) return -2;
+      printf("Relay %ld is %s\n", relay, (rstate==ON)?"on":"off");
+      return used;
+   }
+   else return -1;
+   
+   seq->pulse_ms[relay] = 0;
+   if (!strcasecmp(value, "on") || !strcmp(value, "1"))
+   {
+      seq->states |= RELAY_BIT(relay);
+   }
+   else if (!strcasecmp(value, "off") || !strcmp(value, "0"))
+   {
+      seq->states &= ~RELAY_BIT(relay);
+   }
+   else if (!strncasecmp(value, "pulse", 5))
+   {
+      ms = DEFAULT_PULSE_DURATION;
+      if (value[5] == ':')
+      {
+         ms = strtol(value+6, &end, 10);
+         if (end == value+6 || (*end && strcmp(end, "ms")) || ms <= 0) return -1;
+      }
+      else if (value[5] != 0) return -1;
+      seq->states |= RELAY_BIT(relay);
+      seq->pulse_ms[relay] = ms;
+   }
+   else return -1;
+   seq->mask |= RELAY_BIT(relay);
+   return used;
+}
+
+
+/**********************************************************
+ * Function cli_script()
+ * 
+ * Description:
+ *           Processes relay commands read from a file, one
+ *           step per line. Everything after '#' is ignored.
+ * 
+ * Parameters:
+ *           seq (in/out) - command sequence
+ *           f (in)       - script file
+ * 
+ * Returns:   0 - success
+ *           -1 - fail, invalid command
+ *          <-1 - fail, relay command failed
+ *********************************************************/
+static int cli_script(cli_seq_t* seq, FILE* f)
+{
+   char line[1024];
+   char* words[256];
+   char* save;
+   char* p;
+   int lineno=0;
+   int n, i;
+   int err;
+   
+   while (fgets(line, sizeof(line), f) != NULL)
+   {
+      lineno++;
+      if ((p = strchr(line, '#')) != NULL) *p = 0;
+      for (n=0, p=strtok_r(line, " \t\r\n", &save); p && n<256; p=strtok_r(NULL, " \t\r\n", &save))
+         words[n++] = p;
+      
+      for (i=0; i<n; i+=err)
+      {
+         if ((err = cli_step(seq, words[i], (i+1<n) ? words[i+1] : NULL)) < 0)
+         {
+            if (err == -1) printf("Invalid command in line %d: %s\n", lineno, words[i]);
+            return err;
+         }
+      }
+      if (cli_flush(seq) != 0)
+         return -2;
+   }
+   return 0;
+}
 
 
 /**********************************************************
@@ -83,6 +372,15 @@ void print_usage()
    printf("       otherwise the relays state is set to the new value provided as second parameter.\n");
    printf("       The USB communication port is auto detected. The first compatible device\n");
    printf("       found will be used, unless -s switch and a serial number is passed.\n\n");
+   printf("    crelay [-s <serial number>] <command> [<command> ...] | -\n\n");
+   printf("       Several relay commands in one call, or read from stdin (-) one step per\n");
+   printf("       line. Relays switched in the same step are written to the card at once.\n");
+   printf("         <relay number>=on|off  set a relay\n");
+   printf("         <relay number>=pulse[:<ms>]\n");
+   printf("                                switch a relay on, and off again after <ms>\n");
+   printf("                                (default %d ms)\n", DEFAULT_PULSE_DURATION);
+   printf("         <relay number>          print the relay state\n");
+   printf("         wait=<ms>               wait before the next step\n\n");
 }
 
 
@@ -105,12 +403,12 @@ int main(int argc, char *argv[])
    {
       /*****  Command line mode *****/
       
-      relay_state_t rstate;
-      char com_port[MAX_COM_PORT_NAME_LEN];
       char cname[MAX_RELAY_CARD_NAME_LEN];
       char* serial=NULL;
-      uint8_t num_relays=FIRST_RELAY;
-      relay_info_t *relay_info;
+      relay_dev_t *dev;
+      static relay_info_t relay_info[MAX_LISTED_CARDS];
+      int num_cards;
+      cli_seq_t seq;
       int argn = 1;
       int err;
       int i = 1;
@@ -118,29 +416,30 @@ int main(int argc, char *argv[])
       if (!strcmp(argv[argn],"-i"))
       {
          /* Detect all cards connected to the system */
-         if (crelay_detect_all_relay_cards(&relay_info) == -1)
+         if ((num_cards = crelay_detect_all_relay_cards(relay_info, MAX_LISTED_CARDS)) == -1)
          {
             printf("No compatible device detected.\n");
             return -1;
          }
          printf("\nDetected relay cards:\n");
-         while (relay_info->next != NULL)
+         for (i=0; i<num_cards && i<MAX_LISTED_CARDS; i++)
          {
-            crelay_get_relay_card_name(relay_info->relay_type, cname);
-            printf("  #%d\t%s (serial %s)\n", i++ ,cname, relay_info->serial);
-            relay_info = relay_info->next;
-            // TODO: free relay_info list memory
+            crelay_get_relay_card_name(relay_info[i].relay_type, cname);
+            printf("  #%d\t%s (serial %s, %d relays on %s)\n", i+1, cname, relay_info[i].serial,
+                   relay_info[i].num_relays, relay_info[i].portname);
          }
+         if (num_cards > MAX_LISTED_CARDS)
+            printf("  ... and %d more\n", num_cards-MAX_LISTED_CARDS);
          
          exit(EXIT_SUCCESS);
       }
    
       if (!strcmp(argv[argn], "-s"))
       {
-         if (argc > (argn+1))
+         /* Serial number and relay commands */
+         if (argc > (argn+2))
          {
-            serial = malloc(sizeof(char)*strlen(argv[argn+1]));
-            strcpy(serial, argv[argn+1]);
+            serial = argv[argn+1];
             argn += 2;
          }
          else
@@ -150,7 +449,7 @@ int main(int argc, char *argv[])
          }
       }
 
-      if (crelay_detect_relay_card(com_port, &num_relays, serial, NULL) == -1)
+      if ((dev = crelay_open(serial)) == NULL)
       {
          printf("No compatible device detected.\n");
          
@@ -164,36 +463,45 @@ int main(int argc, char *argv[])
          exit(EXIT_FAILURE);
       }
 
-      switch (argc)
+      memset(&seq, 0, sizeof(seq));
+      seq.dev = dev;
+      seq.deadline = now_ms();
+      
+      err = 0;
+      if (!strcmp(argv[argn], "-") && argn+1 == argc)
       {
-         case 2:
-         case 4:
-            /* GET current relay state */
-            if (crelay_get_relay(com_port, atoi(argv[argn]), &rstate, serial) == 0)
-               printf("Relay %d is %s\n", atoi(argv[argn]), (rstate==ON)?"on":"off");
+         /* Script from stdin */
+         if ((err = cli_script(&seq, stdin)) == -1)
+            err = -2;
+      }
+      else
+      {
+         while (err == 0 && argn < argc)
+         {
+            if ((i = cli_step(&seq, argv[argn], (argn+1 < argc) ? argv[argn+1] : NULL)) < 0)
+               err = i;
             else
-               exit(EXIT_FAILURE);
-            break;
-            
-         case 3:
-         case 5:
-            /* SET new relay state */
-            if (!strcmp(argv[argn+1],"on") || !strcmp(argv[argn+1],"ON"))
-               err = crelay_set_relay(com_port, atoi(argv[argn]), ON, serial);
-            else if (!strcmp(argv[argn+1],"off") || !strcmp(argv[argn+1],"OFF"))
-               err = crelay_set_relay(com_port, atoi(argv[argn]), OFF, serial);
-            else 
-            {
-               print_usage();
-               exit(EXIT_FAILURE);
-            }
-            if (err)
-               exit(EXIT_FAILURE);
-            break;
-            
-         default:
-            print_usage();
+               argn += i;
+         }
+         if (err == 0 && cli_flush(&seq) != 0)
+            err = -2;
       }
+      
+      /* Let the pulses end before the card is closed */
+      if (err == 0)
+         err = cli_sleep(&seq, 0);
+      if (err)
+         cli_abort(&seq);
+      if (err == -1)
+      {
+         crelay_close(dev);
+         print_usage();
+         exit(EXIT_FAILURE);
+      }
+      
+      crelay_close(dev);
+      if (err)
+         exit(EXIT_FAILURE);
    }
    
    exit(EXIT_SUCCESS);
@@ -52,33 +52,235 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "data_types.h"
 #include "config.h"
 #include "relay_drv.h"
+#include "relay_sched.h"
+#include "http_server.h"
+#include "dev_worker.h"
+#include "ctl_server.h"
+#include "relay_journal.h"
+#ifdef DRV_SIM
+#include "relay_drv_sim.h"
+#endif
+#ifdef USB_HOTPLUG
+#include "hotplug.h"
+#endif
 
 #define VERSION "0.14"
 #define DATE "2019"
 
 /* HTTP server defines */
 #define SERVER "crelay/"VERSION
-#define PROTOCOL "HTTP/1.1"
-#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
 #define API_URL "gpio"
+#define JSON_URL "state"
+#define EVENTS_URL "events"
+#define BATCH_URL "batch"
+#define METRICS_URL "metrics"
 #define DEFAULT_SERVER_PORT 8000
+#define DEFAULT_PULSE_DURATION 1000 /* ms */
+#define DEFAULT_RESYNC_INTERVAL 10000 /* ms */
+#define WEB_POLL_INTERVAL 5000 /* ms */
+#define MAX_BATCH_CARDS 32     /* cards switched by one batch request */
+#define WEB_PAGE_CACHE "max-age=3600"
 
 /* HTML tag definitions */
 #define RELAY_TAG "pin"
 #define STATE_TAG "status"
 #define SERIAL_TAG "serial"
+#define MASK_TAG "mask"
+#define VALUE_TAG "value"
+#define SET_TAG "set"
+#define SCENE_TAG "scene"
+#define FRESH_TAG "fresh"
 
 #define CONFIG_FILE "/etc/crelay.conf"
 
+/* Kind of HTTP request */
+typedef enum
+{
+   WEB_REQUEST,         /* web page */
+   API_REQUEST,         /* HTTP API, text response */
+   JSON_REQUEST         /* HTTP API, JSON response */
+} request_type_t;
+
+/* HTTP request data passed to the worker of the relay card */
+typedef struct
+{
+   worker_cmd_t cmd;    /* must be first */
+   worker_cmd_t set_cmd;
+   http_response_t* resp;
+   request_type_t type;
+   int  not_modified;   /* client has the current web page */
+   int  fresh;          /* read the relay states from the card */
+   int  relay;
+   relay_state_t nstate;
+   relay_mask_t nmask;
+   relay_mask_t nvalue;
+   char serial[MAX_SERIAL_LEN];
+} http_job_t;
+
+/* Relays of one card switched by a batch request */
+typedef struct
+{
+   worker_cmd_t cmd;    /* must be first */
+   worker_cmd_t set_cmd;
+   struct batch_job *batch;
+   relay_mask_t pulse_mask;
+   const char *error;   /* why the card failed, NULL = success */
+   char *out;           /* JSON result of the card */
+   size_t out_len;
+   char serial[MAX_SERIAL_LEN];
+} batch_card_t;
+
+/* HTTP batch request, completed by the last card worker */
+typedef struct batch_job
+{
+   http_response_t* resp;
+   atomic_int pending;
+   int  probe;          /* a card is not open yet */
+   int  num_cards;
+   batch_card_t cards[MAX_BATCH_CARDS];
+} batch_job_t;
+
+/* Request waiting in the probe thread for its relay card */
+typedef struct
+{
+   mpsc_node_t node;    /* must be first */
+   http_job_t *job;     /* HTTP API request, or */
+   batch_job_t *batch;  /* batch request */
+} probe_job_t;
+
 /* Global variables */
-config_t config;
+config_t config;   /* read at startup, used by the drivers */
+
+/* Config of the running daemon, replaced by a reload. Readers
+ * register in the slot of the current epoch, so that a reload
+ * can wait for the readers of the old config before freeing it. */
+static config_t* _Atomic live_config = &config;
+static atomic_uint config_epoch;
+static atomic_int  config_readers[2];
+
+/* Requests for relay cards which need to be probed */
+static mpsc_queue_t probe_queue;
+static sem_t probe_sem;
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+static int probe_running=0;
+
+/* Relay labels of the command line, they override the config file */
+static char** cmdline_labels=NULL;
+static int    num_cmdline_labels=0;
+
+/* Web page, built once at startup */
+static char*  web_page=NULL;
+static size_t web_page_len=0;
+static char   web_page_etag[16];
+
+/* Control socket of the daemon, removed at exit */
+static const char* ctl_socket=NULL;
+
+
+/**********************************************************
+ * Function: relay_key()
+ * 
+ * Description:
+ *           Gets the relay number of a per relay config
+ *           parameter relay<n><suffix>, e.g. relay12_label
+ * 
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int relay_key(const char* name, const char* suffix, int* relay)
+{
+   char* end;
+   long n;
+   
+   if (strncmp(name, "relay", 5) || name[5] < '0' || name[5] > '9')
+      return -1;
+   n = strtol(name+5, &end, 10);
+   if (strcmp(end, suffix) || n < FIRST_RELAY || n > MAX_NUM_RELAYS)
+      return -1;
+   *relay = n;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function: config_get()
+ * 
+ * Description:
+ *           Gets the current config of the daemon. It stays
+ *           valid until config_put() is called, which must
+ *           follow soon (no blocking in between).
+ * 
+ * Parameters:
+ *           slot (out) - reader slot to pass to config_put()
+ * 
+ * Returns:  config
+ *********************************************************/
+static const config_t* config_get(int* slot)
+{
+   unsigned epoch;
+   
+   while (1)
+   {
+      epoch = atomic_load(&config_epoch);
+      atomic_fetch_add(&config_readers[epoch & 1], 1);
+      if (atomic_load(&config_epoch) == epoch)
+         break;
+      /* Reload in between, register again */
+      atomic_fetch_sub(&config_readers[epoch & 1], 1);
+   }
+   *slot = epoch & 1;
+   return atomic_load(&live_config);
+}
+
+
+/**********************************************************
+ * Function: config_put()
+ * 
+ * Description:
+ *           Releases the config got by config_get()
+ * 
+ * Parameters:
+ *           slot (in) - reader slot returned by config_get()
+ * 
+ *********************************************************/
+static void config_put(int slot)
+{
+   atomic_fetch_sub(&config_readers[slot], 1);
+}
+
 
-static char rlabels[MAX_NUM_RELAYS][32] = {"My appliance 1", "My appliance 2", "My appliance 3", "My appliance 4",
-                                           "My appliance 5", "My appliance 6", "My appliance 7", "My appliance 8"};                                       
+/**********************************************************
+ * Function: relay_label()
+ * 
+ * Description:
+ *           Gets the label of a relay, from the config file
+ *           or the command line if given there
+ * 
+ * Parameters:
+ *           cfg (in)   - config
+ *           relay (in) - relay number
+ *           buf (in)   - buffer for the default label
+ *           size (in)  - size of buf
+ * 
+ * Returns:  label
+ *********************************************************/
+static const char* relay_label(const config_t* cfg, int relay, char* buf, size_t size)
+{
+   if (cfg->relay_label[relay-FIRST_RELAY] != NULL)
+      return cfg->relay_label[relay-FIRST_RELAY];
+   snprintf(buf, size, "My appliance %d", relay);
+   return buf;
+}
 
 /**********************************************************
  * Function: config_cb()
@@ -92,6 +294,7 @@ static char rlabels[MAX_NUM_RELAYS][32] = {"My appliance 1", "My appliance 2", "
 static int config_cb(void* user, const char* section, const char* name, const char* value)
 {
    config_t* pconfig = (config_t*)user;
+   int relay;
    
    #define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
    if (MATCH("HTTP server", "server_iface")) 
@@ -102,41 +305,45 @@ static int config_cb(void* user, const char* section, const char* name, const ch
    {
       pconfig->server_port = atoi(value);
    } 
-   else if (MATCH("HTTP server", "relay1_label")) 
+   else if (MATCH("HTTP server", "server_backlog")) 
    {
-      pconfig->relay1_label = strdup(value);
+      pconfig->server_backlog = atoi(value);
    } 
-   else if (MATCH("HTTP server", "relay2_label")) 
+   else if (MATCH("HTTP server", "coalesce_window")) 
    {
-      pconfig->relay2_label = strdup(value);
+      pconfig->coalesce_window = atoi(value);
    } 
-   else if (MATCH("HTTP server", "relay3_label")) 
+   else if (strcmp(section, "HTTP server") == 0 && relay_key(name, "_label", &relay) == 0) 
    {
-      pconfig->relay3_label = strdup(value);
+      free((char*)pconfig->relay_label[relay-FIRST_RELAY]);
+      pconfig->relay_label[relay-FIRST_RELAY] = strdup(value);
    } 
-   else if (MATCH("HTTP server", "relay4_label")) 
+   else if (MATCH("HTTP server", "pulse_duration")) 
    {
-      pconfig->relay4_label = strdup(value);
-   } 
-   else if (MATCH("HTTP server", "relay5_label")) 
+      /* Given in seconds, fractions are allowed (e.g. 0.25) */
+      pconfig->pulse_duration = (uint32_t)(atof(value)*1000 + 0.5);
+   }
+   else if (MATCH("HTTP server", "resync_interval")) 
    {
-      pconfig->relay5_label = strdup(value);
-   } 
-   else if (MATCH("HTTP server", "relay6_label")) 
+      /* Given in seconds, fractions are allowed */
+      pconfig->resync_interval = (uint32_t)(atof(value)*1000 + 0.5);
+   }
+   else if (MATCH("HTTP server", "rate_limit")) 
    {
-      pconfig->relay6_label = strdup(value);
-   } 
-   else if (MATCH("HTTP server", "relay7_label")) 
+      pconfig->rate_limit = atoi(value);
+   }
+   else if (MATCH("HTTP server", "rate_burst")) 
    {
-      pconfig->relay7_label = strdup(value);
-   } 
-   else if (MATCH("HTTP server", "relay8_label")) 
+      pconfig->rate_burst = atoi(value);
+   }
+   else if (MATCH("HTTP server", "queue_limit")) 
    {
-      pconfig->relay8_label = strdup(value);
-   } 
-   else if (MATCH("HTTP server", "pulse_duration")) 
+      pconfig->queue_limit = atoi(value);
+   }
+   else if (MATCH("HTTP server", "state_file")) 
    {
-      pconfig->pulse_duration = atoi(value);
+      free((char*)pconfig->state_file);
+      pconfig->state_file = strdup(value);
    }
    else if (MATCH("GPIO drv", "num_relays")) 
    {
@@ -145,42 +352,60 @@ static int config_cb(void* user, const char* section, const char* name, const ch
    else if (MATCH("GPIO drv", "active_value")) 
    {
       pconfig->gpio_active_value = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay1_gpio_pin")) 
+   }
+   else if (MATCH("GPIO drv", "chip")) 
    {
-      pconfig->relay1_gpio_pin = atoi(value);
+      pconfig->gpio_chip = strdup(value);
    } 
-   else if (MATCH("GPIO drv", "relay2_gpio_pin")) 
+   else if (strcmp(section, "GPIO drv") == 0 && relay_key(name, "_gpio_pin", &relay) == 0) 
    {
-      pconfig->relay2_gpio_pin = atoi(value);
+      pconfig->relay_gpio_pin[relay-FIRST_RELAY] = atoi(value);
    } 
-   else if (MATCH("GPIO drv", "relay3_gpio_pin")) 
+   else if (MATCH("Sainsmart drv", "num_relays")) 
    {
-      pconfig->relay3_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay4_gpio_pin")) 
+      pconfig->sainsmart_num_relays = atoi(value);
+   }
+   else if (MATCH("Sim drv", "num_cards")) 
    {
-      pconfig->relay4_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay5_gpio_pin")) 
+      pconfig->sim_num_cards = atoi(value);
+   }
+   else if (MATCH("Sim drv", "num_relays")) 
    {
-      pconfig->relay5_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay6_gpio_pin")) 
+      pconfig->sim_num_relays = atoi(value);
+   }
+   else if (MATCH("Sim drv", "latency")) 
    {
-      pconfig->relay6_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay7_gpio_pin")) 
+      pconfig->sim_latency = atoi(value);
+   }
+   else if (MATCH("Sim drv", "jitter")) 
    {
-      pconfig->relay7_gpio_pin = atoi(value);
-   } 
-   else if (MATCH("GPIO drv", "relay8_gpio_pin")) 
+      pconfig->sim_jitter = atoi(value);
+   }
+   else if (MATCH("Sim drv", "error_rate")) 
+   {
+      pconfig->sim_error_rate = atof(value);
+   }
+   else if (strcmp(section, "Scenes") == 0) 
    {
-      pconfig->relay8_gpio_pin = atoi(value);
+      if (pconfig->num_scenes >= MAX_NUM_SCENES)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "too many scenes, %s ignored\n", name);
+         return -1;
+      }
+      pconfig->scene_name[pconfig->num_scenes] = strdup(name);
+      pconfig->scene_relays[pconfig->num_scenes] = strdup(value);
+      pconfig->num_scenes++;
    } 
-   else if (MATCH("Sainsmart drv", "num_relays")) 
+   else if (strcmp(section, "Aliases") == 0) 
    {
-      pconfig->sainsmart_num_relays = atoi(value);
+      if (pconfig->num_aliases >= MAX_NUM_ALIASES)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "too many aliases, %s ignored\n", name);
+         return -1;
+      }
+      pconfig->alias_name[pconfig->num_aliases] = strdup(name);
+      pconfig->alias_serial[pconfig->num_aliases] = strdup(value);
+      pconfig->num_aliases++;
    } 
    else 
    {
@@ -191,6 +416,155 @@ static int config_cb(void* user, const char* section, const char* name, const ch
 }
 
 
+/**********************************************************
+ * Function: sched_timer_cb()
+ * 
+ * Description:
+ *           Performs the expired delayed relay actions
+ *           when the scheduler timer fires.
+ * 
+ * Returns:  -
+ *********************************************************/
+static void sched_timer_cb(void)
+{
+   sched_run();
+}
+
+
+/**********************************************************
+ * Function: config_defaults()
+ * 
+ * Description:
+ *           Sets the default values of parameters missing in
+ *           the config file and applies the relay labels of
+ *           the command line
+ * 
+ * Parameters:
+ *           cfg (in/out) - config
+ * 
+ *********************************************************/
+static void config_defaults(config_t* cfg)
+{
+   int i;
+   
+   /* Ensure pulse duration is valid **/
+   if (cfg->pulse_duration == 0)
+      cfg->pulse_duration = DEFAULT_PULSE_DURATION;
+   
+   if (cfg->resync_interval == 0)
+      cfg->resync_interval = DEFAULT_RESYNC_INTERVAL;
+   
+   /* Relay labels of the command line override the config file */
+   for (i=0; i<num_cmdline_labels; i++)
+   {
+      free((char*)cfg->relay_label[i]);
+      cfg->relay_label[i] = strdup(cmdline_labels[i]);
+   }
+}
+
+
+/**********************************************************
+ * Function: config_free()
+ * 
+ * Description:
+ *           Frees a config read by conf_parse()
+ * 
+ * Parameters:
+ *           cfg (in) - config
+ * 
+ *********************************************************/
+static void config_free(config_t* cfg)
+{
+   int i;
+   
+   free((char*)cfg->server_iface);
+   free((char*)cfg->gpio_chip);
+   free((char*)cfg->state_file);
+   for (i=0; i<MAX_NUM_RELAYS; i++)
+      free((char*)cfg->relay_label[i]);
+   for (i=0; i<cfg->num_scenes; i++)
+   {
+      free((char*)cfg->scene_name[i]);
+      free((char*)cfg->scene_relays[i]);
+   }
+   for (i=0; i<cfg->num_aliases; i++)
+   {
+      free((char*)cfg->alias_name[i]);
+      free((char*)cfg->alias_serial[i]);
+   }
+   free(cfg);
+}
+
+
+/**********************************************************
+ * Function: config_reload()
+ * 
+ * Description:
+ *           Reads the config file again and replaces the
+ *           config of the running daemon. Relay labels,
+ *           scenes, new aliases, pulse duration, coalesce
+ *           window and resync interval take effect at once.
+ *           The open relay cards, their cached states and
+ *           the client connections are kept, so the server,
+ *           GPIO and driver parameters need a restart.
+ * 
+ * Returns:  0 on success, -1 otherwise (old config kept)
+ *********************************************************/
+static int config_reload(void)
+{
+   config_t* cfg;
+   config_t* old;
+   unsigned epoch;
+   int i;
+   
+   if ((cfg = calloc(1, sizeof(config_t))) == NULL)
+      return -1;
+   if (conf_parse(CONFIG_FILE, config_cb, cfg) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Can't load %s, config not changed\n", CONFIG_FILE);
+      config_free(cfg);
+      return -1;
+   }
+   config_defaults(cfg);
+   
+   #define CHANGED(field) (cfg->field != config.field)
+   #define CHANGED_STR(field) ((cfg->field == NULL) != (config.field == NULL) || \
+                               (cfg->field != NULL && strcmp(cfg->field, config.field)))
+   if (CHANGED_STR(server_iface) || CHANGED(server_port) || CHANGED(server_backlog) ||
+       CHANGED_STR(state_file) || CHANGED(gpio_num_relays) || CHANGED(gpio_active_value) || CHANGED_STR(gpio_chip) ||
+       memcmp(cfg->relay_gpio_pin, config.relay_gpio_pin, sizeof(config.relay_gpio_pin)) ||
+       CHANGED(sainsmart_num_relays) || CHANGED(sim_num_cards) || CHANGED(sim_num_relays) ||
+       CHANGED(sim_latency) || CHANGED(sim_jitter) || CHANGED(sim_error_rate))
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Server or driver parameters changed, they take effect after a restart\n");
+   }
+   
+   crelay_worker_set_coalesce_window(cfg->coalesce_window);
+   crelay_worker_set_resync_interval(cfg->resync_interval);
+   crelay_worker_set_queue_limit(cfg->queue_limit);
+   http_server_set_rate_limit(cfg->rate_limit, cfg->rate_burst);
+   for (i=0; i<cfg->num_aliases; i++)
+   {
+      if (crelay_worker_add_alias((char*)cfg->alias_name[i], (char*)cfg->alias_serial[i]) != 0)
+         syslog(LOG_DAEMON | LOG_WARNING, "Alias %s: relay card %s not found or alias in use\n",
+                cfg->alias_name[i], cfg->alias_serial[i]);
+   }
+   
+   /* Publish the new config, then wait until the readers of the
+    * old one, which registered in the slot of the old epoch,
+    * are done with it */
+   old = atomic_exchange(&live_config, cfg);
+   epoch = atomic_fetch_add(&config_epoch, 1);
+   while (atomic_load(&config_readers[epoch & 1]) != 0)
+      sched_yield();
+   if (old != &config)
+      config_free(old);
+   
+   syslog(LOG_DAEMON | LOG_NOTICE, "Config reloaded from %s\n", CONFIG_FILE);
+   return 0;
+}
+
+
 /**********************************************************
  * Function: exit_handler()
  * 
@@ -203,43 +577,44 @@ static int config_cb(void* user, const char* section, const char* name, const ch
 static void exit_handler(int signum)
 {
    syslog(LOG_DAEMON | LOG_NOTICE, "Exit crelay daemon\n");
+   if (ctl_socket != NULL) unlink(ctl_socket);
    exit(EXIT_SUCCESS);
 }
 
-                                           
+
 /**********************************************************
- * Function send_headers()
+ * Function: signal_cb()
  * 
  * Description:
+ *           Reloads the config when SIGHUP is received. On
+ *           SIGTERM and SIGINT the pending pulses are ended
+ *           before the exit, so that the state journal does
+ *           not keep a relay on which was only pulsed.
  * 
- * Parameters:
- * 
+ * Returns:  -
  *********************************************************/
-void send_headers(FILE *f, int status, char *title, char *extra, char *mime, 
-                  int length, time_t date)
+static int signal_fd=-1;
+
+static void signal_cb(void)
 {
-   time_t now;
-   char timebuf[128];
+   struct signalfd_siginfo si;
    
-   fprintf(f, "%s %d %s\r\n", PROTOCOL, status, title);
-   fprintf(f, "Server: %s\r\n", SERVER);
-   //fprintf(f, "Access-Control-Allow-Origin: *\r\n"); // TEST For test only
-   now = time(NULL);
-   strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
-   fprintf(f, "Date: %s\r\n", timebuf);
-   if (extra) fprintf(f, "%s\r\n", extra);
-   if (mime) fprintf(f, "Content-Type: %s; charset=utf-8\r\n", mime);
-   if (length >= 0) fprintf(f, "Content-Length: %d\r\n", length);
-   if (date != -1)
+   while (read(signal_fd, &si, sizeof(si)) == sizeof(si))
    {
-      strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&date));
-      fprintf(f, "Last-Modified: %s\r\n", timebuf);
+      if (si.ssi_signo == SIGHUP)
+      {
+         config_reload();
+      }
+      else
+      {
+         sched_flush();
+         exit_handler(si.ssi_signo);
+      }
    }
-   fprintf(f, "Connection: close\r\n");
-   fprintf(f, "\r\n");
 }
 
 
+                                           
 /**********************************************************
  * Function java_script_src()
  * 
@@ -251,29 +626,73 @@ void send_headers(FILE *f, int status, char *title, char *extra, char *mime,
 void java_script_src(FILE *f)
 {
    fprintf(f, "<script type='text/javascript'>\r\n");
-   fprintf(f, "function switch_relay(checkboxElem){\r\n");
-   fprintf(f, "   var status = checkboxElem.checked ? 1 : 0;\r\n");
-   fprintf(f, "   var pin = checkboxElem.id;\r\n");
-   fprintf(f, "   var url = '/gpio?pin='+pin+'&status='+status;\r\n");
+   fprintf(f, "var serial = null;\r\n");
+   fprintf(f, "function render(s){\r\n");
+   fprintf(f, "   var t = document.getElementById('relays');\r\n");
+   fprintf(f, "   var i, h;\r\n");
+   fprintf(f, "   document.getElementById('error').style.display = 'none';\r\n");
+   fprintf(f, "   if (t.rows.length != s.relays.length+1) {\r\n");
+   fprintf(f, "      h = '<tr style=\"font-size: 14px; background-color: lightgrey\"><td style=\"width: 200px;\"><span id=\"card\"></span><br><span style=\"font-style: italic; font-size: 12px; color: grey; font-weight: normal;\">on <span id=\"port\"></span></span></td><td style=\"background-color: white;\"></td><td style=\"background-color: white;\"></td></tr>';\r\n");
+   fprintf(f, "      for (i=0; i<s.relays.length; i++)\r\n");
+   fprintf(f, "         h += '<tr style=\"vertical-align: top; background-color: rgb(230, 230, 255);\"><td style=\"width: 300px;\">Relay '+s.relays[i].relay+'<br><span style=\"font-style: italic; font-size: 16px; color: grey;\"></span></td><td style=\"text-align: center; vertical-align: middle; width: 100px; background-color: white;\"><label class=\"switch\"><input type=\"checkbox\" id=\"'+s.relays[i].relay+'\" onchange=\"switch_relay(this)\"><span class=\"slider\"></span></label></td></tr>';\r\n");
+   fprintf(f, "      t.innerHTML = h;\r\n");
+   fprintf(f, "   }\r\n");
+   fprintf(f, "   serial = s.serial;\r\n");
+   fprintf(f, "   document.getElementById('card').textContent = s.card;\r\n");
+   fprintf(f, "   document.getElementById('port').textContent = s.port;\r\n");
+   fprintf(f, "   for (i=0; i<s.relays.length; i++) {\r\n");
+   fprintf(f, "      t.rows[i+1].cells[0].lastChild.textContent = s.relays[i].label;\r\n");
+   fprintf(f, "      document.getElementById(s.relays[i].relay).checked = (s.relays[i].state == 1);\r\n");
+   fprintf(f, "   }\r\n");
+   fprintf(f, "}\r\n");
+   fprintf(f, "function update(url, checkboxElem){\r\n");
    fprintf(f, "   var xmlHttp = new XMLHttpRequest();\r\n");
    fprintf(f, "   xmlHttp.onreadystatechange = function () {\r\n");
    fprintf(f, "      if (this.readyState < 4)\r\n");
+   fprintf(f, "         return;\r\n");
+   fprintf(f, "      if (this.status == 200) {\r\n");
    fprintf(f, "         document.getElementById('status').innerHTML = '';\r\n");
-   fprintf(f, "      else if (this.readyState == 4) {\r\n"); 
-   fprintf(f, "         if (this.status == 0) {\r\n");
-   fprintf(f, "            document.getElementById('status').innerHTML = \"Network error\";\r\n");
-   fprintf(f, "            checkboxElem.checked = (status==0);\r\n");
-   fprintf(f, "         }\r\n");
-   fprintf(f, "         else if (this.status != 200) {\r\n");
-   fprintf(f, "            document.getElementById('status').innerHTML = this.statusText;\r\n");
-   fprintf(f, "            checkboxElem.checked = (status==0);\r\n");
-   fprintf(f, "         }\r\n");
-   // TODO: add update of all relays status here (according to API response in xmlHttp.responseText) 
+   fprintf(f, "         render(JSON.parse(this.responseText));\r\n");
+   fprintf(f, "         return;\r\n");
+   fprintf(f, "      }\r\n");
+   fprintf(f, "      if (this.status == 503) {\r\n");
+   fprintf(f, "         document.getElementById('relays').innerHTML = '';\r\n");
+   fprintf(f, "         document.getElementById('error').style.display = 'block';\r\n");
    fprintf(f, "      }\r\n");
+   fprintf(f, "      else\r\n");
+   fprintf(f, "         document.getElementById('status').innerHTML = (this.status == 0) ? \"Network error\" : this.statusText;\r\n");
+   fprintf(f, "      if (checkboxElem)\r\n");
+   fprintf(f, "         checkboxElem.checked = !checkboxElem.checked;\r\n");
    fprintf(f, "   }\r\n");
    fprintf(f, "   xmlHttp.open( 'GET', url, true );\r\n");
    fprintf(f, "   xmlHttp.send( null );\r\n");
    fprintf(f, "}\r\n");
+   fprintf(f, "function apply(e){\r\n");
+   fprintf(f, "   var i, c, b;\r\n");
+   fprintf(f, "   if (e.serial != serial)\r\n");
+   fprintf(f, "      return;\r\n");
+   fprintf(f, "   var changed = BigInt(e.changed), states = BigInt(e.states);\r\n");
+   fprintf(f, "   for (i=1; (c = document.getElementById(i)) != null; i++) {\r\n");
+   fprintf(f, "      b = BigInt(i-1);\r\n");
+   fprintf(f, "      if ((changed >> b) & 1n)\r\n");
+   fprintf(f, "         c.checked = ((states >> b) & 1n) == 1n;\r\n");
+   fprintf(f, "   }\r\n");
+   fprintf(f, "}\r\n");
+   fprintf(f, "function switch_relay(checkboxElem){\r\n");
+   fprintf(f, "   var status = checkboxElem.checked ? 1 : 0;\r\n");
+   fprintf(f, "   update('/%s?pin='+checkboxElem.id+'&status='+status, checkboxElem);\r\n", JSON_URL);
+   fprintf(f, "}\r\n");
+   fprintf(f, "window.onload = function () {\r\n");
+   fprintf(f, "   var es;\r\n");
+   fprintf(f, "   update('/%s', null);\r\n", JSON_URL);
+   fprintf(f, "   if (!window.EventSource) {\r\n");
+   fprintf(f, "      setInterval(function () { update('/%s', null); }, %d);\r\n", JSON_URL, WEB_POLL_INTERVAL);
+   fprintf(f, "      return;\r\n");
+   fprintf(f, "   }\r\n");
+   fprintf(f, "   es = new EventSource('/%s');\r\n", EVENTS_URL);
+   fprintf(f, "   es.addEventListener('relays', function (m) { apply(JSON.parse(m.data)); });\r\n");
+   fprintf(f, "   es.onopen = function () { update('/%s', null); };\r\n", JSON_URL);
+   fprintf(f, "}\r\n");
    fprintf(f, "</script>\r\n");
 }
 
@@ -338,355 +757,1436 @@ void style_sheet(FILE *f)
 
 
 /**********************************************************
- * Function web_page_header()
+ * Function web_page_header()
+ * 
+ * Description:
+ * 
+ * Parameters:
+ * 
+ *********************************************************/
+void web_page_header(FILE *f)
+{
+   fprintf(f, "<!DOCTYPE html PUBLIC \"-//W3C//DTD HTML 4.01//EN\" \"http://www.w3.org/TR/html4/strict.dtd\">\r\n");
+   fprintf(f, "<html><head><title>Relay Card Control</title>\r\n");
+   style_sheet(f);
+   java_script_src(f);
+   fprintf(f, "</head>\r\n");
+   
+   /* Display web page heading */
+   fprintf(f, "<body><table style=\"text-align: left; width: 460px; background-color: #2196F3; font-family: Helvetica,Arial,sans-serif; font-weight: bold; color: white;\" border=\"0\" cellpadding=\"2\" cellspacing=\"2\">\r\n");
+   fprintf(f, "<tbody><tr><td>\r\n");
+   fprintf(f, "<span style=\"vertical-align: top; font-size: 48px;\">Relay Card Control</span><br>\r\n");
+   fprintf(f, "<span style=\"font-size: 16px; color: rgb(204, 255, 255);\">Remote relay card control <span style=\"font-style: italic; color: white;\">made easy</span></span>\r\n");
+   fprintf(f, "</td></tr></tbody></table><br>\r\n");  
+}
+
+
+/**********************************************************
+ * Function web_page_footer()
+ * 
+ * Description:
+ * 
+ * Parameters:
+ * 
+ *********************************************************/
+void web_page_footer(FILE *f)
+{
+   /* Display web page footer */
+   fprintf(f, "<table style=\"text-align: left; width: 460px; background-color: #2196F3;\" border=\"0\" cellpadding=\"2\" cellspacing=\"2\"><tbody>\r\n");
+   fprintf(f, "<tr><td style=\"vertical-align: top; text-align: center;\"><span style=\"font-family: Helvetica,Arial,sans-serif; color: white;\"><a style=\"text-decoration:none; color: white;\" href=http://ondrej1024.github.io/crelay>crelay</a> | version %s | %s</span></td></tr>\r\n",
+           VERSION, DATE);
+   fprintf(f, "</tbody></table></body></html>\r\n");
+}   
+
+
+/**********************************************************
+ * Function web_page_error()
+ * 
+ * Description:
+ * 
+ * Parameters:
+ * 
+ *********************************************************/
+void web_page_error(FILE *f)
+{    
+   /* No relay card detected, error message is shown by the script */
+   fprintf(f, "<div id=\"error\" style=\"display: none;\">\r\n");
+   fprintf(f, "<br><table style=\"text-align: left; width: 460px; background-color: yellow; font-family: Helvetica,Arial,sans-serif; font-weight: bold; color: black;\" border=\"0\" cellpadding=\"2\" cellspacing=\"2\">\r\n");
+   fprintf(f, "<tbody><tr style=\"font-size: 20px; font-weight: bold;\">\r\n");
+   fprintf(f, "<td>No compatible relay card detected !<br>\r\n");
+   fprintf(f, "<span style=\"font-size: 14px; color: grey;  font-weight: normal;\">This can be due to the following reasons:\r\n");
+   fprintf(f, "<div>- No supported relay card is connected via USB cable</div>\r\n");
+   fprintf(f, "<div>- The relay card is connected but it is broken</div>\r\n");
+   fprintf(f, "<div>- There is no GPIO sysfs support available or GPIO pins not defined in %s\r\n", CONFIG_FILE);
+   fprintf(f, "<div>- You are running on a multiuser OS and don't have root permissions\r\n");
+   fprintf(f, "</span></td></tbody></table><br>\r\n");
+   fprintf(f, "</div>\r\n");
+}   
+
+
+/**********************************************************
+ * Function web_page_build()
+ * 
+ * Description:
+ *           Builds the web page once, the relay states are
+ *           filled in by the script from the JSON API. The
+ *           entity tag is a hash of the page content.
+ * 
+ * Returns:  0 on success, -1 otherwise
+ *********************************************************/
+static int web_page_build(void)
+{
+   FILE *f;
+   uint32_t hash=2166136261u;
+   size_t i;
+   
+   if ((f = open_memstream(&web_page, &web_page_len)) == NULL)
+      return -1;
+   web_page_header(f);
+   fprintf(f, "<table id=\"relays\" style=\"text-align: left; width: 460px; background-color: white; font-family: Helvetica,Arial,sans-serif; font-weight: bold; font-size: 20px;\" border=\"0\" cellpadding=\"2\" cellspacing=\"3\"></table><br>\r\n");
+   fprintf(f, "<span id=\"status\" style=\"font-size: 16px; color: red; font-family: Helvetica,Arial,sans-serif;\"></span><br><br>\r\n");
+   web_page_error(f);
+   web_page_footer(f);
+   if (fclose(f) != 0)
+      return -1;
+   
+   /* FNV-1a */
+   for (i=0; i<web_page_len; i++)
+   {
+      hash = (hash ^ (uint8_t)web_page[i]) * 16777619u;
+   }
+   snprintf(web_page_etag, sizeof(web_page_etag), "\"%08x\"", hash);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function web_page_send()
+ * 
+ * Description:
+ *           Sends the web page, or only tells the client to
+ *           use its cached copy
+ * 
+ * Parameters:
+ *           resp (out)        - HTTP response
+ *           not_modified (in) - client has the current page
+ * 
+ *********************************************************/
+static void web_page_send(http_response_t *resp, int not_modified)
+{
+   char extra[64];
+   
+   snprintf(extra, sizeof(extra), "ETag: %s\r\nCache-Control: %s", web_page_etag, WEB_PAGE_CACHE);
+   if (not_modified)
+   {
+      send_headers(resp, 304, "Not Modified", extra, NULL, -1);
+      return;
+   }
+   send_headers(resp, 200, "OK", extra, "text/html", -1);
+   send_static(resp, web_page, web_page_len);
+}
+
+
+/**********************************************************
+ * Function json_string()
+ * 
+ * Description:
+ *           Writes a string as quoted JSON string
+ * 
+ *********************************************************/
+static void json_string(FILE *f, const char *str)
+{
+   fputc('"', f);
+   for (; *str; str++)
+   {
+      if (*str == '"' || *str == '\\')
+         fprintf(f, "\\%c", *str);
+      else if ((unsigned char)*str < 0x20)
+         fprintf(f, "\\u%04x", *str);
+      else
+         fputc(*str, f);
+   }
+   fputc('"', f);
+}
+
+
+/**********************************************************
+ * Function json_relay_state()
+ * 
+ * Description:
+ *           Writes card information and state of all relays
+ *           as JSON object
+ * 
+ * Parameters:
+ *           f (in)      - output stream
+ *           dev (in)    - relay card
+ *           rstates(in) - bitmap of relay states
+ * 
+ *********************************************************/
+static void json_relay_state(FILE *f, relay_dev_t* dev, relay_mask_t rstates)
+{
+   char cname[MAX_RELAY_CARD_NAME_LEN];
+   char label[32];
+   const config_t* cfg;
+   int slot;
+   int i;
+   
+   crelay_get_relay_card_name(dev->relay_type, cname);
+   fprintf(f, "{\"card\":");
+   json_string(f, cname);
+   fprintf(f, ",\"port\":");
+   json_string(f, dev->portname);
+   fprintf(f, ",\"serial\":");
+   json_string(f, dev->serial);
+   fprintf(f, ",\"relays\":[");
+   cfg = config_get(&slot);
+   for (i=FIRST_RELAY; i<=dev->num_relays; i++)
+   {
+      fprintf(f, "%s{\"relay\":%d,\"label\":", (i == FIRST_RELAY) ? "" : ",", i);
+      json_string(f, relay_label(cfg, i, label, sizeof(label)));
+      fprintf(f, ",\"state\":%d}", (rstates & RELAY_BIT(i)) ? 1 : 0);
+   }
+   config_put(slot);
+   fprintf(f, "]}");
+}
+
+
+/**********************************************************
+ * Function relay_state_changed()
+ * 
+ * Description:
+ *           Sends the changed relay states of a card to the
+ *           clients of the event stream and stores them in the
+ *           state journal. Runs in the thread
+ *           which accessed the card.
+ * 
+ * Parameters:
+ *           dev (in)     - relay card
+ *           changed (in) - bitmap of changed relays
+ * 
+ *********************************************************/
+static void relay_state_changed(relay_dev_t* dev, relay_mask_t changed)
+{
+   char event[256];
+   char m1[RELAY_MASK_STR_LEN];
+   char m2[RELAY_MASK_STR_LEN];
+   FILE *f;
+   long len;
+   
+   if ((f = fmemopen(event, sizeof(event), "w")) == NULL)
+      return;
+   fprintf(f, "event: relays\ndata: {\"serial\":");
+   json_string(f, dev->serial);
+   fprintf(f, ",\"changed\":\"%s\",\"states\":\"%s\"}\n\n",
+           crelay_mask_format(m1, sizeof(m1), changed), crelay_mask_format(m2, sizeof(m2), dev->shadow));
+   len = ftell(f);
+   fclose(f);
+   
+   /* Drop the event if it was truncated */
+   if (len > 0 && len < sizeof(event)-1)
+      http_server_broadcast(event, len);
+   
+   journal_update(dev);
+}
+
+
+/**********************************************************
+ * Function url_match()
+ * 
+ * Description:
+ *           Checks if the path of an URL is the given one
+ * 
+ * Parameters:
+ *           url (in)  - requested URL
+ *           path (in) - path without leading '/'
+ * 
+ * Returns:  1 if the path matches, 0 otherwise
+ *********************************************************/
+static int url_match(const char* url, const char* path)
+{
+   return (url[0] == '/') && !strcmp(url+1, path);
+}
+
+
+/**********************************************************
+ * Function relay_pulse()
+ * 
+ * Description:
+ *           Generates a pulse on a relay. The relay is
+ *           switched back by the scheduler, a pulse on a
+ *           relay which is already pulsing just extends it.
+ *           Runs in the worker thread of the relay card.
+ * 
+ * Parameters:
+ *           dev (in)    - relay card
+ *           serial (in) - serial number the card was opened with
+ *           relay (in)  - relay number
+ * 
+ * Returns:   0 - success
+ *           -1 - fail, the relay is not pulsing
+ *********************************************************/
+static int relay_pulse(relay_dev_t* dev, char* serial, int relay)
+{
+   relay_state_t pstate=INVALID;
+   uint32_t duration;
+   int slot;
+   
+   duration = config_get(&slot)->pulse_duration;
+   config_put(slot);
+   if (sched_get_pending(serial, relay, &pstate) != 0)
+   {
+      if ((crelay_dev_get_relay(dev, relay, &pstate) != 0) ||
+          (crelay_dev_set_relay(dev, relay, (pstate == ON) ? OFF : ON) != 0))
+      {
+         pstate = INVALID;
+      }
+   }
+   if (pstate == INVALID)
+      return -1;
+   if (sched_add(duration, serial, relay, pstate) != 0)
+   {
+      /* No room for the event, don't leave the relay switched */
+      syslog(LOG_DAEMON | LOG_WARNING, "Too many pending pulses, relay %d not pulsed\n", relay);
+      crelay_dev_set_relay(dev, relay, pstate);
+      return -1;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function relay_response()
+ * 
+ * Description:
+ *           Writes the response with the relay states of a
+ *           card to a HTTP request
+ * 
+ * Parameters:
+ *           job (in)     - HTTP request data
+ *           dev (in)     - relay card
+ *           rstates (in) - bitmap of relay states
+ * 
+ *********************************************************/
+static void relay_response(http_job_t* job, relay_dev_t* dev, relay_mask_t rstates)
+{
+   FILE *fout = job->resp->body;
+   int  i;
+   
+   if (job->type == API_REQUEST)
+   {
+      /* HTTP API request, send response */
+      send_headers(job->resp, 200, "OK", NULL, "text/plain", -1);
+      for (i=FIRST_RELAY; i<=dev->num_relays; i++)
+      {
+         fprintf(fout, "Relay %d:%d<br>", i, (rstates & RELAY_BIT(i)) ? ON : OFF);
+      }
+   }
+   else if (job->type == JSON_REQUEST)
+   {
+      send_headers(job->resp, 200, "OK", "Cache-Control: no-store", "application/json", -1);
+      json_relay_state(fout, dev, rstates);
+   }
+   else
+   {
+      /* Web request, the page shows the states from the JSON API */
+      web_page_send(job->resp, job->not_modified);
+   }
+}
+
+
+/**********************************************************
+ * Function relay_error_response()
+ * 
+ * Description:
+ *           Writes the response to a HTTP request which the
+ *           relay card could not carry out
+ * 
+ * Parameters:
+ *           job (in)    - HTTP request data
+ *           status (in) - HTTP status, 400 or 503
+ *           msg (in)    - error message
+ * 
+ *********************************************************/
+static void relay_error_response(http_job_t* job, int status, const char* msg)
+{
+   char *reason = (status == 400) ? "Bad Request" : "Service Unavailable";
+   char *hdr = (status == 400) ? NULL : "Retry-After: 1";
+   
+   if (job->type == JSON_REQUEST)
+   {
+      send_headers(job->resp, status, reason, hdr, "application/json", -1);
+      fprintf(job->resp->body, "{\"error\":");
+      json_string(job->resp->body, msg);
+      fprintf(job->resp->body, "}");
+   }
+   else
+   {
+      send_headers(job->resp, status, reason, hdr, "text/plain", -1);
+      fprintf(job->resp->body, "ERROR: %s", msg);
+   }
+}
+
+
+/**********************************************************
+ * Function process_relay_request()
+ * 
+ * Description:
+ *           Performs the pulse action of a HTTP request
+ *           and writes the response. Runs in the worker
+ *           thread of the relay card, after the relays
+ *           have been set by the queued set command.
+ * 
+ * Parameters:
+ *           dev (in)  - relay card
+ *           arg (in)  - HTTP request data
+ * 
+ *********************************************************/
+static int process_relay_request(relay_dev_t* dev, void* arg)
+{
+   http_job_t *job = arg;
+   char *serial = job->serial;
+   int  relay = job->relay;
+   relay_mask_t rstates=0;
+   
+   /* The relays have been written by the set command */
+   if (job->set_cmd.relay_mask & ~RELAY_MASK_ALL(dev->num_relays))
+   {
+      relay_error_response(job, 400, "Relay number out of range");
+      return -1;
+   }
+   if (job->set_cmd.relay_mask != 0 && job->set_cmd.result != 0)
+   {
+      relay_error_response(job, 503, "Relay card write failed");
+      return -1;
+   }
+   if ((relay != 0) && (job->nstate == PULSE) && (relay_pulse(dev, serial, relay) != 0))
+   {
+      relay_error_response(job, 503, "Relay not pulsed");
+      return -1;
+   }
+   
+   /* Get current state for all relays, from the shadow copy
+    * unless the client asks for a fresh read of the card */
+   if (job->fresh || crelay_dev_get_cached_relays(dev, &rstates) != 0)
+      crelay_dev_get_all_relays(dev, &rstates);
+   
+   /* Send response to client */
+   relay_response(job, dev, rstates);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function relay_request_done()
+ * 
+ * Description:
+ *           Completion of a HTTP request in the worker
+ *           thread, hands the response back to the server
+ * 
+ * Parameters:
+ *           cmd (in) - executed worker command
+ * 
+ *********************************************************/
+static void relay_request_done(worker_cmd_t* cmd)
+{
+   http_job_t *job = (http_job_t*)cmd;
+   
+   http_server_complete(job->resp);
+   free(job);
+}
+
+
+/**********************************************************
+ * Function form_number()
+ * 
+ * Description:
+ *           Gets the numeric value of a form field, decimal
+ *           or hex (0x...)
+ * 
+ * Parameters:
+ *           data (in)   - form data
+ *           len (in)    - length of the form data
+ *           name (in)   - name of the field
+ *           value (out) - value
+ * 
+ * Returns:  0 if found, -1 if missing or not a number
+ *********************************************************/
+static int form_number(const char* data, int len, const char* name, long* value)
+{
+   char buf[32];
+   char* end;
+   
+   if (http_get_param(data, len, name, buf, sizeof(buf)) <= 0)
+      return -1;
+   *value = strtol(buf, &end, 0);
+   return (*end == 0) ? 0 : -1;
+}
+
+
+/**********************************************************
+ * Function form_mask()
+ * 
+ * Description:
+ *           Gets a relay bitmap from a form field, decimal
+ *           or hex (0x...)
+ * 
+ * Parameters:
+ *           data (in)   - form data
+ *           len (in)    - length of the form data
+ *           name (in)   - name of the field
+ *           mask (out)  - bitmap
+ * 
+ * Returns:  0 if found, -1 if missing or not a bitmap
+ *********************************************************/
+static int form_mask(const char* data, int len, const char* name, relay_mask_t* mask)
+{
+   char buf[48];
+   char* end;
+   
+   if (http_get_param(data, len, name, buf, sizeof(buf)) <= 0)
+      return -1;
+   return (crelay_mask_parse(buf, &end, mask) == 0 && *end == 0) ? 0 : -1;
+}
+
+
+/**********************************************************
+ * Function batch_add()
+ * 
+ * Description:
+ *           Adds a list of relays to a batch request. The
+ *           list has the format [serial:]relay:state,...
+ * 
+ * Parameters:
+ *           batch (in/out) - batch request
+ *           list (in)      - list of relays
+ *           serial (in)    - card of items without serial
+ * 
+ * Returns:  0 on success, -1 on invalid list
+ *********************************************************/
+static int batch_add(batch_job_t* batch, const char* list, const char* serial)
+{
+   char buf[HTTP_MAX_REQUEST_LEN];
+   char *item, *field[3], *save, *end;
+   char cserial[MAX_SERIAL_LEN];
+   batch_card_t *card;
+   long relay, state;
+   int  n, i;
+   
+   snprintf(buf, sizeof(buf), "%s", list);
+   for (item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save))
+   {
+      /* Split the item, the serial number may be empty */
+      for (n=0; n<3 && item; n++)
+      {
+         field[n] = item;
+         if ((item = strchr(item, ':')) != NULL) *item++ = 0;
+      }
+      if (item != NULL || n < 2)
+         return -1;
+      
+      /* Items for an alias belong to the card itself */
+      snprintf(cserial, sizeof(cserial), "%s", (n == 3) ? field[0] : serial);
+      if (crelay_worker_find(cserial, cserial) == -2)
+         batch->probe = 1;
+      relay = strtol(field[n-2], &end, 10);
+      if (*end || relay < FIRST_RELAY || relay > MAX_NUM_RELAYS)
+         return -1;
+      state = strtol(field[n-1], &end, 10);
+      if (*end || (state != OFF && state != ON && state != PULSE))
+         return -1;
+      
+      /* One set command per card */
+      for (i=0; i<batch->num_cards && strcmp(batch->cards[i].serial, cserial); i++);
+      if (i == batch->num_cards)
+      {
+         if (i == MAX_BATCH_CARDS)
+            return -1;
+         batch->num_cards++;
+         card = &batch->cards[i];
+         card->batch = batch;
+         card->set_cmd.type = WORKER_SET_MASK;
+         snprintf(card->serial, sizeof(card->serial), "%s", cserial);
+      }
+      card = &batch->cards[i];
+      
+      if (state == PULSE)
+      {
+         card->pulse_mask |= RELAY_BIT(relay);
+         continue;
+      }
+      card->set_cmd.relay_mask |= RELAY_BIT(relay);
+      if (state == ON)
+         card->set_cmd.relay_states |= RELAY_BIT(relay);
+      else
+         card->set_cmd.relay_states &= ~RELAY_BIT(relay);
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function batch_release()
+ * 
+ * Description:
+ *           Drops a reference to a batch request, the last
+ *           one sends the response with the results of all
+ *           cards
+ * 
+ * Parameters:
+ *           batch (in) - batch request
+ * 
+ *********************************************************/
+static void batch_release(batch_job_t* batch)
+{
+   FILE *fout = batch->resp->body;
+   const char *error=NULL;
+   int i;
+   
+   if (atomic_fetch_sub(&batch->pending, 1) != 1)
+      return;
+   
+   /* The states of the cards are sent along with a failure */
+   for (i=0; i<batch->num_cards && error == NULL; i++)
+      error = batch->cards[i].error;
+   if (error != NULL)
+   {
+      send_headers(batch->resp, 503, "Service Unavailable", "Retry-After: 1", "application/json", -1);
+      fprintf(fout, "{\"error\":");
+      json_string(fout, error);
+      fprintf(fout, ",\"cards\":[");
+   }
+   else
+   {
+      send_headers(batch->resp, 200, "OK", "Cache-Control: no-store", "application/json", -1);
+      fprintf(fout, "{\"cards\":[");
+   }
+   for (i=0; i<batch->num_cards; i++)
+   {
+      fprintf(fout, "%s", i ? "," : "");
+      if (batch->cards[i].out != NULL)
+         fwrite(batch->cards[i].out, 1, batch->cards[i].out_len, fout);
+      free(batch->cards[i].out);
+   }
+   fprintf(fout, "]}");
+   
+   http_server_complete(batch->resp);
+   free(batch);
+}
+
+
+/**********************************************************
+ * Function batch_card_run()
+ * 
+ * Description:
+ *           Performs the pulses of a batch request on a card
+ *           and gets its result. Runs in the worker thread of
+ *           the card, after its relays have been set.
+ * 
+ * Parameters:
+ *           dev (in)  - relay card
+ *           arg (in)  - card of the batch request
+ * 
+ *********************************************************/
+static int batch_card_run(relay_dev_t* dev, void* arg)
+{
+   batch_card_t *card = arg;
+   relay_mask_t rstates=0;
+   FILE *f;
+   int i;
+   
+   /* The relays have been written by the set command */
+   if (card->set_cmd.relay_mask & ~RELAY_MASK_ALL(dev->num_relays))
+      card->error = "Relay number out of range";
+   else if (card->set_cmd.relay_mask != 0 && card->set_cmd.result != 0)
+      card->error = "Relay card write failed";
+   for (i=FIRST_RELAY; i<=dev->num_relays; i++)
+   {
+      if ((card->pulse_mask & RELAY_BIT(i)) && relay_pulse(dev, card->serial, i) != 0)
+         card->error = "Relay not pulsed";
+   }
+   if (crelay_dev_get_cached_relays(dev, &rstates) != 0)
+      crelay_dev_get_all_relays(dev, &rstates);
+   
+   if ((f = open_memstream(&card->out, &card->out_len)) != NULL)
+   {
+      json_relay_state(f, dev, rstates);
+      fclose(f);
+   }
+   return 0;
+}
+
+
+static void batch_card_done(worker_cmd_t* cmd)
+{
+   batch_release(((batch_card_t*)cmd)->batch);
+}
+
+
+/**********************************************************
+ * Function batch_submit()
+ * 
+ * Description:
+ *           Queues the writes of a batch request for the
+ *           worker of each card
+ * 
+ * Parameters:
+ *           batch (in) - batch request
+ * 
+ * Returns:  HTTP_PENDING if the response is sent by the last
+ *           card, 0 if it is complete
+ *********************************************************/
+static int batch_submit(batch_job_t* batch)
+{
+   http_response_t *resp = batch->resp;
+   FILE *fout = resp->body;
+   batch_card_t *card;
+   FILE *f;
+   int submitted=0;
+   int i, j;
+   
+   /* Push back when the queue of a card is full */
+   for (i=0; i<batch->num_cards; i++)
+   {
+      if (crelay_worker_admit(batch->cards[i].serial) == -2)
+      {
+         send_headers(resp, 503, "Service Unavailable", "Retry-After: 1", "text/plain", -1);
+         fprintf(fout, "ERROR: Relay card %s busy", batch->cards[i].serial);
+         free(batch);
+         return 0;
+      }
+   }
+   
+   /* Queue the write and the result of each card, the response
+    * is sent when the last card has completed */
+   atomic_init(&batch->pending, batch->num_cards+1);
+   for (i=0; i<batch->num_cards; i++)
+   {
+      card = &batch->cards[i];
+      for (j=FIRST_RELAY; j<=MAX_NUM_RELAYS; j++)
+      {
+         /* Explicit switching ends a pulse */
+         if (card->set_cmd.relay_mask & RELAY_BIT(j)) sched_cancel(card->serial, j);
+      }
+      card->cmd.type = WORKER_CALL;
+      card->cmd.fn = batch_card_run;
+      card->cmd.arg = card;
+      card->cmd.done = batch_card_done;
+      if (crelay_worker_submit_pair(card->serial,
+             (card->set_cmd.relay_mask != 0) ? &card->set_cmd : NULL, &card->cmd) == 0)
+      {
+         submitted++;
+         continue;
+      }
+      
+      /* No relay card present */
+      if ((f = open_memstream(&card->out, &card->out_len)) != NULL)
+      {
+         fprintf(f, "{\"serial\":");
+         json_string(f, card->serial);
+         fprintf(f, ",\"error\":\"No compatible device detected\"}");
+         fclose(f);
+      }
+      atomic_fetch_sub(&batch->pending, 1);
+   }
+   
+   if (submitted == 0)
+   {
+      send_headers(resp, 503, "No compatible device detected", NULL, "text/plain", -1);
+      fprintf(fout, "ERROR: No compatible device detected");
+      for (i=0; i<batch->num_cards; i++) free(batch->cards[i].out);
+      free(batch);
+      return 0;
+   }
+   batch_release(batch);
+   return HTTP_PENDING;
+}
+
+
+/**********************************************************
+ * Function relay_request_submit()
+ * 
+ * Description:
+ *           Queues the commands of a HTTP API request for
+ *           the worker of the relay card
+ * 
+ * Parameters:
+ *           job (in)        - HTTP request data
+ *           card_found (in) - relay card of the request is open
+ * 
+ * Returns:  HTTP_PENDING if the response is sent by the
+ *           worker, 0 if it is complete
+ *********************************************************/
+static int relay_request_submit(http_job_t* job, int card_found)
+{
+   http_response_t *resp = job->resp;
+   FILE *fout = resp->body;
+   relay_dev_t dev;
+   int  i;
+   
+   /* Switch relays on/off with a set command, so that the worker
+    * can merge it with the ones of concurrent requests */
+   job->set_cmd.type = WORKER_SET_MASK;
+   if ((job->relay >= FIRST_RELAY) && (job->relay <= MAX_NUM_RELAYS) &&
+       (job->nstate == ON || job->nstate == OFF))
+   {
+      job->set_cmd.relay_mask = RELAY_BIT(job->relay);
+      job->set_cmd.relay_states = (job->nstate == ON) ? RELAY_BIT(job->relay) : 0;
+   }
+   job->set_cmd.relay_mask |= job->nmask;
+   job->set_cmd.relay_states = (job->set_cmd.relay_states & ~job->nmask) | (job->nvalue & job->nmask);
+   
+   /* Push back when the queue of the card is full, reads are
+    * still served from the last known states */
+   if (card_found && crelay_worker_admit(job->serial) == -2)
+   {
+      if (job->set_cmd.relay_mask == 0 && !(job->relay != 0 && job->nstate == PULSE) &&
+          !job->fresh && crelay_worker_get_cached(job->serial, &dev) == 0)
+      {
+         relay_response(job, &dev, dev.shadow);
+      }
+      else if (job->type == JSON_REQUEST)
+      {
+         send_headers(resp, 503, "Service Unavailable", "Retry-After: 1", "application/json", -1);
+         fprintf(fout, "{\"error\":\"Relay card busy\"}");
+      }
+      else
+      {
+         send_headers(resp, 503, "Service Unavailable", "Retry-After: 1", "text/plain", -1);
+         fprintf(fout, "ERROR: Relay card busy");
+      }
+      free(job);
+      return 0;
+   }
+   
+   for (i=FIRST_RELAY; i<=MAX_NUM_RELAYS; i++)
+   {
+      /* Explicit switching ends a pulse */
+      if (job->set_cmd.relay_mask & RELAY_BIT(i)) sched_cancel(job->serial, i);
+   }
+   
+   /* Pass the request to the worker of the relay card, after
+    * the write of the relays */
+   job->cmd.type = WORKER_CALL;
+   job->cmd.fn = process_relay_request;
+   job->cmd.arg = job;
+   job->cmd.done = relay_request_done;
+   if (card_found && crelay_worker_submit_pair(job->serial,
+          (job->set_cmd.relay_mask != 0) ? &job->set_cmd : NULL, &job->cmd) == 0)
+   {
+      return HTTP_PENDING;
+   }
+   
+   /* No relay card present */
+   if (job->type == API_REQUEST)
+   {
+      /* HTTP API request, send response */
+      send_headers(resp, 503, "No compatible device detected", NULL, "text/plain", -1);
+      fprintf(fout, "ERROR: No compatible device detected");
+   }
+   else if (job->type == JSON_REQUEST)
+   {
+      send_headers(resp, 503, "No compatible device detected", "Cache-Control: no-store", "application/json", -1);
+      fprintf(fout, "{\"error\":\"No compatible device detected\"}");
+   }
+   else
+   {  
+      /* Web page request, the page shows the error itself */
+      web_page_send(resp, job->not_modified);
+   }     
+   free(job);
+
+   return 0;
+}
+
+
+/**********************************************************
+ * Function probe_thread()
+ * 
+ * Description:
+ *           Thread which completes the requests for relay
+ *           cards not open yet, so that the event loop
+ *           doesn't wait for the bus to be probed
+ * 
+ * Parameters:
+ *           arg (in) - not used
+ * 
+ *********************************************************/
+static void* probe_thread(void* arg)
+{
+   mpsc_node_t *node;
+   probe_job_t *p;
+   http_response_t *resp;
+   
+   while (1)
+   {
+      if (sem_wait(&probe_sem) != 0) continue;
+      
+      /* A producer may still be linking its request */
+      while ((node = mpsc_pop(&probe_queue)) == NULL)
+         sched_yield();
+      p = (probe_job_t*)node;
+      
+      if (p->job != NULL)
+      {
+         resp = p->job->resp;
+         if (relay_request_submit(p->job, crelay_worker_resolve(p->job->serial, p->job->serial) == 0) == 0)
+            http_server_complete(resp);
+      }
+      else
+      {
+         /* The cards are probed when their writes are queued */
+         resp = p->batch->resp;
+         if (batch_submit(p->batch) == 0)
+            http_server_complete(resp);
+      }
+      free(p);
+   }
+   return NULL;
+}
+
+
+static void probe_start(void)
+{
+   pthread_t thread;
+   
+   mpsc_init(&probe_queue);
+   sem_init(&probe_sem, 0, 0);
+   if (pthread_create(&thread, NULL, probe_thread, NULL) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Failed to start probe thread: %s\n", strerror(errno));
+      return;
+   }
+   pthread_detach(thread);
+   probe_running = 1;
+}
+
+
+/**********************************************************
+ * Function probe_defer()
  * 
  * Description:
+ *           Passes a request to the probe thread, which is
+ *           started with the first one
  * 
  * Parameters:
+ *           job (in)   - HTTP API request or NULL
+ *           batch (in) - batch request or NULL
  * 
+ * Returns:  0 on success, -1 if the request must be
+ *           completed by the caller
  *********************************************************/
-void web_page_header(FILE *f)
+static int probe_defer(http_job_t* job, batch_job_t* batch)
 {
-   /* Send http header */
-   send_headers(f, 200, "OK", NULL, "text/html", -1, -1);   
-   fprintf(f, "<!DOCTYPE html PUBLIC \"-//W3C//DTD HTML 4.01//EN\" \"http://www.w3.org/TR/html4/strict.dtd\">\r\n");
-   fprintf(f, "<html><head><title>Relay Card Control</title>\r\n");
-   style_sheet(f);
-   java_script_src(f);
-   fprintf(f, "</head>\r\n");
+   probe_job_t *p;
    
-   /* Display web page heading */
-   fprintf(f, "<body><table style=\"text-align: left; width: 460px; background-color: #2196F3; font-family: Helvetica,Arial,sans-serif; font-weight: bold; color: white;\" border=\"0\" cellpadding=\"2\" cellspacing=\"2\">\r\n");
-   fprintf(f, "<tbody><tr><td>\r\n");
-   fprintf(f, "<span style=\"vertical-align: top; font-size: 48px;\">Relay Card Control</span><br>\r\n");
-   fprintf(f, "<span style=\"font-size: 16px; color: rgb(204, 255, 255);\">Remote relay card control <span style=\"font-style: italic; color: white;\">made easy</span></span>\r\n");
-   fprintf(f, "</td></tr></tbody></table><br>\r\n");  
+   pthread_once(&probe_once, probe_start);
+   if (!probe_running || (p = calloc(1, sizeof(probe_job_t))) == NULL)
+      return -1;
+   p->job = job;
+   p->batch = batch;
+   mpsc_push(&probe_queue, &p->node);
+   sem_post(&probe_sem);
+   return 0;
 }
 
 
 /**********************************************************
- * Function web_page_footer()
+ * Function process_batch_request()
  * 
  * Description:
+ *           Switches a list of relays, or a scene from the
+ *           config file, with one write per card and sends
+ *           the state of all involved cards as response
  * 
  * Parameters:
+ *           formdata (in)    - form data
+ *           formdatalen (in) - length of the form data
+ *           resp (out)       - HTTP response
  * 
  *********************************************************/
-void web_page_footer(FILE *f)
+static int process_batch_request(const char* formdata, int formdatalen, http_response_t* resp)
 {
-   /* Display web page footer */
-   fprintf(f, "<table style=\"text-align: left; width: 460px; background-color: #2196F3;\" border=\"0\" cellpadding=\"2\" cellspacing=\"2\"><tbody>\r\n");
-   fprintf(f, "<tr><td style=\"vertical-align: top; text-align: center;\"><span style=\"font-family: Helvetica,Arial,sans-serif; color: white;\"><a style=\"text-decoration:none; color: white;\" href=http://ondrej1024.github.io/crelay>crelay</a> | version %s | %s</span></td></tr>\r\n",
-           VERSION, DATE);
-   fprintf(f, "</tbody></table></body></html>\r\n");
-}   
+   FILE *fout = resp->body;
+   char value[HTTP_MAX_REQUEST_LEN];
+   char serial[MAX_SERIAL_LEN];
+   batch_job_t *batch;
+   const config_t* cfg;
+   int err=0;
+   int found;
+   int slot;
+   int i;
+   
+   if ((batch = calloc(1, sizeof(batch_job_t))) == NULL)
+   {
+      send_headers(resp, 500, "Internal Error", NULL, "text/plain", -1);
+      return 0;
+   }
+   batch->resp = resp;
+   if (http_get_param(formdata, formdatalen, SERIAL_TAG, serial, sizeof(serial)) < 0)
+      serial[0] = 0;
+   
+   /* Collect the relays of the scene and of the list */
+   if (http_get_param(formdata, formdatalen, SCENE_TAG, value, sizeof(value)) >= 0)
+   {
+      /* The relays of the scene are copied, the card lookup
+       * may take a while */
+      cfg = config_get(&slot);
+      for (i=0; i<cfg->num_scenes && strcmp(cfg->scene_name[i], value); i++);
+      found = (i < cfg->num_scenes);
+      if (found)
+         snprintf(value, sizeof(value), "%s", cfg->scene_relays[i]);
+      config_put(slot);
+      if (!found)
+      {
+         send_headers(resp, 404, "Not Found", NULL, "text/plain", -1);
+         fprintf(fout, "ERROR: Unknown scene %s", value);
+         free(batch);
+         return 0;
+      }
+      err = batch_add(batch, value, serial);
+   }
+   if (err == 0 && http_get_param(formdata, formdatalen, SET_TAG, value, sizeof(value)) >= 0)
+   {
+      err = batch_add(batch, value, serial);
+   }
+   if (err != 0 || batch->num_cards == 0)
+   {
+      send_headers(resp, 400, "Bad Request", NULL, "text/plain", -1);
+      fprintf(fout, "ERROR: Invalid relay list");
+      free(batch);
+      return 0;
+   }
+   
+   /* Cards which are not open are probed outside the event loop */
+   if (batch->probe && probe_defer(NULL, batch) == 0)
+      return HTTP_PENDING;
+   return batch_submit(batch);
+}
 
 
 /**********************************************************
- * Function web_page_error()
+ * Function process_http_request()
  * 
  * Description:
+ *           Parses a HTTP request and passes it to the 
+ *           worker thread of the relay card
  * 
  * Parameters:
+ *           req (in)   - HTTP request
+ *           resp (out) - HTTP response
  * 
  *********************************************************/
-void web_page_error(FILE *f)
-{    
-   /* No relay card detected, display error message on web page */
-   fprintf(f, "<br><table style=\"text-align: left; width: 460px; background-color: yellow; font-family: Helvetica,Arial,sans-serif; font-weight: bold; color: black;\" border=\"0\" cellpadding=\"2\" cellspacing=\"2\">\r\n");
-   fprintf(f, "<tbody><tr style=\"font-size: 20px; font-weight: bold;\">\r\n");
-   fprintf(f, "<td>No compatible relay card detected !<br>\r\n");
-   fprintf(f, "<span style=\"font-size: 14px; color: grey;  font-weight: normal;\">This can be due to the following reasons:\r\n");
-   fprintf(f, "<div>- No supported relay card is connected via USB cable</div>\r\n");
-   fprintf(f, "<div>- The relay card is connected but it is broken</div>\r\n");
-   fprintf(f, "<div>- There is no GPIO sysfs support available or GPIO pins not defined in %s\r\n", CONFIG_FILE);
-   fprintf(f, "<div>- You are running on a multiuser OS and don't have root permissions\r\n");
-   fprintf(f, "</span></td></tbody></table><br>\r\n");
-}   
+int process_http_request(http_request_t* req, http_response_t* resp)
+{
+   FILE *fout = resp->body;
+   char *url = req->url;
+   const char *formdata;
+   int  formdatalen;
+   int  err;
+   long value;
+   http_job_t *job;
+   
+   /* Check the request method we are dealing with. The form data
+    * of a POST request is the body, of a GET request the query. */
+   if (strcasecmp(req->method, "POST") == 0)
+   {
+      formdata = req->body;
+      formdatalen = req->body_len;
+   }
+   else if (strcasecmp(req->method, "GET") == 0)
+   {
+      formdata = req->query;
+      formdatalen = req->query_len;
+   }
+   else
+   {
+      return -3;
+   }
+   
+   /* Several relays (of several cards) switched at once */
+   if (url_match(url, BATCH_URL))
+   {
+      return process_batch_request(formdata, formdatalen, resp);
+   }
+   
+   /* Counters and latency histograms for monitoring */
+   if (url_match(url, METRICS_URL))
+   {
+      send_headers(resp, 200, "OK", "Cache-Control: no-cache", "text/plain", -1);
+      crelay_write_metrics(fout);
+      crelay_worker_write_metrics(fout);
+      http_server_write_metrics(fout);
+      return 0;
+   }
+   
+   if ((job = calloc(1, sizeof(http_job_t))) == NULL) {
+     send_headers(resp, 500, "Internal Error", NULL, "text/html", -1);
+     fprintf(fout, "ERROR: Invalid Input. \r\n");
+     return 0;
+   }
+   job->nstate = INVALID;
+   if (strstr(url, API_URL) != NULL)
+      job->type = API_REQUEST;
+   else if (url_match(url, JSON_URL))
+      job->type = JSON_REQUEST;
+   else
+      job->type = WEB_REQUEST;
+   job->not_modified = (req->if_none_match != NULL) &&
+                       (strstr(req->if_none_match, web_page_etag) != NULL);
+   
+   /* Clients of the event stream get the relay state changes */
+   if (url_match(url, EVENTS_URL))
+   {
+      free(job);
+      return HTTP_EVENT_STREAM;
+   }
+   
+   /* The web page itself doesn't depend on the relay card */
+   if (job->type == WEB_REQUEST && formdatalen == 0)
+   {
+      web_page_send(resp, job->not_modified);
+      free(job);
+      return 0;
+   }
+
+   /* Get values from form data */
+   if (formdatalen > 0) 
+   {
+      if (form_number(formdata, formdatalen, RELAY_TAG, &value) == 0 &&
+          value >= FIRST_RELAY && value <= MAX_NUM_RELAYS)
+         job->relay = value;
+      if (form_number(formdata, formdatalen, STATE_TAG, &value) == 0 &&
+          value >= OFF && value <= PULSE)
+         job->nstate = value;
+      if (form_mask(formdata, formdatalen, MASK_TAG, &job->nmask) != 0)
+         job->nmask = 0;
+      if (form_mask(formdata, formdatalen, VALUE_TAG, &job->nvalue) != 0)
+         job->nvalue = 0;
+      if (form_number(formdata, formdatalen, FRESH_TAG, &value) == 0)
+         job->fresh = value;
+      if (http_get_param(formdata, formdatalen, SERIAL_TAG, job->serial, sizeof(job->serial)) < 0)
+         job->serial[0] = 0;
+   }
+   
+   /* Switch relays on/off with a set command, so that the worker
+    * can merge it with the ones of concurrent requests */
+   job->resp = resp;
+   
+   /* A card which is not open is probed outside the event loop */
+   if ((err = crelay_worker_find(job->serial, job->serial)) == -2)
+   {
+      if (probe_defer(job, NULL) == 0)
+         return HTTP_PENDING;
+      err = crelay_worker_resolve(job->serial, job->serial);
+   }
+   return relay_request_submit(job, err == 0);
+}
+
+
+/* Relay commands of the command line, set together until the next
+ * step (a wait, a read, another card or the end of a script line) */
+typedef struct
+{
+   char serial[MAX_SERIAL_LEN];    /* "" = first card */
+   relay_mask_t mask;
+   relay_mask_t states;
+   relay_mask_t pulse;
+   uint32_t pulse_ms[MAX_NUM_RELAYS+1];
+   uint64_t deadline;              /* time of the next step, in ms */
+   int ctl;                        /* daemon control socket, -1 = none */
+} cli_seq_t;
+
+
+static uint64_t cli_now(void)
+{
+   struct timespec ts;
+   
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
 
 
 /**********************************************************
- * Function read_httppost_data()
+ * Function cli_cmd()
  * 
  * Description:
+ *           Sends a command of the control protocol to the
+ *           daemon, or executes it in this process if no
+ *           daemon is running
  * 
  * Parameters:
+ *           seq (in)    - command line sequence
+ *           reply (out) - reply after "OK "
+ *           len (in)    - size of reply
+ *           fmt (in)    - command format, followed by the
+ *                         arguments
  * 
+ * Returns:   0 - success
+ *           -1 - fail, no relay card found
+ *           -2 - fail
  *********************************************************/
-int read_httppost_data(FILE* f, char* data, size_t datalen)
+static int cli_cmd(cli_seq_t* seq, char* reply, size_t len, const char* fmt, ...)
 {
-   char buf[256];
-   int data_len=0;
+   char cmd[CTL_MAX_MSG_LEN];
+   char buf[CTL_MAX_MSG_LEN];
+   va_list ap;
+   int n;
+   
+   va_start(ap, fmt);
+   n = vsnprintf(cmd, sizeof(cmd), fmt, ap);
+   va_end(ap);
+   if (seq->serial[0])
+      snprintf(cmd+n, sizeof(cmd)-n, " %s", seq->serial);
    
-   /* POST request: data is provided after the page header.
-    * Therefore we skip the header and then read the form
-    * data into the buffer.
-    */
-   *data = 0;
-   while (fgets(buf, sizeof(buf), f) != NULL)
+   if (seq->ctl >= 0)
    {
-      //printf("%s", buf);
-      /* Find length of form data */
-      if (strstr(buf, "Content-Length:"))
+      if (ctl_client_cmd(seq->ctl, cmd, buf, sizeof(buf)) != 0)
       {
-         data_len=atoi(buf+strlen("Content-Length:"));
-         //printf("DBG: data length is %d\n", data_len);
+         printf("No response from crelay daemon.\n");
+         return -2;
       }
-      
-      /* Find end of header (empty line) */
-      if (!strcmp(buf, "\r\n")) break;
    }
-
-   /* Make sure we're not trying to overwrite the buffer */
-   if (data_len >= datalen)
-     return -1;
-
-   /* Get form data string */
-   if (!fgets(data, data_len+1, f)) return -1;
-   *(data+data_len) = 0;
+   else
+   {
+      ctl_server_exec(cmd, buf, sizeof(buf));
+   }
    
-   return data_len;
+   if (!strncmp(buf, "OK ", 3))
+   {
+      if (reply != NULL) snprintf(reply, len, "%s", buf+3);
+      return 0;
+   }
+   if (!strcmp(buf, "NOCARD"))
+   {
+      printf("No compatible device detected.\n");
+      if (seq->ctl < 0 && geteuid() != 0)
+      {
+         printf("\nWarning: this program is currently not running with root privileges !\n");
+         printf("Therefore it might not be able to access your relay card communication port.\n");
+         printf("Consider invoking the program from the root account or use \"sudo ...\"\n");
+      }
+      return -1;
+   }
+   return -2;
 }
 
 
 /**********************************************************
- * Function read_httpget_data()
+ * Function cli_flush()
  * 
  * Description:
+ *           Writes the relays collected so far with a single
+ *           transfer and schedules the end of their pulses
  * 
  * Parameters:
+ *           seq (in/out) - command line sequence
  * 
+ * Returns:   0 - success
+ *           <0 - fail
  *********************************************************/
-int read_httpget_data(char* buf, char* data, size_t datalen)
+static int cli_flush(cli_seq_t* seq)
 {
-   char *datastr;
-         
-   /* GET request: data (if any) is provided in the first line
-    * of the page header. Therefore we first check if there is
-    * any data. If so we read the data into a buffer.
-    *
-    * Note that we may truncate the input if it's too long.
-    */
-   *data = 0;
-   if ((datastr=strchr(buf, '?')) != NULL)
+   char m1[RELAY_MASK_STR_LEN];
+   char m2[RELAY_MASK_STR_LEN];
+   int err=0;
+   int i;
+   
+   if (seq->mask != 0)
+      err = cli_cmd(seq, NULL, 0, "mask %s %s", crelay_mask_format(m1, sizeof(m1), seq->mask),
+                    crelay_mask_format(m2, sizeof(m2), seq->states));
+   for (i=FIRST_RELAY; err == 0 && i<=MAX_NUM_RELAYS; i++)
    {
-       strncpy(data, datastr+1, datalen);
+      if (seq->pulse & RELAY_BIT(i))
+         err = cli_cmd(seq, NULL, 0, "after %u %d 0", seq->pulse_ms[i], i);
    }
-   
-   return strlen(data);
+   seq->mask = seq->states = seq->pulse = 0;
+   return err;
 }
 
 
 /**********************************************************
- * Function process_http_request()
+ * Function cli_sleep()
  * 
  * Description:
+ *           Waits until the given time. Without daemon, the
+ *           scheduled relay states are set meanwhile.
  * 
  * Parameters:
+ *           seq (in)      - command line sequence
+ *           deadline (in) - time to wait for, in ms
+ *                           (0 = until all scheduled
+ *                           states are set)
  * 
  *********************************************************/
-int process_http_request(int sock)
+static void cli_sleep(cli_seq_t* seq, uint64_t deadline)
 {
-   FILE *fin, *fout;
-   char buf[256];
-   char *method;
-   char *url;
-   char formdata[64];
-   char *datastr;
-   int  relay=0;
-   int  i;
-   int  formdatalen;
-   char com_port[MAX_COM_PORT_NAME_LEN];
-   char* serial=NULL;
-   uint8_t last_relay=FIRST_RELAY;
-   relay_state_t rstate[MAX_NUM_RELAYS];
-   relay_state_t nstate=INVALID;
-   
-   formdata[0]=0;  
-
-   /* Open file for input */
-   fin = fdopen(sock, "r");
+   struct pollfd pfd;
+   struct timespec ts;
+   uint64_t now;
    
-   /* Read  first line of request header which contains 
-    * the request method and url seperated by a space
-    */
-   if (!fgets(buf, sizeof(buf), fin)) 
+   pfd.fd = sched_init();
+   pfd.events = POLLIN;
+   while (1)
    {
-      fclose(fin);
-      return -1;
+      now = cli_now();
+      if (deadline ? (now >= deadline) : (seq->ctl >= 0 || sched_pending() == 0))
+         break;
+      if (seq->ctl >= 0)
+      {
+         ts.tv_sec = (deadline-now) / 1000;
+         ts.tv_nsec = ((deadline-now) % 1000) * 1000000;
+         nanosleep(&ts, NULL);
+      }
+      else if (poll(&pfd, 1, deadline ? (int)(deadline-now) : 10) > 0)
+      {
+         sched_run();
+      }
    }
-   //printf("********** Raw data ***********\n");
-   //printf("%s", buf);
+}
+
+
+/**********************************************************
+ * Function cli_step()
+ * 
+ * Description:
+ *           Processes one relay command of the command line,
+ *           the relay number may be followed by the state
+ *           as separate word
+ * 
+ *           <relay>=on|off|pulse[:<ms>]  set a relay
+ *           <relay> [on|off]             set or read a relay
+ *           wait=<ms>                    wait before the next step
+ *           serial=<serial number>       select another card
+ * 
+ * Parameters:
+ *           seq (in/out) - command line sequence
+ *           word (in)    - command
+ *           next (in)    - next word or NULL
+ * 
+ * Returns:  number of words used
+ *           -1 - fail, invalid command
+ *           <-1 - fail, relay command failed
+ *********************************************************/
+static int cli_step(cli_seq_t* seq, char* word, char* next)
+{
+   char reply[CTL_MAX_MSG_LEN];
+   char* value;
+   char* end;
+   long relay;
+   long ms;
+   int used=1;
+   int err;
    
-   method = strtok(buf, " ");
-   if (!method) 
+   if (!strncmp(word, "serial=", 7))
    {
-      fclose(fin);
-      return -1;
+      if ((err = cli_flush(seq)) != 0) return err-1;
+      snprintf(seq->serial, sizeof(seq->serial), "%s", word+7);
+      return used;
    }
-   //printf("method: %s\n", method);
-   
-   url = strtok(NULL, " ");
-   if (!url)
+   if (!strncmp(word, "wait=", 5))
    {
-      fclose(fin);
-      return -2;
+      ms = strtol(word+5, &end, 10);
+      if (end == word+5 || (*end && strcmp(end, "ms")) || ms < 0) return -1;
+      if ((err = cli_flush(seq)) != 0) return err-1;
+      /* Steps keep their timing, whatever the commands take */
+      seq->deadline += ms;
+      cli_sleep(seq, seq->deadline);
+      return used;
    }
-   //printf("url: %s\n", url);
    
-   /* Check the request method we are dealing with */
-   if (strcasecmp(method, "POST") == 0)
+   relay = strtol(word, &end, 10);
+   if (end == word || relay < FIRST_RELAY || relay > MAX_NUM_RELAYS) return -1;
+   if (*end == '=')
    {
-      formdatalen = read_httppost_data(fin, formdata, sizeof(formdata));
+      value = end+1;
    }
-   else if (strcasecmp(method, "GET") == 0)
+   else if (*end == 0 && next != NULL &&
+            (!strcasecmp(next, "on") || !strcasecmp(next, "off")))
    {
-      formdatalen = read_httpget_data(url, formdata, sizeof(formdata));
+      value = next;
+      used++;
    }
-   else
+   else if (*end == 0)
    {
-      fclose(fin);
-      return -3;
+      /* Read, after the relays set before */
+      if ((err = cli_flush(seq)) != 0) return err-1;
+      if ((err = cli_cmd(seq, reply, sizeof(reply), "get %ld", relay)) != 0) return err-1;
+      printf("Relay %ld is %s\n", relay, atoi(reply) ? "on" : "off");
+      return used;
    }
+   else return -1;
    
-   //printf("DBG: form data: %s\n", formdata);
-   
-   /* Open file for output */
-   fout = fdopen(sock, "w");
-
-   /* Send an error if we failed to read the form data properly */
-   if (formdatalen < 0) {
-     send_headers(fout, 500, "Internal Error", NULL, "text/html", -1, -1);
-     fprintf(fout, "ERROR: Invalid Input. \r\n");
-     goto done;
+   seq->pulse &= ~RELAY_BIT(relay);
+   if (!strcasecmp(value, "on") || !strcmp(value, "1"))
+   {
+      seq->states |= RELAY_BIT(relay);
    }
-
-   /* Get values from form data */
-   if (formdatalen > 0) 
+   else if (!strcasecmp(value, "off") || !strcmp(value, "0"))
    {
-      int found=0;
-      //printf("DBG: Found data: ");
-      datastr = strstr(formdata, RELAY_TAG);
-      if (datastr) {
-         relay = atoi(datastr+strlen(RELAY_TAG)+1);
-         //printf("relay=%d", relay);
-         found++;
-      }
-      datastr = strstr(formdata, STATE_TAG);
-      if (datastr) {
-         nstate = atoi(datastr+strlen(STATE_TAG)+1);
-         //printf("%sstate=%d", found ? ", " : "", nstate);
-      }
-      datastr = strstr(formdata, SERIAL_TAG);
-      if (datastr) {
-         serial = datastr+strlen(SERIAL_TAG)+1;
-         datastr = strstr(serial, "&");
-         if (datastr)
-            *datastr = 0;
-         //printf("%sserial=%s", found ? ", " : "", serial);
-      }
-      //printf("\n\n");
+      seq->states &= ~RELAY_BIT(relay);
    }
-   
-   /* Check if a relay card is present */
-   if (crelay_detect_relay_card(com_port, &last_relay, serial, NULL) == -1)
+   else if (!strncasecmp(value, "pulse", 5))
    {
-      if (strstr(url, API_URL))
+      ms = DEFAULT_PULSE_DURATION;
+      if (value[5] == ':')
       {
-         /* HTTP API request, send response */
-         send_headers(fout, 503, "No compatible device detected", NULL, "text/plain", -1, -1);
-         fprintf(fout, "ERROR: No compatible device detected");
+         ms = strtol(value+6, &end, 10);
+         if (end == value+6 || (*end && strcmp(end, "ms")) || ms <= 0) return -1;
       }
-      else
-      {  
-         /* Web page request */
-         web_page_header(fout);
-         web_page_error(fout);
-         web_page_footer(fout);
-      }     
+      else if (value[5] != 0) return -1;
+      seq->states |= RELAY_BIT(relay);
+      seq->pulse |= RELAY_BIT(relay);
+      seq->pulse_ms[relay] = ms;
    }
-   else
-   {  
-      /* Process form data */
-      if (formdatalen > 0)
-      {
-         if ((relay != 0) && (nstate != INVALID))
-         {
-            /* Perform the requested action here */
-            if (nstate==PULSE)
-            {
-               /* Generate pulse on relay switch */
-               crelay_get_relay(com_port, relay, &rstate[relay-1], serial);
-               if (rstate[relay-1] == ON)
-               {
-                  crelay_set_relay(com_port, relay, OFF, serial);
-                  sleep(config.pulse_duration);
-                  crelay_set_relay(com_port, relay, ON, serial);
-               }
-               else
-               {
-                  crelay_set_relay(com_port, relay, ON, serial);
-                  sleep(config.pulse_duration);
-                  crelay_set_relay(com_port, relay, OFF, serial);
-               }
-            }
-            else
-            {
-               /* Switch relay on/off */
-               crelay_set_relay(com_port, relay, nstate, serial);
-            }
-         }
-      }
-      
-      /* Read current state for all relays */
-      for (i=FIRST_RELAY; i<=last_relay; i++)
-      {
-         crelay_get_relay(com_port, i, &rstate[i-1], serial);
-      }
+   else return -1;
+   seq->mask |= RELAY_BIT(relay);
+   return used;
+}
+
+
+/**********************************************************
+ * Function cli_script()
+ * 
+ * Description:
+ *           Processes relay commands read from a file, one
+ *           step per line. Everything after '#' is ignored.
+ * 
+ * Parameters:
+ *           seq (in/out) - command line sequence
+ *           f (in)       - script file
+ * 
+ * Returns:   0 - success
+ *           -1 - fail, invalid command
+ *          <-1 - fail, relay command failed
+ *********************************************************/
+static int cli_script(cli_seq_t* seq, FILE* f)
+{
+   char line[1024];
+   char* words[256];
+   char* save;
+   char* p;
+   int lineno=0;
+   int n, i;
+   int err;
+   
+   while (fgets(line, sizeof(line), f) != NULL)
+   {
+      lineno++;
+      if ((p = strchr(line, '#')) != NULL) *p = 0;
+      for (n=0, p=strtok_r(line, " \t\r\n", &save); p && n<256; p=strtok_r(NULL, " \t\r\n", &save))
+         words[n++] = p;
       
-      /* Send response to client */
-      if (strstr(url, API_URL))
-      {
-         /* HTTP API request, send response */
-         send_headers(fout, 200, "OK", NULL, "text/plain", -1, -1);
-         for (i=FIRST_RELAY; i<=last_relay; i++)
-         {
-            fprintf(fout, "Relay %d:%d<br>", i, rstate[i-1]);
-         }
-      }
-      else
+      for (i=0; i<n; i+=err)
       {
-         /* Web request */
-         char cname[MAX_RELAY_CARD_NAME_LEN];
-         crelay_get_relay_card_name(crelay_get_relay_card_type(), cname);
-         
-         web_page_header(fout);
-         
-         /* Display relay status and controls on web page */
-         fprintf(fout, "<table style=\"text-align: left; width: 460px; background-color: white; font-family: Helvetica,Arial,sans-serif; font-weight: bold; font-size: 20px;\" border=\"0\" cellpadding=\"2\" cellspacing=\"3\"><tbody>\r\n");
-         fprintf(fout, "<tr style=\"font-size: 14px; background-color: lightgrey\">\r\n");
-         fprintf(fout, "<td style=\"width: 200px;\">%s<br><span style=\"font-style: italic; font-size: 12px; color: grey; font-weight: normal;\">on %s</span></td>\r\n", 
-                 cname, com_port);
-         fprintf(fout, "<td style=\"background-color: white;\"></td><td style=\"background-color: white;\"></td></tr>\r\n");
-         for (i=FIRST_RELAY; i<=last_relay; i++)
+         if ((err = cli_step(seq, words[i], (i+1<n) ? words[i+1] : NULL)) < 0)
          {
-            fprintf(fout, "<tr style=\"vertical-align: top; background-color: rgb(230, 230, 255);\">\r\n");
-            fprintf(fout, "<td style=\"width: 300px;\">Relay %d<br><span style=\"font-style: italic; font-size: 16px; color: grey;\">%s</span></td>\r\n", 
-                    i, rlabels[i-1]);
-            fprintf(fout, "<td style=\"text-align: center; vertical-align: middle; width: 100px; background-color: white;\"><label class=\"switch\"><input type=\"checkbox\" %s id=%d onchange=\"switch_relay(this)\"><span class=\"slider\"></span></label></td>\r\n", 
-                    rstate[i-1]==ON?"checked":"",i);
+            if (err == -1) printf("Invalid command in line %d: %s\n", lineno, words[i]);
+            return err;
          }
-         fprintf(fout, "</tbody></table><br>\r\n");
-         fprintf(fout, "<span id=\"status\" style=\"font-size: 16px; color: red; font-family: Helvetica,Arial,sans-serif;\"></span><br><br>\r\n");
-         
-         web_page_footer(fout);
       }
+      if ((err = cli_flush(seq)) != 0)
+         return err-1;
    }
-
- done:
-   fclose(fout);
-   fclose(fin);
-
    return 0;
 }
 
@@ -722,7 +2222,19 @@ void print_usage()
    printf("       If only the relay number is provided then the current state is returned,\n");
    printf("       otherwise the relays state is set to the new value provided as second parameter.\n");
    printf("       The USB communication port is auto detected. The first compatible device\n");
-   printf("       found will be used, unless -s switch and a serial number is passed.\n\n");
+   printf("       found will be used, unless -s switch and a serial number is passed.\n");
+   printf("       If the crelay daemon is running, the command is passed to it through the\n");
+   printf("       socket %s instead of accessing the card.\n\n", CTL_SOCKET_PATH);
+   printf("    crelay [-s <serial number>] <command> [<command> ...] | -\n\n");
+   printf("       Several relay commands in one call, or read from stdin (-) one step per\n");
+   printf("       line. Relays switched in the same step are written to the card at once.\n");
+   printf("         <relay number>=on|off  set a relay\n");
+   printf("         <relay number>=pulse[:<ms>]\n");
+   printf("                                switch a relay on, and off again after <ms>\n");
+   printf("                                (default %d ms)\n", DEFAULT_PULSE_DURATION);
+   printf("         <relay number>          print the relay state\n");
+   printf("         wait=<ms>               wait before the next step\n");
+   printf("         serial=<serial number>  continue with another card\n\n");
    printf("Daemon mode:\n");
    printf("    crelay -d|-D [<relay1_label> [<relay2_label> [<relay3_label> [<relay4_label>]]]] \n\n");
    printf("       -d use daemon mode, run in foreground\n");
@@ -750,12 +2262,12 @@ void print_usage()
  *********************************************************/
 int main(int argc, char *argv[])
 {
-      relay_state_t rstate;
-      char com_port[MAX_COM_PORT_NAME_LEN];
       char cname[MAX_RELAY_CARD_NAME_LEN];
       char* serial=NULL;
-      uint8_t num_relays=FIRST_RELAY;
-      relay_info_t *relay_info;
+      static relay_info_t relay_info[MAX_LISTED_CARDS];
+      int num_cards;
+      cli_seq_t seq;
+      sigset_t sigset;
       int argn = 1;
       int err;
       int i = 1;
@@ -770,10 +2282,9 @@ int main(int argc, char *argv[])
    {
       /*****  Daemon mode *****/
       
-      struct sockaddr_in sin;
       struct in_addr iface;
       int port=DEFAULT_SERVER_PORT;
-      int sock;
+      int backlog=DEFAULT_SERVER_BACKLOG;
       int i;
       
       iface.s_addr = INADDR_ANY;
@@ -785,6 +2296,16 @@ int main(int argc, char *argv[])
       /* Setup signal handlers */
       signal(SIGINT, exit_handler);   /* Ctrl-C */
       signal(SIGTERM, exit_handler);  /* "regular" kill */
+      
+      /* SIGHUP reloads the config file, SIGTERM and SIGINT end the
+       * pulses before the exit. They are read from a signalfd in the
+       * event loop, so they are blocked before any thread exists (the
+       * threads inherit the mask). */
+      sigemptyset(&sigset);
+      sigaddset(&sigset, SIGHUP);
+      sigaddset(&sigset, SIGINT);
+      sigaddset(&sigset, SIGTERM);
+      sigprocmask(SIG_BLOCK, &sigset, NULL);
    
       /* Load configuration from .conf file */
       memset((void*)&config, 0, sizeof(config_t));
@@ -794,38 +2315,32 @@ int main(int argc, char *argv[])
          syslog(LOG_DAEMON | LOG_NOTICE, "***************************\n");
          if (config.server_iface != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "server_iface: %s\n", config.server_iface);
          if (config.server_port != 0)     syslog(LOG_DAEMON | LOG_NOTICE, "server_port: %u\n", config.server_port);
-         if (config.relay1_label != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "relay1_label: %s\n", config.relay1_label);
-         if (config.relay2_label != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "relay2_label: %s\n", config.relay2_label);
-         if (config.relay3_label != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "relay3_label: %s\n", config.relay3_label);
-         if (config.relay4_label != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "relay4_label: %s\n", config.relay4_label);
-         if (config.relay5_label != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "relay5_label: %s\n", config.relay5_label);
-         if (config.relay6_label != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "relay6_label: %s\n", config.relay6_label);
-         if (config.relay7_label != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "relay7_label: %s\n", config.relay7_label);
-         if (config.relay8_label != NULL) syslog(LOG_DAEMON | LOG_NOTICE, "relay8_label: %s\n", config.relay8_label);
-         if (config.pulse_duration != 0)  syslog(LOG_DAEMON | LOG_NOTICE, "pulse_duration: %u\n", config.pulse_duration);
+         if (config.server_backlog != 0)  syslog(LOG_DAEMON | LOG_NOTICE, "server_backlog: %u\n", config.server_backlog);
+         if (config.pulse_duration != 0)  syslog(LOG_DAEMON | LOG_NOTICE, "pulse_duration: %u ms\n", config.pulse_duration);
+         if (config.coalesce_window != 0) syslog(LOG_DAEMON | LOG_NOTICE, "coalesce_window: %u ms\n", config.coalesce_window);
+         if (config.resync_interval != 0) syslog(LOG_DAEMON | LOG_NOTICE, "resync_interval: %u ms\n", config.resync_interval);
+         if (config.rate_limit != 0)      syslog(LOG_DAEMON | LOG_NOTICE, "rate_limit: %u/s\n", config.rate_limit);
+         if (config.rate_burst != 0)      syslog(LOG_DAEMON | LOG_NOTICE, "rate_burst: %u\n", config.rate_burst);
+         if (config.queue_limit != 0)     syslog(LOG_DAEMON | LOG_NOTICE, "queue_limit: %u\n", config.queue_limit);
+         if (config.state_file != NULL)   syslog(LOG_DAEMON | LOG_NOTICE, "state_file: %s\n", config.state_file);
          if (config.gpio_num_relays != 0) syslog(LOG_DAEMON | LOG_NOTICE, "gpio_num_relays: %u\n", config.gpio_num_relays);
          if (config.gpio_active_value >= 0) syslog(LOG_DAEMON | LOG_NOTICE, "gpio_active_value: %u\n", config.gpio_active_value);
-         if (config.relay1_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay1_gpio_pin: %u\n", config.relay1_gpio_pin);
-         if (config.relay2_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay2_gpio_pin: %u\n", config.relay2_gpio_pin);
-         if (config.relay3_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay3_gpio_pin: %u\n", config.relay3_gpio_pin);
-         if (config.relay4_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay4_gpio_pin: %u\n", config.relay4_gpio_pin);
-         if (config.relay5_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay5_gpio_pin: %u\n", config.relay5_gpio_pin);
-         if (config.relay6_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay6_gpio_pin: %u\n", config.relay6_gpio_pin);
-         if (config.relay7_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay7_gpio_pin: %u\n", config.relay7_gpio_pin);
-         if (config.relay8_gpio_pin != 0) syslog(LOG_DAEMON | LOG_NOTICE, "relay8_gpio_pin: %u\n", config.relay8_gpio_pin);
+         if (config.gpio_chip != NULL)    syslog(LOG_DAEMON | LOG_NOTICE, "gpio_chip: %s\n", config.gpio_chip);
          if (config.sainsmart_num_relays != 0) syslog(LOG_DAEMON | LOG_NOTICE, "sainsmart_num_relays: %u\n", config.sainsmart_num_relays);
+         if (config.sim_num_cards != 0)   syslog(LOG_DAEMON | LOG_NOTICE, "sim_num_cards: %u\n", config.sim_num_cards);
+         if (config.sim_num_relays != 0)  syslog(LOG_DAEMON | LOG_NOTICE, "sim_num_relays: %u\n", config.sim_num_relays);
+         if (config.sim_latency != 0)     syslog(LOG_DAEMON | LOG_NOTICE, "sim_latency: %u\n", config.sim_latency);
+         if (config.sim_jitter != 0)      syslog(LOG_DAEMON | LOG_NOTICE, "sim_jitter: %u\n", config.sim_jitter);
+         if (config.sim_error_rate != 0)  syslog(LOG_DAEMON | LOG_NOTICE, "sim_error_rate: %.3f\n", config.sim_error_rate);
+         for (i=0; i<MAX_NUM_RELAYS; i++)
+         {
+            if (config.relay_label[i] != NULL)
+               syslog(LOG_DAEMON | LOG_NOTICE, "relay%d_label: %s\n", i+FIRST_RELAY, config.relay_label[i]);
+            if (config.relay_gpio_pin[i] != 0)
+               syslog(LOG_DAEMON | LOG_NOTICE, "relay%d_gpio_pin: %u\n", i+FIRST_RELAY, config.relay_gpio_pin[i]);
+         }
          syslog(LOG_DAEMON | LOG_NOTICE, "***************************\n");
          
-         /* Get relay labels from config file */
-         if (config.relay1_label != NULL) strcpy(rlabels[0], config.relay1_label);
-         if (config.relay2_label != NULL) strcpy(rlabels[1], config.relay2_label);
-         if (config.relay3_label != NULL) strcpy(rlabels[2], config.relay3_label);
-         if (config.relay4_label != NULL) strcpy(rlabels[3], config.relay4_label);
-         if (config.relay5_label != NULL) strcpy(rlabels[4], config.relay5_label);
-         if (config.relay6_label != NULL) strcpy(rlabels[5], config.relay6_label);
-         if (config.relay7_label != NULL) strcpy(rlabels[6], config.relay7_label);
-         if (config.relay8_label != NULL) strcpy(rlabels[7], config.relay8_label);
-         
          /* Get listen interface from config file */
          if (config.server_iface != NULL)
          {
@@ -840,6 +2355,12 @@ int main(int argc, char *argv[])
          {
             port = config.server_port;
          }
+         
+         /* Get listen backlog from config file */
+         if (config.server_backlog > 0)
+         {
+            backlog = config.server_backlog;
+         }
 
       }
       else
@@ -847,35 +2368,55 @@ int main(int argc, char *argv[])
          syslog(LOG_DAEMON | LOG_NOTICE, "Can't load %s, using default parameters\n", CONFIG_FILE);
       }
 
-      /* Ensure pulse duration is valid **/
-      if (config.pulse_duration == 0)
+      /* Parse command line for relay labels (overrides config file)*/
+      if (argc > 2)
       {
-         config.pulse_duration = 1;
+         cmdline_labels = argv+2;
+         num_cmdline_labels = (argc-2 < MAX_NUM_RELAYS) ? argc-2 : MAX_NUM_RELAYS;
       }
+      config_defaults(&config);
       
-      /* Parse command line for relay labels (overrides config file)*/
-      for (i=0; i<argc-2 && i<MAX_NUM_RELAYS; i++)
+      /* Merge relay writes arriving within this time window */
+      crelay_worker_set_coalesce_window(config.coalesce_window);
+      
+      /* Refresh the cached relay states of idle cards */
+      crelay_worker_set_resync_interval(config.resync_interval);
+      
+      /* Push back on clients sending too much */
+      crelay_worker_set_queue_limit(config.queue_limit);
+      http_server_set_rate_limit(config.rate_limit, config.rate_burst);
+      
+#ifdef DRV_SIM
+      /* Simulated relay cards */
+      if (sim_set_params(config.sim_num_cards ? config.sim_num_cards : 1,
+                         config.sim_num_relays ? config.sim_num_relays : SIM_NUM_RELAYS,
+                         config.sim_latency, config.sim_jitter, config.sim_error_rate) != 0)
       {
-         strcpy(rlabels[i], argv[i+2]);
-      }         
+         syslog(LOG_DAEMON | LOG_WARNING, "Invalid simulation parameters in config file, using default values");
+      }
+#endif
       
-      /* Start build-in web server */
-      sock = socket(AF_INET, SOCK_STREAM, 0);
-      sin.sin_family = AF_INET;
-      sin.sin_addr.s_addr = iface.s_addr;
-      sin.sin_port = htons(port);
-      if (bind(sock, (struct sockaddr *) &sin, sizeof(sin)) != 0)
+      /* Build static part of the web GUI */
+      if (web_page_build() != 0)
       {
-         syslog(LOG_DAEMON | LOG_ERR, "Failed to bind socket to port %d : %s", port, strerror(errno));
-         exit(EXIT_FAILURE);         
+         syslog(LOG_DAEMON | LOG_ERR, "Failed to build web page");
+         exit(EXIT_FAILURE);
       }
-      if (listen(sock, 5) != 0)
+      
+      /* Start build-in web server */
+      if (http_server_init(SERVER, iface, port, backlog, process_http_request) != 0)
       {
-         syslog(LOG_DAEMON | LOG_ERR, "Failed to listen to port %d : %s", port, strerror(errno));
          exit(EXIT_FAILURE);         
       }
       
       syslog(LOG_DAEMON | LOG_NOTICE, "HTTP server listening on %s:%d\n", inet_ntoa(iface), port);      
+      
+      /* Read the saved relay states before the cards are opened */
+      if (config.state_file != NULL && (i = journal_open(config.state_file)) >= 0)
+         syslog(LOG_DAEMON | LOG_NOTICE, "State journal %s: %d relay card(s) saved\n", config.state_file, i);
+      
+      /* Push relay state changes to the event stream */
+      crelay_set_state_callback(relay_state_changed);
 
       if (!strcmp(argv[1],"-D"))
       {
@@ -888,23 +2429,59 @@ int main(int argc, char *argv[])
          syslog(LOG_DAEMON | LOG_NOTICE, "Program is now running as system daemon");
       }
 
-      /* Init GPIO pins in case they have been configured */
-      crelay_detect_relay_card(com_port, &num_relays, NULL, NULL);
+#ifdef USB_HOTPLUG
+      /* Follow cards plugged in or removed later on, started
+       * first so that no card is missed */
+      if (hotplug_init() != 0)
+         syslog(LOG_DAEMON | LOG_WARNING, "USB hotplug not supported, cards are probed on request\n");
+#endif
+      
+      /* Open all relay cards (this also inits the GPIO pins in
+       * case they have been configured) */
+      if ((i = crelay_worker_start_all()) > 0)
+         syslog(LOG_DAEMON | LOG_NOTICE, "Found %d relay card(s)\n", i);
+      else
+         syslog(LOG_DAEMON | LOG_WARNING, "No relay card found\n");
       
-      while (1)
+      for (i=0; i<config.num_aliases; i++)
       {
-         int s;
-         
-         /* Wait for request from web client */
-         s = accept(sock, NULL, NULL);
-         if (s < 0) break;
+         if (crelay_worker_add_alias((char*)config.alias_name[i], (char*)config.alias_serial[i]) != 0)
+            syslog(LOG_DAEMON | LOG_WARNING, "Alias %s: relay card %s not found\n", config.alias_name[i], config.alias_serial[i]);
+      }
+      
+      /* Set the relays back to the saved states */
+      if ((i = journal_restore()) > 0)
+         syslog(LOG_DAEMON | LOG_NOTICE, "Restored the relay states of %d card(s)\n", i);
+      
+      /* Let the command line utility use the open cards */
+      if (ctl_server_init(CTL_SOCKET_PATH) == 0)
+         ctl_socket = CTL_SOCKET_PATH;
+      else
+         syslog(LOG_DAEMON | LOG_WARNING, "Control socket not available, command line calls access the cards directly\n");
+      
+      /* Init scheduler for delayed relay actions */
+      if (http_server_watch(sched_init(), sched_timer_cb) != 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Failed to create scheduler timer : %s", strerror(errno));
+         exit(EXIT_FAILURE);         
+      }
+      
+      /* Reload the config on SIGHUP, keeping cards and connections */
+      if ((signal_fd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+          http_server_watch(signal_fd, signal_cb) != 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Config reload on SIGHUP not available : %s", strerror(errno));
          
-         /* Process request */
-         process_http_request(s);
-         close(s);
+         /* Exit from the signal handler instead */
+         sigemptyset(&sigset);
+         sigaddset(&sigset, SIGINT);
+         sigaddset(&sigset, SIGTERM);
+         sigprocmask(SIG_UNBLOCK, &sigset, NULL);
       }
       
-      close(sock);
+      /* Serve web clients until failure */
+      http_server_run();
+      exit(EXIT_FAILURE);
    }
    else
    {
@@ -913,29 +2490,30 @@ int main(int argc, char *argv[])
       if (!strcmp(argv[argn],"-i"))
       {
          /* Detect all cards connected to the system */
-         if (crelay_detect_all_relay_cards(&relay_info) == -1)
+         if ((num_cards = crelay_detect_all_relay_cards(relay_info, MAX_LISTED_CARDS)) == -1)
          {
             printf("No compatible device detected.\n");
             return -1;
          }
          printf("\nDetected relay cards:\n");
-         while (relay_info->next != NULL)
+         for (i=0; i<num_cards && i<MAX_LISTED_CARDS; i++)
          {
-            crelay_get_relay_card_name(relay_info->relay_type, cname);
-            printf("  #%d\t%s (serial %s)\n", i++ ,cname, relay_info->serial);
-            relay_info = relay_info->next;
-            // TODO: free relay_info list memory
+            crelay_get_relay_card_name(relay_info[i].relay_type, cname);
+            printf("  #%d\t%s (serial %s, %d relays on %s)\n", i+1, cname, relay_info[i].serial,
+                   relay_info[i].num_relays, relay_info[i].portname);
          }
+         if (num_cards > MAX_LISTED_CARDS)
+            printf("  ... and %d more\n", num_cards-MAX_LISTED_CARDS);
          
          exit(EXIT_SUCCESS);
       }
    
       if (!strcmp(argv[argn], "-s"))
       {
-         if (argc > (argn+1))
+         /* Serial number and relay commands */
+         if (argc > (argn+2))
          {
-            serial = malloc(sizeof(char)*strlen(argv[argn+1]));
-            strcpy(serial, argv[argn+1]);
+            serial = argv[argn+1];
             argn += 2;
          }
          else
@@ -945,50 +2523,52 @@ int main(int argc, char *argv[])
          }
       }
 
-      if (crelay_detect_relay_card(com_port, &num_relays, serial, NULL) == -1)
+      memset(&seq, 0, sizeof(seq));
+      if (serial != NULL)
+         snprintf(seq.serial, sizeof(seq.serial), "%s", serial);
+      seq.deadline = cli_now();
+      
+      /* A running daemon has the cards open already, otherwise
+       * they are opened once in this process for all commands */
+      if ((seq.ctl = ctl_client_open(CTL_SOCKET_PATH)) < 0)
+         sched_init();
+      
+      err = 0;
+      if (!strcmp(argv[argn], "-") && argn+1 == argc)
       {
-         printf("No compatible device detected.\n");
-         
-         if(geteuid() != 0)
+         /* Script from stdin */
+         if ((err = cli_script(&seq, stdin)) == -1)
+            err = -2;
+      }
+      else
+      {
+         while (err == 0 && argn < argc)
          {
-            printf("\nWarning: this program is currently not running with root privileges !\n");
-            printf("Therefore it might not be able to access your relay card communication port.\n");
-            printf("Consider invoking the program from the root account or use \"sudo ...\"\n");
+            if ((i = cli_step(&seq, argv[argn], (argn+1 < argc) ? argv[argn+1] : NULL)) < 0)
+               err = i;
+            else
+               argn += i;
          }
-         
-         exit(EXIT_FAILURE);
+         if (err == 0 && (err = cli_flush(&seq)) != 0)
+            err--;
       }
-
-      switch (argc)
+      
+      /* Let the pulses end before the cards are closed, after an
+       * error they are ended at once (a daemon ends its own) */
+      if (err == 0)
+         cli_sleep(&seq, 0);
+      else if (seq.ctl < 0)
+         sched_flush();
+      if (seq.ctl >= 0)
+         close(seq.ctl);
+      
+      if (err == -1)
       {
-         case 2:
-         case 4:
-            /* GET current relay state */
-            if (crelay_get_relay(com_port, atoi(argv[argn]), &rstate, serial) == 0)
-               printf("Relay %d is %s\n", atoi(argv[argn]), (rstate==ON)?"on":"off");
-            else
-               exit(EXIT_FAILURE);
-            break;
-            
-         case 3:
-         case 5:
-            /* SET new relay state */
-            if (!strcmp(argv[argn+1],"on") || !strcmp(argv[argn+1],"ON"))
-               err = crelay_set_relay(com_port, atoi(argv[argn]), ON, serial);
-            else if (!strcmp(argv[argn+1],"off") || !strcmp(argv[argn+1],"OFF"))
-               err = crelay_set_relay(com_port, atoi(argv[argn]), OFF, serial);
-            else 
-            {
-               print_usage();
-               exit(EXIT_FAILURE);
-            }
-            if (err)
-               exit(EXIT_FAILURE);
-            break;
-            
-         default:
-            print_usage();
+         print_usage();
+         exit(EXIT_FAILURE);
       }
+      if (err != 0)
+         exit(EXIT_FAILURE);
    }
    
    exit(EXIT_SUCCESS);
@@ -0,0 +1,343 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Control socket
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the implementation of the UNIX socket through
+ *   which the command line utility controls the relays of a running daemon.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "relay_drv.h"
+#include "dev_worker.h"
+#include "relay_sched.h"
+#include "ctl_server.h"
+
+static int listen_fd=-1;
+static atomic_int num_clients=0;
+
+
+static int set_timeout(int s, int timeout)
+{
+   struct timeval tv;
+
+   tv.tv_sec = timeout;
+   tv.tv_usec = 0;
+   return setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+
+static int set_address(struct sockaddr_un* sun, const char* path)
+{
+   memset(sun, 0, sizeof(*sun));
+   sun->sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(sun->sun_path))
+      return -1;
+   strcpy(sun->sun_path, path);
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function parse_args()
+ *
+ * Description: Parse the numbers of a command, followed by
+ *              an optional serial number
+ *
+ * Parameters: p (in)       - arguments
+ *             v (out)      - numbers
+ *             n (in)       - count of numbers
+ *             serial (out) - serial number, NULL if none
+ *
+ * Return:   0 - success
+ *          -1 - fail, invalid arguments
+ *********************************************************/
+static int parse_args(char* p, long* v, int n, char** serial)
+{
+   char* end;
+   int i;
+
+   for (i=0; i<n; i++)
+   {
+      v[i] = strtol(p, &end, 0);
+      if (end == p || (*end != 0 && *end != ' ')) return -1;
+      p = end;
+   }
+   *serial = (*p == ' ' && p[1] != 0) ? p+1 : NULL;
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function parse_masks()
+ *
+ * Description: Parse the two relay bitmaps of a mask command,
+ *              followed by an optional serial number
+ *
+ * Parameters: p (in)       - arguments
+ *             v (out)      - bitmaps
+ *             serial (out) - serial number, NULL if none
+ *
+ * Return:   0 - success
+ *          -1 - fail, invalid arguments
+ *********************************************************/
+static int parse_masks(char* p, relay_mask_t* v, char** serial)
+{
+   char* end;
+   int i;
+
+   for (i=0; i<2; i++)
+   {
+      if (*p == ' ') p++;
+      if (crelay_mask_parse(p, &end, &v[i]) != 0 || (*end != 0 && *end != ' ')) return -1;
+      p = end;
+   }
+   *serial = (*p == ' ' && p[1] != 0) ? p+1 : NULL;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function ctl_server_exec()
+ *********************************************************/
+int ctl_server_exec(const char* req, char* reply, size_t len)
+{
+   worker_cmd_t cmd;
+   char buf[CTL_MAX_MSG_LEN+1];
+   char serial[MAX_SERIAL_LEN];
+   char* name;
+   long v[3];
+   relay_mask_t m[2];
+   int i;
+   int err;
+
+   snprintf(buf, sizeof(buf), "%s", req);
+   memset(&cmd, 0, sizeof(cmd));
+   if (!strncmp(buf, "get ", 4) && parse_args(buf+4, v, 1, &name) == 0 &&
+       v[0] >= 0 && v[0] <= UINT8_MAX)
+   {
+      cmd.type = WORKER_GET_RELAY;
+      cmd.relay = v[0];
+   }
+   else if (!strncmp(buf, "set ", 4) && parse_args(buf+4, v, 2, &name) == 0 &&
+            v[0] >= 0 && v[0] <= UINT8_MAX && (v[1] == 0 || v[1] == 1))
+   {
+      cmd.type = WORKER_SET_RELAY;
+      cmd.relay = v[0];
+      cmd.relay_state = v[1] ? ON : OFF;
+   }
+   else if (!strncmp(buf, "mask ", 5) && parse_masks(buf+5, m, &name) == 0 && m[0] != 0)
+   {
+      cmd.type = WORKER_SET_MASK;
+      cmd.relay_mask = m[0];
+      cmd.relay_states = m[1] & m[0];
+   }
+   else if (!strncmp(buf, "after ", 6) && parse_args(buf+6, v, 3, &name) == 0 &&
+            v[0] >= 0 && v[0] <= UINT32_MAX && v[1] >= FIRST_RELAY && v[1] <= MAX_NUM_RELAYS &&
+            (v[2] == 0 || v[2] == 1))
+   {
+      /* Executed later by the scheduler */
+      if (crelay_worker_resolve(name, serial) != 0)
+         return snprintf(reply, len, "NOCARD");
+      if (sched_add(v[0], serial, v[1], v[2] ? ON : OFF) != 0)
+         return snprintf(reply, len, "ERR -1");
+      return snprintf(reply, len, "OK %ld", v[2]);
+   }
+   else
+   {
+      return snprintf(reply, len, "ERR -1");
+   }
+
+   if (crelay_worker_resolve(name, serial) != 0)
+      return snprintf(reply, len, "NOCARD");
+
+   /* Explicit switching ends a pulse */
+   if (cmd.type == WORKER_SET_RELAY)
+      sched_cancel(serial, cmd.relay);
+   for (i=FIRST_RELAY; i<=MAX_NUM_RELAYS; i++)
+   {
+      if (cmd.relay_mask & RELAY_BIT(i)) sched_cancel(serial, i);
+   }
+
+   if ((err = crelay_worker_exec(serial, &cmd)) != 0)
+      return snprintf(reply, len, "ERR %d", err);
+   if (cmd.type == WORKER_SET_MASK)
+      return snprintf(reply, len, "OK %s", crelay_mask_format(buf, sizeof(buf), cmd.relay_states));
+   return snprintf(reply, len, "OK %d", (cmd.relay_state == ON) ? 1 : 0);
+}
+
+
+static void* client_thread(void* arg)
+{
+   int s = (intptr_t)arg;
+   char req[CTL_MAX_MSG_LEN+1];
+   char reply[CTL_MAX_MSG_LEN];
+   ssize_t n;
+   int len;
+
+   /* One packet per command, until the client is done or idle */
+   while ((n = recv(s, req, CTL_MAX_MSG_LEN, 0)) > 0)
+   {
+      req[n] = 0;
+      len = ctl_server_exec(req, reply, sizeof(reply));
+      if (send(s, reply, len, MSG_NOSIGNAL) < 0)
+         break;
+   }
+   close(s);
+   atomic_fetch_sub(&num_clients, 1);
+   return NULL;
+}
+
+
+static void* listen_thread(void* arg)
+{
+   pthread_t thread;
+   int s;
+
+   while (1)
+   {
+      if ((s = accept(listen_fd, NULL, NULL)) < 0)
+         continue;
+
+      if (atomic_fetch_add(&num_clients, 1) >= CTL_MAX_CLIENTS)
+      {
+         atomic_fetch_sub(&num_clients, 1);
+         close(s);
+         continue;
+      }
+      set_timeout(s, CTL_IDLE_TIMEOUT);
+      if (pthread_create(&thread, NULL, client_thread, (void*)(intptr_t)s) != 0)
+      {
+         atomic_fetch_sub(&num_clients, 1);
+         close(s);
+         continue;
+      }
+      pthread_detach(thread);
+   }
+   return NULL;
+}
+
+
+/**********************************************************
+ * Function ctl_server_init()
+ *********************************************************/
+int ctl_server_init(const char* path)
+{
+   struct sockaddr_un sun;
+   pthread_t thread;
+   int s;
+
+   if (set_address(&sun, path) != 0)
+      return -1;
+
+   /* Don't take over the socket of another daemon */
+   if ((s = ctl_client_open(path)) >= 0)
+   {
+      close(s);
+      syslog(LOG_DAEMON | LOG_ERR, "Control socket %s used by another process\n", path);
+      return -1;
+   }
+   unlink(path);
+
+   if ((s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+      return -1;
+   if (bind(s, (struct sockaddr*)&sun, sizeof(sun)) != 0 || listen(s, CTL_MAX_CLIENTS) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to create control socket %s : %s\n", path, strerror(errno));
+      close(s);
+      return -1;
+   }
+   /* The relays can be switched by members of the group too */
+   chmod(path, 0660);
+
+   listen_fd = s;
+   if (pthread_create(&thread, NULL, listen_thread, NULL) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to start control socket thread: %s\n", strerror(errno));
+      close(s);
+      unlink(path);
+      listen_fd = -1;
+      return -1;
+   }
+   pthread_detach(thread);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function ctl_client_open()
+ *********************************************************/
+int ctl_client_open(const char* path)
+{
+   struct sockaddr_un sun;
+   int s;
+
+   if (set_address(&sun, path) != 0)
+      return -1;
+   if ((s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+      return -1;
+   if (connect(s, (struct sockaddr*)&sun, sizeof(sun)) != 0)
+   {
+      close(s);
+      return -1;
+   }
+   set_timeout(s, CTL_TIMEOUT);
+   return s;
+}
+
+
+/**********************************************************
+ * Function ctl_client_cmd()
+ *********************************************************/
+int ctl_client_cmd(int s, const char* cmd, char* reply, size_t len)
+{
+   ssize_t n;
+
+   if (len == 0 || send(s, cmd, strlen(cmd), MSG_NOSIGNAL) < 0)
+      return -1;
+   while ((n = recv(s, reply, len-1, 0)) < 0 && errno == EINTR);
+   if (n <= 0)
+      return -1;
+   reply[n] = 0;
+   return 0;
+}
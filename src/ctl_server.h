@@ -0,0 +1,125 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Control socket
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the declaration of the UNIX socket through which
+ *   the command line utility controls the relays of a running daemon.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef ctl_server_h
+#define ctl_server_h
+
+#include <stddef.h>
+
+#define CTL_SOCKET_PATH  "/var/run/crelay.sock"
+#define CTL_MAX_CLIENTS  16
+#define CTL_MAX_MSG_LEN  128
+#define CTL_IDLE_TIMEOUT 10 /* s, server side */
+#define CTL_TIMEOUT      5  /* s, client side */
+
+/*
+ *  Protocol: the socket is of type SOCK_SEQPACKET, each packet
+ *  holds one command or its reply as text. A connection can
+ *  be used for any number of commands.
+ *
+ *    get <relay>[ <serial>]                 ->  OK <state>
+ *    set <relay> <state>[ <serial>]         ->  OK <state>
+ *    mask <mask> <states>[ <serial>]        ->  OK <states>
+ *    after <ms> <relay> <state>[ <serial>]  ->  OK <state>
+ *
+ *  <state> is 0 (off) or 1 (on), <mask> and <states> are
+ *  bitmaps (bit 0 is relay 1, in decimal or 0x... notation),
+ *  all relays of <mask> are written at once. "after" hands
+ *  the relay state to the scheduler, to be set after <ms>.
+ *  Switching a relay cancels such a pending state.
+ *  <serial> is the serial number or an alias of the card
+ *  (rest of the packet). Failures are replied with "NOCARD"
+ *  if the card is not found or with "ERR <code>" otherwise.
+ */
+
+/**********************************************************
+ * Function ctl_server_init()
+ *
+ * Description: Create the control socket and start the
+ *              thread which serves it. Commands are run by
+ *              the relay card workers.
+ *
+ * Parameters: path (in) - path of the socket
+ *
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int ctl_server_init(const char* path);
+
+/**********************************************************
+ * Function ctl_server_exec()
+ *
+ * Description: Execute a command of the protocol in this
+ *              process, with the relay card workers and the
+ *              scheduler of the process (the scheduler must
+ *              have been initialized for "after")
+ *
+ * Parameters: req (in)    - command
+ *             reply (out) - reply
+ *             len (in)    - size of reply
+ *
+ * Return:  length of the reply
+ *********************************************************/
+int ctl_server_exec(const char* req, char* reply, size_t len);
+
+/**********************************************************
+ * Function ctl_client_open()
+ *
+ * Description: Connect to the control socket of a running
+ *              daemon
+ *
+ * Parameters: path (in) - path of the socket
+ *
+ * Return:  socket descriptor
+ *          -1 - fail, no daemon running
+ *********************************************************/
+int ctl_client_open(const char* path);
+
+/**********************************************************
+ * Function ctl_client_cmd()
+ *
+ * Description: Send a command to the daemon and wait for
+ *              the reply
+ *
+ * Parameters: s (in)       - socket from ctl_client_open()
+ *             cmd (in)     - command
+ *             reply (out)  - reply
+ *             len (in)     - size of reply
+ *
+ * Return:   0 - success
+ *          -1 - fail, connection lost
+ *********************************************************/
+int ctl_client_cmd(int s, const char* cmd, char* reply, size_t len);
+
+#endif
@@ -37,37 +37,53 @@
 #ifndef data_types_h
 #define data_types_h
 
+#include "relay_drv.h"
+
+#define MAX_NUM_SCENES 16
+#define MAX_NUM_ALIASES 16
+
 /* Config data struct */
 typedef struct
 {
     /* [HTTP server] */
     const char*  server_iface;
     uint16_t server_port;
-    const char* relay1_label;
-    const char* relay2_label;
-    const char* relay3_label;
-    const char* relay4_label;
-    const char* relay5_label;
-    const char* relay6_label;
-    const char* relay7_label;
-    const char* relay8_label;
-    uint8_t pulse_duration;
+    uint16_t server_backlog;
+    const char* relay_label[MAX_NUM_RELAYS];     /* relay<n>_label, NULL = default */
+    uint32_t pulse_duration;   /* in ms */
+    uint16_t coalesce_window;  /* in ms */
+    uint32_t resync_interval;  /* in ms */
+    const char* state_file;    /* relay state journal, NULL = none */
+    uint32_t rate_limit;       /* requests/s per client, 0 = no limit */
+    uint32_t rate_burst;
+    uint32_t queue_limit;      /* queued commands per card, 0 = no limit */
     
     /* [GPIO drv] */
     uint8_t gpio_num_relays;
     uint8_t gpio_active_value;
-    uint16_t relay1_gpio_pin;
-    uint16_t relay2_gpio_pin;
-    uint16_t relay3_gpio_pin;
-    uint16_t relay4_gpio_pin;
-    uint16_t relay5_gpio_pin;
-    uint16_t relay6_gpio_pin;
-    uint16_t relay7_gpio_pin;
-    uint16_t relay8_gpio_pin;
+    const char* gpio_chip;
+    uint16_t relay_gpio_pin[MAX_NUM_RELAYS];     /* relay<n>_gpio_pin, 0 = not set */
     
     /* [Sainsmart drv] */
     uint8_t sainsmart_num_relays;
     
+    /* [Sim drv] */
+    uint16_t sim_num_cards;
+    uint8_t  sim_num_relays;
+    uint32_t sim_latency;
+    uint32_t sim_jitter;
+    double   sim_error_rate;
+    
+    /* [Scenes] */
+    uint8_t num_scenes;
+    const char* scene_name[MAX_NUM_SCENES];
+    const char* scene_relays[MAX_NUM_SCENES];
+    
+    /* [Aliases] */
+    uint8_t num_aliases;
+    const char* alias_name[MAX_NUM_ALIASES];
+    const char* alias_serial[MAX_NUM_ALIASES];
+    
 } config_t;
 
 #endif
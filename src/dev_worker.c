@@ -0,0 +1,1000 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Per device worker threads
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the implementation of the worker threads which
+ *   serialize the access to each relay card.
+ *   
+ *   Every relay card gets its own thread which keeps the card open and
+ *   executes the commands queued for it one after the other. Commands
+ *   are passed through a lock-free queue, so callers (e.g. the HTTP
+ *   server) never wait for a card being busy with a slow USB transfer
+ *   and different cards are switched in parallel.
+ *
+ *   Consecutive set commands in the queue are merged into a single
+ *   bitmap write. Optionally the worker waits a short time window for
+ *   more set commands to arrive before writing to the card.
+ *
+ *   The workers are found through a hash index by serial number or
+ *   by an alias name, so routing a request to its card takes constant
+ *   time no matter how many cards are connected.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <syslog.h>
+
+#include "relay_drv.h"
+#include "dev_worker.h"
+#include "metrics.h"
+
+/* Size of the worker index, a power of 2 well above the
+ * number of serial numbers and aliases */
+#define WORKER_INDEX_SIZE 4096
+
+/* Serial numbers for which no card was found are not probed
+ * again for a while */
+#define WORKER_MISS_SIZE 64
+#define WORKER_MISS_TTL  10000000  /* us */
+
+typedef struct
+{
+   relay_dev_t* dev;
+   pthread_t    thread;
+   mpsc_queue_t queue;
+   sem_t        sem;                   /* number of queued commands */
+   worker_cmd_t resync_cmd;            /* state refresh after a bus change */
+   atomic_int   resync_queued;
+   atomic_int   depth;                 /* commands in the queue */
+   atomic_uint  snap_seq;              /* odd while the snapshot is written */
+   relay_dev_t  snap;                  /* copy of the card for crelay_worker_get_cached() */
+} worker_t;
+
+/* Serial number which was probed without success, free if at is 0 */
+typedef struct
+{
+   char      key[MAX_SERIAL_LEN];
+   uint64_t  at;                       /* time of the probe */
+} worker_miss_t;
+
+/* Entry of the worker index, free if w is NULL */
+typedef struct
+{
+   char      key[MAX_SERIAL_LEN];      /* serial number or alias */
+   worker_t* w;
+} worker_key_t;
+
+static worker_t* workers[MAX_NUM_WORKERS];
+static int num_workers=0;
+static worker_key_t worker_index[WORKER_INDEX_SIZE];
+static int num_keys=0;
+static pthread_rwlock_t workers_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;  /* held while cards are opened */
+static uint32_t coalesce_window=0;  /* ms */
+static uint32_t resync_interval=0;  /* ms */
+static uint8_t  hotplug=0;          /* registry kept up to date by hotplug events */
+static uint32_t queue_limit=0;      /* commands per card, 0 = no limit */
+static worker_miss_t misses[WORKER_MISS_SIZE];
+static int next_miss=0;
+static pthread_mutex_t miss_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static metrics_hist_t    queue_wait;   /* from submission to execution */
+static metrics_counter_t commands;
+static metrics_counter_t merged;       /* set commands folded into another write */
+static metrics_counter_t refused;      /* requests refused at the queue limit */
+
+
+/**********************************************************
+ * Internal function worker_run()
+ *
+ * Description: Execute a command on the card of a worker
+ *
+ * Parameters: w (in)       - worker
+ *             cmd (in/out) - command
+ *
+ * Return:  none
+ *********************************************************/
+static void worker_run(worker_t* w, worker_cmd_t* cmd)
+{
+   switch (cmd->type)
+   {
+      case WORKER_GET_RELAY:
+         cmd->result = crelay_dev_get_relay(w->dev, cmd->relay, &cmd->relay_state);
+         break;
+      case WORKER_SET_RELAY:
+         cmd->result = crelay_dev_set_relay(w->dev, cmd->relay, cmd->relay_state);
+         break;
+      case WORKER_GET_ALL:
+         cmd->result = crelay_dev_get_all_relays(w->dev, &cmd->relay_states);
+         break;
+      case WORKER_SET_MASK:
+         cmd->result = crelay_dev_set_relay_mask(w->dev, cmd->relay_mask, cmd->relay_states);
+         break;
+      case WORKER_CALL:
+         cmd->result = (*cmd->fn)(w->dev, cmd->arg);
+         break;
+      default:
+         cmd->result = -1;
+   }
+}
+
+
+static void worker_complete(worker_cmd_t* cmd)
+{
+   /* The command may be gone after the completion */
+   if (cmd->sem != NULL)
+   {
+      sem_post(cmd->sem);
+   }
+   else if (cmd->done != NULL)
+   {
+      (*cmd->done)(cmd);
+   }
+}
+
+
+static void deadline_after(struct timespec* deadline, uint32_t ms)
+{
+   clock_gettime(CLOCK_REALTIME, deadline);
+   deadline->tv_sec  += ms / 1000;
+   deadline->tv_nsec += (ms % 1000) * 1000000;
+   if (deadline->tv_nsec >= 1000000000)
+   {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000;
+   }
+}
+
+
+static void worker_push(worker_t* w, worker_cmd_t* cmd)
+{
+   cmd->queued_at = metrics_now();
+   atomic_fetch_add_explicit(&w->depth, 1, memory_order_relaxed);
+   mpsc_push(&w->queue, &cmd->node);
+   sem_post(&w->sem);
+}
+
+
+static worker_cmd_t* worker_pop(worker_t* w)
+{
+   mpsc_node_t* node;
+   worker_cmd_t* cmd;
+
+   /* A producer may still be linking its command */
+   while ((node = mpsc_pop(&w->queue)) == NULL)
+      sched_yield();
+
+   cmd = (worker_cmd_t*)node;
+   atomic_fetch_sub_explicit(&w->depth, 1, memory_order_relaxed);
+   metrics_inc(&commands);
+   metrics_observe(&queue_wait, cmd->queued_at, 0);
+   return cmd;
+}
+
+
+/**********************************************************
+ * Internal function worker_next()
+ *
+ * Description: Get the next queued command of a worker
+ *              without blocking, or wait for it until the
+ *              given deadline
+ *
+ * Parameters: w (in)        - worker
+ *             deadline (in) - absolute timeout (CLOCK_REALTIME),
+ *                             NULL = don't wait
+ *
+ * Return:  pointer to command, NULL if there is none
+ *********************************************************/
+static worker_cmd_t* worker_next(worker_t* w, struct timespec* deadline)
+{
+   int err;
+
+   if (deadline == NULL)
+      err = sem_trywait(&w->sem);
+   else
+      while ((err = sem_timedwait(&w->sem, deadline)) != 0 && errno == EINTR);
+
+   return (err == 0) ? worker_pop(w) : NULL;
+}
+
+
+/**********************************************************
+ * Internal function worker_fold()
+ *
+ * Description: Merge a set command into the pending bitmap
+ *              write of a worker
+ *
+ * Parameters: w (in)             - worker
+ *             cmd (in)           - command
+ *             mask (in/out)      - bitmap of relays to set
+ *             states (in/out)    - bitmap of new relay states
+ *
+ * Return:  1 - command merged
+ *          0 - not a valid set command, executed alone
+ *********************************************************/
+static int worker_fold(worker_t* w, worker_cmd_t* cmd, relay_mask_t* mask, relay_mask_t* states)
+{
+   relay_mask_t m;
+   relay_mask_t v;
+
+   if (cmd->type == WORKER_SET_RELAY)
+   {
+      if (cmd->relay < FIRST_RELAY || cmd->relay > w->dev->num_relays ||
+          (cmd->relay_state != ON && cmd->relay_state != OFF))
+         return 0;
+      m = RELAY_BIT(cmd->relay);
+      v = (cmd->relay_state == ON) ? m : 0;
+   }
+   else if (cmd->type == WORKER_SET_MASK)
+   {
+      /* Relays beyond the card fail when executed alone */
+      if (cmd->relay_mask & ~RELAY_MASK_ALL(w->dev->num_relays))
+         return 0;
+      m = cmd->relay_mask;
+      v = cmd->relay_states & m;
+   }
+   else
+   {
+      return 0;
+   }
+
+   /* Later commands override earlier ones */
+   *mask |= m;
+   *states = (*states & ~m) | v;
+   return 1;
+}
+
+
+/**********************************************************
+ * Internal function worker_publish()
+ *
+ * Description: Copy the card with the shadow of the relay
+ *              states for the readers which don't go through
+ *              the queue. Only the worker thread writes the
+ *              copy.
+ *
+ * Parameters: w (in) - worker
+ *
+ * Return:  none
+ *********************************************************/
+static void worker_publish(worker_t* w)
+{
+   unsigned seq = atomic_load_explicit(&w->snap_seq, memory_order_relaxed);
+
+   if (!memcmp(&w->snap, w->dev, sizeof(relay_dev_t)))
+      return;
+   atomic_store_explicit(&w->snap_seq, seq+1, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+   w->snap = *w->dev;
+   atomic_store_explicit(&w->snap_seq, seq+2, memory_order_release);
+}
+
+
+static void* worker_thread(void* arg)
+{
+   worker_t* w = arg;
+   worker_cmd_t* cmd;
+   worker_cmd_t* batch;
+   worker_cmd_t* held;
+   worker_cmd_t* next;
+   relay_mask_t mask;
+   relay_mask_t states;
+   struct timespec deadline;
+   struct timespec next_resync;
+   int result;
+
+   deadline_after(&next_resync, resync_interval);
+   while (1)
+   {
+      worker_publish(w);
+
+      /* Wait for work, refresh the shadow copy of the relay
+       * states when the card has been idle long enough */
+      if (resync_interval == 0)
+      {
+         if (sem_wait(&w->sem) != 0) continue;
+      }
+      else if (sem_timedwait(&w->sem, &next_resync) != 0)
+      {
+         if (errno == ETIMEDOUT)
+         {
+            crelay_dev_get_all_relays(w->dev, &states);
+            deadline_after(&next_resync, resync_interval);
+         }
+         continue;
+      }
+      cmd = worker_pop(w);
+
+      mask = states = 0;
+      if (!worker_fold(w, cmd, &mask, &states))
+      {
+         worker_run(w, cmd);
+         worker_complete(cmd);
+         continue;
+      }
+
+      /* Collect further set commands into the same write */
+      deadline_after(&deadline, coalesce_window);
+      batch = cmd;
+      cmd->batch_next = NULL;
+      held = NULL;
+      while ((next = worker_next(w, coalesce_window ? &deadline : NULL)) != NULL)
+      {
+         if (!worker_fold(w, next, &mask, &states))
+         {
+            /* Executed after the write to keep the order */
+            held = next;
+            break;
+         }
+         next->batch_next = batch;
+         batch = next;
+         metrics_inc(&merged);
+      }
+
+      result = (mask != 0) ? crelay_dev_set_relay_mask(w->dev, mask, states) : 0;
+      while (batch != NULL)
+      {
+         next = batch->batch_next;
+         batch->result = result;
+         worker_complete(batch);
+         batch = next;
+      }
+
+      if (held != NULL)
+      {
+         worker_run(w, held);
+         worker_complete(held);
+      }
+   }
+   return NULL;
+}
+
+
+/**********************************************************
+ * Internal function worker_slot()
+ *
+ * Description: Find the index entry of a key (open addressing
+ *              with linear probing, FNV-1a hash)
+ *
+ * Parameters: key (in) - serial number or alias
+ *
+ * Return:  pointer to the entry of the key, or to the free
+ *          entry where it would be added
+ *********************************************************/
+static worker_key_t* worker_slot(const char* key)
+{
+   uint32_t h = 2166136261u;
+   const char* p;
+   worker_key_t* e;
+
+   for (p=key; *p; p++)
+      h = (h ^ (uint8_t)*p) * 16777619u;
+
+   /* The index is never more than half full, a free entry is
+    * always found */
+   for (;;)
+   {
+      e = &worker_index[h & (WORKER_INDEX_SIZE-1)];
+      if (e->w == NULL || !strcmp(e->key, key))
+         return e;
+      h++;
+   }
+}
+
+
+static worker_t* worker_find(const char* key)
+{
+   return worker_slot(key)->w;
+}
+
+
+/**********************************************************
+ * Internal function worker_index_add()
+ *
+ * Description: Add a key for a worker to the index
+ *
+ * Parameters: key (in) - serial number or alias
+ *             w (in)   - worker
+ *
+ * Return:   0 - success
+ *          -1 - fail, key too long, index full or key
+ *               already used for another card
+ *********************************************************/
+static int worker_index_add(const char* key, worker_t* w)
+{
+   worker_key_t* e;
+
+   if (strlen(key) >= MAX_SERIAL_LEN)
+      return -1;
+   e = worker_slot(key);
+   if (e->w != NULL)
+      return (e->w == w) ? 0 : -1;
+   if (num_keys >= WORKER_INDEX_SIZE/2)
+      return -1;
+
+   snprintf(e->key, sizeof(e->key), "%s", key);
+   e->w = w;
+   num_keys++;
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function worker_start()
+ *
+ * Description: Open a relay card and start its worker. The
+ *              card is opened without the registry lock, so
+ *              that the lookups of open cards don't wait for
+ *              the bus. Must be called with the start lock
+ *              held.
+ *
+ * Parameters: serial (in) - serial number ("" = any card)
+ *
+ * Return:  pointer to worker, NULL on failure
+ *********************************************************/
+static worker_t* worker_start(char* serial)
+{
+   worker_t* w;
+   int full;
+
+   /* Only the holder of the start lock adds workers */
+   pthread_rwlock_rdlock(&workers_lock);
+   full = (num_workers >= MAX_NUM_WORKERS || num_keys >= WORKER_INDEX_SIZE/2);
+   pthread_rwlock_unlock(&workers_lock);
+   if (full)
+      return NULL;
+   if ((w = calloc(1, sizeof(worker_t))) == NULL)
+      return NULL;
+
+   if ((w->dev = crelay_open(serial[0] ? serial : NULL)) == NULL)
+   {
+      free(w);
+      return NULL;
+   }
+   mpsc_init(&w->queue);
+   sem_init(&w->sem, 0, 0);
+
+   if (pthread_create(&w->thread, NULL, worker_thread, w) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to start worker thread: %s\n", strerror(errno));
+      crelay_close(w->dev);
+      sem_destroy(&w->sem);
+      free(w);
+      return NULL;
+   }
+   pthread_detach(w->thread);
+
+   pthread_rwlock_wrlock(&workers_lock);
+   workers[num_workers++] = w;
+   worker_index_add(serial, w);
+   pthread_rwlock_unlock(&workers_lock);
+   return w;
+}
+
+
+/**********************************************************
+ * Internal function worker_missed()
+ *
+ * Description: Check if a card was probed without success
+ *              shortly before
+ *
+ * Parameters: key (in) - serial number or alias
+ *
+ * Return:  1 - card recently not found
+ *          0 - not known
+ *********************************************************/
+static int worker_missed(const char* key)
+{
+   uint64_t now = metrics_now();
+   int i;
+
+   pthread_mutex_lock(&miss_lock);
+   for (i=0; i<WORKER_MISS_SIZE; i++)
+   {
+      if (misses[i].at != 0 && now - misses[i].at < WORKER_MISS_TTL && !strcmp(misses[i].key, key))
+         break;
+   }
+   pthread_mutex_unlock(&miss_lock);
+   return (i < WORKER_MISS_SIZE);
+}
+
+
+/**********************************************************
+ * Internal function worker_miss_add()
+ *
+ * Description: Remember a card which was not found, the
+ *              oldest entry is replaced if all are in use
+ *
+ * Parameters: key (in) - serial number or alias
+ *
+ * Return:  none
+ *********************************************************/
+static void worker_miss_add(const char* key)
+{
+   int i;
+
+   pthread_mutex_lock(&miss_lock);
+   for (i=0; i<WORKER_MISS_SIZE && strcmp(misses[i].key, key); i++);
+   if (i == WORKER_MISS_SIZE)
+   {
+      i = next_miss;
+      next_miss = (next_miss+1) % WORKER_MISS_SIZE;
+      snprintf(misses[i].key, sizeof(misses[i].key), "%s", key);
+   }
+   misses[i].at = metrics_now();
+   pthread_mutex_unlock(&miss_lock);
+}
+
+
+/**********************************************************
+ * Internal function worker_lookup()
+ *
+ * Description: Get the worker of a relay card, start it if
+ *              not yet running. A card which was not found
+ *              is not probed again for WORKER_MISS_TTL.
+ *
+ * Parameters: serial (in) - serial number (NULL = any card)
+ *
+ * Return:  pointer to worker, NULL if no card found
+ *********************************************************/
+static worker_t* worker_lookup(char* serial)
+{
+   worker_t* w;
+
+   if (serial == NULL) serial = "";
+
+   pthread_rwlock_rdlock(&workers_lock);
+   w = worker_find(serial);
+   pthread_rwlock_unlock(&workers_lock);
+   if (w != NULL || hotplug || worker_missed(serial))
+      return w;
+
+   /* Look again, the card may have been opened meanwhile */
+   pthread_mutex_lock(&start_lock);
+   pthread_rwlock_wrlock(&workers_lock);
+   if ((w = worker_find(serial)) == NULL && serial[0] == 0 && num_workers > 0)
+   {
+      /* Any card will do, take one which is already open
+       * (it can't be probed again while the worker has it) */
+      w = workers[0];
+      worker_index_add(serial, w);
+   }
+   pthread_rwlock_unlock(&workers_lock);
+   if (w == NULL)
+      w = worker_start(serial);
+   pthread_mutex_unlock(&start_lock);
+
+   if (w == NULL)
+      worker_miss_add(serial);
+   return w;
+}
+
+
+/**********************************************************
+ * Internal function resync_done()
+ *********************************************************/
+static void resync_done(worker_cmd_t* cmd)
+{
+   worker_t* w = cmd->arg;
+
+   atomic_store(&w->resync_queued, 0);
+}
+
+
+/**********************************************************
+ * Internal function worker_resync()
+ *
+ * Description: Queue a refresh of the relay states for a
+ *              worker, unless one is already queued. If the
+ *              card is gone or has been replugged, this
+ *              closes or opens it again.
+ *
+ * Parameters: w (in) - worker
+ *
+ * Return:  none
+ *********************************************************/
+static void worker_resync(worker_t* w)
+{
+   if (atomic_exchange(&w->resync_queued, 1))
+      return;
+
+   w->resync_cmd.type = WORKER_GET_ALL;
+   w->resync_cmd.arg = w;
+   w->resync_cmd.done = resync_done;
+   worker_push(w, &w->resync_cmd);
+}
+
+
+/**********************************************************
+ * Function crelay_worker_set_coalesce_window()
+ *********************************************************/
+void crelay_worker_set_coalesce_window(uint32_t window_ms)
+{
+   coalesce_window = window_ms;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_set_resync_interval()
+ *********************************************************/
+void crelay_worker_set_resync_interval(uint32_t interval_ms)
+{
+   resync_interval = interval_ms;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_set_hotplug()
+ *********************************************************/
+void crelay_worker_set_hotplug(uint8_t enable)
+{
+   hotplug = enable;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_set_queue_limit()
+ *********************************************************/
+void crelay_worker_set_queue_limit(uint32_t limit)
+{
+   queue_limit = limit;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_get()
+ *********************************************************/
+int crelay_worker_get(char* serial)
+{
+   return (worker_lookup(serial) != NULL) ? 0 : -1;
+}
+
+
+/**********************************************************
+ * Internal function worker_add_cards()
+ *
+ * Description: Detect the relay cards of a type and start a
+ *              worker for each new one. The bus is scanned
+ *              without any lock held.
+ *
+ * Parameters: rtype (in) - relay type (NO_RELAY_TYPE = all)
+ *
+ * Return:  number of new cards
+ *********************************************************/
+static int worker_add_cards(relay_type_t rtype)
+{
+   relay_info_t* found;
+   worker_t* w;
+   int added=0;
+   int i, n;
+
+   if ((found = malloc(MAX_NUM_WORKERS * sizeof(relay_info_t))) == NULL)
+      return 0;
+   n = crelay_detect_relay_cards(rtype, found, MAX_NUM_WORKERS);
+   if (n > MAX_NUM_WORKERS)
+      n = MAX_NUM_WORKERS;
+
+   pthread_mutex_lock(&start_lock);
+   for (i=0; i<n; i++)
+   {
+      if (found[i].serial[0] == 0)
+         continue;
+      pthread_rwlock_rdlock(&workers_lock);
+      w = worker_find(found[i].serial);
+      pthread_rwlock_unlock(&workers_lock);
+      if (w != NULL)
+         continue;
+      if (worker_start(found[i].serial) != NULL)
+         added++;
+      else
+         syslog(LOG_DAEMON | LOG_ERR, "Failed to open relay card %s\n", found[i].serial);
+   }
+   pthread_mutex_unlock(&start_lock);
+   free(found);
+   return added;
+}
+
+
+/**********************************************************
+ * Internal function worker_resync_type()
+ *
+ * Description: Queue a refresh of the relay states for the
+ *              workers of the cards of a type
+ *
+ * Parameters: rtype (in) - relay type
+ *
+ * Return:  none
+ *********************************************************/
+static void worker_resync_type(relay_type_t rtype)
+{
+   int i;
+
+   pthread_rwlock_rdlock(&workers_lock);
+   for (i=0; i<num_workers; i++)
+   {
+      if (workers[i]->dev->relay_type == rtype)
+         worker_resync(workers[i]);
+   }
+   pthread_rwlock_unlock(&workers_lock);
+}
+
+
+static void worker_clear_misses(void)
+{
+   pthread_mutex_lock(&miss_lock);
+   memset(misses, 0, sizeof(misses));
+   pthread_mutex_unlock(&miss_lock);
+}
+
+
+/**********************************************************
+ * Function crelay_worker_start_all()
+ *********************************************************/
+int crelay_worker_start_all(void)
+{
+   worker_t* w;
+   int n;
+
+   /* Cards not found before may be there now */
+   worker_clear_misses();
+   worker_add_cards(NO_RELAY_TYPE);
+
+   /* Requests without serial number go to the first card, as
+    * before. Cards which are not listed (e.g. GPIO) are used
+    * only if there is no other card. */
+   pthread_mutex_lock(&start_lock);
+   pthread_rwlock_wrlock(&workers_lock);
+   w = worker_find("");
+   if (w == NULL && num_workers > 0)
+      worker_index_add("", workers[0]);
+   n = num_workers;
+   pthread_rwlock_unlock(&workers_lock);
+   if (w == NULL && n == 0 && worker_start("") != NULL)
+      n = 1;
+   pthread_mutex_unlock(&start_lock);
+   return (n > 0) ? n : -1;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_card_arrived()
+ *********************************************************/
+int crelay_worker_card_arrived(relay_type_t rtype)
+{
+   worker_clear_misses();
+
+   /* A replugged card is opened again by its worker */
+   worker_resync_type(rtype);
+   return worker_add_cards(rtype);
+}
+
+
+/**********************************************************
+ * Function crelay_worker_card_left()
+ *********************************************************/
+void crelay_worker_card_left(relay_type_t rtype)
+{
+   /* The worker of the card closes it when it is gone */
+   worker_resync_type(rtype);
+}
+
+
+/**********************************************************
+ * Function crelay_worker_add_alias()
+ *********************************************************/
+int crelay_worker_add_alias(char* alias, char* serial)
+{
+   worker_t* w;
+   int err;
+
+   if ((w = worker_lookup(serial)) == NULL)
+      return -1;
+
+   pthread_rwlock_wrlock(&workers_lock);
+   err = worker_index_add(alias, w);
+   pthread_rwlock_unlock(&workers_lock);
+   return err;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_resolve()
+ *********************************************************/
+int crelay_worker_resolve(char* name, char* serial)
+{
+   worker_t* w;
+
+   if ((w = worker_lookup(name)) == NULL)
+      return -1;
+
+   snprintf(serial, MAX_SERIAL_LEN, "%s", w->dev->serial);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_find()
+ *********************************************************/
+int crelay_worker_find(char* name, char* serial)
+{
+   worker_t* w;
+
+   if (name == NULL) name = "";
+
+   pthread_rwlock_rdlock(&workers_lock);
+   w = worker_find(name);
+   if (w == NULL && name[0] == 0 && num_workers > 0)
+      w = workers[0];
+   pthread_rwlock_unlock(&workers_lock);
+
+   if (w != NULL)
+   {
+      snprintf(serial, MAX_SERIAL_LEN, "%s", w->dev->serial);
+      return 0;
+   }
+   return (hotplug || worker_missed(name)) ? -1 : -2;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_submit()
+ *********************************************************/
+int crelay_worker_submit(char* serial, worker_cmd_t* cmd)
+{
+   worker_t* w;
+
+   if ((w = worker_lookup(serial)) == NULL)
+      return -1;
+
+   worker_push(w, cmd);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_submit_pair()
+ *********************************************************/
+int crelay_worker_submit_pair(char* serial, worker_cmd_t* first, worker_cmd_t* cmd)
+{
+   worker_t* w;
+
+   if ((w = worker_lookup(serial)) == NULL)
+      return -1;
+
+   if (first != NULL)
+      worker_push(w, first);
+   worker_push(w, cmd);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_admit()
+ *********************************************************/
+int crelay_worker_admit(char* serial)
+{
+   worker_t* w;
+
+   if ((w = worker_lookup(serial)) == NULL)
+      return -1;
+
+   if (queue_limit != 0 &&
+       atomic_load_explicit(&w->depth, memory_order_relaxed) >= queue_limit)
+   {
+      metrics_inc(&refused);
+      return -2;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_get_cached()
+ *********************************************************/
+int crelay_worker_get_cached(char* serial, relay_dev_t* dev)
+{
+   worker_t* w;
+   unsigned seq;
+
+   if ((w = worker_lookup(serial)) == NULL)
+      return -1;
+
+   do
+   {
+      while ((seq = atomic_load_explicit(&w->snap_seq, memory_order_acquire)) & 1)
+         sched_yield();
+      *dev = w->snap;
+      atomic_thread_fence(memory_order_acquire);
+   } while (atomic_load_explicit(&w->snap_seq, memory_order_relaxed) != seq);
+
+   return dev->shadow_valid ? 0 : -2;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_exec()
+ *********************************************************/
+int crelay_worker_exec(char* serial, worker_cmd_t* cmd)
+{
+   sem_t sem;
+
+   sem_init(&sem, 0, 0);
+   cmd->sem = &sem;
+   if (crelay_worker_submit(serial, cmd) != 0)
+   {
+      sem_destroy(&sem);
+      return -1;
+   }
+   while (sem_wait(&sem) != 0 && errno == EINTR);
+   sem_destroy(&sem);
+   return cmd->result;
+}
+
+
+/**********************************************************
+ * Function crelay_worker_write_metrics()
+ *********************************************************/
+void crelay_worker_write_metrics(FILE* f)
+{
+   char labels[MAX_SERIAL_LEN+16];
+   char serial[MAX_SERIAL_LEN];
+   int i;
+
+   metrics_write_type(f, "crelay_worker_queue_depth", "gauge",
+                      "Commands waiting for a relay card");
+   pthread_rwlock_rdlock(&workers_lock);
+   for (i=0; i<num_workers; i++)
+   {
+      snprintf(labels, sizeof(labels), "card=\"%s\"",
+               metrics_label(serial, sizeof(serial), workers[i]->dev->serial));
+      metrics_write_value(f, "crelay_worker_queue_depth", labels,
+                          atomic_load_explicit(&workers[i]->depth, memory_order_relaxed));
+   }
+   pthread_rwlock_unlock(&workers_lock);
+
+   metrics_write_type(f, "crelay_worker_queue_wait_seconds", "histogram",
+                      "Time commands wait before execution");
+   metrics_write_hist(f, "crelay_worker_queue_wait_seconds", "", &queue_wait);
+   metrics_write_type(f, "crelay_worker_commands_total", "counter",
+                      "Commands executed by the workers");
+   metrics_write_value(f, "crelay_worker_commands_total", "", metrics_read(&commands));
+   metrics_write_type(f, "crelay_worker_merged_total", "counter",
+                      "Set commands merged into the write of another one");
+   metrics_write_value(f, "crelay_worker_merged_total", "", metrics_read(&merged));
+   metrics_write_type(f, "crelay_worker_refused_total", "counter",
+                      "Requests refused because the queue of the card was full");
+   metrics_write_value(f, "crelay_worker_refused_total", "", metrics_read(&refused));
+}
@@ -0,0 +1,333 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Per device worker threads
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the declaration of the worker threads which
+ *   serialize the access to each relay card, so that different cards
+ *   can be switched in parallel.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef dev_worker_h
+#define dev_worker_h
+
+#include <semaphore.h>
+
+#include "mpsc.h"
+
+#define MAX_NUM_WORKERS 1024
+
+typedef enum
+{
+   WORKER_GET_RELAY,
+   WORKER_SET_RELAY,
+   WORKER_GET_ALL,
+   WORKER_SET_MASK,
+   WORKER_CALL
+} worker_cmd_type_t;
+
+/* Command for a worker thread */
+typedef struct worker_cmd
+{
+   mpsc_node_t   node;          /* queue link (internal) */
+   worker_cmd_type_t type;
+   uint8_t       relay;         /* WORKER_GET_RELAY, WORKER_SET_RELAY */
+   relay_state_t relay_state;
+   relay_mask_t  relay_mask;    /* WORKER_GET_ALL, WORKER_SET_MASK */
+   relay_mask_t  relay_states;
+   int  (*fn)(relay_dev_t* dev, void* arg);  /* WORKER_CALL */
+   void* arg;
+   int   result;                /* return code of the command */
+   void (*done)(struct worker_cmd* cmd);     /* completion (optional) */
+   sem_t* sem;                  /* completion for crelay_worker_exec() (internal) */
+   struct worker_cmd* batch_next;            /* merged writes (internal) */
+   uint64_t queued_at;          /* time of submission (internal) */
+} worker_cmd_t;
+
+/**********************************************************
+ * Function crelay_worker_set_coalesce_window()
+ *
+ * Description: Set the time a worker waits for more set
+ *              commands to merge into one write to the card.
+ *              Commands already queued are always merged.
+ *
+ * Parameters: window_ms (in) - time window in ms (0 = none)
+ *
+ * Return:  none
+ *********************************************************/
+void crelay_worker_set_coalesce_window(uint32_t window_ms);
+
+/**********************************************************
+ * Function crelay_worker_set_resync_interval()
+ *
+ * Description: Set the time after which an idle worker reads
+ *              the relay states from the card to refresh the
+ *              shadow copy (e.g. after manual switching)
+ *
+ * Parameters: interval_ms (in) - interval in ms (0 = never)
+ *
+ * Return:  none
+ *********************************************************/
+void crelay_worker_set_resync_interval(uint32_t interval_ms);
+
+/**********************************************************
+ * Function crelay_worker_set_hotplug()
+ *
+ * Description: Set whether the cards are added by hotplug
+ *              events (see crelay_worker_card_arrived()). If so,
+ *              requests for an unknown card fail right away
+ *              instead of probing the bus.
+ *
+ * Parameters: enable (in) - 1 = hotplug, 0 = probe on request
+ *
+ * Return:  none
+ *********************************************************/
+void crelay_worker_set_hotplug(uint8_t enable);
+
+/**********************************************************
+ * Function crelay_worker_set_queue_limit()
+ *
+ * Description: Set the number of queued commands of a card
+ *              above which crelay_worker_admit() refuses new
+ *              requests
+ *
+ * Parameters: limit (in) - commands per card (0 = no limit)
+ *
+ * Return:  none
+ *********************************************************/
+void crelay_worker_set_queue_limit(uint32_t limit);
+
+/**********************************************************
+ * Function crelay_worker_get()
+ *
+ * Description: Check that a worker exists for a relay card,
+ *              start it (and open the card) if not
+ *
+ * Parameters: serial (in) - serial number (NULL = any card)
+ *
+ * Return:   0 - success
+ *          -1 - fail, no relay card found
+ *********************************************************/
+int crelay_worker_get(char* serial);
+
+/**********************************************************
+ * Function crelay_worker_start_all()
+ *
+ * Description: Detect all relay cards, open them and start a
+ *              worker for each one. Requests without serial
+ *              number are sent to the first card.
+ *
+ * Parameters: none
+ *
+ * Return:  number of relay cards
+ *          -1 - fail, no relay card found
+ *********************************************************/
+int crelay_worker_start_all(void);
+
+/**********************************************************
+ * Function crelay_worker_card_arrived()
+ *
+ * Description: Update the cards of a type after a card of
+ *              this type was plugged in. New cards are opened
+ *              and get a worker, the workers of the type
+ *              refresh the relay states, which opens again
+ *              replugged cards.
+ *
+ * Parameters: rtype (in) - relay type
+ *
+ * Return:  number of new relay cards
+ *********************************************************/
+int crelay_worker_card_arrived(relay_type_t rtype);
+
+/**********************************************************
+ * Function crelay_worker_card_left()
+ *
+ * Description: Update the cards of a type after a card of
+ *              this type was removed. The workers of the type
+ *              refresh the relay states, which closes the
+ *              cards which are gone.
+ *
+ * Parameters: rtype (in) - relay type
+ *
+ * Return:  none
+ *********************************************************/
+void crelay_worker_card_left(relay_type_t rtype);
+
+/**********************************************************
+ * Function crelay_worker_add_alias()
+ *
+ * Description: Add a name which can be used instead of the
+ *              serial number of a relay card
+ *
+ * Parameters: alias (in)  - alias name
+ *             serial (in) - serial number of the card
+ *
+ * Return:   0 - success
+ *          -1 - fail, no relay card found or alias already
+ *               used for another card
+ *********************************************************/
+int crelay_worker_add_alias(char* alias, char* serial);
+
+/**********************************************************
+ * Function crelay_worker_resolve()
+ *
+ * Description: Get the serial number of the relay card for
+ *              a serial number or alias, start its worker
+ *              if not yet running
+ *
+ * Parameters: name (in)    - serial number or alias
+ *                            (NULL = any card)
+ *             serial (out) - serial number, MAX_SERIAL_LEN
+ *                            bytes ("" for cards opened
+ *                            without serial number)
+ *
+ * Return:   0 - success
+ *          -1 - fail, no relay card found
+ *********************************************************/
+int crelay_worker_resolve(char* name, char* serial);
+
+/**********************************************************
+ * Function crelay_worker_find()
+ *
+ * Description: Get the serial number of the relay card for
+ *              a serial number or alias like
+ *              crelay_worker_resolve(), but without probing
+ *              the bus for a card which is not open. Used
+ *              where blocking is not allowed.
+ *
+ * Parameters: name (in)    - serial number or alias
+ *                            (NULL = any card)
+ *             serial (out) - serial number, MAX_SERIAL_LEN
+ *                            bytes
+ *
+ * Return:   0 - success
+ *          -1 - fail, no relay card found
+ *          -2 - fail, card not open, crelay_worker_resolve()
+ *               needs to probe the bus
+ *********************************************************/
+int crelay_worker_find(char* name, char* serial);
+
+/**********************************************************
+ * Function crelay_worker_submit()
+ *
+ * Description: Queue a command for the worker of a relay
+ *              card. The done() callback of the command is
+ *              called from the worker thread when finished.
+ *
+ * Parameters: serial (in)  - serial number (NULL = any card)
+ *             cmd (in/out) - command, must stay valid until
+ *                            completion
+ *
+ * Return:   0 - success
+ *          -1 - fail, no relay card found
+ *********************************************************/
+int crelay_worker_submit(char* serial, worker_cmd_t* cmd);
+
+/**********************************************************
+ * Function crelay_worker_submit_pair()
+ *
+ * Description: Queue two commands for the worker of a relay
+ *              card as one unit, either both or none is
+ *              queued. The first one is executed before cmd,
+ *              so it may be part of the same allocation and
+ *              be released by the done() callback of cmd.
+ *
+ * Parameters: serial (in)    - serial number (NULL = any card)
+ *             first (in/out) - first command, without done()
+ *                              callback, or NULL
+ *             cmd (in/out)   - command, must stay valid until
+ *                              completion
+ *
+ * Return:   0 - success
+ *          -1 - fail, no relay card found
+ *********************************************************/
+int crelay_worker_submit_pair(char* serial, worker_cmd_t* first, worker_cmd_t* cmd);
+
+/**********************************************************
+ * Function crelay_worker_admit()
+ *
+ * Description: Check whether a request may queue commands for
+ *              a relay card, to push back on clients when the
+ *              card can't keep up. Commands of the daemon
+ *              itself (e.g. the end of a pulse) are always
+ *              queued.
+ *
+ * Parameters: serial (in) - serial number (NULL = any card)
+ *
+ * Return:   0 - success
+ *          -1 - fail, no relay card found
+ *          -2 - fail, queue limit reached
+ *********************************************************/
+int crelay_worker_admit(char* serial);
+
+/**********************************************************
+ * Function crelay_worker_get_cached()
+ *
+ * Description: Get a copy of a relay card with the states last
+ *              known by its worker (in shadow) without queuing
+ *              a command. The copy can't be used to access the
+ *              card.
+ *
+ * Parameters: serial (in) - serial number (NULL = any card)
+ *             dev (out)   - copy of the relay card
+ *
+ * Return:   0 - success
+ *          -1 - fail, no relay card found
+ *          -2 - fail, states not known yet
+ *********************************************************/
+int crelay_worker_get_cached(char* serial, relay_dev_t* dev);
+
+/**********************************************************
+ * Function crelay_worker_exec()
+ *
+ * Description: Queue a command for the worker of a relay
+ *              card and wait for its completion
+ *
+ * Parameters: serial (in)  - serial number (NULL = any card)
+ *             cmd (in/out) - command
+ *
+ * Return:  result of the command
+ *          -1 - fail, no relay card found
+ *********************************************************/
+int crelay_worker_exec(char* serial, worker_cmd_t* cmd);
+
+/**********************************************************
+ * Function crelay_worker_write_metrics()
+ *
+ * Description: Write the queue depth of each worker, the
+ *              time commands wait in the queues and the
+ *              number of merged writes in the Prometheus
+ *              text format
+ *
+ * Parameters: f (in) - output stream
+ *
+ * Return:  none
+ *********************************************************/
+void crelay_worker_write_metrics(FILE* f);
+
+#endif
@@ -0,0 +1,195 @@
+/******************************************************************************
+ *
+ * Relay card control utility: USB hotplug discovery
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the implementation of the USB hotplug discovery
+ *   used in daemon mode.
+ *   
+ *   A thread waits for libusb hotplug events and updates the relay card
+ *   workers when a USB device is plugged in or removed. The bus is only
+ *   scanned after such an event, never while serving a request. Several
+ *   events in a short time (e.g. the interfaces of one device) lead to a
+ *   single scan once the bus has settled.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include <libusb-1.0/libusb.h>
+
+#include "relay_drv.h"
+#include "dev_worker.h"
+#include "hotplug.h"
+
+static libusb_context* ctx=NULL;
+static int changes=0;       /* events since the last scan (hotplug thread only) */
+static uint32_t arrived=0;  /* relay types with a card plugged in, bit per type */
+static uint32_t left=0;     /* relay types with a card removed, bit per type */
+
+
+/**********************************************************
+ * Internal function hotplug_cb()
+ *
+ * Description: Called by libusb for every relay card plugged
+ *              in or removed. Only takes note of the change,
+ *              since the device can't be used from here.
+ *
+ * Parameters: user_data (in) - first relay type of the VID/PID
+ *
+ * Return:  0 - keep the callback registered
+ *********************************************************/
+static int hotplug_cb(libusb_context* c, libusb_device* device, libusb_hotplug_event event, void* user_data)
+{
+   relay_type_t rtype = (relay_type_t)(intptr_t)user_data;
+   relay_type_t t;
+   uint16_t vid, pid, tvid, tpid;
+   uint32_t types=0;
+
+   /* All relay types with this VID/PID may have the card */
+   crelay_get_relay_card_usb_id(rtype, &vid, &pid);
+   for (t=NO_RELAY_TYPE+1; t<LAST_RELAY_TYPE; t++)
+   {
+      if (crelay_get_relay_card_usb_id(t, &tvid, &tpid) == 0 && tvid == vid && tpid == pid)
+         types |= 1u << t;
+   }
+
+   if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+      arrived |= types;
+   else
+      left |= types;
+   changes++;
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function hotplug_thread()
+ *
+ * Description: Wait for hotplug events and update the
+ *              relay card workers
+ *
+ * Parameters: arg (in) - unused
+ *
+ * Return:  never returns
+ *********************************************************/
+static void* hotplug_thread(void* arg)
+{
+   struct timeval tv;
+   relay_type_t rtype;
+   uint32_t in, out;
+   int n;
+
+   while (1)
+   {
+      if (libusb_handle_events_completed(ctx, NULL) != 0 || changes == 0)
+         continue;
+
+      /* Wait until no more events arrive and the kernel
+       * drivers are bound to the new device */
+      do
+      {
+         changes = 0;
+         tv.tv_sec = HOTPLUG_SETTLE_TIME / 1000;
+         tv.tv_usec = (HOTPLUG_SETTLE_TIME % 1000) * 1000;
+         libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+      }
+      while (changes > 0);
+
+      in = arrived;
+      out = left;
+      arrived = left = 0;
+      n = 0;
+      for (rtype=NO_RELAY_TYPE+1; rtype<LAST_RELAY_TYPE; rtype++)
+      {
+         if (out & (1u << rtype))
+            crelay_worker_card_left(rtype);
+         if (in & (1u << rtype))
+            n += crelay_worker_card_arrived(rtype);
+      }
+      syslog(LOG_DAEMON | LOG_NOTICE, "USB relay cards changed, %d new card(s) found\n", n);
+   }
+   return NULL;
+}
+
+
+/**********************************************************
+ * Function hotplug_init()
+ *********************************************************/
+int hotplug_init(void)
+{
+   pthread_t thread;
+   relay_type_t rtype, prev;
+   uint16_t vid, pid, pvid, ppid;
+   int num_cb=0;
+
+   if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+      return -1;
+   if (libusb_init(&ctx) != 0)
+      return -1;
+
+   /* Only the VID/PIDs of the USB relay cards are watched, one
+    * callback per VID/PID (some relay types share one) */
+   for (rtype=NO_RELAY_TYPE+1; rtype<LAST_RELAY_TYPE; rtype++)
+   {
+      if (crelay_get_relay_card_usb_id(rtype, &vid, &pid) != 0)
+         continue;
+      for (prev=NO_RELAY_TYPE+1; prev<rtype; prev++)
+      {
+         if (crelay_get_relay_card_usb_id(prev, &pvid, &ppid) == 0 && pvid == vid && ppid == pid)
+            break;
+      }
+      if (prev < rtype)
+         continue;
+      if (libusb_hotplug_register_callback(ctx,
+             LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+             LIBUSB_HOTPLUG_NO_FLAGS, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY,
+             hotplug_cb, (void*)(intptr_t)rtype, NULL) == LIBUSB_SUCCESS)
+         num_cb++;
+   }
+   if (num_cb == 0)
+   {
+      libusb_exit(ctx);
+      return -1;
+   }
+
+   if (pthread_create(&thread, NULL, hotplug_thread, NULL) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to start hotplug thread: %s\n", strerror(errno));
+      libusb_exit(ctx);
+      return -1;
+   }
+   pthread_detach(thread);
+
+   crelay_worker_set_hotplug(1);
+   return 0;
+}
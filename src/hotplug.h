@@ -0,0 +1,56 @@
+/******************************************************************************
+ *
+ * Relay card control utility: USB hotplug discovery
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the declaration of the USB hotplug discovery
+ *   used in daemon mode.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef hotplug_h
+#define hotplug_h
+
+/* Time without events after which the bus is scanned */
+#define HOTPLUG_SETTLE_TIME 1000 /* ms */
+
+/**********************************************************
+ * Function hotplug_init()
+ *
+ * Description: Start the thread which updates the relay
+ *              card workers on USB hotplug events. Once
+ *              started, requests for unknown cards don't
+ *              probe the bus anymore.
+ *
+ * Parameters: none
+ *
+ * Return:   0 - success
+ *          -1 - fail, hotplug not supported
+ *********************************************************/
+int hotplug_init(void);
+
+#endif
@@ -0,0 +1,1283 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Built-in HTTP server
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the implementation of the event driven HTTP
+ *   server used in daemon mode.
+ *
+ *   All sockets are non-blocking and handled by a single epoll loop.
+ *   Requests are collected incrementally in a per connection buffer
+ *   and passed to the request handler once complete. Connections
+ *   are kept open according to the HTTP/1.1 keep-alive rules and
+ *   closed after HTTP_KEEPALIVE_TIMEOUT seconds of inactivity.
+ *
+ *   A request handler may complete its response later from another
+ *   thread. Completed responses are queued to the event loop, which
+ *   is woken up through an eventfd.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "mpsc.h"
+#include "metrics.h"
+#include "http_server.h"
+
+#define PROTOCOL "HTTP/1.1"
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+#define MAX_EVENTS 16
+#define EVENT_STREAM_HEADERS "Cache-Control: no-cache"
+#define EVENT_STREAM_MIME    "text/event-stream"
+#define EVENT_STREAM_PING    ":\n\n"
+#define RATE_UNIT            1000000    /* tokens of one request */
+#define RATE_PROBE           8          /* client entries searched for an address */
+
+/* Event source registered with epoll */
+typedef struct
+{
+   int fd;
+   void (*cb)(void* arg, uint32_t events);
+   void* arg;
+} watch_t;
+
+/* Request parser states */
+typedef enum
+{
+   PS_METHOD,
+   PS_PATH,
+   PS_QUERY,
+   PS_VERSION,
+   PS_LF,         /* end of a line, CR seen */
+   PS_NAME,       /* start of a line, header field name */
+   PS_VALUE_WS,
+   PS_VALUE,
+   PS_END_LF,     /* end of the header, CR seen */
+   PS_BODY
+} parse_state_t;
+
+/* Header fields used by the server */
+typedef enum
+{
+   HDR_OTHER,
+   HDR_CONTENT_LENGTH,
+   HDR_CONNECTION,
+   HDR_IF_NONE_MATCH,
+   HDR_TRANSFER_ENCODING
+} header_t;
+
+/* State of the request being parsed. The input is looked at only
+ * once, however it arrives. Offsets are relative to the start of
+ * the request, 0 = none. */
+typedef struct
+{
+   parse_state_t state;
+   int      pos;          /* next byte to parse */
+   int      mark;         /* start of the current token */
+   int      path;
+   int      query;
+   int      query_len;
+   int      version;
+   header_t header;
+   int      if_none_match;
+   int      content_len;  /* -1 = no Content-Length */
+   int      connection;   /* 1 = close, 2 = keep-alive, 0 = default */
+   int      hdr_len;
+} parser_t;
+
+/* Client connection */
+typedef struct
+{
+   watch_t watch;
+   char    in[HTTP_MAX_REQUEST_LEN+1];
+   int     in_off;       /* start of the unprocessed input */
+   int     in_len;
+   parser_t parser;
+   int     req_len;      /* length of the request being processed */
+   uint64_t req_start;   /* time the request was parsed */
+   char*   out;
+   size_t  out_len;
+   size_t  out_off;
+   const char* out_data; /* static part of the response */
+   size_t  out_data_len;
+   int     keep_alive;
+   time_t  last_active;
+   http_response_t resp;
+   int     pending;      /* response completed by another thread */
+   int     stream;       /* subscribed to the event stream */
+   int     closed;       /* closed while pending, free on completion */
+   in_addr_t addr;       /* client address */
+   mpsc_node_t done_node;
+} conn_t;
+
+/* Token bucket of a client address, free if last is 0 */
+typedef struct
+{
+   in_addr_t addr;
+   uint64_t  tokens;     /* in 1/RATE_UNIT requests */
+   uint64_t  last;       /* time of the last refill */
+} client_t;
+
+/* Event for the stream clients */
+typedef struct
+{
+   mpsc_node_t node;
+   size_t      len;
+   char        data[];
+} event_t;
+
+static int epoll_fd=-1;
+static watch_t listen_watch;
+static http_handler_t http_handler=NULL;
+static const char* server_name="";
+static conn_t* conns[HTTP_MAX_CONNECTIONS];
+static int num_conns=0;
+static watch_t done_watch;
+static mpsc_queue_t done_queue;
+static mpsc_queue_t event_queue;
+static client_t clients[HTTP_MAX_CLIENTS];
+static uint32_t rate_limit=0;   /* requests/s, 0 = no limit */
+static uint32_t rate_burst=0;
+
+static metrics_hist_t    parse_time;
+static metrics_hist_t    request_time;  /* from parsing to the response */
+static metrics_counter_t responses[6];  /* by status class, 0 = invalid */
+static metrics_counter_t bad_requests;
+static metrics_counter_t accepted;
+static metrics_counter_t rejected;      /* connection limit reached */
+static metrics_counter_t rate_limited;  /* requests over the rate limit */
+
+
+static int set_nonblocking(int fd)
+{
+   int flags = fcntl(fd, F_GETFL, 0);
+
+   if (flags < 0) return -1;
+   return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+static void conn_free(conn_t* conn)
+{
+   if (conn->resp.body != NULL) fclose(conn->resp.body);
+   free(conn->resp.buf);
+   free(conn->out);
+   free(conn);
+}
+
+
+static void conn_close(conn_t* conn)
+{
+   int i;
+
+   for (i=0; i<num_conns; i++)
+   {
+      if (conns[i] == conn)
+      {
+         conns[i] = conns[--num_conns];
+         break;
+      }
+   }
+   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->watch.fd, NULL);
+   close(conn->watch.fd);
+   
+   /* The response may still be written by another thread */
+   if (conn->pending)
+      conn->closed = 1;
+   else
+      conn_free(conn);
+}
+
+
+/**********************************************************
+ * Internal function conn_flush()
+ *
+ * Description: Send pending response data. If the socket
+ *              buffer is full, wait for it to become
+ *              writable again.
+ *
+ * Return:   1 - all data sent
+ *           0 - data still pending
+ *          -1 - connection error
+ *********************************************************/
+static int conn_flush(conn_t* conn)
+{
+   struct epoll_event ev;
+   struct iovec iov[2];
+   struct msghdr msg;
+   ssize_t n;
+
+   while (conn->out_off < conn->out_len + conn->out_data_len)
+   {
+      /* Header and static data go out with one call */
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      if (conn->out_off < conn->out_len)
+      {
+         iov[0].iov_base = conn->out+conn->out_off;
+         iov[0].iov_len  = conn->out_len-conn->out_off;
+         iov[1].iov_base = (void*)conn->out_data;
+         iov[1].iov_len  = conn->out_data_len;
+         msg.msg_iovlen  = conn->out_data_len ? 2 : 1;
+      }
+      else
+      {
+         iov[0].iov_base = (void*)(conn->out_data+conn->out_off-conn->out_len);
+         iov[0].iov_len  = conn->out_data_len-(conn->out_off-conn->out_len);
+         msg.msg_iovlen  = 1;
+      }
+      n = sendmsg(conn->watch.fd, &msg, MSG_NOSIGNAL);
+      if (n < 0)
+      {
+         if (errno == EINTR) continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+         ev.events = EPOLLOUT;
+         ev.data.ptr = &conn->watch;
+         epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->watch.fd, &ev);
+         return 0;
+      }
+      conn->out_off += n;
+   }
+
+   free(conn->out);
+   conn->out = NULL;
+   conn->out_len = conn->out_off = 0;
+   conn->out_data = NULL;
+   conn->out_data_len = 0;
+
+   ev.events = EPOLLIN;
+   ev.data.ptr = &conn->watch;
+   epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->watch.fd, &ev);
+   return 1;
+}
+
+
+/**********************************************************
+ * Internal function build_response()
+ *
+ * Description: Compose header and body of a response into
+ *              the connection output buffer
+ *
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+static int build_response(conn_t* conn, http_response_t* resp)
+{
+   char hdr[768];
+   char timebuf[64];
+   time_t now;
+   int len;
+
+   now = time(NULL);
+   strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
+   len = snprintf(hdr, sizeof(hdr), "%s %d %s\r\nServer: %s\r\nDate: %s\r\n",
+                  PROTOCOL, resp->status, resp->title, server_name, timebuf);
+   if (resp->extra[0])
+      len += snprintf(hdr+len, sizeof(hdr)-len, "%s\r\n", resp->extra);
+   if (resp->mime[0])
+      len += snprintf(hdr+len, sizeof(hdr)-len, "Content-Type: %s; charset=utf-8\r\n", resp->mime);
+   /* An event stream ends when the connection is closed */
+   if (resp->status != 304 && !conn->stream)
+      len += snprintf(hdr+len, sizeof(hdr)-len, "Content-Length: %zu\r\n", resp->len + resp->data_len);
+   if (resp->date != -1)
+   {
+      strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&resp->date));
+      len += snprintf(hdr+len, sizeof(hdr)-len, "Last-Modified: %s\r\n", timebuf);
+   }
+   len += snprintf(hdr+len, sizeof(hdr)-len, "Connection: %s\r\n\r\n", conn->keep_alive ? "keep-alive" : "close");
+   if (len >= sizeof(hdr)) return -1;
+
+   if ((conn->out = malloc(len + resp->len)) == NULL) return -1;
+   memcpy(conn->out, hdr, len);
+   memcpy(conn->out+len, resp->buf, resp->len);
+   conn->out_len = len + resp->len;
+   conn->out_off = 0;
+   conn->out_data = resp->data;
+   conn->out_data_len = resp->data_len;
+   return 0;
+}
+
+
+static int hex_value(char c)
+{
+   if (c >= '0' && c <= '9') return c - '0';
+   if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+   if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+   return -1;
+}
+
+
+/**********************************************************
+ * Internal function url_decode()
+ *
+ * Description: Decode %xx escapes in place and terminate
+ *              the result
+ *
+ * Return:  length of the decoded string
+ *          -1 - invalid escape
+ *********************************************************/
+static int url_decode(char* s, int len)
+{
+   int hi, lo;
+   int i, n;
+
+   for (i=0, n=0; i<len; i++, n++)
+   {
+      if (s[i] == '%')
+      {
+         if (i+2 >= len) return -1;
+         if ((hi = hex_value(s[i+1])) < 0 || (lo = hex_value(s[i+2])) < 0 || (hi|lo) == 0)
+            return -1;
+         s[n] = (hi << 4) | lo;
+         i += 2;
+      }
+      else s[n] = s[i];
+   }
+   s[n] = 0;
+   return n;
+}
+
+
+static int is_token_char(char c)
+{
+   return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+
+/* Compare a token with a lower case name */
+static int token_is(const char* s, int len, const char* name)
+{
+   return (strlen(name) == len) && !strncasecmp(s, name, len);
+}
+
+
+/**********************************************************
+ * Internal function parse_header()
+ *
+ * Description: Interpret a header field of interest
+ *
+ * Parameters: p (in/out) - parser state
+ *             in (in)    - request
+ *             off (in)   - offset of the terminated value
+ *             len (in)   - length of the value
+ *
+ * Return:   0 - success
+ *          -1 - invalid field
+ *********************************************************/
+static int parse_header(parser_t* p, char* in, int off, int len)
+{
+   char* value = in+off;
+   int n=0;
+   int i, t;
+
+   switch (p->header)
+   {
+      case HDR_CONTENT_LENGTH:
+         if (len == 0) return -1;
+         for (i=0; i<len; i++)
+         {
+            if (value[i] < '0' || value[i] > '9') return -1;
+            n = n*10 + (value[i] - '0');
+            if (n > HTTP_MAX_REQUEST_LEN) return -1;
+         }
+         /* Differing lengths would desynchronize the pipeline */
+         if (p->content_len >= 0 && p->content_len != n) return -1;
+         p->content_len = n;
+         break;
+
+      case HDR_CONNECTION:
+         /* Comma separated list of options */
+         for (i=0; i<=len; i=t+1)
+         {
+            while (i < len && (value[i] == ' ' || value[i] == '\t')) i++;
+            for (t=i; t<len && value[t] != ',' && value[t] != ' ' && value[t] != '\t'; t++);
+            if (token_is(value+i, t-i, "close")) p->connection = 1;
+            else if (token_is(value+i, t-i, "keep-alive") && p->connection == 0) p->connection = 2;
+            while (t < len && value[t] != ',') t++;
+         }
+         break;
+
+      case HDR_IF_NONE_MATCH:
+         p->if_none_match = off;
+         break;
+
+      case HDR_TRANSFER_ENCODING:
+         /* Chunked bodies are not supported */
+         return -1;
+
+      default:
+         break;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function parse_request()
+ *
+ * Description: Parse the input of a connection up to the end
+ *              of the next request. Parsing continues where
+ *              it stopped when more input arrives. The parts
+ *              of the request are terminated in place.
+ *
+ * Return:  >0 - length of the complete request
+ *           0 - request not complete yet
+ *          -1 - invalid request
+ *********************************************************/
+static int parse_request(conn_t* conn, http_request_t* req)
+{
+   parser_t* p = &conn->parser;
+   char* in = conn->in + conn->in_off;
+   int len = conn->in_len - conn->in_off;
+   int end;
+   char c;
+
+   while (p->state != PS_BODY && p->pos < len)
+   {
+      c = in[p->pos];
+      switch (p->state)
+      {
+         case PS_METHOD:
+            if (c == ' ' && p->pos > 0)
+            {
+               in[p->pos] = 0;
+               p->path = p->pos+1;
+               p->state = PS_PATH;
+            }
+            else if (c < 'A' || c > 'Z') return -1;
+            break;
+
+         case PS_PATH:
+         case PS_QUERY:
+         case PS_VERSION:
+            if (c == ' ' || c == '\r' || c == '\n' || (c == '?' && p->state == PS_PATH))
+            {
+               if (p->state == PS_PATH)
+               {
+                  if (in[p->path] != '/' || url_decode(in+p->path, p->pos-p->path) < 0)
+                     return -1;
+               }
+               else if (p->state == PS_QUERY)
+               {
+                  p->query_len = p->pos - p->query;
+               }
+               in[p->pos] = 0;
+
+               if (c == '?')
+               {
+                  p->query = p->pos+1;
+                  p->state = PS_QUERY;
+               }
+               else if (c == ' ')
+               {
+                  if (p->state == PS_VERSION) return -1;
+                  p->version = p->pos+1;
+                  p->state = PS_VERSION;
+               }
+               else
+               {
+                  p->state = (c == '\r') ? PS_LF : PS_NAME;
+                  p->mark = p->pos+1;
+               }
+            }
+            else if ((unsigned char)c < 0x21 || c == 0x7f) return -1;
+            break;
+
+         case PS_LF:
+            if (c != '\n') return -1;
+            p->state = PS_NAME;
+            p->mark = p->pos+1;
+            break;
+
+         case PS_NAME:
+            if (p->pos == p->mark && (c == '\r' || c == '\n'))
+            {
+               /* Empty line, end of the header */
+               if (c == '\n')
+               {
+                  p->hdr_len = p->pos+1;
+                  p->state = PS_BODY;
+               }
+               else p->state = PS_END_LF;
+            }
+            else if (c == ':' && p->pos > p->mark)
+            {
+               if (token_is(in+p->mark, p->pos-p->mark, "content-length"))
+                  p->header = HDR_CONTENT_LENGTH;
+               else if (token_is(in+p->mark, p->pos-p->mark, "connection"))
+                  p->header = HDR_CONNECTION;
+               else if (token_is(in+p->mark, p->pos-p->mark, "if-none-match"))
+                  p->header = HDR_IF_NONE_MATCH;
+               else if (token_is(in+p->mark, p->pos-p->mark, "transfer-encoding"))
+                  p->header = HDR_TRANSFER_ENCODING;
+               else
+                  p->header = HDR_OTHER;
+               p->state = PS_VALUE_WS;
+            }
+            /* This includes continuation lines, which are obsolete */
+            else if (!is_token_char(c)) return -1;
+            break;
+
+         case PS_VALUE_WS:
+            if (c == ' ' || c == '\t')
+               break;
+            p->mark = p->pos;
+            p->state = PS_VALUE;
+            /* fall through */
+
+         case PS_VALUE:
+            if (c == '\r' || c == '\n')
+            {
+               for (end = p->pos; end > p->mark && (in[end-1] == ' ' || in[end-1] == '\t'); end--);
+               in[end] = 0;
+               if (parse_header(p, in, p->mark, end-p->mark) < 0)
+                  return -1;
+               p->state = (c == '\r') ? PS_LF : PS_NAME;
+               p->mark = p->pos+1;
+            }
+            else if (((unsigned char)c < 0x20 && c != '\t') || c == 0x7f) return -1;
+            break;
+
+         case PS_END_LF:
+            if (c != '\n') return -1;
+            p->hdr_len = p->pos+1;
+            p->state = PS_BODY;
+            break;
+
+         default:
+            return -1;
+      }
+      p->pos++;
+   }
+
+   if (p->state != PS_BODY)
+      return (len >= HTTP_MAX_REQUEST_LEN) ? -1 : 0;
+   if (p->content_len < 0)
+      p->content_len = 0;
+   if (p->hdr_len + p->content_len > HTTP_MAX_REQUEST_LEN)
+      return -1;
+   if (len < p->hdr_len + p->content_len)
+      return 0;
+
+   req->method = in;
+   req->url = in + p->path;
+   req->query = p->query ? in + p->query : "";
+   req->query_len = p->query_len;
+   req->body = in + p->hdr_len;
+   req->body_len = p->content_len;
+   req->if_none_match = p->if_none_match ? in + p->if_none_match : NULL;
+
+   /* HTTP/1.1 keeps the connection open by default, HTTP/1.0 doesn't */
+   if (p->version && strcmp(in+p->version, "HTTP/1.1") && strcmp(in+p->version, "HTTP/1.0"))
+      return -1;
+   req->keep_alive = (p->connection == 2) ||
+                     (p->connection == 0 && p->version && !strcmp(in+p->version, "HTTP/1.1"));
+   return p->hdr_len + p->content_len;
+}
+
+
+static void parser_reset(parser_t* p)
+{
+   memset(p, 0, sizeof(parser_t));
+   p->state = PS_METHOD;
+   p->content_len = -1;
+}
+
+
+/**********************************************************
+ * Internal function conn_finish()
+ *
+ * Description: Send the response of the processed request
+ *              and remove the request from the input buffer
+ *
+ * Parameters: conn (in/out) - connection
+ *             err (in)      - return code of the handler
+ *
+ * Return:   0 - success
+ *          -1 - connection to be closed
+ *********************************************************/
+static int conn_finish(conn_t* conn, int err)
+{
+   http_response_t* resp = &conn->resp;
+
+   fclose(resp->body);
+   resp->body = NULL;
+   if (err >= 0) err = build_response(conn, resp);
+   free(resp->buf);
+   resp->buf = NULL;
+   metrics_observe(&request_time, conn->req_start, err);
+   if (err < 0) return -1;
+   metrics_inc(&responses[(resp->status >= 100 && resp->status < 600) ? resp->status/100 : 0]);
+
+   /* Remove the request, keep any pipelined one */
+   conn->in_off += conn->req_len;
+   if (conn->in_off == conn->in_len)
+      conn->in_off = conn->in_len = 0;
+   conn->req_len = 0;
+   parser_reset(&conn->parser);
+
+   if ((err = conn_flush(conn)) < 0) return -1;
+   if (err > 0 && !conn->keep_alive && !conn->stream) return -1;
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function conn_send()
+ *
+ * Description: Queue data on a stream connection
+ *
+ * Return:   0 - success
+ *          -1 - connection to be closed
+ *********************************************************/
+static int conn_send(conn_t* conn, const char* data, size_t len)
+{
+   size_t unsent = conn->out_len - conn->out_off;
+   char* out;
+
+   if (unsent + len > HTTP_MAX_STREAM_QUEUE)
+      return -1;
+   if (conn->out_off > 0)
+      memmove(conn->out, conn->out+conn->out_off, unsent);
+   if ((out = realloc(conn->out, unsent + len)) == NULL)
+      return -1;
+   memcpy(out+unsent, data, len);
+   conn->out = out;
+   conn->out_len = unsent + len;
+   conn->out_off = 0;
+   conn->last_active = time(NULL);
+   return (conn_flush(conn) < 0) ? -1 : 0;
+}
+
+
+/**********************************************************
+ * Internal function rate_take()
+ *
+ * Description: Take a request from the token bucket of a
+ *              client address. The bucket is refilled with
+ *              rate_limit requests per second up to rate_burst.
+ *              With all entries in use, the one of the client
+ *              idle the longest is taken over.
+ *
+ * Parameters: addr (in) - client address
+ *
+ * Return:   0 - request allowed
+ *          -1 - over the limit
+ *********************************************************/
+static int rate_take(in_addr_t addr)
+{
+   uint64_t now = metrics_now();
+   uint64_t max = (uint64_t)rate_burst * RATE_UNIT;
+   client_t* c = NULL;
+   client_t* e;
+   uint32_t h = ((uint32_t)addr * 2654435761u) % HTTP_MAX_CLIENTS;
+   int i;
+
+   for (i=0; i<RATE_PROBE; i++)
+   {
+      e = &clients[(h+i) % HTTP_MAX_CLIENTS];
+      if (e->last != 0 && e->addr == addr)
+      {
+         c = e;
+         break;
+      }
+      if (c == NULL || e->last < c->last)
+         c = e;
+   }
+   if (c->last == 0 || c->addr != addr)
+   {
+      /* New client, starts with a full bucket */
+      c->addr = addr;
+      c->tokens = max;
+   }
+   else if (now - c->last >= max / rate_limit)
+   {
+      c->tokens = max;
+   }
+   else
+   {
+      c->tokens += (now - c->last) * rate_limit;
+      if (c->tokens > max) c->tokens = max;
+   }
+   c->last = now;
+
+   if (c->tokens < RATE_UNIT)
+      return -1;
+   c->tokens -= RATE_UNIT;
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function conn_reject()
+ *
+ * Description: Answer an invalid request and close the
+ *              connection, the rest of the input is dropped
+ *
+ * Return:   0 - response pending
+ *          -1 - connection to be closed
+ *********************************************************/
+static int conn_reject(conn_t* conn)
+{
+   http_response_t* resp = &conn->resp;
+
+   memset(resp, 0, sizeof(http_response_t));
+   send_headers(resp, 400, "Bad Request", NULL, NULL, -1);
+   conn->keep_alive = 0;
+   conn->in_off = conn->in_len = 0;
+   parser_reset(&conn->parser);
+   if (build_response(conn, resp) < 0) return -1;
+   metrics_inc(&responses[4]);
+   return (conn_flush(conn) == 0) ? 0 : -1;
+}
+
+
+/**********************************************************
+ * Internal function conn_process()
+ *
+ * Description: Handle all complete requests in the input
+ *              buffer of a connection
+ *
+ * Return:   0 - success
+ *          -1 - connection to be closed
+ *********************************************************/
+static int conn_process(conn_t* conn)
+{
+   http_request_t req;
+   http_response_t* resp = &conn->resp;
+   char saved;
+   int len;
+   int err;
+
+   /* A stream client has nothing more to ask */
+   if (conn->stream)
+   {
+      conn->in_off = conn->in_len = 0;
+      return 0;
+   }
+
+   /* Responses are sent in order, wait for the pending one */
+   while (!conn->pending && conn->out == NULL && conn->in_len > conn->in_off)
+   {
+      memset(&req, 0, sizeof(req));
+      conn->req_start = metrics_now();
+      if ((len = parse_request(conn, &req)) == 0)
+         return 0;
+      if (len < 0)
+      {
+         metrics_inc(&bad_requests);
+         return conn_reject(conn);
+      }
+      metrics_observe(&parse_time, conn->req_start, 0);
+
+      memset(resp, 0, sizeof(http_response_t));
+      resp->status = 200;
+      strcpy(resp->title, "OK");
+      resp->date = -1;
+      if ((resp->body = open_memstream(&resp->buf, &resp->len)) == NULL)
+         return -1;
+
+      conn->keep_alive = req.keep_alive;
+      conn->req_len = len;
+
+      /* Clients over their rate don't get to the handler */
+      if (rate_limit != 0 && rate_take(conn->addr) != 0)
+      {
+         metrics_inc(&rate_limited);
+         send_headers(resp, 429, "Too Many Requests", "Retry-After: 1", "text/plain", -1);
+         fprintf(resp->body, "ERROR: Too many requests");
+         if (conn_finish(conn, 0) < 0) return -1;
+         continue;
+      }
+
+      /* Terminate the body, this may overwrite the next request */
+      saved = conn->in[conn->in_off+len];
+      conn->in[conn->in_off+len] = 0;
+      err = http_handler(&req, resp);
+      conn->in[conn->in_off+len] = saved;
+
+      if (err == HTTP_PENDING)
+      {
+         /* Wait for http_server_complete() */
+         conn->pending = 1;
+         return 0;
+      }
+      if (err == HTTP_EVENT_STREAM)
+      {
+         send_headers(resp, 200, "OK", EVENT_STREAM_HEADERS, EVENT_STREAM_MIME, -1);
+         conn->stream = 1;
+         conn->keep_alive = 0;
+         return conn_finish(conn, 0);
+      }
+      if (conn_finish(conn, err) < 0) return -1;
+   }
+   return 0;
+}
+
+
+static void conn_event(void* arg, uint32_t events)
+{
+   struct epoll_event ev;
+   conn_t* conn = arg;
+   ssize_t n;
+   int err;
+
+   conn->last_active = time(NULL);
+
+   if (events & (EPOLLERR | EPOLLHUP))
+   {
+      conn_close(conn);
+      return;
+   }
+
+   if (events & EPOLLOUT)
+   {
+      if ((err = conn_flush(conn)) < 0 || (err > 0 && !conn->keep_alive && !conn->stream))
+      {
+         conn_close(conn);
+         return;
+      }
+   }
+
+   if (events & EPOLLIN)
+   {
+      /* Make room for the rest of a pipelined request */
+      if (conn->in_off > 0 && conn->in_len == HTTP_MAX_REQUEST_LEN)
+      {
+         conn->in_len -= conn->in_off;
+         memmove(conn->in, conn->in+conn->in_off, conn->in_len);
+         conn->in_off = 0;
+      }
+      while (conn->in_len < HTTP_MAX_REQUEST_LEN)
+      {
+         n = recv(conn->watch.fd, conn->in+conn->in_len, HTTP_MAX_REQUEST_LEN-conn->in_len, 0);
+         if (n < 0)
+         {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            conn_close(conn);
+            return;
+         }
+         if (n == 0)
+         {
+            /* Client closed the connection */
+            conn_close(conn);
+            return;
+         }
+         conn->in_len += n;
+      }
+   }
+
+   if (conn_process(conn) < 0)
+   {
+      conn_close(conn);
+      return;
+   }
+
+   /* A full buffer can't take more while the response is pending,
+    * stop watching the socket until conn_finish() flushes the
+    * response and watches it again */
+   if (conn->pending && conn->in_len == HTTP_MAX_REQUEST_LEN)
+   {
+      ev.events = 0;
+      ev.data.ptr = &conn->watch;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->watch.fd, &ev);
+   }
+}
+
+
+static void listen_event(void* arg, uint32_t events)
+{
+   struct epoll_event ev;
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+   conn_t* conn;
+   int s;
+
+   while ((s = accept(listen_watch.fd, (struct sockaddr*)&addr, &addr_len)) >= 0)
+   {
+      addr_len = sizeof(addr);
+      if (num_conns >= HTTP_MAX_CONNECTIONS || set_nonblocking(s) < 0 ||
+          (conn = calloc(1, sizeof(conn_t))) == NULL)
+      {
+         metrics_inc(&rejected);
+         close(s);
+         continue;
+      }
+      conn->watch.fd = s;
+      conn->watch.cb = conn_event;
+      conn->watch.arg = conn;
+      conn->last_active = time(NULL);
+      conn->addr = addr.sin_addr.s_addr;
+      parser_reset(&conn->parser);
+
+      ev.events = EPOLLIN;
+      ev.data.ptr = &conn->watch;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev) < 0)
+      {
+         close(s);
+         free(conn);
+         continue;
+      }
+      conns[num_conns++] = conn;
+      metrics_inc(&accepted);
+   }
+}
+
+
+static void done_event(void* arg, uint32_t events)
+{
+   uint64_t count;
+   mpsc_node_t* node;
+   conn_t* conn;
+
+   if (read(done_watch.fd, &count, sizeof(count)) < 0) {}
+
+   /* An element still being queued comes with its own wakeup */
+   while ((node = mpsc_pop(&done_queue)) != NULL)
+   {
+      conn = (conn_t*)((char*)node - offsetof(conn_t, done_node));
+      conn->pending = 0;
+      if (conn->closed)
+      {
+         conn_free(conn);
+         continue;
+      }
+      conn->last_active = time(NULL);
+      if (conn_finish(conn, 0) < 0 || conn_process(conn) < 0)
+         conn_close(conn);
+   }
+
+   /* Fan out the events, each one is formatted only once */
+   while ((node = mpsc_pop(&event_queue)) != NULL)
+   {
+      event_t* event = (event_t*)node;
+      int i;
+
+      for (i=num_conns-1; i>=0; i--)
+      {
+         if (conns[i]->stream && conn_send(conns[i], event->data, event->len) < 0)
+            conn_close(conns[i]);
+      }
+      free(event);
+   }
+}
+
+
+static void watch_event(void* arg, uint32_t events)
+{
+   ((void (*)(void))arg)();
+}
+
+
+/**********************************************************
+ * Function http_server_init()
+ *********************************************************/
+int http_server_init(const char* name, struct in_addr iface, int port, int backlog, http_handler_t handler)
+{
+   struct sockaddr_in sin;
+   int sock;
+   int on=1;
+
+   sock = socket(AF_INET, SOCK_STREAM, 0);
+   if (sock < 0) return -1;
+   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+   memset(&sin, 0, sizeof(sin));
+   sin.sin_family = AF_INET;
+   sin.sin_addr.s_addr = iface.s_addr;
+   sin.sin_port = htons(port);
+   if (bind(sock, (struct sockaddr *) &sin, sizeof(sin)) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to bind socket to port %d : %s", port, strerror(errno));
+      close(sock);
+      return -1;
+   }
+   if (listen(sock, backlog) != 0 || set_nonblocking(sock) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to listen to port %d : %s", port, strerror(errno));
+      close(sock);
+      return -1;
+   }
+
+   listen_watch.fd = sock;
+   listen_watch.cb = listen_event;
+   listen_watch.arg = NULL;
+
+   mpsc_init(&done_queue);
+   mpsc_init(&event_queue);
+   if ((done_watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+   {
+      close(sock);
+      return -1;
+   }
+   done_watch.cb = done_event;
+   done_watch.arg = NULL;
+   http_handler = handler;
+   server_name = name;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function http_server_watch()
+ *********************************************************/
+int http_server_watch(int fd, void (*cb)(void))
+{
+   struct epoll_event ev;
+   watch_t* w;
+
+   if (epoll_fd < 0 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      return -1;
+   if ((w = calloc(1, sizeof(watch_t))) == NULL)
+      return -1;
+   w->fd = fd;
+   w->cb = watch_event;
+   w->arg = (void*)cb;
+
+   ev.events = EPOLLIN;
+   ev.data.ptr = w;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+   {
+      free(w);
+      return -1;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function http_server_set_rate_limit()
+ *********************************************************/
+void http_server_set_rate_limit(uint32_t rate, uint32_t burst)
+{
+   /* Buckets are refilled with the new rate, as of now */
+   rate_limit = rate;
+   rate_burst = (burst != 0) ? burst : rate;
+}
+
+
+/**********************************************************
+ * Function http_server_run()
+ *********************************************************/
+int http_server_run(void)
+{
+   struct epoll_event ev;
+   struct epoll_event events[MAX_EVENTS];
+   watch_t* w;
+   time_t now;
+   int n;
+   int i;
+
+   if (epoll_fd < 0 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      return -1;
+   ev.events = EPOLLIN;
+   ev.data.ptr = &listen_watch;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_watch.fd, &ev) < 0)
+      return -1;
+   ev.data.ptr = &done_watch;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_watch.fd, &ev) < 0)
+      return -1;
+
+   while (1)
+   {
+      n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+      if (n < 0)
+      {
+         if (errno == EINTR) continue;
+         syslog(LOG_DAEMON | LOG_ERR, "HTTP server failure : %s", strerror(errno));
+         return -1;
+      }
+
+      for (i=0; i<n; i++)
+      {
+         w = events[i].data.ptr;
+         w->cb(w->arg, events[i].events);
+      }
+
+      /* Drop idle connections, keep event streams alive so that
+       * dead clients are noticed */
+      now = time(NULL);
+      for (i=num_conns-1; i>=0; i--)
+      {
+         if (conns[i]->pending || now - conns[i]->last_active <= HTTP_KEEPALIVE_TIMEOUT)
+            continue;
+         if (!conns[i]->stream || conn_send(conns[i], EVENT_STREAM_PING, strlen(EVENT_STREAM_PING)) < 0)
+            conn_close(conns[i]);
+      }
+   }
+}
+
+
+/**********************************************************
+ * Function send_headers()
+ *********************************************************/
+void send_headers(http_response_t* resp, int status, char *title, char *extra, char *mime, time_t date)
+{
+   resp->status = status;
+   snprintf(resp->title, sizeof(resp->title), "%s", title);
+   snprintf(resp->extra, sizeof(resp->extra), "%s", extra ? extra : "");
+   snprintf(resp->mime, sizeof(resp->mime), "%s", mime ? mime : "");
+   resp->date = date;
+}
+
+
+/**********************************************************
+ * Function send_static()
+ *********************************************************/
+void send_static(http_response_t* resp, const char* data, size_t len)
+{
+   resp->data = data;
+   resp->data_len = len;
+}
+
+
+/**********************************************************
+ * Function http_server_complete()
+ *********************************************************/
+void http_server_complete(http_response_t* resp)
+{
+   conn_t* conn = (conn_t*)((char*)resp - offsetof(conn_t, resp));
+   uint64_t one=1;
+
+   mpsc_push(&done_queue, &conn->done_node);
+   if (write(done_watch.fd, &one, sizeof(one)) < 0) {}
+}
+
+
+/**********************************************************
+ * Function http_server_broadcast()
+ *********************************************************/
+int http_server_broadcast(const char* data, size_t len)
+{
+   event_t* event;
+   uint64_t one=1;
+
+   if ((event = malloc(sizeof(event_t) + len)) == NULL)
+      return -1;
+   event->len = len;
+   memcpy(event->data, data, len);
+
+   mpsc_push(&event_queue, &event->node);
+   if (write(done_watch.fd, &one, sizeof(one)) < 0) {}
+   return 0;
+}
+
+
+/**********************************************************
+ * Function http_get_param()
+ *********************************************************/
+int http_get_param(const char* data, int len, const char* name, char* value, size_t size)
+{
+   const char* end = data + len;
+   const char* field;
+   const char* p;
+   size_t n = strlen(name);
+   size_t i = 0;
+   int hi, lo;
+
+   for (p = data; p < end; p++)
+   {
+      for (field = p; p < end && *p != '&'; p++);
+      if (p-field < n || strncmp(field, name, n) || (p-field > n && field[n] != '='))
+         continue;
+
+      /* Form encoding, '+' is a space */
+      for (field += n+1; field < p; field++)
+      {
+         if (i+1 >= size) return -1;
+         if (*field == '%')
+         {
+            if (p-field < 3 || (hi = hex_value(field[1])) < 0 || (lo = hex_value(field[2])) < 0 ||
+                (hi|lo) == 0)
+               return -1;
+            value[i++] = (hi << 4) | lo;
+            field += 2;
+         }
+         else value[i++] = (*field == '+') ? ' ' : *field;
+      }
+      value[i] = 0;
+      return i;
+   }
+   return -1;
+}
+
+
+/**********************************************************
+ * Function http_server_write_metrics()
+ *********************************************************/
+void http_server_write_metrics(FILE* f)
+{
+   char labels[16];
+   int i;
+
+   metrics_write_type(f, "crelay_http_parse_duration_seconds", "histogram",
+                      "Time to parse a request");
+   metrics_write_hist(f, "crelay_http_parse_duration_seconds", "", &parse_time);
+   metrics_write_type(f, "crelay_http_request_duration_seconds", "histogram",
+                      "Time from parsing a request to its response");
+   metrics_write_hist(f, "crelay_http_request_duration_seconds", "", &request_time);
+
+   metrics_write_type(f, "crelay_http_responses_total", "counter",
+                      "Responses by status class");
+   for (i=1; i<6; i++)
+   {
+      snprintf(labels, sizeof(labels), "code=\"%dxx\"", i);
+      metrics_write_value(f, "crelay_http_responses_total", labels, metrics_read(&responses[i]));
+   }
+   metrics_write_type(f, "crelay_http_bad_requests_total", "counter",
+                      "Requests rejected because they could not be parsed");
+   metrics_write_value(f, "crelay_http_bad_requests_total", "", metrics_read(&bad_requests));
+   metrics_write_type(f, "crelay_http_rate_limited_total", "counter",
+                      "Requests answered with 429 because of the rate limit");
+   metrics_write_value(f, "crelay_http_rate_limited_total", "", metrics_read(&rate_limited));
+
+   metrics_write_type(f, "crelay_http_connections", "gauge", "Open client connections");
+   metrics_write_value(f, "crelay_http_connections", "", num_conns);
+   metrics_write_type(f, "crelay_http_connections_accepted_total", "counter", "Accepted client connections");
+   metrics_write_value(f, "crelay_http_connections_accepted_total", "", metrics_read(&accepted));
+   metrics_write_type(f, "crelay_http_connections_rejected_total", "counter",
+                      "Client connections refused at the connection limit");
+   metrics_write_value(f, "crelay_http_connections_rejected_total", "", metrics_read(&rejected));
+}
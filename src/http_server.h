@@ -0,0 +1,246 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Built-in HTTP server
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the declaration of the event driven HTTP server
+ *   used in daemon mode.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef http_server_h
+#define http_server_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define HTTP_MAX_REQUEST_LEN   4096
+#define HTTP_MAX_CONNECTIONS   256
+#define HTTP_KEEPALIVE_TIMEOUT 30 /* s */
+#define HTTP_MAX_STREAM_QUEUE  65536 /* unsent event data per client */
+#define HTTP_MAX_CLIENTS       256   /* client addresses with a rate limit */
+#define DEFAULT_SERVER_BACKLOG 16
+
+/* Handler return code for a response completed later */
+#define HTTP_PENDING 1
+
+/* Handler return code to turn the connection into a Server-Sent
+ * Events stream fed by http_server_broadcast() */
+#define HTTP_EVENT_STREAM 2
+
+/* Parsed HTTP request, strings point into the connection buffer */
+typedef struct
+{
+   char* method;
+   char* url;            /* decoded path, without the query */
+   const char* query;    /* raw query string ("" if none) */
+   int   query_len;
+   char* body;
+   int   body_len;
+   int   keep_alive;
+   char* if_none_match;  /* entity tags of a conditional request or NULL */
+} http_request_t;
+
+/* HTTP response, the body is written to a memory stream and
+ * followed by the static data, if any */
+typedef struct
+{
+   FILE*  body;
+   char*  buf;
+   size_t len;
+   const char* data;
+   size_t data_len;
+   int    status;
+   char   title[64];
+   char   extra[256];
+   char   mime[32];
+   time_t date;
+} http_response_t;
+
+/* Request handler, returns <0 to drop the connection without response,
+ * HTTP_PENDING if the response is completed by http_server_complete()
+ * or HTTP_EVENT_STREAM to subscribe the client to broadcast events */
+typedef int (*http_handler_t)(http_request_t* req, http_response_t* resp);
+
+/**********************************************************
+ * Function http_server_init()
+ *
+ * Description: Create the listening socket of the server
+ *
+ * Parameters: name (in)    - server name for the header
+ *             iface (in)   - interface address to bind to
+ *             port (in)    - TCP port
+ *             backlog (in) - listen backlog
+ *             handler (in) - request handler
+ *
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int http_server_init(const char* name, struct in_addr iface, int port, int backlog, http_handler_t handler);
+
+/**********************************************************
+ * Function http_server_watch()
+ *
+ * Description: Add a file descriptor to the server event
+ *              loop (e.g. a timer)
+ *
+ * Parameters: fd (in) - file descriptor
+ *             cb (in) - function called when fd is readable
+ *
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int http_server_watch(int fd, void (*cb)(void));
+
+/**********************************************************
+ * Function http_server_set_rate_limit()
+ *
+ * Description: Limit the requests of each client address with
+ *              a token bucket. Requests over the limit are
+ *              answered with 429 without calling the handler.
+ *              Must be called from the thread running the
+ *              server.
+ *
+ * Parameters: rate (in)  - requests per second and client
+ *                          (0 = no limit)
+ *             burst (in) - requests a client may send at
+ *                          once (0 = rate)
+ *
+ * Return:  none
+ *********************************************************/
+void http_server_set_rate_limit(uint32_t rate, uint32_t burst);
+
+/**********************************************************
+ * Function http_server_run()
+ *
+ * Description: Run the server event loop
+ *
+ * Parameters: none
+ *
+ * Return:  -1 - fail (does not return otherwise)
+ *********************************************************/
+int http_server_run(void);
+
+/**********************************************************
+ * Function send_headers()
+ *
+ * Description: Set the status and header fields of a
+ *              response. The header is sent together with
+ *              the body once the request is processed.
+ *
+ * Parameters: resp (in/out) - HTTP response
+ *             status (in)   - HTTP status code
+ *             title (in)    - HTTP status text
+ *             extra (in)    - extra header lines or NULL
+ *             mime (in)     - content type or NULL
+ *             date (in)     - last modified date or -1
+ *
+ * Return:  none
+ *********************************************************/
+void send_headers(http_response_t* resp, int status, char *title, char *extra, char *mime, time_t date);
+
+/**********************************************************
+ * Function send_static()
+ *
+ * Description: Append data which never changes to the body
+ *              of a response. The data is sent from where it
+ *              is without being copied.
+ *
+ * Parameters: resp (in/out) - HTTP response
+ *             data (in)     - data, must stay valid while
+ *                             the server is running
+ *             len (in)      - length of the data
+ *
+ * Return:  none
+ *********************************************************/
+void send_static(http_response_t* resp, const char* data, size_t len);
+
+/**********************************************************
+ * Function http_server_complete()
+ *
+ * Description: Send a response for which the handler has
+ *              returned HTTP_PENDING. Can be called from any
+ *              thread. The request data is not valid anymore
+ *              at this point, the response must not be used
+ *              afterwards.
+ *
+ * Parameters: resp (in) - HTTP response
+ *
+ * Return:  none
+ *********************************************************/
+void http_server_complete(http_response_t* resp);
+
+/**********************************************************
+ * Function http_server_broadcast()
+ *
+ * Description: Send an event to all clients subscribed to
+ *              the event stream. Can be called from any
+ *              thread. Clients which can't keep up are
+ *              disconnected.
+ *
+ * Parameters: data (in) - formatted event
+ *             len (in)  - length of the event
+ *
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int http_server_broadcast(const char* data, size_t len);
+
+/**********************************************************
+ * Function http_get_param()
+ *
+ * Description: Get the decoded value of a parameter of a
+ *              query string or url encoded form data
+ *
+ * Parameters: data (in)   - query string or form data
+ *             len (in)    - length of the data
+ *             name (in)   - name of the parameter
+ *             value (out) - decoded value
+ *             size (in)   - size of the value buffer
+ *
+ * Return:  length of the value
+ *          -1 - fail, parameter not found, invalid or too long
+ *********************************************************/
+int http_get_param(const char* data, int len, const char* name, char* value, size_t size);
+
+/**********************************************************
+ * Function http_server_write_metrics()
+ *
+ * Description: Write the request latency, response and
+ *              connection counts of the server in the
+ *              Prometheus text format. Must be called from
+ *              the request handler.
+ *
+ * Parameters: f (in) - output stream
+ *
+ * Return:  none
+ *********************************************************/
+void http_server_write_metrics(FILE* f);
+
+#endif
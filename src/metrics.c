@@ -0,0 +1,151 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Metrics
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the implementation of the lock-free counters and
+ *   latency histograms exported in the Prometheus text format.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+
+static const uint64_t bucket_us[METRICS_NUM_BUCKETS-1] = { METRICS_BUCKETS_US };
+
+
+/**********************************************************
+ * Function metrics_now()
+ *********************************************************/
+uint64_t metrics_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**********************************************************
+ * Function metrics_observe()
+ *********************************************************/
+void metrics_observe(metrics_hist_t* h, uint64_t start, int err)
+{
+   uint64_t us = metrics_now() - start;
+   int i;
+
+   for (i=0; i<METRICS_NUM_BUCKETS-1 && us > bucket_us[i]; i++);
+   metrics_inc(&h->bucket[i]);
+   metrics_add(&h->sum, us);
+   if (err < 0) metrics_inc(&h->errors);
+}
+
+
+/**********************************************************
+ * Function metrics_count()
+ *********************************************************/
+uint64_t metrics_count(metrics_hist_t* h)
+{
+   uint64_t count=0;
+   int i;
+
+   for (i=0; i<METRICS_NUM_BUCKETS; i++)
+      count += metrics_read(&h->bucket[i]);
+   return count;
+}
+
+
+/**********************************************************
+ * Function metrics_write_type()
+ *********************************************************/
+void metrics_write_type(FILE* f, const char* name, const char* type, const char* help)
+{
+   fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+/**********************************************************
+ * Function metrics_write_value()
+ *********************************************************/
+void metrics_write_value(FILE* f, const char* name, const char* labels, uint64_t value)
+{
+   if (labels[0])
+      fprintf(f, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+   else
+      fprintf(f, "%s %llu\n", name, (unsigned long long)value);
+}
+
+
+/**********************************************************
+ * Function metrics_write_hist()
+ *********************************************************/
+void metrics_write_hist(FILE* f, const char* name, const char* labels, metrics_hist_t* h)
+{
+   const char* sep = labels[0] ? "," : "";
+   uint64_t count=0;
+   int i;
+
+   /* The buckets are read one by one while they may change,
+    * the count is taken from them to stay consistent */
+   for (i=0; i<METRICS_NUM_BUCKETS-1; i++)
+   {
+      count += metrics_read(&h->bucket[i]);
+      fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+              bucket_us[i] / 1e6, (unsigned long long)count);
+   }
+   count += metrics_read(&h->bucket[i]);
+   fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)count);
+   if (labels[0])
+   {
+      fprintf(f, "%s_sum{%s} %.6f\n", name, labels, metrics_read(&h->sum) / 1e6);
+      fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long)count);
+   }
+   else
+   {
+      fprintf(f, "%s_sum %.6f\n", name, metrics_read(&h->sum) / 1e6);
+      fprintf(f, "%s_count %llu\n", name, (unsigned long long)count);
+   }
+}
+
+
+/**********************************************************
+ * Function metrics_label()
+ *********************************************************/
+char* metrics_label(char* out, size_t size, const char* in)
+{
+   size_t i;
+
+   for (i=0; i+1<size && in[i]; i++)
+      out[i] = (in[i] == '"' || in[i] == '\\' || in[i] < ' ') ? '_' : in[i];
+   if (size > 0) out[i] = 0;
+   return out;
+}
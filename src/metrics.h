@@ -0,0 +1,161 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Metrics
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the declaration of the lock-free counters and
+ *   latency histograms exported in the Prometheus text format.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef metrics_h
+#define metrics_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Upper bounds of the histogram buckets in us, the last bucket
+ * takes everything above */
+#define METRICS_BUCKETS_US 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, \
+                           10000, 25000, 50000, 100000, 250000, 1000000
+#define METRICS_NUM_BUCKETS 16
+
+typedef atomic_uint_fast64_t metrics_counter_t;
+
+/* Latency histogram, the buckets are not cumulative */
+typedef struct
+{
+   metrics_counter_t bucket[METRICS_NUM_BUCKETS];
+   metrics_counter_t sum;      /* us */
+   metrics_counter_t errors;   /* operations which failed */
+} metrics_hist_t;
+
+/* Count events, can be called from any thread */
+#define metrics_add(c, n) atomic_fetch_add_explicit((c), (n), memory_order_relaxed)
+#define metrics_inc(c)    metrics_add((c), 1)
+#define metrics_read(c)   atomic_load_explicit((c), memory_order_relaxed)
+
+/**********************************************************
+ * Function metrics_now()
+ *
+ * Description: Get the monotonic time used to measure the
+ *              duration of an operation
+ *
+ * Parameters: none
+ *
+ * Return:  time in us
+ *********************************************************/
+uint64_t metrics_now(void);
+
+/**********************************************************
+ * Function metrics_observe()
+ *
+ * Description: Add the duration of an operation to a
+ *              histogram. Can be called from any thread.
+ *
+ * Parameters: h (in/out)  - histogram
+ *             start (in)  - start time from metrics_now()
+ *             err (in)    - result of the operation (<0 =
+ *                           counted as error)
+ *
+ * Return:  none
+ *********************************************************/
+void metrics_observe(metrics_hist_t* h, uint64_t start, int err);
+
+/**********************************************************
+ * Function metrics_count()
+ *
+ * Description: Get the number of operations in a histogram
+ *
+ * Parameters: h (in) - histogram
+ *
+ * Return:  number of operations
+ *********************************************************/
+uint64_t metrics_count(metrics_hist_t* h);
+
+/**********************************************************
+ * Function metrics_write_type()
+ *
+ * Description: Write the help and type comments which start
+ *              a metric in the exposition format
+ *
+ * Parameters: f (in)    - output stream
+ *             name (in) - metric name
+ *             type (in) - "counter", "gauge" or "histogram"
+ *             help (in) - description
+ *
+ * Return:  none
+ *********************************************************/
+void metrics_write_type(FILE* f, const char* name, const char* type, const char* help);
+
+/**********************************************************
+ * Function metrics_write_value()
+ *
+ * Description: Write a sample of a counter or gauge
+ *
+ * Parameters: f (in)      - output stream
+ *             name (in)   - metric name
+ *             labels (in) - label list without braces,
+ *                           e.g. "card=\"1\"" or ""
+ *             value (in)  - value
+ *
+ * Return:  none
+ *********************************************************/
+void metrics_write_value(FILE* f, const char* name, const char* labels, uint64_t value);
+
+/**********************************************************
+ * Function metrics_write_hist()
+ *
+ * Description: Write the buckets, sum (in seconds) and count
+ *              of a histogram
+ *
+ * Parameters: f (in)      - output stream
+ *             name (in)   - metric name
+ *             labels (in) - label list without braces
+ *             h (in)      - histogram
+ *
+ * Return:  none
+ *********************************************************/
+void metrics_write_hist(FILE* f, const char* name, const char* labels, metrics_hist_t* h);
+
+/**********************************************************
+ * Function metrics_label()
+ *
+ * Description: Copy a string for use as label value,
+ *              characters which would need escaping are
+ *              replaced
+ *
+ * Parameters: out (out) - label value
+ *             size (in) - size of out
+ *             in (in)   - string
+ *
+ * Return:  out
+ *********************************************************/
+char* metrics_label(char* out, size_t size, const char* in);
+
+#endif
@@ -0,0 +1,103 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Lock-free command queue
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the implementation of a lock-free multi producer,
+ *   single consumer queue (intrusive list with a stub node, after
+ *   D. Vyukov). Producers only do one atomic exchange, the consumer
+ *   never blocks them.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "mpsc.h"
+
+
+/**********************************************************
+ * Function mpsc_init()
+ *********************************************************/
+void mpsc_init(mpsc_queue_t* q)
+{
+   atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+   atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+   q->tail = &q->stub;
+}
+
+
+/**********************************************************
+ * Function mpsc_push()
+ *********************************************************/
+void mpsc_push(mpsc_queue_t* q, mpsc_node_t* node)
+{
+   mpsc_node_t* prev;
+
+   atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+   prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+   /* The list is broken here until the link is set, see mpsc_pop() */
+   atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+
+/**********************************************************
+ * Function mpsc_pop()
+ *********************************************************/
+mpsc_node_t* mpsc_pop(mpsc_queue_t* q)
+{
+   mpsc_node_t* tail = q->tail;
+   mpsc_node_t* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+   if (tail == &q->stub)
+   {
+      if (next == NULL) return NULL;
+      q->tail = next;
+      tail = next;
+      next = atomic_load_explicit(&next->next, memory_order_acquire);
+   }
+
+   if (next != NULL)
+   {
+      q->tail = next;
+      return tail;
+   }
+
+   /* A producer has exchanged the head but not yet linked it */
+   if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+      return NULL;
+
+   /* Last element, put the stub back behind it */
+   mpsc_push(q, &q->stub);
+   next = atomic_load_explicit(&tail->next, memory_order_acquire);
+   if (next != NULL)
+   {
+      q->tail = next;
+      return tail;
+   }
+   return NULL;
+}
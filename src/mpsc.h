@@ -0,0 +1,90 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Lock-free command queue
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the declaration of a lock-free multi producer,
+ *   single consumer queue used to pass commands between threads.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef mpsc_h
+#define mpsc_h
+
+#include <stdatomic.h>
+
+/* Queue link, to be embedded into the queued element */
+typedef struct mpsc_node
+{
+   struct mpsc_node* _Atomic next;
+} mpsc_node_t;
+
+typedef struct
+{
+   mpsc_node_t* _Atomic head;
+   mpsc_node_t* tail;
+   mpsc_node_t stub;
+} mpsc_queue_t;
+
+/**********************************************************
+ * Function mpsc_init()
+ *
+ * Description: Initialize an empty queue
+ *
+ * Parameters: q (out) - queue
+ *
+ * Return:  none
+ *********************************************************/
+void mpsc_init(mpsc_queue_t* q);
+
+/**********************************************************
+ * Function mpsc_push()
+ *
+ * Description: Add an element to the queue. Can be called
+ *              from any thread.
+ *
+ * Parameters: q (in/out) - queue
+ *             node (in)  - link of the element to add
+ *
+ * Return:  none
+ *********************************************************/
+void mpsc_push(mpsc_queue_t* q, mpsc_node_t* node);
+
+/**********************************************************
+ * Function mpsc_pop()
+ *
+ * Description: Remove the oldest element from the queue.
+ *              Must only be called from the consumer thread.
+ *
+ * Parameters: q (in/out) - queue
+ *
+ * Return:  link of the removed element
+ *          NULL - queue empty (or a push is in progress)
+ *********************************************************/
+mpsc_node_t* mpsc_pop(mpsc_queue_t* q);
+
+#endif
@@ -35,8 +35,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "relay_drv.h"
+#include "metrics.h"
 
 /* Card driver specific include files */
 #include "relay_drv_conrad.h"
@@ -44,222 +49,1605 @@
 #include "relay_drv_hidapi.h"
 #include "relay_drv_sainsmart16.h"
 #include "relay_drv_gpio.h"
+#include "relay_drv_gpiochip.h"
+#include "relay_drv_gpiomem.h"
+#include "relay_drv_sim.h"
 
 
 static relay_type_t relay_type=NO_RELAY_TYPE;
 
+/* Notified when the shadow copy of an open card changes */
+static void (*state_cb)(relay_dev_t* dev, relay_mask_t changed) = NULL;
+
+/* Serializes bus probing, cards opened with crelay_open() may
+ * be reopened from different threads */
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Guards the session cache and the references to the sessions,
+ * the transfers hold the lock of their session only */
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Driver operations measured for each relay type */
+typedef enum
+{
+   DRV_OP_DETECT,
+   DRV_OP_OPEN,
+   DRV_OP_GET,
+   DRV_OP_SET,
+   DRV_NUM_OPS
+} drv_op_t;
+
+static const char* drv_op_name[DRV_NUM_OPS] = { "detect", "open", "get", "set" };
+static metrics_hist_t drv_metrics[LAST_RELAY_TYPE][DRV_NUM_OPS];
+
+#ifdef DRV_ONLY
+/*
+ *  Build with a single driver: its functions are called directly,
+ *  so the calls can be inlined and there is no driver table.
+ *  ONLY(fun) is the driver specific name of a function.
+ */
+#if defined(DRV_CONRAD)
+#define ONLY(fun)   fun##_conrad_4chan
+#define ONLY_NAME   CONRAD_4CHANNEL_USB_NAME
+#define ONLY_USB_VID CONRAD_4CHANNEL_USB_VID
+#define ONLY_USB_PID CONRAD_4CHANNEL_USB_PID
+#elif defined(DRV_SAINSMART)
+#define ONLY(fun)   fun##_sainsmart_4_8chan
+#define ONLY_NAME   SAINSMART_USB_NAME
+#define ONLY_USB_VID SAINSMART_USB_VID
+#define ONLY_USB_PID SAINSMART_USB_PID
+#elif defined(DRV_HIDAPI)
+#define ONLY(fun)   fun##_hidapi
+#define ONLY_NAME   HID_API_RELAY_NAME
+#define ONLY_USB_VID HID_API_USB_VID
+#define ONLY_USB_PID HID_API_USB_PID
+#elif defined(DRV_SAINSMART16)
+#define ONLY(fun)   fun##_sainsmart_16chan
+#define ONLY_NAME   SAINSMART16_USB_NAME
+#define ONLY_USB_VID SAINSMART16_USB_VID
+#define ONLY_USB_PID SAINSMART16_USB_PID
+#elif defined(DRV_SIM)
+#define ONLY(fun)   fun##_sim
+#define ONLY_NAME   SIM_NAME
+#elif defined(DRV_GPIOMEM) && !defined(BUILD_LIB)
+#define ONLY(fun)   fun##_gpiomem
+#define ONLY_NAME   GPIOMEM_NAME
+#elif defined(DRV_GPIOCHIP) && !defined(BUILD_LIB)
+#define ONLY(fun)   fun##_gpiochip
+#define ONLY_NAME   GPIOCHIP_NAME
+#elif defined(DRV_GPIO) && !defined(BUILD_LIB)
+#define ONLY(fun)   fun##_generic_gpio
+#define ONLY_NAME   GENERIC_GPIO_NAME
+#define ONLY_NO_OPEN
+#else
+#error "DRV_ONLY needs one driver"
+#endif
+#ifndef ONLY_USB_VID
+#define ONLY_USB_VID 0             /* no USB device */
+#define ONLY_USB_PID 0
+#endif
+
+#define DRV_DETECT(t, port, num, serial, info)  ONLY(detect_relay_card)(port, num, serial, info)
+#ifndef ONLY_NO_OPEN
+#define DRV_HAS_OPEN(t)                1
+#define DRV_OPEN(t, dev)               ONLY(open_relay_card)(dev)
+#define DRV_CLOSE(t, dev)              ONLY(close_relay_card)(dev)
+#else
+#define DRV_HAS_OPEN(t)                0
+#define DRV_OPEN(t, dev)               0
+#define DRV_CLOSE(t, dev)              do {} while (0)
+#endif
+#define DRV_GET(t, dev, relay, state)  ONLY(get_relay)(dev, relay, state)
+#define DRV_SET(t, dev, relay, state)  ONLY(set_relay)(dev, relay, state)
+#define DRV_HAS_GET_ALL(t)             1
+#define DRV_GET_ALL(t, dev, states)    ONLY(get_all_relays)(dev, states)
+#define DRV_HAS_SET_MASK(t)            1
+#define DRV_SET_MASK(t, dev, mask, states)  ONLY(set_relay_mask)(dev, mask, states)
+#define DRV_NAME(t)                    ONLY_NAME
+#define DRV_USB_VID(t)                 ONLY_USB_VID
+#define DRV_USB_PID(t)                 ONLY_USB_PID
+
+#else
 /*
  *  Table which holds the specific relay card data:
  *    - function to detect the communication port
+ *    - function to open the card (optional)
+ *    - function to close the card (optional)
  *    - function to get the current relay state
  *    - function to set the new relay state
+ *    - function to get the state of all relays (optional)
+ *    - function to set several relays at once (optional)
  *    - card name string
- *    - number of relays on the card
+ *    - USB vendor and product ID (USB cards only)
  * 
  *  The index into the table is the relay card type.
  */
 static relay_data_t relay_data[LAST_RELAY_TYPE] =
 { 
    {  // NO_RELAY_TYPE (dummy entry)
-      NULL, NULL, NULL, ""
+      NULL, NULL, NULL, NULL, NULL, NULL, NULL, "", 0, 0
    },
 #ifdef DRV_CONRAD
    {  // CONRAD_4CHANNEL_USB_RELAY_TYPE
       detect_relay_card_conrad_4chan,
+      open_relay_card_conrad_4chan,
+      close_relay_card_conrad_4chan,
       get_relay_conrad_4chan,
       set_relay_conrad_4chan,
-      CONRAD_4CHANNEL_USB_NAME
+      get_all_relays_conrad_4chan,
+      set_relay_mask_conrad_4chan,
+      CONRAD_4CHANNEL_USB_NAME,
+      CONRAD_4CHANNEL_USB_VID, CONRAD_4CHANNEL_USB_PID
    },
 #endif
 #ifdef DRV_SAINSMART
    {  // SAINSMART_USB_RELAY_TYPE
       detect_relay_card_sainsmart_4_8chan,
+      open_relay_card_sainsmart_4_8chan,
+      close_relay_card_sainsmart_4_8chan,
       get_relay_sainsmart_4_8chan,
       set_relay_sainsmart_4_8chan,
-      SAINSMART_USB_NAME
+      get_all_relays_sainsmart_4_8chan,
+      set_relay_mask_sainsmart_4_8chan,
+      SAINSMART_USB_NAME,
+      SAINSMART_USB_VID, SAINSMART_USB_PID
    },
 #endif
 #ifdef DRV_HIDAPI
    {  // HID_API_RELAY_TYPE
       detect_relay_card_hidapi,
+      open_relay_card_hidapi,
+      close_relay_card_hidapi,
       get_relay_hidapi,
       set_relay_hidapi,
-      HID_API_RELAY_NAME
+      get_all_relays_hidapi,
+      set_relay_mask_hidapi,
+      HID_API_RELAY_NAME,
+      HID_API_USB_VID, HID_API_USB_PID
    },
 #endif
 #ifdef DRV_SAINSMART16
    {  // SAINSMART16_USB_RELAY_TYPE
       detect_relay_card_sainsmart_16chan,
+      open_relay_card_sainsmart_16chan,
+      close_relay_card_sainsmart_16chan,
       get_relay_sainsmart_16chan,
       set_relay_sainsmart_16chan,
-      SAINSMART16_USB_NAME
+      get_all_relays_sainsmart_16chan,
+      set_relay_mask_sainsmart_16chan,
+      SAINSMART16_USB_NAME,
+      SAINSMART16_USB_VID, SAINSMART16_USB_PID
+   },
+#endif
+#ifdef DRV_SIM
+   {  // SIM_RELAY_TYPE
+      detect_relay_card_sim,
+      open_relay_card_sim,
+      close_relay_card_sim,
+      get_relay_sim,
+      set_relay_sim,
+      get_all_relays_sim,
+      set_relay_mask_sim,
+      SIM_NAME
    },
 #endif
 #ifndef BUILD_LIB
+#ifdef DRV_GPIOMEM
+   {  // GPIOMEM_RELAY_TYPE
+      detect_relay_card_gpiomem,
+      open_relay_card_gpiomem,
+      close_relay_card_gpiomem,
+      get_relay_gpiomem,
+      set_relay_gpiomem,
+      get_all_relays_gpiomem,
+      set_relay_mask_gpiomem,
+      GPIOMEM_NAME
+   },
+#endif
+#ifdef DRV_GPIOCHIP
+   {  // GPIOCHIP_RELAY_TYPE
+      detect_relay_card_gpiochip,
+      open_relay_card_gpiochip,
+      close_relay_card_gpiochip,
+      get_relay_gpiochip,
+      set_relay_gpiochip,
+      get_all_relays_gpiochip,
+      set_relay_mask_gpiochip,
+      GPIOCHIP_NAME
+   },
+#endif
+#ifdef DRV_GPIO
    {  // GENERIC_GPIO_RELAY_TYPE
       detect_relay_card_generic_gpio,
+      NULL,
+      NULL,
       get_relay_generic_gpio,
       set_relay_generic_gpio,
+      get_all_relays_generic_gpio,
+      set_relay_mask_generic_gpio,
       GENERIC_GPIO_NAME
    }
 #endif
+#endif
 };
 
+/* Calls through the driver table */
+#define DRV_DETECT(t, port, num, serial, info)  (*relay_data[t].detect_relay_card_fun)(port, num, serial, info)
+#define DRV_HAS_OPEN(t)                (relay_data[t].open_relay_card_fun != NULL)
+#define DRV_OPEN(t, dev)               (*relay_data[t].open_relay_card_fun)(dev)
+#define DRV_CLOSE(t, dev)              (*relay_data[t].close_relay_card_fun)(dev)
+#define DRV_GET(t, dev, relay, state)  (*relay_data[t].get_relay_fun)(dev, relay, state)
+#define DRV_SET(t, dev, relay, state)  (*relay_data[t].set_relay_fun)(dev, relay, state)
+#define DRV_HAS_GET_ALL(t)             (relay_data[t].get_all_relays_fun != NULL)
+#define DRV_GET_ALL(t, dev, states)    (*relay_data[t].get_all_relays_fun)(dev, states)
+#define DRV_HAS_SET_MASK(t)            (relay_data[t].set_relay_mask_fun != NULL)
+#define DRV_SET_MASK(t, dev, mask, states)  (*relay_data[t].set_relay_mask_fun)(dev, mask, states)
+#define DRV_NAME(t)                    (relay_data[t].card_name)
+#define DRV_USB_VID(t)                 (relay_data[t].usb_vid)
+#define DRV_USB_PID(t)                 (relay_data[t].usb_pid)
+#endif /* DRV_ONLY */
+
+#define USB_SYSFS_PATH  "/sys/bus/usb/devices"
+#define MAX_USB_DEVICES 128
+
+/* USB vendor and product ID of a device on the bus */
+typedef struct
+{
+   uint16_t vid;
+   uint16_t pid;
+} usb_id_t;
+
+/* Relay type of the cards found so far, by requested serial number */
+typedef struct
+{
+   char         serial[MAX_SERIAL_LEN];
+   relay_type_t relay_type;
+} drv_hint_t;
+
+static drv_hint_t drv_hints[MAX_NUM_SESSIONS];
+static int next_hint=0;
+
+/* Session of a relay card, the device comes first so that the
+ * handle returned by crelay_open() is the session itself */
+typedef struct
+{
+   relay_dev_t     dev;
+   pthread_mutex_t lock;   /* held during the transfers of the calls by serial number */
+   int             refs;   /* cache entry, owner and calls in progress (session_lock) */
+} session_t;
+
+/*
+ *  Cache of the relay card sessions opened so far, keyed by
+ *  relay type and the serial number requested by the caller.
+ *  A session keeps the detection result and the open device
+ *  handle, so that a card is only probed again after an I/O
+ *  error or an explicit call to crelay_invalidate_sessions().
+ *  Accessed with session_lock held.
+ */
+static relay_dev_t* sessions[MAX_NUM_SESSIONS];
+
 
 /**********************************************************
- * Function crelay_detect_all_relay_cards()
+ * Internal function session_find()
  * 
- * Description: Detect all relay cards
+ * Description: Find the cached session for a serial number
  * 
- * Parameters: relay_info(out)- pointer to list of 
- *                              relays info struct
+ * Parameters: serial (in) - serial number (NULL = any card)
  * 
- * Return:  0 - success
- *         -1 - fail, no relay card found
+ * Return:  pointer to session, NULL if not found
  *********************************************************/
-int crelay_detect_all_relay_cards(relay_info_t** relay_info)
+static relay_dev_t* session_find(char* serial)
 {
    int i;
-   relay_info_t* my_relay_info;
    
-   /* Create first list element */
-   my_relay_info = malloc(sizeof(relay_info_t));
-   my_relay_info->next = NULL;
+   if (serial == NULL) serial = "";
+   
+   for (i=0; i<MAX_NUM_SESSIONS; i++)
+   {
+      if (sessions[i] != NULL && !strcmp(sessions[i]->serial, serial))
+         return sessions[i];
+   }
+   return NULL;
+}
 
-   /* Return pointer to first element to caller */
-   *relay_info = my_relay_info;
+
+/**********************************************************
+ * Internal function session_release()
+ * 
+ * Description: Drop a reference to a session, the last one
+ *              closes the card. Must be called with the
+ *              session lock held.
+ * 
+ * Parameters: dev (in) - session
+ * 
+ * Return:  none
+ *********************************************************/
+static void session_release(relay_dev_t* dev)
+{
+   session_t* s = (session_t*)dev;
    
-   for (i=1; i<LAST_RELAY_TYPE; i++)
+   if (--s->refs > 0)
+      return;
+   if (DRV_HAS_OPEN(dev->relay_type) && dev->handle != NULL)
+      DRV_CLOSE(dev->relay_type, dev);
+   pthread_mutex_destroy(&s->lock);
+   free(s);
+}
+
+
+/**********************************************************
+ * Internal function session_close()
+ * 
+ * Description: Remove a session from the cache, the card is
+ *              closed when no call uses it any more. Must be
+ *              called with the session lock held.
+ * 
+ * Parameters: dev (in) - session to close
+ * 
+ * Return:  none
+ *********************************************************/
+static void session_close(relay_dev_t* dev)
+{
+   int cached=0;
+   int i;
+   
+   for (i=0; i<MAX_NUM_SESSIONS; i++)
+   {
+      if (sessions[i] == dev)
+      {
+         sessions[i] = NULL;
+         cached = 1;
+      }
+   }
+   if (cached)
+      session_release(dev);
+}
+
+
+/**********************************************************
+ * Internal function session_open()
+ * 
+ * Description: Open the detected card and add the new 
+ *              session to the cache
+ * 
+ * Parameters: rtype (in)      - detected relay type
+ *             portname (in)   - detected com port
+ *             num_relays (in) - detected number of relays
+ *             serial (in)     - requested serial number
+ * 
+ * Return:  pointer to session, NULL on failure
+ *********************************************************/
+static relay_dev_t* session_open(relay_type_t rtype, char* portname, uint8_t num_relays, char* serial)
+{
+   relay_dev_t* dev;
+   session_t* s;
+   uint64_t start;
+   int err;
+   int i;
+   
+   for (i=0; i<MAX_NUM_SESSIONS && sessions[i] != NULL; i++);
+   if (i == MAX_NUM_SESSIONS)
+   {
+      /* Cache is full, drop the oldest session */
+      session_close(sessions[0]);
+      memmove(&sessions[0], &sessions[1], (MAX_NUM_SESSIONS-1)*sizeof(relay_dev_t*));
+      i = MAX_NUM_SESSIONS-1;
+   }
+   
+   if ((s = calloc(1, sizeof(session_t))) == NULL)
+      return NULL;
+   dev = &s->dev;
+   dev->relay_type = rtype;
+   dev->num_relays = num_relays;
+   snprintf(dev->serial, sizeof(dev->serial), "%s", serial ? serial : "");
+   snprintf(dev->portname, sizeof(dev->portname), "%s", portname);
+   
+   if (DRV_HAS_OPEN(rtype))
    {
-      /* Create new list element with related info for each detected card */
-      (*relay_data[i].detect_relay_card_fun)(NULL, NULL, NULL, &my_relay_info);
+      start = metrics_now();
+      err = DRV_OPEN(rtype, dev);
+      metrics_observe(&drv_metrics[rtype][DRV_OP_OPEN], start, err);
+      if (err < 0)
+      {
+         free(s);
+         return NULL;
+      }
    }
    
-   if ((*relay_info)->next == NULL)
+   pthread_mutex_init(&s->lock, NULL);
+   s->refs = 1;
+   sessions[i] = dev;
+   return dev;
+}
+
+
+#ifdef DRV_ONLY
+/* Nothing to choose from, the one driver probes */
+#define usb_scan(ids, max) (-1)
+#else
+/**********************************************************
+ * Internal function usb_read_id()
+ * 
+ * Description: Read a hexadecimal ID of a USB device
+ * 
+ * Return:  ID, -1 on failure
+ *********************************************************/
+static int usb_read_id(const char* dev, const char* name)
+{
+   char path[300];
+   char buf[8];
+   char* end;
+   long id;
+   int fd, n;
+   
+   snprintf(path, sizeof(path), "%s/%s/%s", USB_SYSFS_PATH, dev, name);
+   if ((fd = open(path, O_RDONLY)) < 0)
       return -1;
-   else
-      return 0;
+   n = read(fd, buf, sizeof(buf)-1);
+   close(fd);
+   if (n <= 0)
+      return -1;
+   buf[n] = 0;
+   id = strtol(buf, &end, 16);
+   return (end == buf || id > 0xffff) ? -1 : id;
 }
 
 
 /**********************************************************
- * Function crelay_detect_relay_card()
+ * Internal function usb_scan()
  * 
- * Description: Detect the relay card
+ * Description: List the IDs of the USB devices on the bus,
+ *              so that only the drivers of cards which are
+ *              present need to probe. This takes one pass
+ *              over sysfs instead of a bus enumeration by
+ *              the USB library of each driver.
  * 
- * Parameters: portname (out) - pointer to a string where
- *                              the detected com port will
- *                              be stored
- *             num_relays(out)- pointer to number of relays
+ * Parameters: ids (out) - IDs of the devices
+ *             max (in)  - size of the list
  * 
- * Return:  0 - success
- *         -1 - fail, no relay card found
+ * Return:  number of different IDs
+ *          -1 - bus can't be listed, probe all drivers
  *********************************************************/
-int crelay_detect_relay_card(char* portname, uint8_t* num_relays, char* serial, relay_info_t** my_relay_info)
+static int usb_scan(usb_id_t* ids, int max)
 {
+   struct dirent* entry;
+   DIR* dir;
+   int vid, pid;
+   int n=0;
    int i;
    
-   for (i=1; i<LAST_RELAY_TYPE; i++)
+   if ((dir = opendir(USB_SYSFS_PATH)) == NULL)
+      return -1;
+   while ((entry = readdir(dir)) != NULL)
    {
-      if ((*relay_data[i].detect_relay_card_fun)(portname, num_relays, serial, NULL) == 0)
+      /* Interfaces (e.g. 1-1:1.0) have no device IDs */
+      if (entry->d_name[0] == '.' || strchr(entry->d_name, ':') != NULL)
+         continue;
+      if ((vid = usb_read_id(entry->d_name, "idVendor")) < 0 ||
+          (pid = usb_read_id(entry->d_name, "idProduct")) < 0)
+         continue;
+      for (i=0; i<n && (ids[i].vid != vid || ids[i].pid != pid); i++);
+      if (i == n && n < max)
       {
-         relay_type=i;
-         return 0;
+         ids[n].vid = vid;
+         ids[n].pid = pid;
+         n++;
       }
    }
+   closedir(dir);
    
-   relay_type = NO_RELAY_TYPE;
-   return -1;   
+   /* A full list may miss cards */
+   return (n < max) ? n : -1;
 }
+#endif /* DRV_ONLY */
 
 
 /**********************************************************
- * Function crelay_get_relay()
+ * Internal function usb_present()
  * 
- * Description: Get the current relay state
+ * Description: Check if a card of a relay type may be present
  * 
- * Parameters: portname (in)     - communication port
- *             relay (in)        - relay number
- *             relay_state (out) - current relay state
+ * Parameters: rtype (in) - relay type
+ *             ids (in)   - IDs of the USB devices
+ *             n (in)     - number of IDs (<0 = unknown)
  * 
- * Return:   0 - success
- *          -1 - fail
+ * Return:  1 - driver needs to probe
+ *          0 - no card of this type on the bus
  *********************************************************/
-int crelay_get_relay(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
+static int usb_present(relay_type_t rtype, usb_id_t* ids, int n)
 {
-   if (relay_type != NO_RELAY_TYPE)
+   int i;
+   
+   if (n < 0 || DRV_USB_VID(rtype) == 0)
+      return 1;
+   for (i=0; i<n; i++)
    {
-      return (*relay_data[relay_type].get_relay_fun)(portname, relay, relay_state, serial);
+      if (ids[i].vid == DRV_USB_VID(rtype) && ids[i].pid == DRV_USB_PID(rtype))
+         return 1;
    }
-   else
-   {   
-      return -1;
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function drv_hint()
+ * 
+ * Description: Get or set the relay type of the card last
+ *              found with a serial number. Must be called
+ *              with the probe lock held.
+ * 
+ * Parameters: serial (in) - serial number (NULL = any card)
+ *             rtype (in)  - relay type to remember, or
+ *                           NO_RELAY_TYPE to look it up
+ * 
+ * Return:  relay type, NO_RELAY_TYPE if not known
+ *********************************************************/
+static relay_type_t drv_hint(char* serial, relay_type_t rtype)
+{
+   int i;
+   
+   if (serial == NULL) serial = "";
+   for (i=0; i<MAX_NUM_SESSIONS; i++)
+   {
+      if (drv_hints[i].relay_type != NO_RELAY_TYPE && !strcmp(drv_hints[i].serial, serial))
+         break;
+   }
+   if (rtype == NO_RELAY_TYPE)
+      return (i < MAX_NUM_SESSIONS) ? drv_hints[i].relay_type : NO_RELAY_TYPE;
+   
+   if (i == MAX_NUM_SESSIONS)
+   {
+      /* Replace the oldest entry */
+      i = next_hint;
+      next_hint = (next_hint+1) % MAX_NUM_SESSIONS;
+      snprintf(drv_hints[i].serial, sizeof(drv_hints[i].serial), "%s", serial);
    }
+   drv_hints[i].relay_type = rtype;
+   return rtype;
 }
 
 
 /**********************************************************
- * Function crelay_set_relay()
+ * Internal function probe_driver()
  * 
- * Description: Set new relay state
+ * Description: Let one driver look for a relay card
  * 
- * Parameters: portname (in)     - communication port
- *             relay (in)        - relay number
- *             relay_state (in)  - current relay state
+ * Parameters: rtype (in)       - relay type
+ *             portname (out)   - detected com port
+ *             num_relays (out) - detected number of relays
+ *             serial (in)      - serial number (NULL = any card)
  * 
- * Return:   o - success
- *          -1 - fail
+ * Return:  0 - success
+ *         <0 - fail, no relay card found
  *********************************************************/
-int crelay_set_relay(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
+static int probe_driver(relay_type_t rtype, char* portname, uint8_t* num_relays, char* serial)
+{
+   uint64_t start;
+   int err;
+   
+   portname[0] = 0;
+   *num_relays = 0;
+   start = metrics_now();
+   err = DRV_DETECT(rtype, portname, num_relays, serial, NULL);
+   /* No card of this type is not an error */
+   metrics_observe(&drv_metrics[rtype][DRV_OP_DETECT], start, 0);
+   return err;
+}
+
+
+/**********************************************************
+ * Internal function probe_relay_card()
+ * 
+ * Description: Probe the drivers for a relay card and open
+ *              a new session for the first card found. The
+ *              driver which found the card with this serial
+ *              number before probes first, drivers of USB
+ *              cards which are not on the bus are skipped.
+ * 
+ * Parameters: serial (in) - serial number (NULL = any card)
+ * 
+ * Return:  pointer to session, NULL if no card found
+ *********************************************************/
+static relay_dev_t* probe_relay_card(char* serial)
 {
-   if (relay_type != NO_RELAY_TYPE)
+   char portname[MAX_COM_PORT_NAME_LEN];
+   usb_id_t usb_ids[MAX_USB_DEVICES];
+   int num_usb;
+   uint8_t num_relays;
+   relay_type_t hint;
+   relay_type_t rtype;
+   
+   pthread_mutex_lock(&probe_lock);
+   num_usb = usb_scan(usb_ids, MAX_USB_DEVICES);
+   hint = drv_hint(serial, NO_RELAY_TYPE);
+   if (hint > NO_RELAY_TYPE && hint < LAST_RELAY_TYPE && usb_present(hint, usb_ids, num_usb) &&
+       probe_driver(hint, portname, &num_relays, serial) == 0)
    {
-      return (*relay_data[relay_type].set_relay_fun)(portname, relay, relay_state, serial);
+      rtype = hint;
    }
    else
-   {   
-      return -1;
+   {
+      for (rtype=NO_RELAY_TYPE+1; rtype<LAST_RELAY_TYPE; rtype++)
+      {
+         if (rtype != hint && usb_present(rtype, usb_ids, num_usb) &&
+             probe_driver(rtype, portname, &num_relays, serial) == 0)
+         {
+            drv_hint(serial, rtype);
+            break;
+         }
+      }
    }
+   pthread_mutex_unlock(&probe_lock);
+   
+   if (rtype >= LAST_RELAY_TYPE)
+      return NULL;
+   return session_open(rtype, portname, num_relays, serial);
 }
 
 
 /**********************************************************
- * Function crelay_get_relay_card_type()
+ * Internal function session_get()
  * 
- * Description: Get the detected relay type
+ * Description: Get the session for a serial number, probe
+ *              the card if it is not yet in the cache. Must
+ *              be called with the session lock held.
  * 
- * Parameters: none
+ * Parameters: serial (in) - serial number (NULL = any card)
  * 
- * Return: relay type
+ * Return:  pointer to session, NULL if no card found
  *********************************************************/
-relay_type_t crelay_get_relay_card_type()
+static relay_dev_t* session_get(char* serial)
 {
-   return relay_type;
+   relay_dev_t* dev;
+   
+   /* A card missing now doesn't drop the sessions of the other
+    * cards, they are only probed again after an I/O error or
+    * crelay_invalidate_sessions() */
+   if ((dev = session_find(serial)) != NULL)
+      return dev;
+   return probe_relay_card(serial);
 }
 
 
 /**********************************************************
- * Function crelay_get_relay_card_name()
+ * Internal function session_acquire()
  * 
- * Description: Get the relay card name for a relay type
+ * Description: Get the session for a serial number like
+ *              session_get() and lock it for the transfers
+ *              of a call
  * 
- * Parameters: rtype           - relay type
- *             card_name (out) - pointer to a string where
- *                               the detected com port will
- *                               be stored
+ * Parameters: serial (in) - serial number (NULL = any card)
+ * 
+ * Return:  pointer to session, NULL if no card found
+ *********************************************************/
+static relay_dev_t* session_acquire(char* serial)
+{
+   relay_dev_t* dev;
+   
+   pthread_mutex_lock(&session_lock);
+   if ((dev = session_get(serial)) != NULL)
+      ((session_t*)dev)->refs++;
+   pthread_mutex_unlock(&session_lock);
+   if (dev != NULL)
+      pthread_mutex_lock(&((session_t*)dev)->lock);
+   return dev;
+}
+
+
+/**********************************************************
+ * Internal function session_done()
+ * 
+ * Description: Unlock a session after the transfers of a
+ *              call. It is dropped from the cache if the card
+ *              is gone, so that the next call probes again.
+ * 
+ * Parameters: dev (in) - session from session_acquire()
+ *             err (in) - result of the call
+ * 
+ * Return:  err
+ *********************************************************/
+static int session_done(relay_dev_t* dev, int err)
+{
+   pthread_mutex_unlock(&((session_t*)dev)->lock);
+   pthread_mutex_lock(&session_lock);
+   if (err < -1)
+      session_close(dev);
+   session_release(dev);
+   pthread_mutex_unlock(&session_lock);
+   return err;
+}
+
+
+/**********************************************************
+ * Internal function dev_reopen()
+ * 
+ * Description: Close and open again a relay device after an
+ *              I/O error. The card is probed again with its
+ *              own driver, since the port may have changed
+ *              if the card was replugged.
+ * 
+ * Parameters: dev (in/out) - relay device
  * 
  * Return:  0 - success
+ *         <0 - fail, card not found
+ *********************************************************/
+static int dev_reopen(relay_dev_t* dev)
+{
+   char portname[MAX_COM_PORT_NAME_LEN];
+   uint8_t num_relays;
+   uint64_t start;
+   int err;
+   
+   if (DRV_HAS_OPEN(dev->relay_type) && dev->handle != NULL)
+      DRV_CLOSE(dev->relay_type, dev);
+   dev->handle = NULL;
+   
+   /* The card may have lost its relay states */
+   dev->shadow_valid = 0;
+   
+   portname[0] = 0;
+   num_relays = dev->num_relays;
+   pthread_mutex_lock(&probe_lock);
+   start = metrics_now();
+   err = DRV_DETECT(dev->relay_type, portname, &num_relays, dev->serial[0] ? dev->serial : NULL, NULL);
+   metrics_observe(&drv_metrics[dev->relay_type][DRV_OP_DETECT], start, 0);
+   pthread_mutex_unlock(&probe_lock);
+   if (err != 0)
+      return -1;
+   
+   snprintf(dev->portname, sizeof(dev->portname), "%s", portname);
+   dev->num_relays = num_relays;
+   
+   if (DRV_HAS_OPEN(dev->relay_type))
+   {
+      start = metrics_now();
+      err = DRV_OPEN(dev->relay_type, dev);
+      metrics_observe(&drv_metrics[dev->relay_type][DRV_OP_OPEN], start, err);
+   }
+   return err;
+}
+
+
+/**********************************************************
+ * Function crelay_detect_all_relay_cards()
+ * 
+ * Description: Detect all relay cards
+ * 
+ * Parameters: info (out) - array for the detected cards
+ *             size (in)  - number of elements of the array
+ * 
+ * Return:  number of cards found, only the first size
+ *          cards are stored if there are more
  *         -1 - fail, no relay card found
  *********************************************************/
-int crelay_get_relay_card_name(relay_type_t rtype, char* card_name)
+int crelay_detect_all_relay_cards(relay_info_t* info, int size)
+{
+   return crelay_detect_relay_cards(NO_RELAY_TYPE, info, size);
+}
+
+
+/**********************************************************
+ * Function crelay_detect_relay_cards()
+ * 
+ * Description: Detect the relay cards of one type
+ * 
+ * Parameters: rtype (in) - relay type (NO_RELAY_TYPE = all)
+ *             info (out) - array for the detected cards
+ *             size (in)  - number of elements of the array
+ * 
+ * Return:  number of cards found, only the first size
+ *          cards are stored if there are more
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int crelay_detect_relay_cards(relay_type_t rtype, relay_info_t* info, int size)
 {
-   if (rtype != NO_RELAY_TYPE)
+   relay_list_t list;
+   usb_id_t usb_ids[MAX_USB_DEVICES];
+   int num_usb;
+   uint64_t start;
+   int i;
+   
+   list.info = info;
+   list.size = size;
+   list.num = 0;
+   
+   pthread_mutex_lock(&probe_lock);
+   num_usb = usb_scan(usb_ids, MAX_USB_DEVICES);
+   for (i=1; i<LAST_RELAY_TYPE; i++)
    {
-      strcpy(card_name, relay_data[rtype].card_name);
-      return 0;
+      if ((rtype != NO_RELAY_TYPE && i != rtype) || !usb_present(i, usb_ids, num_usb))
+         continue;
+      
+      /* The driver adds each card it finds to the list */
+      start = metrics_now();
+      DRV_DETECT(i, NULL, NULL, NULL, &list);
+      metrics_observe(&drv_metrics[i][DRV_OP_DETECT], start, 0);
    }
-   else
-   {   
+   pthread_mutex_unlock(&probe_lock);
+   
+   return (list.num > 0) ? list.num : -1;
+}
+
+
+/**********************************************************
+ * Function crelay_list_add()
+ * 
+ * Description: Add a card to the list of detected cards,
+ *              called by the drivers when all cards are
+ *              listed
+ * 
+ * Parameters: list (in/out)   - list of detected cards
+ *             rtype (in)      - relay type
+ *             serial (in)     - serial number
+ *             portname (in)   - communication port
+ *             num_relays (in) - number of relays
+ * 
+ * Return:   0 - success
+ *          -1 - list full, the card is only counted
+ *********************************************************/
+int crelay_list_add(relay_list_t* list, relay_type_t rtype, const char* serial, const char* portname, uint8_t num_relays)
+{
+   relay_info_t* info;
+   
+   if (list->num++ >= list->size)
       return -1;
-   }  
+   
+   info = &list->info[list->num-1];
+   info->relay_type = rtype;
+   snprintf(info->serial, sizeof(info->serial), "%s", serial);
+   snprintf(info->portname, sizeof(info->portname), "%s", portname);
+   info->num_relays = num_relays;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function crelay_detect_relay_card()
+ * 
+ * Description: Detect the relay card. The card is kept 
+ *              open in a session cache, so only the first
+ *              call for a serial number probes the bus.
+ * 
+ * Parameters: portname (out) - pointer to a string where
+ *                              the detected com port will
+ *                              be stored
+ *             num_relays(out)- pointer to number of relays
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int crelay_detect_relay_card(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
+{
+   relay_dev_t* dev;
+   
+   if ((dev = session_acquire(serial)) == NULL)
+   {
+      relay_type = NO_RELAY_TYPE;
+      return -1;
+   }
+   
+   relay_type = dev->relay_type;
+   if (portname != NULL) strcpy(portname, dev->portname);
+   if (num_relays != NULL) *num_relays = dev->num_relays;
+   return session_done(dev, 0);
+}
+
+
+/**********************************************************
+ * Function crelay_get_relay()
+ * 
+ * Description: Get the current relay state
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int crelay_get_relay(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
+{
+   relay_dev_t* dev;
+   
+   if ((dev = session_acquire(serial)) == NULL)
+      return -1;
+   return session_done(dev, crelay_dev_get_relay(dev, relay, relay_state));
+}
+
+
+/**********************************************************
+ * Function crelay_set_relay()
+ * 
+ * Description: Set new relay state
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay (in)        - relay number
+ *             relay_state (in)  - current relay state
+ * 
+ * Return:   o - success
+ *          -1 - fail
+ *********************************************************/
+int crelay_set_relay(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
+{
+   relay_dev_t* dev;
+   
+   if ((dev = session_acquire(serial)) == NULL)
+      return -1;
+   return session_done(dev, crelay_dev_set_relay(dev, relay, relay_state));
+}
+
+
+/**********************************************************
+ * Function crelay_get_all_relays()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: portname (in)      - communication port
+ *             relay_states (out) - bitmap of relay states
+ *             serial (in)        - serial number [optional]
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_get_all_relays(char* portname, relay_mask_t* relay_states, char* serial)
+{
+   relay_dev_t* dev;
+   
+   if ((dev = session_acquire(serial)) == NULL)
+      return -1;
+   return session_done(dev, crelay_dev_get_all_relays(dev, relay_states));
+}
+
+
+/**********************************************************
+ * Function crelay_set_relay_mask()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ *             serial (in)       - serial number [optional]
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_set_relay_mask(char* portname, relay_mask_t relay_mask, relay_mask_t relay_states, char* serial)
+{
+   relay_dev_t* dev;
+   
+   if ((dev = session_acquire(serial)) == NULL)
+      return -1;
+   return session_done(dev, crelay_dev_set_relay_mask(dev, relay_mask, relay_states));
+}
+
+
+/**********************************************************
+ * Function crelay_open()
+ * 
+ * Description: Detect a relay card and open it. The returned
+ *              handle stays open until crelay_close() is
+ *              called, so relay operations on it don't need
+ *              to open and claim the device each time.
+ * 
+ * Parameters: serial (in) - serial number of the card
+ *                           (NULL = first card found)
+ * 
+ * Return:  handle of the open card
+ *          NULL - fail, no relay card found
+ *********************************************************/
+relay_dev_t* crelay_open(char* serial)
+{
+   relay_dev_t* dev;
+   int i;
+   
+   pthread_mutex_lock(&session_lock);
+   if ((dev = session_get(serial)) != NULL)
+   {
+      /* Hand over the session to the caller, the reference of
+       * the cache becomes the one of the caller */
+      for (i=0; i<MAX_NUM_SESSIONS; i++)
+      {
+         if (sessions[i] == dev) sessions[i] = NULL;
+      }
+   }
+   pthread_mutex_unlock(&session_lock);
+   return dev;
+}
+
+
+/**********************************************************
+ * Function crelay_close()
+ * 
+ * Description: Close a relay card opened with crelay_open()
+ * 
+ * Parameters: dev (in) - handle of the open card
+ * 
+ * Return: none
+ *********************************************************/
+void crelay_close(relay_dev_t* dev)
+{
+   if (dev == NULL) return;
+   
+   /* Closed once no call by serial number uses it any more */
+   pthread_mutex_lock(&session_lock);
+   session_release(dev);
+   pthread_mutex_unlock(&session_lock);
+}
+
+
+/**********************************************************
+ * Internal function dev_is_open()
+ * 
+ * Description: Make sure the device is open, it may have
+ *              lost its handle after a failed reopen
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:  1 - device is open
+ *          0 - fail, card not found
+ *********************************************************/
+static int dev_is_open(relay_dev_t* dev)
+{
+   if (dev->handle == NULL && DRV_HAS_OPEN(dev->relay_type))
+      return (dev_reopen(dev) == 0);
+   return 1;
+}
+
+
+/**********************************************************
+ * Internal function dev_get_relay()
+ * 
+ * Description: Read one relay with the driver
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+static int dev_get_relay(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
+{
+   uint64_t start = metrics_now();
+   int err;
+   
+   err = DRV_GET(dev->relay_type, dev, relay, relay_state);
+   metrics_observe(&drv_metrics[dev->relay_type][DRV_OP_GET], start, err);
+   return err;
+}
+
+
+/**********************************************************
+ * Internal function dev_set_relay()
+ * 
+ * Description: Write one relay with the driver
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+static int dev_set_relay(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
+{
+   uint64_t start = metrics_now();
+   int err;
+   
+   err = DRV_SET(dev->relay_type, dev, relay, relay_state);
+   metrics_observe(&drv_metrics[dev->relay_type][DRV_OP_SET], start, err);
+   return err;
+}
+
+
+/**********************************************************
+ * Internal function shadow_update()
+ * 
+ * Description: Update the shadow copy of the relay states
+ *              after an access to the card
+ * 
+ * Parameters: dev (in/out)      - relay device
+ *             relay_mask (in)   - bitmap of accessed relays
+ *             relay_states (in) - bitmap of relay states
+ *             err (in)          - result of the access
+ * 
+ * Return:  none
+ *********************************************************/
+static void shadow_update(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states, int err)
+{
+   relay_mask_t changed;
+   
+   if (err != 0)
+   {
+      /* After an I/O error the states are unknown */
+      if (err < -1) dev->shadow_valid = 0;
+      return;
+   }
+   changed = (dev->shadow ^ relay_states) & relay_mask;
+   dev->shadow = (dev->shadow & ~relay_mask) | (relay_states & relay_mask);
+   if (!dev->shadow_valid)
+   {
+      if (relay_mask != RELAY_MASK_ALL(dev->num_relays))
+         return;
+      dev->shadow_valid = 1;
+      changed = relay_mask;
+   }
+   if (changed != 0 && state_cb != NULL)
+      (*state_cb)(dev, changed);
+}
+
+
+/**********************************************************
+ * Function crelay_dev_get_relay()
+ * 
+ * Description: Get the current relay state of an open card
+ * 
+ * Parameters: dev (in)          - handle of the open card
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_dev_get_relay(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
+{
+   int err;
+   
+   if (!dev_is_open(dev))
+      return -2;
+   
+   err = dev_get_relay(dev, relay, relay_state);
+   if (err < -1 && dev_reopen(dev) == 0)
+   {
+      /* Card was replugged, retry on the new device */
+      err = dev_get_relay(dev, relay, relay_state);
+   }
+   if (err == 0)
+      shadow_update(dev, RELAY_BIT(relay), (*relay_state == ON) ? RELAY_BIT(relay) : 0, err);
+   else
+      shadow_update(dev, 0, 0, err);
+   return err;
+}
+
+
+/**********************************************************
+ * Function crelay_dev_set_relay()
+ * 
+ * Description: Set new relay state on an open card
+ * 
+ * Parameters: dev (in)          - handle of the open card
+ *             relay (in)        - relay number
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_dev_set_relay(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
+{
+   int err;
+   
+   if (!dev_is_open(dev))
+      return -2;
+   
+   err = dev_set_relay(dev, relay, relay_state);
+   if (err < -1 && dev_reopen(dev) == 0)
+   {
+      /* Card was replugged, retry on the new device */
+      err = dev_set_relay(dev, relay, relay_state);
+   }
+   if (err == 0)
+      shadow_update(dev, RELAY_BIT(relay), (relay_state == ON) ? RELAY_BIT(relay) : 0, err);
+   else
+      shadow_update(dev, 0, 0, err);
+   return err;
+}
+
+
+/**********************************************************
+ * Internal function dev_get_all_relays()
+ * 
+ * Description: Read all relays with the bulk function of
+ *              the driver, or one by one if the driver has
+ *              none
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+static int dev_get_all_relays(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   relay_state_t rstate;
+   uint64_t start;
+   int err;
+   int i;
+   
+   if (DRV_HAS_GET_ALL(dev->relay_type))
+   {
+      start = metrics_now();
+      err = DRV_GET_ALL(dev->relay_type, dev, relay_states);
+      metrics_observe(&drv_metrics[dev->relay_type][DRV_OP_GET], start, err);
+      return err;
+   }
+   
+   *relay_states = 0;
+   for (i=FIRST_RELAY; i<FIRST_RELAY+dev->num_relays; i++)
+   {
+      if ((err = dev_get_relay(dev, i, &rstate)) < 0)
+         return err;
+      if (rstate == ON) *relay_states |= RELAY_BIT(i);
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function dev_set_relay_mask()
+ * 
+ * Description: Write the relays with the bulk function of
+ *              the driver, or one by one if the driver has
+ *              none
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+static int dev_set_relay_mask(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{
+   uint64_t start;
+   int err;
+   int i;
+   
+   if (relay_mask & ~RELAY_MASK_ALL(dev->num_relays))
+   {
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;
+   }
+   
+   if (DRV_HAS_SET_MASK(dev->relay_type))
+   {
+      start = metrics_now();
+      err = DRV_SET_MASK(dev->relay_type, dev, relay_mask, relay_states);
+      metrics_observe(&drv_metrics[dev->relay_type][DRV_OP_SET], start, err);
+      return err;
+   }
+   
+   for (i=FIRST_RELAY; i<FIRST_RELAY+dev->num_relays; i++)
+   {
+      if (!(relay_mask & RELAY_BIT(i))) continue;
+      if ((err = dev_set_relay(dev, i, (relay_states & RELAY_BIT(i)) ? ON : OFF)) < 0)
+         return err;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function crelay_dev_get_all_relays()
+ * 
+ * Description: Get the current state of all relays of an 
+ *              open card
+ * 
+ * Parameters: dev (in)           - handle of the open card
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_dev_get_all_relays(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   int err;
+   
+   if (!dev_is_open(dev))
+      return -2;
+   
+   err = dev_get_all_relays(dev, relay_states);
+   if (err < -1 && dev_reopen(dev) == 0)
+   {
+      /* Card was replugged, retry on the new device */
+      err = dev_get_all_relays(dev, relay_states);
+   }
+   shadow_update(dev, RELAY_MASK_ALL(dev->num_relays), *relay_states, err);
+   return err;
+}
+
+
+/**********************************************************
+ * Function crelay_dev_set_relay_mask()
+ * 
+ * Description: Set new state of several relays of an open
+ *              card at once
+ * 
+ * Parameters: dev (in)          - handle of the open card
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_dev_set_relay_mask(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{
+   int err;
+   
+   if (!dev_is_open(dev))
+      return -2;
+   
+   err = dev_set_relay_mask(dev, relay_mask, relay_states);
+   if (err < -1 && dev_reopen(dev) == 0)
+   {
+      /* Card was replugged, retry on the new device */
+      err = dev_set_relay_mask(dev, relay_mask, relay_states);
+   }
+   shadow_update(dev, relay_mask, relay_states, err);
+   return err;
+}
+
+
+/**********************************************************
+ * Function crelay_set_state_callback()
+ * 
+ * Description: Register a function which is called whenever
+ *              the known state of relays of an open card
+ *              changes
+ * 
+ * Parameters: cb (in) - callback function (NULL = none)
+ * 
+ * Return:   none
+ *********************************************************/
+void crelay_set_state_callback(void (*cb)(relay_dev_t* dev, relay_mask_t changed))
+{
+   state_cb = cb;
+}
+
+
+/**********************************************************
+ * Function crelay_dev_get_cached_relays()
+ * 
+ * Description: Get the last known state of all relays of an
+ *              open card without accessing the card
+ * 
+ * Parameters: dev (in)           - handle of the open card
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          -1 - fail, states not known yet
+ *********************************************************/
+int crelay_dev_get_cached_relays(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   if (!dev->shadow_valid)
+      return -1;
+   
+   *relay_states = dev->shadow;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function crelay_invalidate_sessions()
+ * 
+ * Description: Close all cached relay card sessions, so
+ *              that the next access probes the cards again
+ *              (e.g. after a card was plugged in or out)
+ * 
+ * Parameters: none
+ * 
+ * Return: none
+ *********************************************************/
+void crelay_invalidate_sessions(void)
+{
+   int i;
+   
+   pthread_mutex_lock(&session_lock);
+   for (i=0; i<MAX_NUM_SESSIONS; i++)
+   {
+      if (sessions[i] != NULL) session_close(sessions[i]);
+   }
+   pthread_mutex_unlock(&session_lock);
+}
+
+
+/**********************************************************
+ * Function crelay_get_relay_card_type()
+ * 
+ * Description: Get the detected relay type
+ * 
+ * Parameters: none
+ * 
+ * Return: relay type
+ *********************************************************/
+relay_type_t crelay_get_relay_card_type()
+{
+   return relay_type;
+}
+
+
+/**********************************************************
+ * Function crelay_get_relay_card_name()
+ * 
+ * Description: Get the relay card name for a relay type
+ * 
+ * Parameters: rtype           - relay type
+ *             card_name (out) - pointer to a string where
+ *                               the detected com port will
+ *                               be stored
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int crelay_get_relay_card_name(relay_type_t rtype, char* card_name)
+{
+   if (rtype > NO_RELAY_TYPE && rtype < LAST_RELAY_TYPE)
+   {
+      strcpy(card_name, DRV_NAME(rtype));
+      return 0;
+   }
+   else
+   {   
+      return -1;
+   }  
+}
+
+
+/**********************************************************
+ * Function crelay_get_relay_card_usb_id()
+ * 
+ * Description: Get the USB vendor and product ID of the
+ *              cards of a relay type
+ * 
+ * Parameters: rtype (in) - relay type
+ *             vid (out)  - USB vendor ID
+ *             pid (out)  - USB product ID
+ * 
+ * Return:   0 - success
+ *          -1 - fail, no USB card or ID not known
+ *********************************************************/
+int crelay_get_relay_card_usb_id(relay_type_t rtype, uint16_t* vid, uint16_t* pid)
+{
+   if (rtype <= NO_RELAY_TYPE || rtype >= LAST_RELAY_TYPE || DRV_USB_VID(rtype) == 0)
+      return -1;
+   
+   *vid = DRV_USB_VID(rtype);
+   *pid = DRV_USB_PID(rtype);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function crelay_mask_format()
+ * 
+ * Description: Write a relay bitmap as hexadecimal number
+ *              with 0x prefix
+ * 
+ * Parameters: buf (out) - output buffer, at least
+ *                         RELAY_MASK_STR_LEN bytes
+ *             size (in) - size of the output buffer
+ *             mask (in) - relay bitmap
+ * 
+ * Return: buf
+ *********************************************************/
+char* crelay_mask_format(char* buf, size_t size, relay_mask_t mask)
+{
+   char digits[MAX_NUM_RELAYS/4];
+   int n=0;
+   
+   /* Digits in reverse order, at least one */
+   do
+   {
+      digits[n++] = "0123456789abcdef"[(unsigned)(mask & 0xf)];
+      mask >>= 4;
+   } while (mask != 0);
+   
+   if (size < (size_t)n+3)
+   {
+      if (size > 0) buf[0] = 0;
+      return buf;
+   }
+   buf[0] = '0';
+   buf[1] = 'x';
+   for (size=2; n>0; size++)
+   {
+      buf[size] = digits[--n];
+   }
+   buf[size] = 0;
+   return buf;
+}
+
+
+/**********************************************************
+ * Function crelay_mask_parse()
+ * 
+ * Description: Read a relay bitmap given as decimal number or
+ *              as hexadecimal number with 0x prefix
+ * 
+ * Parameters: str (in)   - string to read
+ *             end (out)  - first character after the number
+ *                          [optional]
+ *             mask (out) - relay bitmap
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no number or more than MAX_NUM_RELAYS bits
+ *********************************************************/
+int crelay_mask_parse(const char* str, char** end, relay_mask_t* mask)
+{
+   const relay_mask_t max = ~(relay_mask_t)0;
+   const char* p = str;
+   relay_mask_t m=0;
+   unsigned base=10;
+   unsigned d;
+   
+   if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+   {
+      base = 16;
+      p += 2;
+   }
+   for (str=p; ; p++)
+   {
+      if (*p >= '0' && *p <= '9')
+         d = *p - '0';
+      else if (base == 16 && *p >= 'a' && *p <= 'f')
+         d = *p - 'a' + 10;
+      else if (base == 16 && *p >= 'A' && *p <= 'F')
+         d = *p - 'A' + 10;
+      else
+         break;
+      if (m > (max - d) / base)
+         return -1;
+      m = m*base + d;
+   }
+   if (p == str)
+      return -1;
+   
+   if (end != NULL) *end = (char*)p;
+   *mask = m;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function crelay_write_metrics()
+ * 
+ * Description: Write the latency of the driver operations
+ *              in the Prometheus text format
+ * 
+ * Parameters: f (in) - output stream
+ * 
+ * Return: none
+ *********************************************************/
+void crelay_write_metrics(FILE* f)
+{
+   char labels[128];
+   char name[64];
+   int i, op;
+   
+   metrics_write_type(f, "crelay_driver_duration_seconds", "histogram",
+                      "Duration of relay card driver operations");
+   for (i=1; i<LAST_RELAY_TYPE; i++)
+   {
+      for (op=0; op<DRV_NUM_OPS; op++)
+      {
+         /* Drivers which were never used are left out */
+         if (metrics_count(&drv_metrics[i][op]) == 0) continue;
+         snprintf(labels, sizeof(labels), "driver=\"%s\",op=\"%s\"",
+                  metrics_label(name, sizeof(name), DRV_NAME(i)), drv_op_name[op]);
+         metrics_write_hist(f, "crelay_driver_duration_seconds", labels, &drv_metrics[i][op]);
+      }
+   }
+   
+   metrics_write_type(f, "crelay_driver_errors_total", "counter",
+                      "Failed relay card driver operations");
+   for (i=1; i<LAST_RELAY_TYPE; i++)
+   {
+      for (op=DRV_OP_OPEN; op<DRV_NUM_OPS; op++)
+      {
+         if (metrics_count(&drv_metrics[i][op]) == 0) continue;
+         snprintf(labels, sizeof(labels), "driver=\"%s\",op=\"%s\"",
+                  metrics_label(name, sizeof(name), DRV_NAME(i)), drv_op_name[op]);
+         metrics_write_value(f, "crelay_driver_errors_total", labels, metrics_read(&drv_metrics[i][op].errors));
+      }
+   }
 }
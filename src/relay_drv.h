@@ -34,32 +34,71 @@
 #ifndef relay_drv_h
 #define relay_drv_h
 
+#include <stdio.h>
+
 /* Conrad 4 channel USB relay card */
 #define CONRAD_4CHANNEL_USB_NAME       "Conrad USB 4-channel relay card"
 #define CONRAD_4CHANNEL_USB_NUM_RELAYS 4
+#define CONRAD_4CHANNEL_USB_VID        0x10C4
+#define CONRAD_4CHANNEL_USB_PID        0xEA60
 
 /* Sainsmart 4/8 channel USB relay card */
 #define SAINSMART_USB_NAME             "Sainsmart USB 4/8-channel relay card"
 #define SAINSMART_USB_NUM_RELAYS       8
+#define SAINSMART_USB_VID              0x0403
+#define SAINSMART_USB_PID              0x6001
 
 /* HID API compatibe x channel relay card */
 #define HID_API_RELAY_NAME             "HID API compatible relay card"
 #define HID_API_NUM_RELAYS             8
+#define HID_API_USB_VID                0x16c0
+#define HID_API_USB_PID                0x05df
 
 /* Sainsmart HID API compatibe 16-channel relay card */
 #define SAINSMART16_USB_NAME          "Sainsmart USB-HID 16-channel relay card"
 #define SAINSMART16_USB_NUM_RELAYS     16
+#define SAINSMART16_USB_VID            0x0416
+#define SAINSMART16_USB_PID            0x5020
 
 /* Generic GPIO connected relay cards */
 #define GENERIC_GPIO_NAME              "Generic GPIO relays"
 #define GENERIC_GPIO_NUM_RELAYS        8
 
+/* GPIO relays on the memory mapped BCM283x GPIO registers */
+#define GPIOMEM_NAME                   "GPIO register relays"
+#define GPIOMEM_NUM_RELAYS             8
+
+/* GPIO relays on the GPIO character device */
+#define GPIOCHIP_NAME                  "GPIO chardev relays"
+#define GPIOCHIP_NUM_RELAYS            8
+
+#define SIM_NAME                       "Simulated relay card"
+#define SIM_NUM_RELAYS                 8
+
 
 #define FIRST_RELAY    1
-#define MAX_NUM_RELAYS 16
 #define MAX_RELAY_CARD_NAME_LEN 40
 #define MAX_COM_PORT_NAME_LEN 32
 #define MAX_SERIAL_LEN 32
+#define MAX_NUM_SESSIONS 16
+#define MAX_LISTED_CARDS 64
+
+/* Relay state bitmap, bit 0 is the first relay. A single word
+ * wide integer, so that all relays of a device (chained boards,
+ * GPIO expanders) are read and written with one mask operation. */
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 relay_mask_t;
+#define MAX_NUM_RELAYS 128
+#else
+typedef uint64_t relay_mask_t;
+#define MAX_NUM_RELAYS 64
+#endif
+
+#define RELAY_BIT(relay)       ((relay_mask_t)1 << ((relay)-FIRST_RELAY))
+#define RELAY_MASK_ALL(num)    ((num) >= MAX_NUM_RELAYS ? ~(relay_mask_t)0 : RELAY_BIT((num)+FIRST_RELAY)-1)
+
+/* Size of a mask written by crelay_mask_format(), "0x" + hex digits */
+#define RELAY_MASK_STR_LEN     (2 + MAX_NUM_RELAYS/4 + 1)
 
 
 typedef enum
@@ -78,11 +117,22 @@ typedef enum
 #ifdef DRV_SAINSMART16
    SAINSMART16_USB_RELAY_TYPE,     /* Sainsmart USB-HID relay card */
 #endif
+#ifdef DRV_SIM
+   SIM_RELAY_TYPE,                 /* Relay card simulated in memory */
+#endif
    
    /* Add other relay types here */
    
 #ifndef BUILD_LIB
+#ifdef DRV_GPIOMEM
+   GPIOMEM_RELAY_TYPE,             /* Relays connected via memory mapped GPIO */
+#endif
+#ifdef DRV_GPIOCHIP
+   GPIOCHIP_RELAY_TYPE,            /* Relays connected via GPIO character device */
+#endif
+#ifdef DRV_GPIO
    GENERIC_GPIO_RELAY_TYPE,        /* Relays connected directly via GPIO pins */
+#endif
 #endif
    LAST_RELAY_TYPE
 } relay_type_t;
@@ -96,20 +146,49 @@ typedef enum
 }
 relay_state_t;
 
-typedef struct relay_info
+/* Relay card found by crelay_detect_all_relay_cards() */
+typedef struct
 {
-   relay_type_t relay_type;
-   char         serial[MAX_SERIAL_LEN]; 
-   struct relay_info *next;
-} 
+   relay_type_t relay_type;                      /* relay card type */
+   char         serial[MAX_SERIAL_LEN];          /* serial number */
+   char         portname[MAX_COM_PORT_NAME_LEN]; /* communication port */
+   uint8_t      num_relays;                      /* number of relays on the card */
+}
 relay_info_t;
 
+/* Caller owned array of detected cards, filled by the drivers */
 typedef struct
 {
-   int (*detect_relay_card_fun)(char*, uint8_t*, char*, relay_info_t **); /* function to detect the relay card */
-   int (*get_relay_fun)(char*, uint8_t, relay_state_t*, char*); /* function to get the current relay state */
-   int (*set_relay_fun)(char*, uint8_t, relay_state_t, char*);  /* function to set the new relay state */
-   char *card_name;                                           /* card name string */
+   relay_info_t* info;   /* array */
+   int           size;   /* number of elements of the array */
+   int           num;    /* number of cards found, may exceed size */
+}
+relay_list_t;
+
+typedef struct relay_dev
+{
+   relay_type_t relay_type;                      /* relay card type */
+   char         serial[MAX_SERIAL_LEN];          /* serial number requested by the caller ("" = first card found) */
+   char         portname[MAX_COM_PORT_NAME_LEN]; /* communication port found at detection */
+   uint8_t      num_relays;                      /* number of relays on the card */
+   void        *handle;                          /* driver specific handle of the open device */
+   relay_mask_t shadow;                          /* last known relay states */
+   uint8_t      shadow_valid;                    /* shadow holds the states of all relays */
+}
+relay_dev_t;
+
+typedef struct
+{
+   int  (*detect_relay_card_fun)(char*, uint8_t*, char*, relay_list_t*); /* function to detect the relay card */
+   int  (*open_relay_card_fun)(relay_dev_t*);                    /* function to open the relay card (optional) */
+   void (*close_relay_card_fun)(relay_dev_t*);                   /* function to close the relay card (optional) */
+   int  (*get_relay_fun)(relay_dev_t*, uint8_t, relay_state_t*); /* function to get the current relay state */
+   int  (*set_relay_fun)(relay_dev_t*, uint8_t, relay_state_t);  /* function to set the new relay state */
+   int  (*get_all_relays_fun)(relay_dev_t*, relay_mask_t*);       /* function to get the state of all relays (optional) */
+   int  (*set_relay_mask_fun)(relay_dev_t*, relay_mask_t, relay_mask_t); /* function to set several relays at once (optional) */
+   char *card_name;                                             /* card name string */
+   uint16_t usb_vid;                                            /* USB vendor ID (0 = no USB device) */
+   uint16_t usb_pid;                                            /* USB product ID */
 }
 relay_data_t;
 
@@ -120,18 +199,54 @@ relay_data_t;
  * 
  * Description: Detect all relay cards
  * 
- * Parameters: relay_info(out)- pointer to list of 
- *                              relays info struct
+ * Parameters: info (out) - array for the detected cards
+ *             size (in)  - number of elements of the array
  * 
- * Return:  0 - success
+ * Return:  number of cards found, only the first size
+ *          cards are stored if there are more
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int crelay_detect_all_relay_cards(relay_info_t* info, int size);
+
+/**********************************************************
+ * Function crelay_detect_relay_cards()
+ * 
+ * Description: Detect the relay cards of one type
+ * 
+ * Parameters: rtype (in) - relay type
+ *             info (out) - array for the detected cards
+ *             size (in)  - number of elements of the array
+ * 
+ * Return:  number of cards found, only the first size
+ *          cards are stored if there are more
  *         -1 - fail, no relay card found
  *********************************************************/
-int crelay_detect_all_relay_cards(relay_info_t** relay_info);
+int crelay_detect_relay_cards(relay_type_t rtype, relay_info_t* info, int size);
+
+/**********************************************************
+ * Function crelay_list_add()
+ * 
+ * Description: Add a card to the list of detected cards,
+ *              called by the drivers when all cards are
+ *              listed
+ * 
+ * Parameters: list (in/out)   - list of detected cards
+ *             rtype (in)      - relay type
+ *             serial (in)     - serial number
+ *             portname (in)   - communication port
+ *             num_relays (in) - number of relays
+ * 
+ * Return:   0 - success
+ *          -1 - list full, the card is only counted
+ *********************************************************/
+int crelay_list_add(relay_list_t* list, relay_type_t rtype, const char* serial, const char* portname, uint8_t num_relays);
 
 /**********************************************************
  * Function crelay_detect_relay_card()
  * 
- * Description: Detect the relay card
+ * Description: Detect the relay card. The card is kept 
+ *              open in a session cache, so only the first
+ *              call for a serial number probes the bus.
  * 
  * Parameters: portname (out) - pointer to a string where
  *                              the detected com port will
@@ -141,7 +256,7 @@ int crelay_detect_all_relay_cards(relay_info_t** relay_info);
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int crelay_detect_relay_card(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info);
+int crelay_detect_relay_card(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list);
 
 /**********************************************************
  * Function crelay_get_relay()
@@ -171,6 +286,170 @@ int crelay_get_relay(char* portname, uint8_t relay, relay_state_t* relay_state,
  *********************************************************/
 int crelay_set_relay(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
 
+/**********************************************************
+ * Function crelay_get_all_relays()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: portname (in)      - communication port
+ *             relay_states (out) - bitmap of relay states
+ *             serial (in)        - serial number [optional]
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_get_all_relays(char* portname, relay_mask_t* relay_states, char* serial);
+
+/**********************************************************
+ * Function crelay_set_relay_mask()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: portname (in)     - communication port
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ *             serial (in)       - serial number [optional]
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_set_relay_mask(char* portname, relay_mask_t relay_mask, relay_mask_t relay_states, char* serial);
+
+/**********************************************************
+ * Function crelay_open()
+ * 
+ * Description: Detect a relay card and open it. The returned
+ *              handle stays open until crelay_close() is
+ *              called, so relay operations on it don't need
+ *              to open and claim the device each time.
+ *              Different handles can be used from different
+ *              threads (see dev_worker.h). The functions
+ *              taking a serial number are thread safe too,
+ *              their transfers for different cards don't wait
+ *              for each other.
+ * 
+ * Parameters: serial (in) - serial number of the card
+ *                           (NULL = first card found)
+ * 
+ * Return:  handle of the open card
+ *          NULL - fail, no relay card found
+ *********************************************************/
+relay_dev_t* crelay_open(char* serial);
+
+/**********************************************************
+ * Function crelay_close()
+ * 
+ * Description: Close a relay card opened with crelay_open()
+ * 
+ * Parameters: dev (in) - handle of the open card
+ * 
+ * Return: none
+ *********************************************************/
+void crelay_close(relay_dev_t* dev);
+
+/**********************************************************
+ * Function crelay_dev_get_relay()
+ * 
+ * Description: Get the current relay state of an open card
+ * 
+ * Parameters: dev (in)          - handle of the open card
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_dev_get_relay(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state);
+
+/**********************************************************
+ * Function crelay_dev_set_relay()
+ * 
+ * Description: Set new relay state on an open card
+ * 
+ * Parameters: dev (in)          - handle of the open card
+ *             relay (in)        - relay number
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_dev_set_relay(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state);
+
+/**********************************************************
+ * Function crelay_dev_get_all_relays()
+ * 
+ * Description: Get the current state of all relays of an 
+ *              open card
+ * 
+ * Parameters: dev (in)           - handle of the open card
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_dev_get_all_relays(relay_dev_t* dev, relay_mask_t* relay_states);
+
+/**********************************************************
+ * Function crelay_dev_set_relay_mask()
+ * 
+ * Description: Set new state of several relays of an open
+ *              card at once
+ * 
+ * Parameters: dev (in)          - handle of the open card
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int crelay_dev_set_relay_mask(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states);
+
+/**********************************************************
+ * Function crelay_set_state_callback()
+ * 
+ * Description: Register a function which is called whenever
+ *              the known state of relays of an open card
+ *              changes, i.e. by a write or by a read which
+ *              found a different state. It is called from
+ *              the thread accessing the card.
+ * 
+ * Parameters: cb (in) - callback function (NULL = none), gets
+ *                       the card and the bitmap of changed
+ *                       relays
+ * 
+ * Return:   none
+ *********************************************************/
+void crelay_set_state_callback(void (*cb)(relay_dev_t* dev, relay_mask_t changed));
+
+/**********************************************************
+ * Function crelay_dev_get_cached_relays()
+ * 
+ * Description: Get the last known state of all relays of an
+ *              open card without accessing the card. The
+ *              states are updated by every successful read
+ *              or write on the handle.
+ * 
+ * Parameters: dev (in)           - handle of the open card
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          -1 - fail, states not known yet
+ *********************************************************/
+int crelay_dev_get_cached_relays(relay_dev_t* dev, relay_mask_t* relay_states);
+
+/**********************************************************
+ * Function crelay_invalidate_sessions()
+ * 
+ * Description: Close all cached relay card sessions, so
+ *              that the next access probes the cards again
+ *              (e.g. after a card was plugged in or out)
+ * 
+ * Parameters: none
+ * 
+ * Return: none
+ *********************************************************/
+void crelay_invalidate_sessions(void);
+
 /**********************************************************
  * Function crelay_get_relay_card_type()
  * 
@@ -193,5 +472,65 @@ relay_type_t crelay_get_relay_card_type();
  *********************************************************/
 int crelay_get_relay_card_name(relay_type_t rtype, char* card_name);
 
+/**********************************************************
+ * Function crelay_get_relay_card_usb_id()
+ * 
+ * Description: Get the USB vendor and product ID of the
+ *              cards of a relay type
+ * 
+ * Parameters: rtype (in) - relay type
+ *             vid (out)  - USB vendor ID
+ *             pid (out)  - USB product ID
+ * 
+ * Return:   0 - success
+ *          -1 - fail, no USB card or ID not known
+ *********************************************************/
+int crelay_get_relay_card_usb_id(relay_type_t rtype, uint16_t* vid, uint16_t* pid);
+
+/**********************************************************
+ * Function crelay_mask_format()
+ * 
+ * Description: Write a relay bitmap as hexadecimal number
+ *              with 0x prefix
+ * 
+ * Parameters: buf (out) - output buffer, at least
+ *                         RELAY_MASK_STR_LEN bytes
+ *             size (in) - size of the output buffer
+ *             mask (in) - relay bitmap
+ * 
+ * Return: buf
+ *********************************************************/
+char* crelay_mask_format(char* buf, size_t size, relay_mask_t mask);
+
+/**********************************************************
+ * Function crelay_mask_parse()
+ * 
+ * Description: Read a relay bitmap given as decimal number or
+ *              as hexadecimal number with 0x prefix
+ * 
+ * Parameters: str (in)   - string to read
+ *             end (out)  - first character after the number
+ *                          [optional]
+ *             mask (out) - relay bitmap
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no number or more than MAX_NUM_RELAYS bits
+ *********************************************************/
+int crelay_mask_parse(const char* str, char** end, relay_mask_t* mask);
+
+/**********************************************************
+ * Function crelay_write_metrics()
+ * 
+ * Description: Write the latency and error counts of the
+ *              driver operations (detect, open, get, set)
+ *              of each relay card type in the Prometheus
+ *              text format
+ * 
+ * Parameters: f (in) - output stream
+ * 
+ * Return: none
+ *********************************************************/
+void crelay_write_metrics(FILE* f);
+
 #endif
 
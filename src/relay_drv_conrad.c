@@ -79,13 +79,16 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <libusb-1.0/libusb.h>
 
 #include "relay_drv.h"
+#include "relay_drv_conrad.h"
 
 /* USB IDs */
-#define VENDOR_ID 0x10C4
-#define DEVICE_ID 0xEA60
+#define VENDOR_ID CONRAD_4CHANNEL_USB_VID
+#define DEVICE_ID CONRAD_4CHANNEL_USB_PID
 
 /* Config request types */
 #define REQTYPE_HOST_TO_DEVICE  0x40
@@ -100,8 +103,142 @@
 
 #define RSTATES_BITOFFSET 8
 
+/* Max time for a control transfer to complete */
+#define TRANSFER_TIMEOUT 1000 /* ms */
 
-//static libusb_device *device;
+/* Context of the open cards, its events are handled by a
+ * thread shared by all cards */
+static libusb_context *usb_ctx = NULL;
+static pthread_once_t usb_once = PTHREAD_ONCE_INIT;
+
+
+/**********************************************************
+ * Internal function usb_event_thread()
+ * 
+ * Description: Handle the transfer completions of all cards
+ * 
+ * Parameters: arg (in) - unused
+ * 
+ * Return:     never returns
+ *********************************************************/
+static void* usb_event_thread(void* arg)
+{
+   while (1)
+   {
+      libusb_handle_events(usb_ctx);
+   }
+   return NULL;
+}
+
+
+/**********************************************************
+ * Internal function usb_init()
+ * 
+ * Description: Create the context of the open cards and
+ *              start its event thread (called once)
+ * 
+ * Parameters: none
+ * 
+ * Return:     none
+ *********************************************************/
+static void usb_init(void)
+{
+   pthread_t thread;
+   
+   if (libusb_init(&usb_ctx) != 0)
+   {
+      usb_ctx = NULL;
+      return;
+   }
+   if (pthread_create(&thread, NULL, usb_event_thread, NULL) != 0)
+   {
+      libusb_exit(usb_ctx);
+      usb_ctx = NULL;
+      return;
+   }
+   pthread_detach(thread);
+}
+
+
+/**********************************************************
+ * Internal function transfer_done()
+ * 
+ * Description: Completion callback of a control transfer,
+ *              wakes up the thread waiting for it
+ * 
+ * Parameters: transfer (in) - completed transfer
+ * 
+ * Return:     none
+ *********************************************************/
+static void transfer_done(struct libusb_transfer *transfer)
+{
+   sem_post(transfer->user_data);
+}
+
+
+/**********************************************************
+ * Internal function control_transfer()
+ * 
+ * Description: Submit a vendor specific control transfer
+ *              and wait for its completion. The transfers
+ *              of different cards are in flight at the same
+ *              time and complete in the event thread.
+ * 
+ * Parameters: handle (in)   - device handle
+ *             reqtype (in)  - request type
+ *             value (in)    - wValue
+ *             index (in)    - wIndex
+ *             data (in/out) - data stage (max 1 byte)
+ *             len (in)      - length of the data stage
+ * 
+ * Return:     number of bytes transferred
+ *             libusb error code on failure
+ *********************************************************/
+static int control_transfer(libusb_device_handle *handle, uint8_t reqtype, uint16_t value, uint16_t index, uint8_t *data, uint16_t len)
+{
+   unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + 1];
+   struct libusb_transfer *transfer;
+   sem_t done;
+   int r;
+   
+   if (len > 1)
+      return LIBUSB_ERROR_INVALID_PARAM;
+   if ((transfer = libusb_alloc_transfer(0)) == NULL)
+      return LIBUSB_ERROR_NO_MEM;
+   
+   libusb_fill_control_setup(buf, reqtype, CP210X_VENDOR_SPECIFIC, value, index, len);
+   if (reqtype == REQTYPE_HOST_TO_DEVICE && len > 0)
+      memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+   sem_init(&done, 0, 0);
+   libusb_fill_control_transfer(transfer, handle, buf, transfer_done, &done, TRANSFER_TIMEOUT);
+   
+   if ((r = libusb_submit_transfer(transfer)) == 0)
+   {
+      while (sem_wait(&done) != 0 && errno == EINTR);
+      switch (transfer->status)
+      {
+         case LIBUSB_TRANSFER_COMPLETED:
+            r = transfer->actual_length;
+            if (r < len)
+               r = LIBUSB_ERROR_IO;
+            else if (reqtype == REQTYPE_DEVICE_TO_HOST && r > 0)
+               memcpy(data, libusb_control_transfer_get_data(transfer), r);
+            break;
+         case LIBUSB_TRANSFER_TIMED_OUT:
+            r = LIBUSB_ERROR_TIMEOUT;
+            break;
+         case LIBUSB_TRANSFER_NO_DEVICE:
+            r = LIBUSB_ERROR_NO_DEVICE;
+            break;
+         default:
+            r = LIBUSB_ERROR_IO;
+      }
+   }
+   
+   sem_destroy(&done);
+   libusb_free_transfer(transfer);
+   return r;
+}
 
 
 /**********************************************************
@@ -110,14 +247,15 @@
  * Description: Tries to open a device with given VIP, PID 
  *              and serial number
  * 
- * Parameters: vendorid (in)   - Vendor Id
+ * Parameters: ctx (in)        - libusb context
+ *             vendorid (in)   - Vendor Id
  *             productid (in)  - Product Id
  *             serial (in/out) - Serial number
  * 
  * Return:     NULL - fail, no matching device found
  *             device handle otherwise
  *********************************************************/
-static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid, uint16_t productid, char *serial, relay_info_t **relay_info)
+static libusb_device_handle* open_device_with_vid_pid_serial(libusb_context *ctx, uint16_t vendorid, uint16_t productid, char *serial, relay_list_t *relay_list)
 {
    int r;
    ssize_t devnum;
@@ -126,10 +264,10 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
    unsigned char sernum[64];
    struct libusb_device_handle *dev = NULL;
    struct libusb_device_descriptor devdesc;
-   relay_info_t* rinfo;
+   char portname[MAX_COM_PORT_NAME_LEN];
 
    // Get a list of all connected USB devices
-   devnum = libusb_get_device_list(NULL, &devices);
+   devnum = libusb_get_device_list(ctx, &devices);
    if (devnum <= LIBUSB_SUCCESS)
    {
       if (devnum == LIBUSB_SUCCESS)
@@ -168,9 +306,10 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
       }
       
       // If serial number was not specified, return handle to first device found
-      if ((serial == NULL) && (relay_info == NULL))
+      if ((serial == NULL) && (relay_list == NULL))
       {
          //printf("Device %d; return dev\n", i);
+         libusb_free_device_list(devices, 1);
          return dev;
       }
       
@@ -185,26 +324,21 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
       }
       
       // Return serial number of first device
-      if ((serial[0] == 0) && (relay_info == NULL))
+      if ((serial[0] == 0) && (relay_list == NULL))
       {
          //printf("Device %d; return serial\n", i);
          strcpy(serial, (char *)sernum);
+         libusb_free_device_list(devices, 1);
          return dev;
       }
 
-      if (relay_info != NULL)
+      if (relay_list != NULL)
       {
          //printf("Device %d; save serial\n", i);
-         // Save serial number and type in current relay info struct
-         (*relay_info)->relay_type = CONRAD_4CHANNEL_USB_RELAY_TYPE;
-         strcpy((*relay_info)->serial, (char *)sernum);
-         // Allocate new struct
-         rinfo = malloc(sizeof(relay_info_t));
-         rinfo->next = NULL;
-         // Link current to new struct
-         (*relay_info)->next = rinfo;
-         // Move pointer to new struct
-         *relay_info = rinfo;
+         // Save serial number, port and type in the list
+         snprintf(portname, sizeof(portname), "Serial number %s", (char *)sernum);
+         crelay_list_add(relay_list, CONRAD_4CHANNEL_USB_RELAY_TYPE, (char *)sernum, portname,
+                         CONRAD_4CHANNEL_USB_NUM_RELAYS);
       }
       else
       {
@@ -212,6 +346,7 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
          //printf("Device %d; check serial\n", i);
          if (!strcmp(serial, (char *)sernum))
          {
+            libusb_free_device_list(devices, 1);
             return dev;
          }
       }
@@ -238,7 +373,7 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_conrad_4chan(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info)
+int detect_relay_card_conrad_4chan(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
 {
    struct libusb_device_handle *dev = NULL; 
    char sernum[64];
@@ -251,7 +386,7 @@ int detect_relay_card_conrad_4chan(char* portname, uint8_t* num_relays, char* se
    libusb_init(NULL);
 
    /* Try to open Conrad CP2104 USB device */
-   dev = open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, sernum, relay_info);
+   dev = open_device_with_vid_pid_serial(NULL, VENDOR_ID, DEVICE_ID, sernum, relay_list);
    if (dev == NULL)
    {
       libusb_exit(NULL);
@@ -271,23 +406,73 @@ int detect_relay_card_conrad_4chan(char* portname, uint8_t* num_relays, char* se
 }
 
 
+/**********************************************************
+ * Function open_relay_card_conrad_4chan()
+ * 
+ * Description: Open the Conrad USB relay card and keep the
+ *              libusb device handle
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int open_relay_card_conrad_4chan(relay_dev_t* dev)
+{
+   struct libusb_device_handle *usbdev = NULL; 
+   
+   pthread_once(&usb_once, usb_init);
+   if (usb_ctx == NULL)
+   {
+      fprintf(stderr, "unable to init libusb\n");
+      return -2;
+   }
+   
+   /* Open USB device */
+   usbdev = open_device_with_vid_pid_serial(usb_ctx, VENDOR_ID, DEVICE_ID, dev->serial[0] ? dev->serial : NULL, NULL);
+   if (usbdev == NULL)
+   {
+      fprintf(stderr, "unable to open CP2104 device\n");
+      return -2;
+   }
+   
+   dev->handle = usbdev;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function close_relay_card_conrad_4chan()
+ * 
+ * Description: Close the Conrad USB relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_conrad_4chan(relay_dev_t* dev)
+{
+   libusb_close(dev->handle);
+   dev->handle = NULL;
+}
+
+
 /**********************************************************
  * Function get_relay_conrad_4chan()
  * 
  * Description: Get the current relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (out) - current relay state
  * 
  * Return:   0 - success
  *          -1 - fail
  *********************************************************/
-int get_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
+int get_relay_conrad_4chan(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
 {
-   struct libusb_device_handle *dev = NULL; 
-   int r;  
-   uint8_t gpio=0;
+   relay_mask_t states;
+   int r;
    
    if (relay<FIRST_RELAY || relay>(FIRST_RELAY+CONRAD_4CHANNEL_USB_NUM_RELAYS-1))
    {  
@@ -295,43 +480,10 @@ int get_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t* relay_s
       return -1;      
    }
 
-   libusb_init(NULL);
-   
-   /* Open USB device */
-   //r = libusb_open(device, &dev);
-   //if (r < 0)
-   dev = open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, serial, NULL);
-   if (dev == NULL)
-   {
-      fprintf(stderr, "unable to open CP2104 device\n");
-      libusb_exit(NULL);
-      return -2;
-   }
+   if ((r = get_all_relays_conrad_4chan(dev, &states)) < 0)
+      return r;
    
-   /* Get relay state from the card */ 
-   r = libusb_control_transfer (
-                dev,                    // libusb_device_handle *  dev_handle,
-                REQTYPE_DEVICE_TO_HOST, // uint8_t         bmRequestType,
-                CP210X_VENDOR_SPECIFIC, // uint8_t         bRequest,
-                CP210X_READ_LATCH,      // uint16_t        wValue,
-                0,                      // uint16_t        wIndex,
-                &gpio,                  // unsigned char * data,
-                1,                      // uint16_t        wLength,
-                0);                     // unsigned int    timeout
-
-   if (r < 0) 
-   {
-      fprintf(stderr, "libusb_control_transfer error (%s)\n", libusb_error_name(r));
-      libusb_close(dev);
-      libusb_exit(NULL);
-      return -3;
-   }
-
-   relay = relay-1;
-   *relay_state = (gpio & (0x0001<<relay)) ? OFF : ON;
-      
-   libusb_close(dev);
-   libusb_exit(NULL);
+   *relay_state = (states & RELAY_BIT(relay)) ? ON : OFF;
    return 0;
 }
 
@@ -341,65 +493,84 @@ int get_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t* relay_s
  * 
  * Description: Set new relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (in)  - current relay state
  * 
  * Return:   o - success
  *          -1 - fail
  *********************************************************/
-int set_relay_conrad_4chan(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
+int set_relay_conrad_4chan(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
 {
-   struct libusb_device_handle *dev = NULL; 
-   int r;  
-   uint16_t gpio=0;
-   
    if (relay<FIRST_RELAY || relay>(FIRST_RELAY+CONRAD_4CHANNEL_USB_NUM_RELAYS-1))
    {  
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
    
-   libusb_init(NULL);
+   return set_relay_mask_conrad_4chan(dev, RELAY_BIT(relay), (relay_state == OFF) ? 0 : RELAY_BIT(relay));
+}
+
+
+/**********************************************************
+ * Function get_all_relays_conrad_4chan()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_conrad_4chan(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   int r;  
+   uint8_t gpio=0;
    
-   /* Open USB device */
-   //r = libusb_open(device, &dev);
-   //if (r < 0)
-   dev = open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, serial, NULL);
-   if (dev == NULL)
+   /* Get relay state from the card */ 
+   r = control_transfer(dev->handle, REQTYPE_DEVICE_TO_HOST, CP210X_READ_LATCH, 0, &gpio, 1);
+   if (r < 0) 
    {
-      fprintf(stderr, "unable to open CP2104 device\n");
-      libusb_exit(NULL);
-      return -2;
+      fprintf(stderr, "libusb control transfer error (%s)\n", libusb_error_name(r));
+      return -3;
    }
+
+   /* Latch bits are active low */
+   *relay_states = ~gpio & RELAY_MASK_ALL(CONRAD_4CHANNEL_USB_NUM_RELAYS);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_conrad_4chan()
+ * 
+ * Description: Set new state of several relays at once. The
+ *              CP2104 latch takes a bit mask, so this is a
+ *              single control transfer.
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_conrad_4chan(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{
+   int r;  
+   uint16_t gpio=0;
    
-   /* Set the relay state bit */
-   relay = relay-1;
-   if (relay_state == OFF) gpio = 0x0001<<(relay+RSTATES_BITOFFSET);
-   
-   /* Set the relay bit mask */
-   gpio = gpio | (0x0001<<relay);
+   /* Set the relay state bits (1 = off) and the relay bit mask */
+   gpio = ((relay_mask & ~relay_states) << RSTATES_BITOFFSET) | relay_mask;
 
    /* Set relay state on the card */ 
-   r = libusb_control_transfer (
-                dev,                    // libusb_device_handle *  dev_handle,
-                REQTYPE_HOST_TO_DEVICE, // uint8_t         bmRequestType,
-                CP210X_VENDOR_SPECIFIC, // uint8_t         bRequest,
-                CP210X_WRITE_LATCH,     // uint16_t        wValue,
-                gpio,                   // uint16_t        wIndex,
-                NULL,                   // unsigned char * data,
-                0,                      // uint16_t        wLength,
-                0);                     // unsigned int    timeout
-   
+   r = control_transfer(dev->handle, REQTYPE_HOST_TO_DEVICE, CP210X_WRITE_LATCH, gpio, NULL, 0);
    if (r < 0) 
    {
-      fprintf(stderr, "libusb_control_transfer error (%s)\n", libusb_error_name(r));
-      libusb_close(dev);
-      libusb_exit(NULL);
+      fprintf(stderr, "libusb control transfer error (%s)\n", libusb_error_name(r));
       return -3;
    }
-
-   libusb_close(dev);
-   libusb_exit(NULL);
+   
    return 0;
 }
@@ -45,6 +45,7 @@
 
 #include "data_types.h"
 #include "relay_drv.h"
+#include "relay_drv_gpio.h"
 
 /* GPIO sysfs file definitions */
 #define GPIO_BASE_DIR  "/sys/class/gpio/"
@@ -53,25 +54,15 @@
 #define GPIO_BASE_FILE GPIO_BASE_DIR"gpio"
 
 
-static uint16_t pins[] =
-{
-  0, // dummy
-  0, // pin 1
-  0, // pin 2
-  0, // pin 3
-  0, // pin 4
-  0, // pin 5
-  0, // pin 6
-  0, // pin 7
-  0  // pin 8
-};
+/* GPIO pin of each relay, index 0 is unused */
+static uint16_t pins[MAX_NUM_RELAYS+1];
 
 static uint8_t g_num_relays=GENERIC_GPIO_NUM_RELAYS;
 static uint8_t g_active_value=1;
 
 extern config_t config;
 
-int set_relay_generic_gpio(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
+static int write_pin_value(uint16_t pin, relay_state_t relay_state);
 
 /**********************************************************
  * Internal function do_export()
@@ -118,7 +109,8 @@ static int do_export(uint16_t pin)
       }
       close(fd);
       
-      /* Set gpio direction to "out" */
+      /* Set gpio direction to "out", with the level of the relay
+       * switched off in the same write to avoid a glitch */
       snprintf(b, sizeof(b), "%s%d/direction", GPIO_BASE_FILE, pin);
       fd = open(b, O_WRONLY);
       if (fd < 0) 
@@ -126,7 +118,7 @@ static int do_export(uint16_t pin)
          fprintf(stderr, "Open %s: %s\n", b, strerror(errno));
          return -1;
       }
-      if (pwrite(fd, "out", 4, 0) < 0) 
+      if (pwrite(fd, (g_active_value == 0) ? "high" : "low", (g_active_value == 0) ? 4 : 3, 0) < 0) 
       {
          fprintf(stderr, "Unable to pwrite to gpio direction for pin %d: %s\n",
                  pin, strerror(errno));
@@ -191,7 +183,7 @@ static int do_unexport(uint16_t pin)
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_generic_gpio(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info)
+int detect_relay_card_generic_gpio(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
 {
    int fd;
    int i;
@@ -213,31 +205,85 @@ int detect_relay_card_generic_gpio(char* portname, uint8_t* num_relays, char* se
    g_active_value = config.gpio_active_value;
    
    /* Get pin numbers from config */
-   pins[1] = config.relay1_gpio_pin;
-   pins[2] = config.relay2_gpio_pin;
-   pins[3] = config.relay3_gpio_pin;
-   pins[4] = config.relay4_gpio_pin;
-   pins[5] = config.relay5_gpio_pin;
-   pins[6] = config.relay6_gpio_pin;
-   pins[7] = config.relay7_gpio_pin;
-   pins[8] = config.relay8_gpio_pin;
+   for (i=FIRST_RELAY; i<=g_num_relays; i++)
+   {
+      pins[i] = config.relay_gpio_pin[i-FIRST_RELAY];
+   }
    
    /* Check if necessary pin numbers are defined */
    for (i=1; i<=g_num_relays; i++)
    {
-      if (pins[i]==0) return -1;
+      if (pins[i]==0) 
+      {
+         close(fd);
+         return -1;
+      }
    }
    
-   /* Init GPIO pins */
+   /* Init GPIO pins, pins already exported keep their level */
    for (i=1; i<=g_num_relays; i++)
    {
-      if (do_export(pins[i]) == 0)
-         set_relay_generic_gpio(NULL, i, OFF, NULL);
+      do_export(pins[i]);
    }
    
    /* Return parameters */
    if (num_relays!=NULL) *num_relays = g_num_relays; 
-   strcpy(portname, GPIO_BASE_DIR);
+   if (portname!=NULL) strcpy(portname, GPIO_BASE_DIR);
+   close(fd);
+   
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function write_pin_value()
+ * 
+ * Description: Write the value for a relay state to the
+ *              GPIO pin
+ * 
+ * Parameters: pin (in)          - GPIO pin number
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          -1 - invalid configuration
+ *          -2 - I/O error
+ *********************************************************/
+static int write_pin_value(uint16_t pin, relay_state_t relay_state)
+{
+   int fd;
+   char b[64];
+   char d[1];
+   
+   switch (g_active_value)
+   {
+      case 0: // active low relay
+         d[0] = (relay_state == OFF ? '1' : '0');
+         break;
+      case 1: // active high relay
+         d[0] = (relay_state == ON ? '1' : '0');
+         break;
+      default:
+         fprintf(stderr, "ERROR: Invalid active pin value configured: %d\n",
+                         g_active_value);
+         return -1;
+   }
+      
+   /* Set new gpio value */
+   snprintf(b, sizeof(b), "%s%d/value", GPIO_BASE_FILE, pin);
+   fd = open(b, O_RDWR);
+   if (fd < 0) 
+   {
+      fprintf(stderr, "ERROR: Open %s: %s\n", b, strerror(errno));
+      return -2;
+   }
+   
+   if (pwrite(fd, d, 1, 0) != 1) 
+   {
+      fprintf(stderr, "ERROR: Unable to pwrite %c to gpio value: %s\n",
+                       d[0], strerror(errno));
+      close(fd);
+      return -2;
+   }
    close(fd);
    
    return 0;
@@ -249,14 +295,14 @@ int detect_relay_card_generic_gpio(char* portname, uint8_t* num_relays, char* se
  * 
  * Description: Get the current relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (out) - current relay state
  * 
  * Return:   0 - success
- *          -1 - fail
+ *          <0 - fail
  *********************************************************/
-int get_relay_generic_gpio(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
+int get_relay_generic_gpio(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
 {
    int fd;
    char b[64];
@@ -278,13 +324,14 @@ int get_relay_generic_gpio(char* portname, uint8_t relay, relay_state_t* relay_s
    if (fd < 0) 
    {
       fprintf(stderr, "ERROR: Open %s: %s\n", b, strerror(errno));
-      return -1;
+      return -2;
    }
    if (pread(fd, d, 1, 0) != 1) 
    {
       fprintf(stderr, "ERROR: Unable to pread gpio value: %s\n",
                        strerror(errno));
-      return -1;
+      close(fd);
+      return -2;
    }
    close(fd);
    
@@ -312,59 +359,78 @@ int get_relay_generic_gpio(char* portname, uint8_t relay, relay_state_t* relay_s
  * 
  * Description: Set the new relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (in)  - new relay state
  * 
  * Return:   0 - success
- *          -1 - fail
+ *          <0 - fail
  *********************************************************/
-int set_relay_generic_gpio(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
+int set_relay_generic_gpio(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
 {
-   int fd;
-   char b[64];
-   char d[1];
-   uint16_t pin;
-   
    if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
    {
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;
    }
  
-   /* Get pin number */
-   pin=pins[relay];
+   return write_pin_value(pins[relay], relay_state);
+}
+
+
+/**********************************************************
+ * Function get_all_relays_generic_gpio()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_generic_gpio(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   relay_state_t rstate;
+   int err;
+   int i;
    
-   /* Set new gpio value */
-   snprintf(b, sizeof(b), "%s%d/value", GPIO_BASE_FILE, pin);
-   fd = open(b, O_RDWR);
-   if (fd < 0) 
+   /* sysfs has one value file per pin, read them one by one */
+   *relay_states = 0;
+   for (i=FIRST_RELAY; i<=g_num_relays; i++)
    {
-      fprintf(stderr, "ERROR: Open %s: %s\n", b, strerror(errno));
-      return -1;
+      if ((err = get_relay_generic_gpio(dev, i, &rstate)) < 0)
+         return err;
+      if (rstate == ON) *relay_states |= RELAY_BIT(i);
    }
    
-   switch (g_active_value)
-   {
-      case 0: // active low relay
-         d[0] = (relay_state == OFF ? '1' : '0');
-         break;
-      case 1: // active high relay
-         d[0] = (relay_state == ON ? '1' : '0');
-         break;
-      default:
-         fprintf(stderr, "ERROR: Invalid active pin value configured: %d\n",
-                         g_active_value);
-         return -1;
-   }
-      
-   if (pwrite(fd, d, 1, 0) != 1) 
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_generic_gpio()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_generic_gpio(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{
+   int err;
+   int i;
+   
+   for (i=FIRST_RELAY; i<=g_num_relays; i++)
    {
-      fprintf(stderr, "ERROR: Unable to pwrite %c to gpio value: %s\n",
-                       d[0], strerror(errno));
-      return -1;
+      if (!(relay_mask & RELAY_BIT(i))) continue;
+      err = write_pin_value(pins[i], (relay_states & RELAY_BIT(i)) ? ON : OFF);
+      if (err < 0) return err;
    }
-   close(fd);
    
    return 0;
 }
@@ -47,34 +47,61 @@
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_generic_gpio(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info);
+int detect_relay_card_generic_gpio(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list);
 
 /**********************************************************
  * Function get_relay_generic_gpio()
  * 
  * Description: Get the current relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (out) - current relay state
  * 
  * Return:   0 - success
- *          -1 - fail
+ *          <0 - fail
  *********************************************************/
-int get_relay_generic_gpio(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial);
+int get_relay_generic_gpio(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state);
 
 /**********************************************************
  * Function set_relay_generic_gpio()
  * 
  * Description: Set the new relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (in)  - new relay state
  * 
  * Return:   0 - success
- *          -1 - fail
+ *          <0 - fail
  *********************************************************/
-int set_relay_generic_gpio(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
+int set_relay_generic_gpio(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state);
+
+/**********************************************************
+ * Function get_all_relays_generic_gpio()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_generic_gpio(relay_dev_t* dev, relay_mask_t* relay_states);
+
+/**********************************************************
+ * Function set_relay_mask_generic_gpio()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_generic_gpio(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states);
 
 #endif
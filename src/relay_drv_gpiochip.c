@@ -0,0 +1,392 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Driver for GPIO character device relays
+ *
+ * Description:
+ *   This software is used to control the relays connected via GPIO pins
+ *   using the GPIO character device (v2 uAPI).
+ *   This file contains the implementation of the specific functions.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "data_types.h"
+#include "relay_drv.h"
+#include "relay_drv_gpiochip.h"
+
+#define GPIOCHIP_CONSUMER "crelay"
+
+/* The line values of a request are a 64 bit bitmap */
+#if MAX_NUM_RELAYS < GPIO_V2_LINES_MAX
+#define GPIOCHIP_MAX_RELAYS MAX_NUM_RELAYS
+#else
+#define GPIOCHIP_MAX_RELAYS GPIO_V2_LINES_MAX
+#endif
+
+/* Line offsets on the GPIO chip, index 0 is relay 1 */
+static uint32_t offsets[GPIOCHIP_MAX_RELAYS];
+
+static uint8_t g_num_relays=GPIOCHIP_NUM_RELAYS;
+static uint8_t g_active_value=1;
+static char g_chip[MAX_COM_PORT_NAME_LEN]=GPIOCHIP_DEFAULT_DEV;
+
+extern config_t config;
+
+/* Driver handle: requested lines */
+typedef struct
+{
+   int fd;
+} gpiochip_t;
+
+
+/**********************************************************
+ * Function detect_relay_card_gpiochip()
+ * 
+ * Description: Detect if the configured GPIO chip is
+ *              available and provides all relay lines
+ * 
+ * Parameters: portname (out) - pointer to a string where
+ *                              the detected com port will
+ *                              be stored
+ *             num_relays(out)- pointer to number of relays
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int detect_relay_card_gpiochip(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
+{
+   struct gpiochip_info info;
+   const uint16_t* pins = config.relay_gpio_pin;
+   int fd;
+   int i;
+   
+   if (config.gpio_num_relays >= FIRST_RELAY &&
+       config.gpio_num_relays <= GPIOCHIP_MAX_RELAYS)
+   {
+      g_num_relays = config.gpio_num_relays;
+   }
+   
+   /* Get active pin value from config */
+   g_active_value = config.gpio_active_value;
+   if (g_active_value > 1)
+   {
+      fprintf(stderr, "ERROR: Invalid active pin value configured: %d\n",
+                      g_active_value);
+      return -1;
+   }
+   
+   if (config.gpio_chip != NULL)
+      snprintf(g_chip, sizeof(g_chip), "%s", config.gpio_chip);
+   
+   /* Check if the GPIO chip is available */
+   fd = open(g_chip, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+   {
+      return -1;
+   }
+   if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) < 0)
+   {
+      close(fd);
+      return -1;
+   }
+   close(fd);
+   
+   /* Check if necessary lines are defined and exist on the chip,
+    * the line offsets are the configured pin numbers */
+   for (i=0; i<g_num_relays; i++)
+   {
+      if (pins[i] == 0 || pins[i] >= info.lines)
+         return -1;
+      offsets[i] = pins[i];
+   }
+   
+   /* Return parameters */
+   if (num_relays!=NULL) *num_relays = g_num_relays; 
+   if (portname!=NULL) strcpy(portname, g_chip);
+   
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function get_initial_values()
+ * 
+ * Description: Get the values the relay lines are driven
+ *              with when requested. Lines already used as
+ *              outputs keep their state, all others start
+ *              with the relay switched off.
+ * 
+ * Parameters: chip (in) - file descriptor of the GPIO chip
+ *             fd (in)   - file descriptor of the lines
+ * 
+ * Return:  bitmap of relay states
+ *********************************************************/
+static relay_mask_t get_initial_values(int chip, int fd)
+{
+   struct gpio_v2_line_info info;
+   struct gpio_v2_line_values values;
+   relay_mask_t outputs=0;
+   int i;
+   
+   for (i=0; i<g_num_relays; i++)
+   {
+      memset(&info, 0, sizeof(info));
+      info.offset = offsets[i];
+      if (ioctl(chip, GPIO_V2_GET_LINEINFO_IOCTL, &info) == 0 &&
+          (info.flags & GPIO_V2_LINE_FLAG_OUTPUT))
+      {
+         outputs |= RELAY_BIT(i+FIRST_RELAY);
+      }
+   }
+   
+   values.mask = outputs;
+   values.bits = 0;
+   if (outputs == 0 || ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+      return 0;
+   
+   return (relay_mask_t)(values.bits & outputs);
+}
+
+
+/**********************************************************
+ * Function open_relay_card_gpiochip()
+ * 
+ * Description: Request all relay lines from the GPIO chip
+ *              and configure them as outputs
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   0 - success
+ *          -1 - fail, lines in use
+ *          -2 - fail, I/O error
+ *********************************************************/
+int open_relay_card_gpiochip(relay_dev_t* dev)
+{
+   struct gpio_v2_line_request req;
+   struct gpio_v2_line_config lc;
+   gpiochip_t* gc;
+   uint64_t flags;
+   int chip;
+   int i;
+   
+   chip = open(dev->portname, O_RDONLY | O_CLOEXEC);
+   if (chip < 0)
+   {
+      fprintf(stderr, "ERROR: Open %s: %s\n", dev->portname, strerror(errno));
+      return -2;
+   }
+   
+   /* The kernel applies the active low setting, so line
+    * values are relay states */
+   flags = (g_active_value == 0) ? GPIO_V2_LINE_FLAG_ACTIVE_LOW : 0;
+   
+   /* Request the lines with their direction as is, so that
+    * the current relay states can be read first */
+   memset(&req, 0, sizeof(req));
+   for (i=0; i<g_num_relays; i++)
+      req.offsets[i] = offsets[i];
+   req.num_lines = g_num_relays;
+   req.config.flags = flags;
+   snprintf(req.consumer, sizeof(req.consumer), "%s", GPIOCHIP_CONSUMER);
+   if (ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+   {
+      fprintf(stderr, "ERROR: Unable to request GPIO lines (already in use?): %s\n",
+                      strerror(errno));
+      close(chip);
+      return -1;
+   }
+   
+   /* Switch all lines to output in one go */
+   memset(&lc, 0, sizeof(lc));
+   lc.flags = flags | GPIO_V2_LINE_FLAG_OUTPUT;
+   lc.num_attrs = 1;
+   lc.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+   lc.attrs[0].attr.values = get_initial_values(chip, req.fd);
+   lc.attrs[0].mask = RELAY_MASK_ALL(g_num_relays);
+   close(chip);
+   if (ioctl(req.fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &lc) < 0)
+   {
+      fprintf(stderr, "ERROR: Unable to set GPIO lines to output: %s\n",
+                      strerror(errno));
+      close(req.fd);
+      return -2;
+   }
+   
+   if ((gc = malloc(sizeof(gpiochip_t))) == NULL)
+   {
+      close(req.fd);
+      return -2;
+   }
+   gc->fd = req.fd;
+   dev->handle = gc;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function close_relay_card_gpiochip()
+ * 
+ * Description: Release the relay lines, they keep their
+ *              last value
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_gpiochip(relay_dev_t* dev)
+{
+   gpiochip_t* gc = dev->handle;
+   
+   close(gc->fd);
+   free(gc);
+   dev->handle = NULL;
+}
+
+
+/**********************************************************
+ * Function get_relay_gpiochip()
+ * 
+ * Description: Get the current relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_relay_gpiochip(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
+{
+   relay_mask_t relay_states;
+   int err;
+   
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
+   {
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;
+   }
+   
+   if ((err = get_all_relays_gpiochip(dev, &relay_states)) < 0)
+      return err;
+   
+   *relay_state = (relay_states & RELAY_BIT(relay)) ? ON : OFF;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_gpiochip()
+ * 
+ * Description: Set the new relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_gpiochip(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
+{
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
+   {
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;
+   }
+   
+   return set_relay_mask_gpiochip(dev, RELAY_BIT(relay), (relay_state == ON) ? RELAY_BIT(relay) : 0);
+}
+
+
+/**********************************************************
+ * Function get_all_relays_gpiochip()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_gpiochip(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   gpiochip_t* gc = dev->handle;
+   struct gpio_v2_line_values values;
+   
+   /* All lines are read with a single ioctl */
+   values.mask = RELAY_MASK_ALL(g_num_relays);
+   values.bits = 0;
+   if (ioctl(gc->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+   {
+      fprintf(stderr, "ERROR: Unable to read GPIO lines: %s\n", strerror(errno));
+      return -2;
+   }
+   
+   *relay_states = (relay_mask_t)values.bits;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_gpiochip()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_gpiochip(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{
+   gpiochip_t* gc = dev->handle;
+   struct gpio_v2_line_values values;
+   
+   /* All selected lines change with a single ioctl */
+   values.mask = relay_mask & RELAY_MASK_ALL(g_num_relays);
+   values.bits = relay_states & values.mask;
+   if (values.mask == 0)
+      return 0;
+   if (ioctl(gc->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
+   {
+      fprintf(stderr, "ERROR: Unable to write GPIO lines: %s\n", strerror(errno));
+      return -2;
+   }
+   
+   return 0;
+}
@@ -0,0 +1,333 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Driver for memory mapped GPIO relays
+ *
+ * Description:
+ *   This software is used to control the relays connected via GPIO pins
+ *   by accessing the GPIO registers of BCM283x SoCs (Raspberry Pi) directly.
+ *   This file contains the implementation of the specific functions.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "data_types.h"
+#include "relay_drv.h"
+#include "relay_drv_gpiomem.h"
+
+/* BCM283x GPIO register block, word offsets */
+#define GPIOMEM_BLOCK_SIZE 4096
+#define GPFSEL0            0
+#define GPSET0             7
+#define GPCLR0             10
+#define GPLEV0             13
+#define GPIOMEM_NUM_PINS   54
+
+/* GPIO pin numbers, index 0 is relay 1 */
+static uint16_t pins[MAX_NUM_RELAYS];
+
+static uint8_t g_num_relays=GPIOMEM_NUM_RELAYS;
+static uint8_t g_active_value=1;
+
+extern config_t config;
+
+
+/**********************************************************
+ * Function detect_relay_card_gpiomem()
+ * 
+ * Description: Detect if the GPIO register block can be
+ *              mapped and all relay pins are defined
+ * 
+ * Parameters: portname (out) - pointer to a string where
+ *                              the detected com port will
+ *                              be stored
+ *             num_relays(out)- pointer to number of relays
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int detect_relay_card_gpiomem(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
+{
+   int i;
+   
+   /* Check if the GPIO memory device is available */
+   if (access(GPIOMEM_DEV, R_OK | W_OK) != 0)
+   {
+      return -1;
+   }
+   
+   if (config.gpio_num_relays >= FIRST_RELAY &&
+       config.gpio_num_relays <= MAX_NUM_RELAYS)
+   {
+      g_num_relays = config.gpio_num_relays;
+   }
+   
+   /* Get active pin value from config */
+   g_active_value = config.gpio_active_value;
+   if (g_active_value > 1)
+   {
+      fprintf(stderr, "ERROR: Invalid active pin value configured: %d\n",
+                      g_active_value);
+      return -1;
+   }
+   
+   /* Get pin numbers from config */
+   memcpy(pins, config.relay_gpio_pin, sizeof(pins));
+   
+   /* Check if necessary pin numbers are defined */
+   for (i=0; i<g_num_relays; i++)
+   {
+      if (pins[i] == 0 || pins[i] >= GPIOMEM_NUM_PINS)
+         return -1;
+   }
+   
+   /* Return parameters */
+   if (num_relays!=NULL) *num_relays = g_num_relays; 
+   if (portname!=NULL) strcpy(portname, GPIOMEM_DEV);
+   
+   return 0;
+}
+
+
+/**********************************************************
+ * Internal function write_pins()
+ * 
+ * Description: Drive a set of relay pins, each register
+ *              bank is written with a single store
+ * 
+ * Parameters: gpio (in)         - mapped GPIO registers
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:  none
+ *********************************************************/
+static void write_pins(volatile uint32_t* gpio, relay_mask_t relay_mask, relay_mask_t relay_states)
+{
+   uint32_t set[2] = {0, 0};
+   uint32_t clr[2] = {0, 0};
+   int high;
+   int i;
+   
+   for (i=0; i<g_num_relays; i++)
+   {
+      if (!(relay_mask & RELAY_BIT(i+FIRST_RELAY))) continue;
+      high = ((relay_states & RELAY_BIT(i+FIRST_RELAY)) != 0) == (g_active_value == 1);
+      if (high)
+         set[pins[i]/32] |= (uint32_t)1 << (pins[i]%32);
+      else
+         clr[pins[i]/32] |= (uint32_t)1 << (pins[i]%32);
+   }
+   
+   for (i=0; i<2; i++)
+   {
+      if (set[i]) gpio[GPSET0+i] = set[i];
+      if (clr[i]) gpio[GPCLR0+i] = clr[i];
+   }
+}
+
+
+/**********************************************************
+ * Function open_relay_card_gpiomem()
+ * 
+ * Description: Map the GPIO registers and configure the
+ *              relay pins as outputs
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   0 - success
+ *          -2 - fail, I/O error
+ *********************************************************/
+int open_relay_card_gpiomem(relay_dev_t* dev)
+{
+   volatile uint32_t* gpio;
+   relay_mask_t inputs=0;
+   uint32_t fsel;
+   int shift;
+   int fd;
+   int i;
+   
+   fd = open(GPIOMEM_DEV, O_RDWR | O_SYNC | O_CLOEXEC);
+   if (fd < 0)
+   {
+      fprintf(stderr, "ERROR: Open %s: %s\n", GPIOMEM_DEV, strerror(errno));
+      return -2;
+   }
+   gpio = mmap(NULL, GPIOMEM_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (gpio == MAP_FAILED)
+   {
+      fprintf(stderr, "ERROR: Unable to map GPIO registers: %s\n", strerror(errno));
+      return -2;
+   }
+   
+   /* Pins which are not outputs yet start with the relay
+    * switched off, the level is set before the direction to
+    * avoid a glitch */
+   for (i=0; i<g_num_relays; i++)
+   {
+      shift = (pins[i]%10)*3;
+      if (((gpio[GPFSEL0+pins[i]/10] >> shift) & 7) != 1)
+         inputs |= RELAY_BIT(i+FIRST_RELAY);
+   }
+   write_pins(gpio, inputs, 0);
+   for (i=0; i<g_num_relays; i++)
+   {
+      shift = (pins[i]%10)*3;
+      fsel = gpio[GPFSEL0+pins[i]/10];
+      gpio[GPFSEL0+pins[i]/10] = (fsel & ~((uint32_t)7 << shift)) | ((uint32_t)1 << shift);
+   }
+   
+   dev->handle = (void*)gpio;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function close_relay_card_gpiomem()
+ * 
+ * Description: Unmap the GPIO registers, the pins keep
+ *              their last value
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_gpiomem(relay_dev_t* dev)
+{
+   munmap(dev->handle, GPIOMEM_BLOCK_SIZE);
+   dev->handle = NULL;
+}
+
+
+/**********************************************************
+ * Function get_relay_gpiomem()
+ * 
+ * Description: Get the current relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_relay_gpiomem(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
+{
+   relay_mask_t relay_states;
+   
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
+   {
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;
+   }
+   
+   get_all_relays_gpiomem(dev, &relay_states);
+   *relay_state = (relay_states & RELAY_BIT(relay)) ? ON : OFF;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_gpiomem()
+ * 
+ * Description: Set the new relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_gpiomem(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
+{
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
+   {
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;
+   }
+   
+   write_pins(dev->handle, RELAY_BIT(relay), (relay_state == ON) ? RELAY_BIT(relay) : 0);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function get_all_relays_gpiomem()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_gpiomem(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   volatile uint32_t* gpio = dev->handle;
+   uint32_t lev[2];
+   int high;
+   int i;
+   
+   lev[0] = gpio[GPLEV0];
+   lev[1] = gpio[GPLEV0+1];
+   
+   *relay_states = 0;
+   for (i=0; i<g_num_relays; i++)
+   {
+      high = (lev[pins[i]/32] >> (pins[i]%32)) & 1;
+      if (high == (g_active_value == 1)) *relay_states |= RELAY_BIT(i+FIRST_RELAY);
+   }
+   
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_gpiomem()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_gpiomem(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{
+   write_pins(dev->handle, relay_mask, relay_states);
+   return 0;
+}
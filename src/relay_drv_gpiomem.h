@@ -0,0 +1,135 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Driver for memory mapped GPIO relays
+ *
+ * Description:
+ *   This software is used to control the relays connected via GPIO pins
+ *   by accessing the GPIO registers of BCM283x SoCs (Raspberry Pi) directly.
+ *   This file contains the declaration of the specific functions.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef relay_drv_gpiomem_h
+#define relay_drv_gpiomem_h
+
+#define GPIOMEM_DEV "/dev/gpiomem"
+
+/**********************************************************
+ * Function detect_relay_card_gpiomem()
+ * 
+ * Description: Detect if the GPIO register block can be
+ *              mapped and all relay pins are defined
+ * 
+ * Parameters: portname (out) - pointer to a string where
+ *                              the detected com port will
+ *                              be stored
+ *             num_relays(out)- pointer to number of relays
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int detect_relay_card_gpiomem(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list);
+
+/**********************************************************
+ * Function open_relay_card_gpiomem()
+ * 
+ * Description: Map the GPIO registers and configure the
+ *              relay pins as outputs
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int open_relay_card_gpiomem(relay_dev_t* dev);
+
+/**********************************************************
+ * Function close_relay_card_gpiomem()
+ * 
+ * Description: Unmap the GPIO registers
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_gpiomem(relay_dev_t* dev);
+
+/**********************************************************
+ * Function get_relay_gpiomem()
+ * 
+ * Description: Get the current relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_relay_gpiomem(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state);
+
+/**********************************************************
+ * Function set_relay_gpiomem()
+ * 
+ * Description: Set the new relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (in)  - new relay state
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_gpiomem(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state);
+
+/**********************************************************
+ * Function get_all_relays_gpiomem()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_gpiomem(relay_dev_t* dev, relay_mask_t* relay_states);
+
+/**********************************************************
+ * Function set_relay_mask_gpiomem()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_gpiomem(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states);
+
+#endif
@@ -90,9 +90,10 @@
 #include <hidapi/hidapi.h>
 
 #include "relay_drv.h"
+#include "relay_drv_hidapi.h"
 
-#define VENDOR_ID 0x16c0
-#define DEVICE_ID 0x05df
+#define VENDOR_ID HID_API_USB_VID
+#define DEVICE_ID HID_API_USB_PID
 
 #define PRODUCT_STR_BASE "USBRelay"
 
@@ -124,14 +125,13 @@ static uint8_t g_num_relays=HID_API_NUM_RELAYS;
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_hidapi(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info)
+int detect_relay_card_hidapi(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
 {
    struct hid_device_info *devs, *nextdev;
    hid_device *hid_dev;
    unsigned char buf[REPORT_LEN];  
    uint8_t found=0;
    uint8_t num;
-   relay_info_t* rinfo;
 
    
    if ((devs = hid_enumerate(VENDOR_ID, DEVICE_ID)) == NULL)
@@ -142,6 +142,7 @@ int detect_relay_card_hidapi(char* portname, uint8_t* num_relays, char* serial,
    if (devs->product_string == NULL ||
        devs->path == NULL)
    {
+      hid_free_enumeration(devs);
       return -2;
    }
 
@@ -153,7 +154,8 @@ int detect_relay_card_hidapi(char* portname, uint8_t* num_relays, char* serial,
       /* Open HID API device */
       if ((hid_dev = hid_open_path(nextdev->path)) == NULL)
       {
-         fprintf(stderr, "unable to open HID API device %s\n", portname);
+         fprintf(stderr, "unable to open HID API device %s\n", nextdev->path);
+         hid_free_enumeration(devs);
          return -3;
       }
       
@@ -161,25 +163,21 @@ int detect_relay_card_hidapi(char* portname, uint8_t* num_relays, char* serial,
       buf[0] = 0x01;
       if (hid_get_feature_report(hid_dev, buf, sizeof(buf)) != REPORT_LEN)
       {
-         fprintf(stderr, "unable to read feature report from device %s (%ls)\n", portname, hid_error(hid_dev));
+         fprintf(stderr, "unable to read feature report from device %s (%ls)\n", nextdev->path, hid_error(hid_dev));
+         hid_close(hid_dev);
+         hid_free_enumeration(devs);
          return -4;
       }
       //printf("DBG: Relay ID: %s\n", buf);
       
       hid_close(hid_dev);
       
-      if (relay_info != NULL)
+      if (relay_list != NULL)
       {
-         // Save serial number and type in current relay info struct
-         (*relay_info)->relay_type = HID_API_RELAY_TYPE;
-         strcpy((*relay_info)->serial, (char *)buf);
-         // Allocate new struct
-         rinfo = malloc(sizeof(relay_info_t));
-         rinfo->next = NULL;
-         // Link current to new struct
-         (*relay_info)->next = rinfo;
-         // Move pointer to new struct
-         *relay_info = rinfo;
+         // Save serial number, port and type in the list
+         num = atoi((const char *)(nextdev->product_string+strlen(PRODUCT_STR_BASE)));
+         crelay_list_add(relay_list, HID_API_RELAY_TYPE, (char *)buf, nextdev->path,
+                         num > 0 ? num : g_num_relays);
       } 
       else if (serial == NULL || !strcmp(serial, (char *)buf))
       {
@@ -191,6 +189,7 @@ int detect_relay_card_hidapi(char* portname, uint8_t* num_relays, char* serial,
    
    if (found == 0)
    {
+      hid_free_enumeration(devs);
       return -5;
    }
    
@@ -212,50 +211,106 @@ int detect_relay_card_hidapi(char* portname, uint8_t* num_relays, char* serial,
 }
 
 
+/**********************************************************
+ * Function open_relay_card_hidapi()
+ * 
+ * Description: Open the HID API compatible relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ *
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int open_relay_card_hidapi(relay_dev_t* dev)
+{
+   hid_device *hid_dev;
+
+   /* Open HID API device */
+   if ((hid_dev = hid_open_path(dev->portname)) == NULL)
+   {
+      fprintf(stderr, "unable to open HID API device %s\n", dev->portname);
+      return -2;
+   }
+   
+   dev->handle = hid_dev;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function close_relay_card_hidapi()
+ * 
+ * Description: Close the HID API compatible relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ *
+ * Return:   none
+ *********************************************************/
+void close_relay_card_hidapi(relay_dev_t* dev)
+{
+   hid_close(dev->handle);
+   dev->handle = NULL;
+}
+
+
+/**********************************************************
+ * Internal function write_relay_cmd()
+ * 
+ * Description: Send a relay command output report
+ * 
+ * Parameters: dev (in)   - relay device
+ *             cmd (in)   - relay command
+ *             relay (in) - relay number (0 for all relays)
+ *
+ * Return:   0 - success
+ *          -3 - fail
+ *********************************************************/
+static int write_relay_cmd(relay_dev_t* dev, uint8_t cmd, uint8_t relay)
+{
+   unsigned char buf[REPORT_LEN];  
+
+   /* Write relay state by sending an output report to the device */
+   memset(buf, 0, sizeof(buf));
+   buf[REPORT_WRCMD_OFFSET] = cmd;
+   buf[REPORT_WRREL_OFFSET] = relay;
+   //printf("DBG: Write relay data %02X %02X\n", buf[REPORT_WRCMD_OFFSET], buf[REPORT_WRREL_OFFSET]);
+   if (hid_write(dev->handle, buf, sizeof(buf)) < 0)
+   {
+      fprintf(stderr, "unable to write output report to device %s (%ls)\n", dev->portname, hid_error(dev->handle));
+      return -3;
+   }
+   
+   return 0;
+}
+
+
 /**********************************************************
  * Function get_relay_hidapi()
  * 
  * Description: Get the current relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (out) - current relay state
- *             serial (in)       - serial number [not used]
  *
  * Return:   0 - success
  *          -1 - fail
  *********************************************************/
-int get_relay_hidapi(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
+int get_relay_hidapi(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
 {
-   hid_device *hid_dev;
-   unsigned char buf[REPORT_LEN];  
+   relay_mask_t states;
+   int err;
 
-   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+dev->num_relays-1))
    {  
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
 
-   /* Open HID API device */
-   if ((hid_dev = hid_open_path(portname)) == NULL)
-   {
-      fprintf(stderr, "unable to open HID API device %s\n", portname);
-      return -2;
-   }
-
-   /* Read relay states requesting a feature report with Id 0x01 */
-   buf[0] = 0x01;
-   if (hid_get_feature_report(hid_dev, buf, sizeof(buf)) != REPORT_LEN)
-   {
-      fprintf(stderr, "unable to read feature report from device %s (%ls)\n", portname, hid_error(hid_dev));
-      return -3;
-   }
-   //printf("DBG: Relay ID: %s\n", buf);
-   //printf("DBG: Read relay bits %02X\n", buf[REPORT_RDDAT_OFFSET]);
-   relay = relay-1;
-   *relay_state = (buf[REPORT_RDDAT_OFFSET] & (0x01<<relay)) ? ON : OFF;
+   if ((err = get_all_relays_hidapi(dev, &states)) < 0)
+      return err;
    
-   hid_close(hid_dev);
+   *relay_state = (states & RELAY_BIT(relay)) ? ON : OFF;
    return 0;
 }
 
@@ -265,43 +320,88 @@ int get_relay_hidapi(char* portname, uint8_t relay, relay_state_t* relay_state,
  * 
  * Description: Set new relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (in)  - current relay state
- *             serial (in)       - serial number [not used]
  *
  * Return:   o - success
  *          -1 - fail
  *********************************************************/
-int set_relay_hidapi(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
+int set_relay_hidapi(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
 { 
-   hid_device *hid_dev;
-   unsigned char buf[REPORT_LEN];  
-
-   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+dev->num_relays-1))
    {  
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
 
-   /* Open HID API device */
-   if ((hid_dev = hid_open_path(portname)) == NULL)
+   return write_relay_cmd(dev, (relay_state==ON) ? CMD_ON : CMD_OFF, relay);
+}
+
+
+/**********************************************************
+ * Function get_all_relays_hidapi()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ *
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_hidapi(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   unsigned char buf[REPORT_LEN];  
+
+   /* Read relay states requesting a feature report with Id 0x01 */
+   buf[0] = 0x01;
+   if (hid_get_feature_report(dev->handle, buf, sizeof(buf)) != REPORT_LEN)
    {
-      fprintf(stderr, "unable to open HID API device %s\n", portname);
-      return -2;
+      fprintf(stderr, "unable to read feature report from device %s (%ls)\n", dev->portname, hid_error(dev->handle));
+      return -3;
    }
+   //printf("DBG: Relay ID: %s\n", buf);
+   //printf("DBG: Read relay bits %02X\n", buf[REPORT_RDDAT_OFFSET]);
+   
+   *relay_states = buf[REPORT_RDDAT_OFFSET] & RELAY_MASK_ALL(dev->num_relays);
+   return 0;
+}
 
-   /* Write relay state by sending an output report to the device */
-   memset(buf, 0, sizeof(buf));
-   buf[REPORT_WRCMD_OFFSET] = (relay_state==ON) ? CMD_ON : CMD_OFF;
-   buf[REPORT_WRREL_OFFSET] = relay;
-   //printf("DBG: Write relay data %02X %02X\n", buf[REPORT_WRCMD_OFFSET], buf[REPORT_WRREL_OFFSET]);
-   if (hid_write(hid_dev, buf, sizeof(buf)) < 0)
+
+/**********************************************************
+ * Function set_relay_mask_hidapi()
+ * 
+ * Description: Set new state of several relays at once.
+ *              The card only has commands for a single relay
+ *              or for all relays, so a partial mask needs
+ *              one output report per relay.
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ *
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_hidapi(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{ 
+   relay_mask_t all = RELAY_MASK_ALL(dev->num_relays);
+   int err;
+   int i;
+   
+   /* Switch all relays with a single command if possible */
+   if (relay_mask == all && (relay_states & all) == all)
+      return write_relay_cmd(dev, CMD_ALL_ON, 0);
+   if (relay_mask == all && (relay_states & all) == 0)
+      return write_relay_cmd(dev, CMD_ALL_OFF, 0);
+   
+   for (i=FIRST_RELAY; i<FIRST_RELAY+dev->num_relays; i++)
    {
-      fprintf(stderr, "unable to write output report to device %s (%ls)\n", portname, hid_error(hid_dev));
-      return -3;
+      if (!(relay_mask & RELAY_BIT(i))) continue;
+      err = write_relay_cmd(dev, (relay_states & RELAY_BIT(i)) ? CMD_ON : CMD_OFF, i);
+      if (err < 0) return err;
    }
    
-   hid_close(hid_dev);
    return 0;
 }
@@ -73,16 +73,16 @@
 #include <libusb-1.0/libusb.h>
 
 #include "relay_drv.h"
+#include "relay_drv_sainsmart.h"
 
-#define VENDOR_ID 0x0403
-#define DEVICE_ID 0x6001
+#define VENDOR_ID SAINSMART_USB_VID
+#define DEVICE_ID SAINSMART_USB_PID
 
 #ifndef BUILD_LIB
 #include "data_types.h"
 extern config_t config;
 #endif
 
-static struct ftdi_context *ftdi;
 static uint8_t g_num_relays=SAINSMART_USB_NUM_RELAYS;
 
 
@@ -99,7 +99,7 @@ static uint8_t g_num_relays=SAINSMART_USB_NUM_RELAYS;
  * Return:     NULL - fail, no matching device found
  *             device handle otherwise
  *********************************************************/
-static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid, uint16_t productid, char *serial, relay_info_t **relay_info)
+static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid, uint16_t productid, char *serial, relay_list_t *relay_list)
 {
    int r;
    ssize_t devnum;
@@ -108,7 +108,7 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
    unsigned char sernum[64];
    struct libusb_device_handle *dev = NULL;
    struct libusb_device_descriptor devdesc;
-   relay_info_t* rinfo;
+   char portname[MAX_COM_PORT_NAME_LEN];
 
    // Get a list of all connected USB devices
    //printf("libusb_get_device_list()\n");
@@ -152,9 +152,10 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
       }
       
       // If serial number was not specified, return handle to first device found
-      if ((serial == NULL) && (relay_info == NULL))
+      if ((serial == NULL) && (relay_list == NULL))
       {
          //printf("Device %d; return dev\n", i);
+         libusb_free_device_list(devices, 1);
          return dev;
       }
       
@@ -169,33 +170,28 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
       }
       
       // Return serial number of first device
-      if ((serial[0] == 0) && (relay_info == NULL))
+      if ((relay_list == NULL) && (serial[0] == 0))
       {
          //printf("Device %d; return serial\n", i);
          strcpy(serial, (char *)sernum);
+         libusb_free_device_list(devices, 1);
          return dev;
       }
 
-      if (relay_info != NULL)
+      if (relay_list != NULL)
       {
          //printf("Device %d; save serial\n", i);
-         // Save serial number and type in current relay info struct
-         (*relay_info)->relay_type = SAINSMART_USB_RELAY_TYPE;
-         strcpy((*relay_info)->serial, (char *)sernum);
-         // Allocate new struct
-         rinfo = malloc(sizeof(relay_info_t));
-         rinfo->next = NULL;
-         // Link current to new struct
-         (*relay_info)->next = rinfo;
-         // Move pointer to new struct
-         *relay_info = rinfo;
+         // Save serial number, port and type in the list
+         snprintf(portname, sizeof(portname), "USB %03d:%03d",
+                  libusb_get_bus_number(devices[i]), libusb_get_device_address(devices[i]));
+         crelay_list_add(relay_list, SAINSMART_USB_RELAY_TYPE, (char *)sernum, portname, g_num_relays);
       }
       else
       {
          // Check if serial numbers match
-         printf("Device %d; check serial\n", i);
          if (!strcmp(serial, (char *)sernum))
          {
+            libusb_free_device_list(devices, 1);
             return dev;
          }
       }
@@ -223,16 +219,17 @@ static libusb_device_handle* open_device_with_vid_pid_serial(uint16_t vendorid,
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info)
+int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
 {
-    unsigned int chipid;
+   struct ftdi_context *ftdi;
+   unsigned int chipid;
    
    /* Find all connected devices, if requested */
-   if (relay_info)
+   if (relay_list)
    { 
       libusb_init(NULL);
       //printf("open_device_with_vid_pid_serial()\n");
-      open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, NULL, relay_info);
+      open_device_with_vid_pid_serial(VENDOR_ID, DEVICE_ID, NULL, relay_list);
       libusb_exit(NULL);
       return -1;
    }
@@ -254,6 +251,7 @@ int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, cha
    if (ftdi_set_bitmode(ftdi, 0xFF, BITMODE_BITBANG) < 0)
    {
       fprintf(stderr, "unable to set bitbang mode: (%s)\n", ftdi_get_error_string(ftdi));
+      ftdi_usb_close(ftdi);
       ftdi_free(ftdi);
       return -1;
    }
@@ -262,6 +260,7 @@ int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, cha
    if (ftdi->type != TYPE_R)
    {
       fprintf(stderr, "unable to continue, not an R-type chip\n");
+      ftdi_usb_close(ftdi);
       ftdi_free(ftdi);
       return -1;
    }
@@ -273,7 +272,7 @@ int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, cha
    g_num_relays = SAINSMART_USB_NUM_RELAYS;
 #else
    if (config.sainsmart_num_relays >= FIRST_RELAY &&
-       config.sainsmart_num_relays <= MAX_NUM_RELAYS)
+       config.sainsmart_num_relays <= SAINSMART_USB_NUM_RELAYS)
    {
       g_num_relays = config.sainsmart_num_relays;
    }
@@ -286,52 +285,101 @@ int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, cha
    //printf("DBG: portname %s\n", portname);
    
    ftdi_usb_close(ftdi);   
+   ftdi_free(ftdi);
    
    return 0;
 }
 
 
 /**********************************************************
- * Function get_relay_sainsmart_4_8chan()
+ * Function open_relay_card_sainsmart_4_8chan()
  * 
- * Description: Get the current relay state
+ * Description: Open the Sainsmart USB relay card and keep
+ *              the FTDI context in the device handle
  * 
- * Parameters: portname (in)     - communication port
- *             relay (in)        - relay number
- *             relay_state (out) - current relay state
+ * Parameters: dev (in/out) - relay device
  * 
  * Return:    0 - success
  *          < 0 - fail
  *********************************************************/
-int get_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
+int open_relay_card_sainsmart_4_8chan(relay_dev_t* dev)
 {
-   unsigned char buf[1];
+   struct ftdi_context *ftdi;
    
-   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
-   {  
-      fprintf(stderr, "ERROR: Relay number out of range\n");
-      return -1;      
+   if ((ftdi = ftdi_new()) == 0)
+   {
+      fprintf(stderr, "ftdi_new failed\n");
+      return -1;
    }
 
    /* Open FTDI USB device */
-   if ((ftdi_usb_open_desc(ftdi, VENDOR_ID, DEVICE_ID, NULL, serial)) < 0)
+   if ((ftdi_usb_open_desc(ftdi, VENDOR_ID, DEVICE_ID, NULL, dev->serial[0] ? dev->serial : NULL)) < 0)
    {
       fprintf(stderr, "unable to open ftdi device: (%s)\n", ftdi_get_error_string(ftdi));
       ftdi_free(ftdi);
       return -2;
    }
    
-   /* Get relay state from the card */
-   if (ftdi_read_pins(ftdi, &buf[0]) < 0)
+   /* Set FTDI chip to bitbang mode */
+   if (ftdi_set_bitmode(ftdi, 0xFF, BITMODE_BITBANG) < 0)
    {
-      fprintf(stderr,"read failed for 0x%x, error %s\n",buf[0], ftdi_get_error_string(ftdi));
+      fprintf(stderr, "unable to set bitbang mode: (%s)\n", ftdi_get_error_string(ftdi));
+      ftdi_usb_close(ftdi);
+      ftdi_free(ftdi);
       return -3;
    }
-   //printf("DBG: Read GPIO bits %02X\n", buf[0]);
-   relay = relay-1;
-   *relay_state = (buf[0] & (0x01<<relay)) ? ON : OFF;
+   
+   dev->handle = ftdi;
+   return 0;
+}
+
 
+/**********************************************************
+ * Function close_relay_card_sainsmart_4_8chan()
+ * 
+ * Description: Close the Sainsmart USB relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_sainsmart_4_8chan(relay_dev_t* dev)
+{
+   struct ftdi_context *ftdi = dev->handle;
+   
    ftdi_usb_close(ftdi);
+   ftdi_free(ftdi);
+   dev->handle = NULL;
+}
+
+
+/**********************************************************
+ * Function get_relay_sainsmart_4_8chan()
+ * 
+ * Description: Get the current relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int get_relay_sainsmart_4_8chan(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
+{
+   relay_mask_t states;
+   int err;
+   
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+dev->num_relays-1))
+   {  
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;      
+   }
+
+   if ((err = get_all_relays_sainsmart_4_8chan(dev, &states)) < 0)
+      return err;
+   
+   *relay_state = (states & RELAY_BIT(relay)) ? ON : OFF;
    return 0;
 }
 
@@ -341,31 +389,71 @@ int get_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t* re
  * 
  * Description: Set new relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (in)  - current relay state
  * 
  * Return:    0 - success
  *          < 0 - fail
  *********************************************************/
-int set_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
+int set_relay_sainsmart_4_8chan(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
 {
-   unsigned char buf[1];
-   
-   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+dev->num_relays-1))
    {  
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
    
-   /* Open FTDI USB device */
-   if ((ftdi_usb_open_desc(ftdi, VENDOR_ID, DEVICE_ID, NULL, serial)) < 0)
+   return set_relay_mask_sainsmart_4_8chan(dev, RELAY_BIT(relay), (relay_state == OFF) ? 0 : RELAY_BIT(relay));
+}
+
+
+/**********************************************************
+ * Function get_all_relays_sainsmart_4_8chan()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int get_all_relays_sainsmart_4_8chan(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   struct ftdi_context *ftdi = dev->handle;
+   unsigned char buf[1];
+   
+   /* Get relay state from the card */
+   if (ftdi_read_pins(ftdi, &buf[0]) < 0)
    {
-      fprintf(stderr, "unable to open ftdi device: (%s)\n", ftdi_get_error_string(ftdi));
-      ftdi_free(ftdi);
-      return -2;
+      fprintf(stderr,"read failed for 0x%x, error %s\n",buf[0], ftdi_get_error_string(ftdi));
+      return -3;
    }
+   //printf("DBG: Read GPIO bits %02X\n", buf[0]);
+   
+   *relay_states = buf[0] & RELAY_MASK_ALL(dev->num_relays);
+   return 0;
+}
+
 
+/**********************************************************
+ * Function set_relay_mask_sainsmart_4_8chan()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:    0 - success
+ *          < 0 - fail
+ *********************************************************/
+int set_relay_mask_sainsmart_4_8chan(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{
+   struct ftdi_context *ftdi = dev->handle;
+   unsigned char buf[1];
+   
    /* Get relay state from the card */
    if (ftdi_read_pins(ftdi, buf) < 0)
    {
@@ -373,18 +461,8 @@ int set_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t rel
       return -3;
    }
    
-   /* Set the new relay state bit */
-   relay = relay-1;
-   if (relay_state == OFF) 
-   {
-      /* Clear the relay bit in mask */
-      buf[0] = buf[0] & ~(0x01<<relay);
-   }
-   else
-   {
-      /* Set the relay bit in mask */
-      buf[0] = buf[0] | (0x01<<relay);
-   }
+   /* Set the new relay state bits */
+   buf[0] = (buf[0] & ~relay_mask) | (relay_states & relay_mask);
    
    //printf("DBG: Writing GPIO bits %02X\n", buf[0]);
    
@@ -395,6 +473,5 @@ int set_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t rel
       return -4;
    }
    
-   ftdi_usb_close(ftdi);
    return 0;
 }
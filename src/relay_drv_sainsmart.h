@@ -47,34 +47,85 @@
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info);
+int detect_relay_card_sainsmart_4_8chan(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list);
+
+/**********************************************************
+ * Function open_relay_card_sainsmart_4_8chan()
+ * 
+ * Description: Open the Sainsmart USB relay card and keep
+ *              the FTDI context in the device handle
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int open_relay_card_sainsmart_4_8chan(relay_dev_t* dev);
+
+/**********************************************************
+ * Function close_relay_card_sainsmart_4_8chan()
+ * 
+ * Description: Close the Sainsmart USB relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_sainsmart_4_8chan(relay_dev_t* dev);
 
 /**********************************************************
  * Function get_relay_sainsmart_4_8chan()
  * 
  * Description: Get the current relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (out) - current relay state
  * 
  * Return:   0 - success
  *          -1 - fail
  *********************************************************/
-int get_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial);
+int get_relay_sainsmart_4_8chan(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state);
 
 /**********************************************************
  * Function set_relay_sainsmart_4_8chan()
  * 
  * Description: Set new relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (in)  - current relay state
  * 
  * Return:   0 - success
  *          -1 - fail
  *********************************************************/
-int set_relay_sainsmart_4_8chan(char* portname, uint8_t relay, relay_state_t relay_state, char* serial);
+int set_relay_sainsmart_4_8chan(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state);
+
+/**********************************************************
+ * Function get_all_relays_sainsmart_4_8chan()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_sainsmart_4_8chan(relay_dev_t* dev, relay_mask_t* relay_states);
+
+/**********************************************************
+ * Function set_relay_mask_sainsmart_4_8chan()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_sainsmart_4_8chan(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states);
 
 #endif
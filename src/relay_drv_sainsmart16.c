@@ -107,14 +107,18 @@
 #include <hidapi/hidapi.h>
 
 #include "relay_drv.h"
+#include "relay_drv_sainsmart16.h"
 
-#define VENDOR_ID 0x0416
-#define DEVICE_ID 0x5020
+#define VENDOR_ID SAINSMART16_USB_VID
+#define DEVICE_ID SAINSMART16_USB_PID
 
 #define CMD_READ  0xD2
 #define CMD_WRITE 0xC3
 #define CMD_SIGNATURE "HIDC"
 
+/* Max time for the card to answer a read command */
+#define READ_TIMEOUT 100 /* ms */
+
 
 /* USB HID message structure */
 typedef struct
@@ -162,15 +166,19 @@ static int get_mask(hid_device *handle, uint16_t *bitmap)
   hid_msg_t  hid_msg;
   uint16_t mask;
   
+  /* Drop late answers to earlier reads, they would be taken
+   * for the answer to this one */
+  while (hid_read_timeout(handle, (unsigned char *)&hid_msg, sizeof(hid_msg), 0) > 0);
+  
   init_hid_msg(&hid_msg, CMD_READ, 0x1111);
 
   if (hid_write(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
   {
     return -1;
   }
-  usleep(1000);
   
-  if (hid_read(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
+  /* Returns as soon as the answer is there */
+  if (hid_read_timeout(handle, (unsigned char *)&hid_msg, sizeof(hid_msg), READ_TIMEOUT) <= 0)
   {
     return -2;
   }
@@ -216,11 +224,10 @@ static int set_mask(hid_device *handle, uint16_t bitmap)
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_sainsmart_16chan(char* portname, uint8_t* num_relays, char* serial, relay_info_t** relay_info)
+int detect_relay_card_sainsmart_16chan(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
 {
    struct hid_device_info *devs, *nextdev;
    uint8_t found=0;
-   relay_info_t* rinfo;
    
    if ((devs = hid_enumerate(VENDOR_ID, DEVICE_ID)) == NULL)
    {
@@ -230,6 +237,7 @@ int detect_relay_card_sainsmart_16chan(char* portname, uint8_t* num_relays, char
    if (devs->product_string == NULL ||
        devs->path == NULL)
    {
+      hid_free_enumeration(devs);
       return -1;
    }
    
@@ -237,18 +245,11 @@ int detect_relay_card_sainsmart_16chan(char* portname, uint8_t* num_relays, char
    nextdev = devs;
    while (nextdev)
    {
-      if (relay_info != NULL)
+      if (relay_list != NULL)
       {
-         // Save serial number and type in current relay info struct
-         (*relay_info)->relay_type = SAINSMART16_USB_RELAY_TYPE;
-         strcpy((*relay_info)->serial, nextdev->path);
-         // Allocate new struct
-         rinfo = malloc(sizeof(relay_info_t));
-         rinfo->next = NULL;
-         // Link current to new struct
-         (*relay_info)->next = rinfo;
-         // Move pointer to new struct
-         *relay_info = rinfo;
+         // Save serial number, port and type in the list
+         crelay_list_add(relay_list, SAINSMART16_USB_RELAY_TYPE, nextdev->path, nextdev->path,
+                         g_num_relays);
       }
       else if (serial == NULL || !strcmp(serial, nextdev->path))
       {
@@ -260,6 +261,7 @@ int detect_relay_card_sainsmart_16chan(char* portname, uint8_t* num_relays, char
 
    if (found == 0)
    {
+      hid_free_enumeration(devs);
       return -5;
    }
 
@@ -276,51 +278,80 @@ int detect_relay_card_sainsmart_16chan(char* portname, uint8_t* num_relays, char
 }
 
 
+/**********************************************************
+ * Function open_relay_card_sainsmart_16chan()
+ * 
+ * Description: Open the Saintsmart 16 channel relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int open_relay_card_sainsmart_16chan(relay_dev_t* dev)
+{
+   hid_device *hid_dev;
+   
+   /* Open HID API device */
+   if ((hid_dev = hid_open_path(dev->portname)) == NULL)
+   {
+      fprintf(stderr, "unable to open HID API device %s\n", dev->portname);
+      return -2;
+   }
+   
+   dev->handle = hid_dev;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function close_relay_card_sainsmart_16chan()
+ * 
+ * Description: Close the Saintsmart 16 channel relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_sainsmart_16chan(relay_dev_t* dev)
+{
+   hid_close(dev->handle);
+   dev->handle = NULL;
+}
+
+
 /**********************************************************
  * Function get_relay_sainsmart_16chan()
  * 
  * Description: Get the current relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (out) - current relay state
  * 
  * Return:   0 - success
  *          <0 - fail
  *********************************************************/
-int get_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
+int get_relay_sainsmart_16chan(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
 {
-   hid_device *hid_dev;
-   uint16_t bitmap, bit;
+   relay_mask_t bitmap;
+   int err;
    
-   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+dev->num_relays-1))
    {  
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
    
-   /* Open HID API device */
-   if ((hid_dev = hid_open_path(portname)) == NULL)
-   {
-      fprintf(stderr, "unable to open HID API device %s\n", portname);
-      return -2;
-   }
+   if ((err = get_all_relays_sainsmart_16chan(dev, &bitmap)) < 0)
+      return err;
    
-   /* Read relay states */
-   if (get_mask(hid_dev, &bitmap) < 0)
-   {
-      fprintf(stderr, "unable to read data from device %s (%ls)\n", portname, hid_error(hid_dev));
-      return -3;
-   }
-   
-   bit = 1 << (relay-1);
-   if (bitmap & bit)
+   if (bitmap & RELAY_BIT(relay))
      *relay_state = ON;
    else
      *relay_state = OFF;
 
-   /* printf("DBG: get: portname=%s, relay=%d, state=%d\n", portname, relay, (int)*relay_state); */
-   hid_close(hid_dev);
+   /* printf("DBG: get: portname=%s, relay=%d, state=%d\n", dev->portname, relay, (int)*relay_state); */
    return 0;
 }
 
@@ -330,61 +361,95 @@ int get_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t* rel
  * 
  * Description: Set new relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (in)  - current relay state
  * 
  * Return:   0 - success
  *          <0 - fail
  *********************************************************/
-int set_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
+int set_relay_sainsmart_16chan(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
 { 
-   hid_device *hid_dev;
-   uint16_t     bitmap;
-   
-   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+g_num_relays-1))
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+dev->num_relays-1))
    {  
       fprintf(stderr, "ERROR: Relay number out of range\n");
       return -1;      
    }
    
-   /* Open HID API device */
-   if ((hid_dev = hid_open_path(portname)) == NULL)
-   {
-      fprintf(stderr, "unable to open HID API device %s\n", portname);
-      return -2;
-   }
-
    /*
    printf("DBG: Sain16 USB: portname=%s, relay=%d, state=%s\n",
-          portname, relay, relay_state == ON? "ON" : "OFF");
+          dev->portname, relay, relay_state == ON? "ON" : "OFF");
    */
+   return set_relay_mask_sainsmart_16chan(dev, RELAY_BIT(relay), (relay_state == OFF) ? 0 : RELAY_BIT(relay));
+}
+
+
+/**********************************************************
+ * Function get_all_relays_sainsmart_16chan()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_sainsmart_16chan(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   uint16_t bitmap;
+   
    /* Read relay states */
-   if (get_mask(hid_dev, &bitmap) < 0)
+   if (get_mask(dev->handle, &bitmap) < 0)
    {
-      fprintf(stderr, "unable to read data from device %s (%ls)\n", portname, hid_error(hid_dev));
+      fprintf(stderr, "unable to read data from device %s (%ls)\n", dev->portname, hid_error(dev->handle));
       return -3;
    }
    
-   /* Set the new relay state bit */
-   if (relay_state == OFF) 
+   *relay_states = bitmap;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_sainsmart_16chan()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_sainsmart_16chan(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{ 
+   uint16_t bitmap;
+   
+   /* The card only takes the state of all relays at once. Take
+    * the other relay states from the shadow copy if it is valid
+    * (the card has been accessed only through this session since
+    * it was opened), otherwise read them from the card. */
+   if (dev->shadow_valid)
    {
-      /* Clear the relay bit in mask */
-      bitmap &= ~(1<<(relay-1));
+      bitmap = dev->shadow;
    }
-   else
+   else if (get_mask(dev->handle, &bitmap) < 0)
    {
-      /* Set the relay bit in mask */
-      bitmap |= (1<<(relay-1));
+      fprintf(stderr, "unable to read data from device %s (%ls)\n", dev->portname, hid_error(dev->handle));
+      return -3;
    }
    
+   /* Set the new relay state bits */
+   bitmap = (bitmap & ~relay_mask) | (relay_states & relay_mask);
+   
    /* Write relay states */
-   if (set_mask(hid_dev, bitmap) < 0)
+   if (set_mask(dev->handle, bitmap) < 0)
    {
-      fprintf(stderr, "unable to write data to device %s (%ls)\n", portname, hid_error(hid_dev));
+      fprintf(stderr, "unable to write data to device %s (%ls)\n", dev->portname, hid_error(dev->handle));
       return -4;
    }
   
-   hid_close(hid_dev);
    return 0;
 }
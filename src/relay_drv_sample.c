@@ -57,29 +57,65 @@
  *                              the detected com port will
  *                              be stored
  *             num_relays(out)- pointer to number of relays
+ *             serial (in)    - serial number [optional]
+ *             relay_list(out)- list of detected cards
+ *                              [only when listing all cards]
  * 
  * Return:  0 - success
  *         -1 - fail, no relay card found
  *********************************************************/
-int detect_relay_card_sample(char* portname, uint8_t* num_relays, char* serial)
+int detect_relay_card_sample(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
 {
    return 0;
 }
 
 
+/**********************************************************
+ * Function open_relay_card_sample()
+ * 
+ * Description: Open the sample relay card found by the
+ *              detect function and keep the driver
+ *              specific handle in dev->handle
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int open_relay_card_sample(relay_dev_t* dev)
+{
+   return 0;
+}
+
+
+/**********************************************************
+ * Function close_relay_card_sample()
+ * 
+ * Description: Close the sample relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_sample(relay_dev_t* dev)
+{
+}
+
+
 /**********************************************************
  * Function get_relay_sample()
  * 
  * Description: Get the current relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
  *             relay_state (out) - current relay state
  * 
  * Return:   0 - success
- *          -1 - fail
+ *          -1 - relay number out of range
+ *         <-1 - I/O error (the card will be probed again)
  *********************************************************/
-int get_relay_sample(char* portname, uint8_t relay, relay_state_t* relay_state, char* serial)
+int get_relay_sample(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
 {
    return 0;
 }
@@ -90,15 +126,56 @@ int get_relay_sample(char* portname, uint8_t relay, relay_state_t* relay_state,
  * 
  * Description: Set new relay state
  * 
- * Parameters: portname (in)     - communication port
+ * Parameters: dev (in)          - relay device
  *             relay (in)        - relay number
- *             relay_state (in)  - current relay state
+ *             relay_state (in)  - new relay state
  * 
- * Return:   o - success
- *          -1 - fail
+ * Return:   0 - success
+ *          -1 - relay number out of range
+ *         <-1 - I/O error (the card will be probed again)
+ *********************************************************/
+int set_relay_sample(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
+{ 
+   return 0;
+}
+
+
+/**********************************************************
+ * Function get_all_relays_sample()
+ * 
+ * Description: Get the current state of all relays with
+ *              a single access to the card (optional, the
+ *              generic code falls back to get_relay_sample)
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *         <-1 - I/O error (the card will be probed again)
+ *********************************************************/
+int get_all_relays_sample(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   *relay_states = 0;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_sample()
+ * 
+ * Description: Set new state of several relays with a
+ *              single access to the card (optional, the
+ *              generic code falls back to set_relay_sample)
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          -1 - relay mask out of range
+ *         <-1 - I/O error (the card will be probed again)
  *********************************************************/
-int set_relay_sample(char* portname, uint8_t relay, relay_state_t relay_state, char* serial)
+int set_relay_mask_sample(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
 { 
    return 0;
 }
- 
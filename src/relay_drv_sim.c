@@ -0,0 +1,361 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Driver for simulated relay cards
+ *
+ * Description:
+ *   This software is used to simulate relay cards in memory, e.g. for
+ *   benchmarks and tests without hardware.
+ *   This file contains the implementation of the specific functions.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+/******************************************************************************
+ * Communication protocol description
+ * ==================================
+ * 
+ * There is no communication, the relay states are kept in memory and
+ * survive closing and opening the card again like on a real card.
+ * 
+ * Every get and set operation takes the configured latency plus a
+ * random jitter, which models the USB transfer of a real card. A
+ * configurable share of the operations fails with an I/O error.
+ * 
+ *****************************************************************************/ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "relay_drv.h"
+#include "relay_drv_sim.h"
+
+static relay_mask_t sim_states[SIM_MAX_CARDS];
+static uint16_t g_num_cards=1;
+static uint8_t  g_num_relays=SIM_NUM_RELAYS;
+static uint32_t g_latency=0;    /* us */
+static uint32_t g_jitter=0;     /* us */
+static uint32_t g_error_limit=0; /* random values below fail */
+
+
+/**********************************************************
+ * Internal function sim_random()
+ * 
+ * Description: Pseudo random number (xorshift), each thread
+ *              has its own sequence
+ * 
+ * Parameters: none
+ * 
+ * Return:  random value
+ *********************************************************/
+static uint32_t sim_random(void)
+{
+   static __thread uint32_t x=0;
+   
+   if (x == 0)
+      x = (uint32_t)(uintptr_t)pthread_self() ^ (uint32_t)time(NULL) ^ 0x9E3779B9u;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   return x;
+}
+
+
+/**********************************************************
+ * Internal function sim_transfer()
+ * 
+ * Description: Simulate the transfer to the card, wait for
+ *              the latency and decide if it fails
+ * 
+ * Parameters: dev (in) - relay device
+ * 
+ * Return:   0 - success
+ *          -3 - fail, simulated I/O error
+ *********************************************************/
+static int sim_transfer(relay_dev_t* dev)
+{
+   struct timespec ts;
+   uint32_t us = g_latency;
+   
+   if (g_jitter > 0)
+      us += sim_random() % (g_jitter + 1);
+   if (us > 0)
+   {
+      ts.tv_sec = us / 1000000;
+      ts.tv_nsec = (us % 1000000) * 1000;
+      while (nanosleep(&ts, &ts) != 0);
+   }
+   
+   if (g_error_limit > 0 && sim_random() < g_error_limit)
+   {
+      fprintf(stderr, "simulated I/O error on %s\n", dev->portname);
+      return -3;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Function sim_set_params()
+ * 
+ * Description: Set the simulation parameters, must be
+ *              called before the cards are detected
+ * 
+ * Parameters: num_cards (in)  - number of simulated cards
+ *                               (1 to SIM_MAX_CARDS), the
+ *                               serial numbers are SIM0,
+ *                               SIM1, ...
+ *             num_relays (in) - relays per card (1 to
+ *                               MAX_NUM_RELAYS)
+ *             latency (in)    - time each operation takes
+ *                               in us
+ *             jitter (in)     - max random time added to
+ *                               the latency in us
+ *             error_rate (in) - percentage of operations
+ *                               which fail with an I/O error
+ * 
+ * Return:   0 - success
+ *          -1 - fail, parameter out of range
+ *********************************************************/
+int sim_set_params(uint16_t num_cards, uint8_t num_relays, uint32_t latency, uint32_t jitter, double error_rate)
+{
+   if (num_cards < 1 || num_cards > SIM_MAX_CARDS ||
+       num_relays < FIRST_RELAY || num_relays > MAX_NUM_RELAYS ||
+       error_rate < 0 || error_rate > 100)
+   {
+      return -1;
+   }
+   
+   g_num_cards = num_cards;
+   g_num_relays = num_relays;
+   g_latency = latency;
+   g_jitter = jitter;
+   g_error_limit = (uint32_t)(error_rate / 100 * UINT32_MAX);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function detect_relay_card_sim()
+ * 
+ * Description: Detect the simulated relay card, which is
+ *              always present
+ * 
+ * Parameters: portname (out) - pointer to a string where
+ *                              the detected com port will
+ *                              be stored
+ *             num_relays(out)- pointer to number of relays
+ *             serial (in)    - serial number [optional]
+ *             relay_list(out)- list of detected cards
+ *                              [only when listing all cards]
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int detect_relay_card_sim(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list)
+{
+   char port[MAX_COM_PORT_NAME_LEN];
+   char sernum[MAX_SERIAL_LEN];
+   char* end;
+   long card=0;
+   int i;
+   
+   if (relay_list != NULL)
+   {
+      for (i=0; i<g_num_cards; i++)
+      {
+         // Save serial number, port and type in the list
+         snprintf(sernum, sizeof(sernum), "%s%d", SIM_SERIAL_PREFIX, i);
+         snprintf(port, sizeof(port), "Simulated %d", i);
+         crelay_list_add(relay_list, SIM_RELAY_TYPE, sernum, port, g_num_relays);
+      }
+      return 0;
+   }
+   
+   /* Serial number SIM<n>, the first card if not specified */
+   if (serial != NULL)
+   {
+      if (strncmp(serial, SIM_SERIAL_PREFIX, strlen(SIM_SERIAL_PREFIX)))
+         return -1;
+      card = strtol(serial + strlen(SIM_SERIAL_PREFIX), &end, 10);
+      if (*end || end == serial + strlen(SIM_SERIAL_PREFIX) || card < 0 || card >= g_num_cards)
+         return -1;
+   }
+   
+   /* Return parameters */
+   if (num_relays != NULL) *num_relays = g_num_relays;
+   if (portname != NULL) sprintf(portname, "Simulated %ld", card);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function open_relay_card_sim()
+ * 
+ * Description: Open the simulated relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int open_relay_card_sim(relay_dev_t* dev)
+{
+   int card;
+   
+   if (sscanf(dev->portname, "Simulated %d", &card) != 1 || card < 0 || card >= g_num_cards)
+      return -1;
+   
+   dev->handle = &sim_states[card];
+   return 0;
+}
+
+
+/**********************************************************
+ * Function close_relay_card_sim()
+ * 
+ * Description: Close the simulated relay card, the relay
+ *              states are kept
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_sim(relay_dev_t* dev)
+{
+   dev->handle = NULL;
+}
+
+
+/**********************************************************
+ * Function get_relay_sim()
+ * 
+ * Description: Get the current relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int get_relay_sim(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state)
+{
+   relay_mask_t states;
+   int err;
+   
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+dev->num_relays-1))
+   {  
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;      
+   }
+   
+   if ((err = get_all_relays_sim(dev, &states)) < 0)
+      return err;
+   
+   *relay_state = (states & RELAY_BIT(relay)) ? ON : OFF;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_sim()
+ * 
+ * Description: Set new relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (in)  - current relay state
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_relay_sim(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state)
+{
+   if (relay<FIRST_RELAY || relay>(FIRST_RELAY+dev->num_relays-1))
+   {  
+      fprintf(stderr, "ERROR: Relay number out of range\n");
+      return -1;      
+   }
+   
+   return set_relay_mask_sim(dev, RELAY_BIT(relay), (relay_state == OFF) ? 0 : RELAY_BIT(relay));
+}
+
+
+/**********************************************************
+ * Function get_all_relays_sim()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_sim(relay_dev_t* dev, relay_mask_t* relay_states)
+{
+   relay_mask_t* states = dev->handle;
+   int err;
+   
+   if (states == NULL)
+      return -2;
+   if ((err = sim_transfer(dev)) < 0)
+      return err;
+   
+   *relay_states = *states;
+   return 0;
+}
+
+
+/**********************************************************
+ * Function set_relay_mask_sim()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_sim(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states)
+{
+   relay_mask_t* states = dev->handle;
+   int err;
+   
+   if (states == NULL)
+      return -2;
+   if ((err = sim_transfer(dev)) < 0)
+      return err;
+   
+   relay_mask &= RELAY_MASK_ALL(dev->num_relays);
+   *states = (*states & ~relay_mask) | (relay_states & relay_mask);
+   return 0;
+}
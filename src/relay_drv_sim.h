@@ -0,0 +1,163 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Driver for simulated relay cards
+ *
+ * Description:
+ *   This software is used to simulate relay cards in memory, e.g. for
+ *   benchmarks and tests without hardware.
+ *   This file contains the declaration of the specific functions.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef relay_drv_sim_h
+#define relay_drv_sim_h
+
+#define SIM_SERIAL_PREFIX "SIM"
+#define SIM_MAX_CARDS     1024
+
+/**********************************************************
+ * Function sim_set_params()
+ * 
+ * Description: Set the simulation parameters, must be
+ *              called before the cards are detected
+ * 
+ * Parameters: num_cards (in)  - number of simulated cards
+ *                               (1 to SIM_MAX_CARDS), the
+ *                               serial numbers are SIM0,
+ *                               SIM1, ...
+ *             num_relays (in) - relays per card (1 to
+ *                               MAX_NUM_RELAYS)
+ *             latency (in)    - time each operation takes
+ *                               in us
+ *             jitter (in)     - max random time added to
+ *                               the latency in us
+ *             error_rate (in) - percentage of operations
+ *                               which fail with an I/O error
+ * 
+ * Return:   0 - success
+ *          -1 - fail, parameter out of range
+ *********************************************************/
+int sim_set_params(uint16_t num_cards, uint8_t num_relays, uint32_t latency, uint32_t jitter, double error_rate);
+
+/**********************************************************
+ * Function detect_relay_card_sim()
+ * 
+ * Description: Detect a simulated relay card, they are
+ *              always present
+ * 
+ * Parameters: portname (out) - pointer to a string where
+ *                              the detected com port will
+ *                              be stored
+ *             num_relays(out)- pointer to number of relays
+ *             serial (in)    - serial number [optional]
+ *             relay_list(out)- list of detected cards
+ *                              [only when listing all cards]
+ * 
+ * Return:  0 - success
+ *         -1 - fail, no relay card found
+ *********************************************************/
+int detect_relay_card_sim(char* portname, uint8_t* num_relays, char* serial, relay_list_t* relay_list);
+
+/**********************************************************
+ * Function open_relay_card_sim()
+ * 
+ * Description: Open a simulated relay card
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int open_relay_card_sim(relay_dev_t* dev);
+
+/**********************************************************
+ * Function close_relay_card_sim()
+ * 
+ * Description: Close a simulated relay card, the relay
+ *              states are kept
+ * 
+ * Parameters: dev (in/out) - relay device
+ * 
+ * Return:   none
+ *********************************************************/
+void close_relay_card_sim(relay_dev_t* dev);
+
+/**********************************************************
+ * Function get_relay_sim()
+ * 
+ * Description: Get the current relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (out) - current relay state
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int get_relay_sim(relay_dev_t* dev, uint8_t relay, relay_state_t* relay_state);
+
+/**********************************************************
+ * Function set_relay_sim()
+ * 
+ * Description: Set new relay state
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay (in)        - relay number
+ *             relay_state (in)  - current relay state
+ * 
+ * Return:   0 - success
+ *          -1 - fail
+ *********************************************************/
+int set_relay_sim(relay_dev_t* dev, uint8_t relay, relay_state_t relay_state);
+
+/**********************************************************
+ * Function get_all_relays_sim()
+ * 
+ * Description: Get the current state of all relays
+ * 
+ * Parameters: dev (in)           - relay device
+ *             relay_states (out) - bitmap of relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int get_all_relays_sim(relay_dev_t* dev, relay_mask_t* relay_states);
+
+/**********************************************************
+ * Function set_relay_mask_sim()
+ * 
+ * Description: Set new state of several relays at once
+ * 
+ * Parameters: dev (in)          - relay device
+ *             relay_mask (in)   - bitmap of relays to set
+ *             relay_states (in) - bitmap of new relay states
+ * 
+ * Return:   0 - success
+ *          <0 - fail
+ *********************************************************/
+int set_relay_mask_sim(relay_dev_t* dev, relay_mask_t relay_mask, relay_mask_t relay_states);
+
+#endif
@@ -0,0 +1,273 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Relay state journal
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the implementation of the relay state journal.
+ *
+ *   The journal is a small fixed size file mapped into memory, with one
+ *   entry per card holding the bitmap of its relay states. An entry is
+ *   updated in place after each write which changed the states, so no
+ *   system call is needed on the write path. The file is kept in the
+ *   page cache, which survives a restart or upgrade of the daemon, and
+ *   written back by the kernel.
+ *
+ *   Each entry carries a sequence number which is odd while the entry
+ *   is written. Entries found with an odd number (daemon killed in the
+ *   middle of an update) are ignored.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "relay_drv.h"
+#include "relay_journal.h"
+#include "dev_worker.h"
+
+#define JOURNAL_MAGIC   0x4a4c5243  /* "CRLJ" */
+#define JOURNAL_VERSION 1
+
+typedef struct
+{
+   relay_mask_t states;                    /* relay states, bit 0 is relay 1 */
+   _Atomic uint32_t seq;                   /* odd while the entry is written, 0 = unused */
+   uint8_t num_relays;
+   char serial[MAX_SERIAL_LEN];            /* serial number the card was opened with */
+   char card[MAX_RELAY_CARD_NAME_LEN];     /* card name */
+} journal_entry_t;
+
+typedef struct
+{
+   uint32_t magic;
+   uint16_t version;
+   uint16_t mask_size;                     /* sizeof(relay_mask_t) */
+   uint32_t num_entries;
+   uint32_t entry_size;
+   journal_entry_t entries[JOURNAL_MAX_CARDS];
+} journal_t;
+
+static journal_t* journal=NULL;
+static int num_used=0;                     /* entries allocated so far */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Entries found at startup, for journal_restore() */
+static journal_entry_t saved[JOURNAL_MAX_CARDS];
+static int num_saved=0;
+
+
+/**********************************************************
+ * Internal function journal_find()
+ *
+ * Description: Get the entry of a card, a new one is added
+ *              if there is none yet
+ *
+ * Parameters: dev (in) - relay card
+ *
+ * Return:  entry, NULL if the journal is full
+ *********************************************************/
+static journal_entry_t* journal_find(relay_dev_t* dev)
+{
+   journal_entry_t* e=NULL;
+   int n = __atomic_load_n(&num_used, __ATOMIC_ACQUIRE);
+   int i;
+
+   for (i=0; i<n; i++)
+   {
+      if (!strcmp(journal->entries[i].serial, dev->serial))
+         return &journal->entries[i];
+   }
+
+   /* New card, searched again under the lock in case another
+    * worker added it meanwhile */
+   pthread_mutex_lock(&journal_lock);
+   for (i=0; i<num_used; i++)
+   {
+      if (!strcmp(journal->entries[i].serial, dev->serial))
+         break;
+   }
+   if (i < num_used)
+   {
+      e = &journal->entries[i];
+   }
+   else if (num_used < JOURNAL_MAX_CARDS)
+   {
+      e = &journal->entries[num_used];
+      memset(e, 0, sizeof(*e));
+      snprintf(e->serial, sizeof(e->serial), "%s", dev->serial);
+      __atomic_store_n(&num_used, num_used+1, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&journal_lock);
+   return e;
+}
+
+
+/**********************************************************
+ * Function journal_open()
+ *********************************************************/
+int journal_open(const char* path)
+{
+   journal_t* j;
+   int fd;
+   int i;
+
+   fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+   if (fd < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to open state journal %s : %m\n", path);
+      return -1;
+   }
+   if (ftruncate(fd, sizeof(journal_t)) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to resize state journal %s : %m\n", path);
+      close(fd);
+      return -1;
+   }
+   j = mmap(NULL, sizeof(journal_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (j == MAP_FAILED)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to map state journal %s : %m\n", path);
+      return -1;
+   }
+
+   if (j->magic == JOURNAL_MAGIC && j->version == JOURNAL_VERSION &&
+       j->mask_size == sizeof(relay_mask_t) && j->num_entries == JOURNAL_MAX_CARDS &&
+       j->entry_size == sizeof(journal_entry_t))
+   {
+      /* Keep the complete entries, the file then starts over
+       * with the cards which are opened */
+      for (i=0; i<JOURNAL_MAX_CARDS; i++)
+      {
+         if (j->entries[i].seq == 0 || (j->entries[i].seq & 1) ||
+             j->entries[i].num_relays > MAX_NUM_RELAYS)
+            continue;
+         saved[num_saved] = j->entries[i];
+         saved[num_saved].serial[MAX_SERIAL_LEN-1] = 0;
+         saved[num_saved].card[MAX_RELAY_CARD_NAME_LEN-1] = 0;
+         num_saved++;
+      }
+   }
+   else if (j->magic != 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "State journal %s has an unknown format, starting a new one\n", path);
+   }
+
+   memset(j, 0, sizeof(journal_t));
+   j->magic = JOURNAL_MAGIC;
+   j->version = JOURNAL_VERSION;
+   j->mask_size = sizeof(relay_mask_t);
+   j->num_entries = JOURNAL_MAX_CARDS;
+   j->entry_size = sizeof(journal_entry_t);
+
+   /* Saved states are written back, so that they are not lost
+    * if their card is missing this time */
+   for (i=0; i<num_saved; i++)
+      j->entries[i] = saved[i];
+   num_used = num_saved;
+   journal = j;
+   return num_saved;
+}
+
+
+/**********************************************************
+ * Function journal_update()
+ *********************************************************/
+int journal_update(relay_dev_t* dev)
+{
+   journal_entry_t* e;
+   uint32_t seq;
+
+   if (journal == NULL || !dev->shadow_valid)
+      return -1;
+   if ((e = journal_find(dev)) == NULL)
+      return -1;
+
+   /* Only the worker of the card writes its entry */
+   seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+   atomic_store_explicit(&e->seq, seq|1, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+   e->states = dev->shadow;
+   e->num_relays = dev->num_relays;
+   crelay_get_relay_card_name(dev->relay_type, e->card);
+   atomic_store_explicit(&e->seq, (seq|1)+1, memory_order_release);
+   return 0;
+}
+
+
+static int restore_card(relay_dev_t* dev, void* arg)
+{
+   journal_entry_t* e = arg;
+   char cname[MAX_RELAY_CARD_NAME_LEN];
+
+   /* Another card may be found under the same serial number
+    * (e.g. "" for the first card) */
+   crelay_get_relay_card_name(dev->relay_type, cname);
+   if (strcmp(cname, e->card) || dev->num_relays != e->num_relays)
+      return -1;
+   
+   /* Nothing to write if the card kept its states (e.g. restart
+    * of the daemon only) */
+   if (dev->shadow_valid && dev->shadow == e->states)
+      return 0;
+   return crelay_dev_set_relay_mask(dev, RELAY_MASK_ALL(dev->num_relays), e->states);
+}
+
+
+/**********************************************************
+ * Function journal_restore()
+ *********************************************************/
+int journal_restore(void)
+{
+   worker_cmd_t cmd;
+   char serial[MAX_SERIAL_LEN];
+   int n=0;
+   int i;
+
+   for (i=0; i<num_saved; i++)
+   {
+      /* Only cards already open, unknown ones are not probed */
+      if (crelay_worker_find(saved[i].serial, serial) != 0)
+         continue;
+      memset(&cmd, 0, sizeof(cmd));
+      cmd.type = WORKER_CALL;
+      cmd.fn = restore_card;
+      cmd.arg = &saved[i];
+      if (crelay_worker_exec(saved[i].serial, &cmd) == 0)
+         n++;
+   }
+   num_saved = 0;
+   return n;
+}
@@ -0,0 +1,84 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Relay state journal
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the declaration of the state journal functions
+ *   used by the daemon to remember the relay states across restarts.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef relay_journal_h
+#define relay_journal_h
+
+#include "relay_drv.h"
+
+#define JOURNAL_MAX_CARDS 64
+
+/**********************************************************
+ * Function journal_open()
+ *
+ * Description: Map the journal file, it is created if it
+ *              does not exist or has an unknown format. The
+ *              states found in the file are kept for
+ *              journal_restore().
+ *
+ * Parameters: path (in) - journal file
+ *
+ * Return:  number of cards found in the journal
+ *          -1 - fail
+ *********************************************************/
+int journal_open(const char* path);
+
+/**********************************************************
+ * Function journal_update()
+ *
+ * Description: Store the known relay states of a card, called
+ *              after each write which changed them. Does
+ *              nothing if no journal is open.
+ *
+ * Parameters: dev (in) - relay card
+ *
+ * Return:   0 - success
+ *          -1 - fail, journal full or not open
+ *********************************************************/
+int journal_update(relay_dev_t* dev);
+
+/**********************************************************
+ * Function journal_restore()
+ *
+ * Description: Set the relays of the open cards to the states
+ *              found by journal_open(), each card with a
+ *              single write
+ *
+ * Parameters: none
+ *
+ * Return:  number of cards restored
+ *********************************************************/
+int journal_restore(void);
+
+#endif
@@ -0,0 +1,444 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Delayed relay action scheduler
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the implementation of a simple timer driven
+ *   scheduler for delayed relay actions (e.g. the end of a pulse).
+ *
+ *   Pending events are kept in a binary min-heap ordered by deadline.
+ *   A single timerfd is armed for the earliest deadline so that the
+ *   daemon main loop can wait for it together with the server socket.
+ *   There is at most one pending event per relay. Expired events are
+ *   passed to the worker thread of the relay card.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+
+#include "relay_drv.h"
+#include "relay_sched.h"
+#include "dev_worker.h"
+
+#define SCHED_INDEX_SIZE 256  /* buckets of the event index, power of 2 */
+#define SCHED_HEAP_MIN   64   /* initial size of the heap */
+
+typedef struct sched_event
+{
+   uint64_t deadline;  /* CLOCK_MONOTONIC, in ms */
+   char serial[MAX_SERIAL_LEN];
+   uint8_t relay;
+   relay_state_t relay_state;
+   int pos;                   /* position in the heap */
+   struct sched_event* next;  /* next event in the index bucket */
+} sched_event_t;
+
+static sched_event_t** heap=NULL;  /* grows up to SCHED_MAX_EVENTS */
+static int heap_size=0;
+static int num_events=0;
+static sched_event_t* event_index[SCHED_INDEX_SIZE];  /* by serial and relay */
+static int timer_fd=-1;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int in_flight=0;  /* expired events not yet executed */
+
+
+static uint64_t now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+static void heap_swap(int i, int j)
+{
+   sched_event_t* tmp = heap[i];
+
+   heap[i] = heap[j];
+   heap[j] = tmp;
+   heap[i]->pos = i;
+   heap[j]->pos = j;
+}
+
+
+static void heap_up(int i)
+{
+   while (i > 0 && heap[(i-1)/2]->deadline > heap[i]->deadline)
+   {
+      heap_swap(i, (i-1)/2);
+      i = (i-1)/2;
+   }
+}
+
+
+static void heap_down(int i)
+{
+   int min;
+
+   while (1)
+   {
+      min = i;
+      if (2*i+1 < num_events && heap[2*i+1]->deadline < heap[min]->deadline) min = 2*i+1;
+      if (2*i+2 < num_events && heap[2*i+2]->deadline < heap[min]->deadline) min = 2*i+2;
+      if (min == i) break;
+      heap_swap(i, min);
+      i = min;
+   }
+}
+
+
+static void heap_remove(int i)
+{
+   num_events--;
+   if (i == num_events) return;
+   heap[i] = heap[num_events];
+   heap[i]->pos = i;
+   heap_up(i);
+   heap_down(i);
+}
+
+
+static int heap_grow(void)
+{
+   sched_event_t** h;
+   int size;
+
+   size = (heap_size > 0) ? 2*heap_size : SCHED_HEAP_MIN;
+   if (size > SCHED_MAX_EVENTS) size = SCHED_MAX_EVENTS;
+   if (size <= heap_size || (h = realloc(heap, size * sizeof(sched_event_t*))) == NULL)
+      return -1;
+   heap = h;
+   heap_size = size;
+   return 0;
+}
+
+
+static sched_event_t** index_bucket(const char* serial, uint8_t relay)
+{
+   uint32_t h = 2166136261u;  /* FNV-1a */
+
+   while (*serial)
+      h = (h ^ (uint8_t)*serial++) * 16777619u;
+   h = (h ^ relay) * 16777619u;
+   return &event_index[h & (SCHED_INDEX_SIZE-1)];
+}
+
+
+static sched_event_t* index_find(char* serial, uint8_t relay)
+{
+   sched_event_t* ev;
+
+   if (serial == NULL) serial = "";
+   for (ev = *index_bucket(serial, relay); ev != NULL; ev = ev->next)
+   {
+      if (ev->relay == relay && !strcmp(ev->serial, serial))
+         return ev;
+   }
+   return NULL;
+}
+
+
+static void index_remove(sched_event_t* ev)
+{
+   sched_event_t** p = index_bucket(ev->serial, ev->relay);
+
+   while (*p != ev)
+      p = &(*p)->next;
+   *p = ev->next;
+   ev->next = NULL;
+}
+
+
+/**********************************************************
+ * Function timer_rearm()
+ *
+ * Description: Arm the timer for the earliest pending
+ *              event, or disarm it if there is none
+ *
+ * Parameters: none
+ *
+ * Return:  none
+ *********************************************************/
+static void timer_rearm(void)
+{
+   struct itimerspec its;
+
+   memset(&its, 0, sizeof(its));
+   if (num_events > 0)
+   {
+      its.it_value.tv_sec  = heap[0]->deadline / 1000;
+      its.it_value.tv_nsec = (heap[0]->deadline % 1000) * 1000000;
+      /* A zero value would disarm the timer */
+      if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+         its.it_value.tv_nsec = 1;
+   }
+   if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Failed to arm scheduler timer\n");
+   }
+}
+
+
+/**********************************************************
+ * Internal function sched_done()
+ *
+ * Description: Completion of a scheduled relay switch,
+ *              called from the worker thread
+ *
+ * Parameters: cmd (in) - executed command
+ *
+ * Return:  none
+ *********************************************************/
+static void sched_done(worker_cmd_t* cmd)
+{
+   if (cmd->result != 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Scheduled switch of relay %d failed\n", cmd->relay);
+   }
+   free(cmd);
+   atomic_fetch_sub(&in_flight, 1);
+}
+
+
+/**********************************************************
+ * Internal function sched_take()
+ *
+ * Description: Take the events due until the given time out
+ *              of the heap and the index, in the order of
+ *              their deadlines, and rearm the timer
+ *
+ * Parameters: until (in)  - time in ms (UINT64_MAX = all)
+ *             count (out) - number of events taken
+ *
+ * Return:  list of the events, linked by next
+ *********************************************************/
+static sched_event_t* sched_take(uint64_t until, int* count)
+{
+   sched_event_t* list=NULL;
+   sched_event_t** tail=&list;
+   sched_event_t* ev;
+
+   *count = 0;
+   pthread_mutex_lock(&sched_lock);
+   while (num_events > 0 && heap[0]->deadline <= until)
+   {
+      ev = heap[0];
+      heap_remove(0);
+      index_remove(ev);
+      *tail = ev;
+      tail = &ev->next;
+      (*count)++;
+   }
+   timer_rearm();
+   pthread_mutex_unlock(&sched_lock);
+   return list;
+}
+
+
+/**********************************************************
+ * Function sched_init()
+ *********************************************************/
+int sched_init(void)
+{
+   if (timer_fd < 0)
+   {
+      timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   }
+   return timer_fd;
+}
+
+
+/**********************************************************
+ * Function sched_add()
+ *********************************************************/
+int sched_add(uint32_t delay_ms, char* serial, uint8_t relay, relay_state_t relay_state)
+{
+   sched_event_t* ev;
+
+   if (timer_fd < 0) return -1;
+
+   pthread_mutex_lock(&sched_lock);
+   if ((ev = index_find(serial, relay)) == NULL)
+   {
+      if ((num_events >= heap_size && heap_grow() != 0) ||
+          (ev = calloc(1, sizeof(sched_event_t))) == NULL)
+      {
+         pthread_mutex_unlock(&sched_lock);
+         return -1;
+      }
+      if (serial != NULL) strncpy(ev->serial, serial, MAX_SERIAL_LEN-1);
+      ev->relay = relay;
+      ev->next = *index_bucket(ev->serial, relay);
+      *index_bucket(ev->serial, relay) = ev;
+      ev->pos = num_events;
+      heap[num_events++] = ev;
+   }
+   ev->relay_state = relay_state;
+   ev->deadline = now_ms() + delay_ms;
+   heap_up(ev->pos);
+   heap_down(ev->pos);
+
+   timer_rearm();
+   pthread_mutex_unlock(&sched_lock);
+   return 0;
+}
+
+
+/**********************************************************
+ * Function sched_get_pending()
+ *********************************************************/
+int sched_get_pending(char* serial, uint8_t relay, relay_state_t* relay_state)
+{
+   sched_event_t* ev;
+
+   pthread_mutex_lock(&sched_lock);
+   if ((ev = index_find(serial, relay)) != NULL && relay_state != NULL)
+      *relay_state = ev->relay_state;
+   pthread_mutex_unlock(&sched_lock);
+   return (ev != NULL) ? 0 : -1;
+}
+
+
+/**********************************************************
+ * Function sched_cancel()
+ *********************************************************/
+int sched_cancel(char* serial, uint8_t relay)
+{
+   sched_event_t* ev;
+
+   pthread_mutex_lock(&sched_lock);
+   if ((ev = index_find(serial, relay)) != NULL)
+   {
+      heap_remove(ev->pos);
+      index_remove(ev);
+      free(ev);
+      timer_rearm();
+   }
+   pthread_mutex_unlock(&sched_lock);
+   return (ev != NULL) ? 0 : -1;
+}
+
+
+/**********************************************************
+ * Function sched_run()
+ *********************************************************/
+int sched_run(void)
+{
+   sched_event_t* expired;
+   sched_event_t* ev;
+   worker_cmd_t* cmd;
+   uint64_t expirations;
+   int count=0;
+
+   if (timer_fd < 0) return 0;
+
+   /* Acknowledge the timer, it will be rearmed below */
+   if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {}
+
+   expired = sched_take(now_ms(), &count);
+   while ((ev = expired) != NULL)
+   {
+      expired = ev->next;
+
+      /* Switch the relay from the worker of its card */
+      if ((cmd = calloc(1, sizeof(worker_cmd_t))) != NULL)
+      {
+         cmd->type = WORKER_SET_RELAY;
+         cmd->relay = ev->relay;
+         cmd->relay_state = ev->relay_state;
+         cmd->done = sched_done;
+         atomic_fetch_add(&in_flight, 1);
+         if (crelay_worker_submit(ev->serial, cmd) != 0)
+         {
+            atomic_fetch_sub(&in_flight, 1);
+            free(cmd);
+            cmd = NULL;
+         }
+      }
+      if (cmd == NULL)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Scheduled switch of relay %d failed\n", ev->relay);
+      }
+      free(ev);
+   }
+   return count;
+}
+
+
+/**********************************************************
+ * Function sched_pending()
+ *********************************************************/
+int sched_pending(void)
+{
+   int n;
+
+   pthread_mutex_lock(&sched_lock);
+   n = num_events;
+   pthread_mutex_unlock(&sched_lock);
+   return n + atomic_load(&in_flight);
+}
+
+
+/**********************************************************
+ * Function sched_flush()
+ *********************************************************/
+int sched_flush(void)
+{
+   sched_event_t* pending;
+   sched_event_t* ev;
+   worker_cmd_t cmd;
+   int count;
+
+   if (timer_fd < 0) return 0;
+
+   pending = sched_take(UINT64_MAX, &count);
+   while ((ev = pending) != NULL)
+   {
+      pending = ev->next;
+
+      memset(&cmd, 0, sizeof(cmd));
+      cmd.type = WORKER_SET_RELAY;
+      cmd.relay = ev->relay;
+      cmd.relay_state = ev->relay_state;
+      if (crelay_worker_exec(ev->serial, &cmd) != 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Scheduled switch of relay %d failed\n", ev->relay);
+      }
+      free(ev);
+   }
+   return count;
+}
@@ -0,0 +1,138 @@
+/******************************************************************************
+ *
+ * Relay card control utility: Delayed relay action scheduler
+ *
+ * Description:
+ *   This software is used to controls different type of relays cards.
+ *   This file contains the declaration of the scheduler functions used
+ *   by the daemon to switch relays back after a pulse without blocking
+ *   the HTTP server.
+ *
+ * Author:
+ *   Ondrej Wisniewski (ondrej.wisniewski *at* gmail.com)
+ *
+ * Last modified:
+ *   14/10/2026
+ *
+ * Copyright 2015-2026, Ondrej Wisniewski
+ *
+ * This file is part of crelay.
+ *
+ * crelay is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crelay.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#ifndef relay_sched_h
+#define relay_sched_h
+
+#define SCHED_MAX_EVENTS 4096  /* pending events, one per pulsing relay */
+
+/**********************************************************
+ * Function sched_init()
+ *
+ * Description: Create the scheduler timer
+ *
+ * Parameters: none
+ *
+ * Return:  file descriptor to poll for expired events
+ *          -1 - fail
+ *********************************************************/
+int sched_init(void);
+
+/**********************************************************
+ * Function sched_add()
+ *
+ * Description: Schedule a new relay state after the given
+ *              delay. A pending event for the same relay
+ *              is replaced.
+ *
+ * Parameters: delay_ms (in)    - delay in milliseconds
+ *             serial (in)      - card serial number or NULL
+ *             relay (in)       - relay number
+ *             relay_state (in) - relay state to set
+ *
+ * Return:   0 - success
+ *          -1 - fail, too many pending events
+ *********************************************************/
+int sched_add(uint32_t delay_ms, char* serial, uint8_t relay, relay_state_t relay_state);
+
+/**********************************************************
+ * Function sched_get_pending()
+ *
+ * Description: Check for a pending event on a relay
+ *
+ * Parameters: serial (in)       - card serial number or NULL
+ *             relay (in)        - relay number
+ *             relay_state (out) - scheduled relay state
+ *                                 (may be NULL)
+ *
+ * Return:   0 - event pending
+ *          -1 - no event pending
+ *********************************************************/
+int sched_get_pending(char* serial, uint8_t relay, relay_state_t* relay_state);
+
+/**********************************************************
+ * Function sched_cancel()
+ *
+ * Description: Remove a pending event on a relay
+ *
+ * Parameters: serial (in) - card serial number or NULL
+ *             relay (in)  - relay number
+ *
+ * Return:   0 - event removed
+ *          -1 - no event pending
+ *********************************************************/
+int sched_cancel(char* serial, uint8_t relay);
+
+/**********************************************************
+ * Function sched_run()
+ *
+ * Description: Execute all expired events and rearm the
+ *              timer for the next one. To be called when
+ *              the scheduler file descriptor is readable.
+ *
+ * Parameters: none
+ *
+ * Return:  number of executed events
+ *********************************************************/
+int sched_run(void);
+
+/**********************************************************
+ * Function sched_pending()
+ *
+ * Description: Get the number of events which have not been
+ *              executed yet, including expired ones still
+ *              queued for the relay card
+ *
+ * Parameters: none
+ *
+ * Return:  number of events
+ *********************************************************/
+int sched_pending(void);
+
+/**********************************************************
+ * Function sched_flush()
+ *
+ * Description: Execute all pending events right away, so
+ *              that no relay is left in the middle of a pulse
+ *              (e.g. before the daemon exits). Waits until
+ *              the relays are switched.
+ *
+ * Parameters: none
+ *
+ * Return:  number of executed events
+ *********************************************************/
+int sched_flush(void);
+
+#endif